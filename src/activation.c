@@ -0,0 +1,843 @@
+/* activation - Activation functions of tensors and their derivatives
+ * The kernels are written once in ACT_DEFINE_KERNELS over a small set of
+ * vector primitives (ACT_ADD, ACT_MUL, ...) and instantiated for every
+ * cpu_level_t, the generic level with scalar primitives. Every level runs
+ * the same operations in the same order, without fused multiply-add, so
+ * they all give the same bits.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+
+#include "tensor.h"
+#include "activation.h"
+#include "ops.h"
+#include "cpu.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ACT_X86 1
+#include <immintrin.h>
+#endif
+
+/* exp(y) = 2^k exp(r) with k = round(y / ln 2) and r = y - k ln 2 in
+ * [-ln2/2, ln2/2]. ln 2 is split in two parts, k * ACT_LN2_HI is exact. */
+#define ACT_LOG2E 0x1.71547652b82fep0
+#define ACT_LN2_HI 0x1.62e42fee00000p-1
+#define ACT_LN2_LO 0x1.a39ef35793c76p-33
+/* Adding and subtracting ACT_ROUND rounds a double below 2^51 to an
+ * integer. The low bits of m + ACT_POW2_BIAS are the exponent field of
+ * 2^m. */
+#define ACT_ROUND 0x1.8p52
+#define ACT_POW2_BIAS (0x1.8p52 + 1023.0)
+/* exp overflows above ACT_EXP_MAX and is zero below ACT_EXP_MIN */
+#define ACT_EXP_MAX 709.79
+#define ACT_EXP_MIN -745.2
+/* tanh(x) rounds to 1 above ACT_TANH_MAX */
+#define ACT_TANH_MAX 20.0
+/* GELU: v = x (2c + 2c a x^2), gelu(x) = x * sigmoid(v). x is clamped
+ * in v, the sigmoid is already 0 or 1 there. */
+#define ACT_GELU_2C 0x1.9884533d43651p+0
+#define ACT_GELU_2CA (ACT_GELU_2C * 0.044715)
+#define ACT_GELU_MAX 1e3
+
+typedef tensor_activation_fn_t act_kernel_t;
+
+struct act_kernels {
+    act_kernel_t forward[TENSOR_NACTIVATIONS];
+    act_kernel_t derivative[TENSOR_NACTIVATIONS];
+    act_kernel_t exp;
+};
+
+static int act_accurate = 0;
+
+/* Scalar bit operations of the generic level */
+static double act_bits_generic(uint64_t bits)
+{
+    double x;
+    memcpy(&x, &bits, sizeof x);
+    return x;
+}
+
+static uint64_t act_double_bits(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof bits);
+    return bits;
+}
+
+static double act_abs_generic(double x)
+{
+    return act_bits_generic(act_double_bits(x) & ~(UINT64_C(1) << 63));
+}
+
+static double act_sign_generic(double x)
+{
+    return act_bits_generic(act_double_bits(x) & (UINT64_C(1) << 63));
+}
+
+static double act_or_generic(double a, double b)
+{
+    return act_bits_generic(act_double_bits(a) | act_double_bits(b));
+}
+
+static double act_pow2i_generic(double m)
+{
+    return act_bits_generic(act_double_bits(m + ACT_POW2_BIAS) << 52);
+}
+
+/* The kernels of one level. ACT_MIN and ACT_MAX return their second
+ * argument if either is NaN, so the clamps keep NaN. */
+/* The vector functions are inlined into the loops, calls would pass the
+ * vectors through the stack */
+#define ACT_INLINE static inline __attribute__((always_inline))
+#define ACT_HORNER(p, r, c) p = ACT_ADD(ACT_MUL(p, r), ACT_SET1(c))
+
+#define ACT_DEFINE_KERNELS(level)                                       \
+    /* expm1(r) for |r| <= ln2/2: Taylor polynomial of degree 13 */     \
+    ACT_TARGET ACT_INLINE ACT_V act_expm1_poly_##level(ACT_V r)         \
+    {                                                                   \
+        ACT_V p = ACT_SET1(1.0 / 6227020800.0);                         \
+        ACT_HORNER(p, r, 1.0 / 479001600.0);                            \
+        ACT_HORNER(p, r, 1.0 / 39916800.0);                             \
+        ACT_HORNER(p, r, 1.0 / 3628800.0);                              \
+        ACT_HORNER(p, r, 1.0 / 362880.0);                               \
+        ACT_HORNER(p, r, 1.0 / 40320.0);                                \
+        ACT_HORNER(p, r, 1.0 / 5040.0);                                 \
+        ACT_HORNER(p, r, 1.0 / 720.0);                                  \
+        ACT_HORNER(p, r, 1.0 / 120.0);                                  \
+        ACT_HORNER(p, r, 1.0 / 24.0);                                   \
+        ACT_HORNER(p, r, 1.0 / 6.0);                                    \
+        ACT_HORNER(p, r, 0.5);                                          \
+        ACT_HORNER(p, r, 1.0);                                          \
+        return ACT_MUL(p, r);                                           \
+    }                                                                   \
+                                                                        \
+    /* round(y / ln 2), and the reduced argument in *r */               \
+    ACT_TARGET ACT_INLINE ACT_V act_reduce_##level(ACT_V y, ACT_V *r)   \
+    {                                                                   \
+        ACT_V k = ACT_MUL(y, ACT_SET1(ACT_LOG2E));                      \
+        k = ACT_SUB(ACT_ADD(k, ACT_SET1(ACT_ROUND)), ACT_SET1(ACT_ROUND)); \
+        *r = ACT_SUB(ACT_SUB(y, ACT_MUL(k, ACT_SET1(ACT_LN2_HI))),      \
+                     ACT_MUL(k, ACT_SET1(ACT_LN2_LO)));                 \
+        return k;                                                       \
+    }                                                                   \
+                                                                        \
+    /* exp(y): 2^k is applied in two halves so it can't overflow the    \
+     * exponent field before the result does */                         \
+    ACT_TARGET ACT_INLINE ACT_V act_exp_##level(ACT_V y)                \
+    {                                                                   \
+        ACT_V r;                                                        \
+        y = ACT_MAX(ACT_SET1(ACT_EXP_MIN), ACT_MIN(ACT_SET1(ACT_EXP_MAX), y)); \
+        ACT_V k = act_reduce_##level(y, &r);                            \
+        ACT_V q = act_expm1_poly_##level(r);                            \
+        ACT_V k1 = ACT_MUL(k, ACT_SET1(0.5));                           \
+        k1 = ACT_SUB(ACT_ADD(k1, ACT_SET1(ACT_ROUND)), ACT_SET1(ACT_ROUND)); \
+        ACT_V k2 = ACT_SUB(k, k1);                                      \
+        ACT_V e = ACT_MUL(ACT_ADD(ACT_SET1(1.0), q), ACT_POW2I(k1));    \
+        return ACT_MUL(e, ACT_POW2I(k2));                               \
+    }                                                                   \
+                                                                        \
+    ACT_TARGET ACT_INLINE ACT_V act_sigmoid_v_##level(ACT_V x)          \
+    {                                                                   \
+        ACT_V e = act_exp_##level(ACT_SUB(ACT_SET1(0.0), x));           \
+        return ACT_DIV(ACT_SET1(1.0), ACT_ADD(ACT_SET1(1.0), e));       \
+    }                                                                   \
+                                                                        \
+    /* tanh(|x|) = e / (e + 2) with e = expm1(2|x|) = q 2^k + (2^k - 1) \
+     * which is exact for k = 0 */                                      \
+    ACT_TARGET ACT_INLINE ACT_V act_tanh_v_##level(ACT_V x)             \
+    {                                                                   \
+        ACT_V r;                                                        \
+        ACT_V a = ACT_MIN(ACT_SET1(ACT_TANH_MAX), ACT_ABS(x));          \
+        ACT_V k = act_reduce_##level(ACT_ADD(a, a), &r);                \
+        ACT_V q = act_expm1_poly_##level(r);                            \
+        ACT_V s = ACT_POW2I(k);                                         \
+        ACT_V e = ACT_ADD(ACT_MUL(q, s), ACT_SUB(s, ACT_SET1(1.0)));    \
+        ACT_V t = ACT_DIV(e, ACT_ADD(e, ACT_SET1(2.0)));                \
+        return ACT_OR(t, ACT_SIGN(x));                                  \
+    }                                                                   \
+                                                                        \
+    ACT_TARGET ACT_INLINE ACT_V act_relu_v_##level(ACT_V x)             \
+    {                                                                   \
+        return ACT_MAX(ACT_SET1(0.0), x);                               \
+    }                                                                   \
+                                                                        \
+    ACT_TARGET ACT_INLINE ACT_V act_gelu_clamp_##level(ACT_V x)         \
+    {                                                                   \
+        ACT_V hi = ACT_SET1(ACT_GELU_MAX);                              \
+        return ACT_MAX(ACT_SUB(ACT_SET1(0.0), hi), ACT_MIN(hi, x));     \
+    }                                                                   \
+                                                                        \
+    ACT_TARGET ACT_INLINE ACT_V act_gelu_arg_##level(ACT_V x)           \
+    {                                                                   \
+        x = act_gelu_clamp_##level(x);                                  \
+        ACT_V x2 = ACT_MUL(x, x);                                       \
+        return ACT_MUL(x, ACT_ADD(ACT_SET1(ACT_GELU_2C),                \
+                                  ACT_MUL(ACT_SET1(ACT_GELU_2CA), x2))); \
+    }                                                                   \
+                                                                        \
+    ACT_TARGET ACT_INLINE ACT_V act_gelu_v_##level(ACT_V x)             \
+    {                                                                   \
+        return ACT_MUL(x, act_sigmoid_v_##level(act_gelu_arg_##level(x))); \
+    }                                                                   \
+                                                                        \
+    /* sigmoid'(x) = e / (1 + e)^2 with e = exp(-|x|) */                \
+    ACT_TARGET ACT_INLINE ACT_V act_sigmoid_d_##level(ACT_V x)          \
+    {                                                                   \
+        ACT_V e = act_exp_##level(ACT_SUB(ACT_SET1(0.0), ACT_ABS(x)));  \
+        ACT_V d = ACT_ADD(ACT_SET1(1.0), e);                            \
+        return ACT_DIV(e, ACT_MUL(d, d));                               \
+    }                                                                   \
+                                                                        \
+    /* tanh'(x) = 4e / (1 + e)^2 with e = exp(-2|x|) */                 \
+    ACT_TARGET ACT_INLINE ACT_V act_tanh_d_##level(ACT_V x)             \
+    {                                                                   \
+        ACT_V a = ACT_ABS(x);                                           \
+        ACT_V e = act_exp_##level(ACT_SUB(ACT_SET1(0.0), ACT_ADD(a, a))); \
+        ACT_V d = ACT_ADD(ACT_SET1(1.0), e);                            \
+        return ACT_DIV(ACT_MUL(ACT_SET1(4.0), e), ACT_MUL(d, d));       \
+    }                                                                   \
+                                                                        \
+    ACT_TARGET ACT_INLINE ACT_V act_relu_d_##level(ACT_V x)             \
+    {                                                                   \
+        return ACT_POSITIVE(x);                                         \
+    }                                                                   \
+                                                                        \
+    /* gelu'(x) = sigmoid(v) + x sigmoid'(v) v'(x) */                   \
+    ACT_TARGET ACT_INLINE ACT_V act_gelu_d_##level(ACT_V x)             \
+    {                                                                   \
+        x = act_gelu_clamp_##level(x);                                  \
+        ACT_V v = act_gelu_arg_##level(x);                              \
+        ACT_V x2 = ACT_MUL(x, x);                                       \
+        ACT_V dv = ACT_ADD(ACT_SET1(ACT_GELU_2C),                       \
+                           ACT_MUL(ACT_SET1(3.0 * ACT_GELU_2CA), x2));  \
+        ACT_V ds = act_sigmoid_d_##level(v);                            \
+        return ACT_ADD(act_sigmoid_v_##level(v),                        \
+                       ACT_MUL(ACT_MUL(x, ds), dv));                    \
+    }                                                                   \
+                                                                        \
+    ACT_DEFINE_LOOP(sigmoid_v, level)                                   \
+    ACT_DEFINE_LOOP(tanh_v, level)                                      \
+    ACT_DEFINE_LOOP(relu_v, level)                                      \
+    ACT_DEFINE_LOOP(gelu_v, level)                                      \
+    ACT_DEFINE_LOOP(sigmoid_d, level)                                   \
+    ACT_DEFINE_LOOP(tanh_d, level)                                      \
+    ACT_DEFINE_LOOP(relu_d, level)                                      \
+    ACT_DEFINE_LOOP(gelu_d, level)                                      \
+    ACT_DEFINE_LOOP(exp, level)
+
+/* The elements left after the last full vector use the generic level */
+#define ACT_DEFINE_LOOP(name, level)                                    \
+    ACT_TARGET static void act_##name##_##level##_loop(size_t n,        \
+                                                       const double *x, \
+                                                       double *y)       \
+    {                                                                   \
+        size_t i = 0;                                                   \
+        for(; i + ACT_W <= n; i += ACT_W) {                             \
+            ACT_STORE(y + i, act_##name##_##level(ACT_LOAD(x + i)));    \
+        }                                                               \
+        for(; i < n; i++) y[i] = act_##name##_generic(x[i]);            \
+    }
+
+#define ACT_LEVEL_KERNELS(level)                                        \
+    {                                                                   \
+        {act_identity, act_sigmoid_v_##level##_loop,                    \
+         act_tanh_v_##level##_loop, act_relu_v_##level##_loop,          \
+         act_gelu_v_##level##_loop},                                    \
+        {act_one, act_sigmoid_d_##level##_loop,                         \
+         act_tanh_d_##level##_loop, act_relu_d_##level##_loop,          \
+         act_gelu_d_##level##_loop},                                    \
+        act_exp_##level##_loop                                          \
+    }
+
+/* Generic level */
+#define ACT_TARGET
+#define ACT_V double
+#define ACT_W 1
+#define ACT_SET1(a) (a)
+#define ACT_LOAD(p) (*(p))
+#define ACT_STORE(p, v) (*(p) = (v))
+#define ACT_ADD(a, b) ((a) + (b))
+#define ACT_SUB(a, b) ((a) - (b))
+#define ACT_MUL(a, b) ((a) * (b))
+#define ACT_DIV(a, b) ((a) / (b))
+#define ACT_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define ACT_MAX(a, b) ((a) > (b) ? (a) : (b))
+#define ACT_ABS(a) act_abs_generic(a)
+#define ACT_SIGN(a) act_sign_generic(a)
+#define ACT_OR(a, b) act_or_generic(a, b)
+#define ACT_POW2I(m) act_pow2i_generic(m)
+#define ACT_POSITIVE(a) ((a) > 0.0 ? 1.0 : 0.0)
+ACT_DEFINE_KERNELS(generic)
+#undef ACT_TARGET
+#undef ACT_V
+#undef ACT_W
+#undef ACT_SET1
+#undef ACT_LOAD
+#undef ACT_STORE
+#undef ACT_ADD
+#undef ACT_SUB
+#undef ACT_MUL
+#undef ACT_DIV
+#undef ACT_MIN
+#undef ACT_MAX
+#undef ACT_ABS
+#undef ACT_SIGN
+#undef ACT_OR
+#undef ACT_POW2I
+#undef ACT_POSITIVE
+
+static void act_identity(size_t n, const double *x, double *y)
+{
+    if(x != y) memmove(y, x, n * sizeof(double));
+}
+
+static void act_one(size_t n, const double *x, double *y)
+{
+    for(size_t i = 0; i < n; i++) y[i] = 1.0;
+}
+
+#ifdef ACT_X86
+/* SSE2 level */
+#define ACT_TARGET __attribute__((target("sse2")))
+#define ACT_V __m128d
+#define ACT_W 2
+#define ACT_SET1(a) _mm_set1_pd(a)
+#define ACT_LOAD(p) _mm_loadu_pd(p)
+#define ACT_STORE(p, v) _mm_storeu_pd(p, v)
+#define ACT_ADD(a, b) _mm_add_pd(a, b)
+#define ACT_SUB(a, b) _mm_sub_pd(a, b)
+#define ACT_MUL(a, b) _mm_mul_pd(a, b)
+#define ACT_DIV(a, b) _mm_div_pd(a, b)
+#define ACT_MIN(a, b) _mm_min_pd(a, b)
+#define ACT_MAX(a, b) _mm_max_pd(a, b)
+#define ACT_ABS(a) _mm_andnot_pd(_mm_set1_pd(-0.0), a)
+#define ACT_SIGN(a) _mm_and_pd(_mm_set1_pd(-0.0), a)
+#define ACT_OR(a, b) _mm_or_pd(a, b)
+#define ACT_POW2I(m)                                                    \
+    _mm_castsi128_pd(_mm_slli_epi64(                                    \
+        _mm_castpd_si128(_mm_add_pd(m, _mm_set1_pd(ACT_POW2_BIAS))), 52))
+#define ACT_POSITIVE(a)                                                 \
+    _mm_and_pd(_mm_cmpgt_pd(a, _mm_setzero_pd()), _mm_set1_pd(1.0))
+ACT_DEFINE_KERNELS(sse2)
+#undef ACT_TARGET
+#undef ACT_V
+#undef ACT_W
+#undef ACT_SET1
+#undef ACT_LOAD
+#undef ACT_STORE
+#undef ACT_ADD
+#undef ACT_SUB
+#undef ACT_MUL
+#undef ACT_DIV
+#undef ACT_MIN
+#undef ACT_MAX
+#undef ACT_ABS
+#undef ACT_SIGN
+#undef ACT_OR
+#undef ACT_POW2I
+#undef ACT_POSITIVE
+
+/* AVX2 level */
+#define ACT_TARGET __attribute__((target("avx2")))
+#define ACT_V __m256d
+#define ACT_W 4
+#define ACT_SET1(a) _mm256_set1_pd(a)
+#define ACT_LOAD(p) _mm256_loadu_pd(p)
+#define ACT_STORE(p, v) _mm256_storeu_pd(p, v)
+#define ACT_ADD(a, b) _mm256_add_pd(a, b)
+#define ACT_SUB(a, b) _mm256_sub_pd(a, b)
+#define ACT_MUL(a, b) _mm256_mul_pd(a, b)
+#define ACT_DIV(a, b) _mm256_div_pd(a, b)
+#define ACT_MIN(a, b) _mm256_min_pd(a, b)
+#define ACT_MAX(a, b) _mm256_max_pd(a, b)
+#define ACT_ABS(a) _mm256_andnot_pd(_mm256_set1_pd(-0.0), a)
+#define ACT_SIGN(a) _mm256_and_pd(_mm256_set1_pd(-0.0), a)
+#define ACT_OR(a, b) _mm256_or_pd(a, b)
+#define ACT_POW2I(m)                                                    \
+    _mm256_castsi256_pd(_mm256_slli_epi64(                              \
+        _mm256_castpd_si256(_mm256_add_pd(m, _mm256_set1_pd(ACT_POW2_BIAS))), \
+        52))
+#define ACT_POSITIVE(a)                                                 \
+    _mm256_and_pd(_mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_GT_OQ),    \
+                  _mm256_set1_pd(1.0))
+ACT_DEFINE_KERNELS(avx2)
+#undef ACT_TARGET
+#undef ACT_V
+#undef ACT_W
+#undef ACT_SET1
+#undef ACT_LOAD
+#undef ACT_STORE
+#undef ACT_ADD
+#undef ACT_SUB
+#undef ACT_MUL
+#undef ACT_DIV
+#undef ACT_MIN
+#undef ACT_MAX
+#undef ACT_ABS
+#undef ACT_SIGN
+#undef ACT_OR
+#undef ACT_POW2I
+#undef ACT_POSITIVE
+
+/* AVX-512 level, the bitwise operations need AVX512DQ */
+#define ACT_TARGET __attribute__((target("avx512f,avx512dq")))
+#define ACT_V __m512d
+#define ACT_W 8
+#define ACT_SET1(a) _mm512_set1_pd(a)
+#define ACT_LOAD(p) _mm512_loadu_pd(p)
+#define ACT_STORE(p, v) _mm512_storeu_pd(p, v)
+#define ACT_ADD(a, b) _mm512_add_pd(a, b)
+#define ACT_SUB(a, b) _mm512_sub_pd(a, b)
+#define ACT_MUL(a, b) _mm512_mul_pd(a, b)
+#define ACT_DIV(a, b) _mm512_div_pd(a, b)
+#define ACT_MIN(a, b) _mm512_min_pd(a, b)
+#define ACT_MAX(a, b) _mm512_max_pd(a, b)
+#define ACT_ABS(a) _mm512_andnot_pd(_mm512_set1_pd(-0.0), a)
+#define ACT_SIGN(a) _mm512_and_pd(_mm512_set1_pd(-0.0), a)
+#define ACT_OR(a, b) _mm512_or_pd(a, b)
+#define ACT_POW2I(m)                                                    \
+    _mm512_castsi512_pd(_mm512_slli_epi64(                              \
+        _mm512_castpd_si512(_mm512_add_pd(m, _mm512_set1_pd(ACT_POW2_BIAS))), \
+        52))
+#define ACT_POSITIVE(a)                                                 \
+    _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(a, _mm512_setzero_pd(),      \
+                                           _CMP_GT_OQ),                 \
+                        _mm512_set1_pd(1.0))
+ACT_DEFINE_KERNELS(avx512)
+#undef ACT_TARGET
+#undef ACT_V
+#undef ACT_W
+#undef ACT_SET1
+#undef ACT_LOAD
+#undef ACT_STORE
+#undef ACT_ADD
+#undef ACT_SUB
+#undef ACT_MUL
+#undef ACT_DIV
+#undef ACT_MIN
+#undef ACT_MAX
+#undef ACT_ABS
+#undef ACT_SIGN
+#undef ACT_OR
+#undef ACT_POW2I
+#undef ACT_POSITIVE
+
+/* Kernels of every cpu_level_t */
+static const struct act_kernels act_kernels[CPU_NLEVELS] = {
+    ACT_LEVEL_KERNELS(generic), ACT_LEVEL_KERNELS(sse2),
+    ACT_LEVEL_KERNELS(avx2), ACT_LEVEL_KERNELS(avx512)
+};
+#else
+static const struct act_kernels act_kernels[CPU_NLEVELS] = {
+    ACT_LEVEL_KERNELS(generic), ACT_LEVEL_KERNELS(generic),
+    ACT_LEVEL_KERNELS(generic), ACT_LEVEL_KERNELS(generic)
+};
+#endif
+
+/* Accurate mode: the same formulas with libm */
+static double act_gelu_clamp_libm(double x)
+{
+    return x > ACT_GELU_MAX ? ACT_GELU_MAX : x < -ACT_GELU_MAX ? -ACT_GELU_MAX
+                                                               : x;
+}
+
+static double act_gelu_arg_libm(double x)
+{
+    x = act_gelu_clamp_libm(x);
+    return x * (ACT_GELU_2C + ACT_GELU_2CA * (x * x));
+}
+
+static double act_sigmoid_v_libm(double x)
+{
+    return 1.0 / (1.0 + exp(-x));
+}
+
+static double act_tanh_v_libm(double x)
+{
+    return tanh(x);
+}
+
+static double act_relu_v_libm(double x)
+{
+    return act_relu_v_generic(x);
+}
+
+static double act_gelu_v_libm(double x)
+{
+    return x * act_sigmoid_v_libm(act_gelu_arg_libm(x));
+}
+
+static double act_sigmoid_d_libm(double x)
+{
+    double e = exp(-fabs(x));
+    return e / ((1.0 + e) * (1.0 + e));
+}
+
+static double act_tanh_d_libm(double x)
+{
+    double e = exp(-2.0 * fabs(x));
+    return 4.0 * e / ((1.0 + e) * (1.0 + e));
+}
+
+static double act_relu_d_libm(double x)
+{
+    return act_relu_d_generic(x);
+}
+
+static double act_gelu_d_libm(double x)
+{
+    x = act_gelu_clamp_libm(x);
+    double v = act_gelu_arg_libm(x);
+    double dv = ACT_GELU_2C + 3.0 * ACT_GELU_2CA * (x * x);
+    return act_sigmoid_v_libm(v) + x * act_sigmoid_d_libm(v) * dv;
+}
+
+static double act_exp_libm(double x)
+{
+    return exp(x);
+}
+
+#define ACT_DEFINE_LIBM_LOOP(name)                                      \
+    static void act_##name##_libm_loop(size_t n, const double *x,       \
+                                       double *y)                       \
+    {                                                                   \
+        for(size_t i = 0; i < n; i++) y[i] = act_##name##_libm(x[i]);   \
+    }
+
+ACT_DEFINE_LIBM_LOOP(sigmoid_v)
+ACT_DEFINE_LIBM_LOOP(tanh_v)
+ACT_DEFINE_LIBM_LOOP(relu_v)
+ACT_DEFINE_LIBM_LOOP(gelu_v)
+ACT_DEFINE_LIBM_LOOP(sigmoid_d)
+ACT_DEFINE_LIBM_LOOP(tanh_d)
+ACT_DEFINE_LIBM_LOOP(relu_d)
+ACT_DEFINE_LIBM_LOOP(gelu_d)
+ACT_DEFINE_LIBM_LOOP(exp)
+
+static const struct act_kernels act_libm_kernels = ACT_LEVEL_KERNELS(libm);
+
+/* tensor_set_activation_accurate: Evaluate the activations with libm if
+ * accurate is non-zero, with the SIMD approximation otherwise. It should
+ * not be changed while activations run on other threads. */
+void tensor_set_activation_accurate(int accurate)
+{
+    __atomic_store_n(&act_accurate, accurate != 0, __ATOMIC_RELAXED);
+}
+
+/* tensor_get_activation_accurate: Check the mode set by
+ * tensor_set_activation_accurate.
+ * It returns non-zero value in the accurate mode */
+int tensor_get_activation_accurate(void)
+{
+    return __atomic_load_n(&act_accurate, __ATOMIC_RELAXED);
+}
+
+/* act_select: kernel of act or of its derivative in the current mode */
+static const act_kernel_t *act_select(tensor_activation_t act,
+                                      int derivative)
+{
+    const struct act_kernels *kernels = &act_kernels[cpu_get_level()];
+    if(tensor_get_activation_accurate()) kernels = &act_libm_kernels;
+    return derivative ? &kernels->derivative[act] : &kernels->forward[act];
+}
+
+/* act_map: tensor_map function calling the kernel pointed by ctx */
+static void act_map(void *ctx, size_t n, const double *x, double *y)
+{
+    const act_kernel_t *kernel = ctx;
+    (*kernel)(n, x, y);
+}
+
+static int act_run(tensor_activation_t act, int derivative,
+                   const tensor_t *X, tensor_t *Y)
+{
+    if((int)act < 0 || act >= TENSOR_NACTIVATIONS) {
+        errno = EINVAL;
+        return -1;
+    }
+    return tensor_map(X, Y, act_map, (void *)act_select(act, derivative));
+}
+
+/* tensor_activate: Compute Y = act(X) elementwise. X and Y can have any
+ * element type and strides and Y can be X, see tensor_map.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if act is not valid,
+ * X or Y is NULL or their shapes differ */
+int tensor_activate(tensor_activation_t act, const tensor_t *X, tensor_t *Y)
+{
+    return act_run(act, 0, X, Y);
+}
+
+/* tensor_activate_derivative: Compute the derivative D = act'(X) at the
+ * inputs X of the activation, see tensor_activate */
+int tensor_activate_derivative(tensor_activation_t act, const tensor_t *X,
+                               tensor_t *D)
+{
+    return act_run(act, 1, X, D);
+}
+
+/* tensor_activate_array: Compute y = act(x) for n doubles on the calling
+ * thread, y can be x. It is the kernel of tensor_activate for code that
+ * already holds rows of doubles.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if act is not valid or
+ * x or y is NULL */
+int tensor_activate_array(tensor_activation_t act, size_t n, const double *x,
+                          double *y)
+{
+    if((int)act < 0 || act >= TENSOR_NACTIVATIONS || x == NULL || y == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    (*act_select(act, 0))(n, x, y);
+    return 0;
+}
+
+/* tensor_get_activation_fn: Get the kernel of tensor_activate_array for
+ * act in the current CPU level and mode, to call it on many short arrays
+ * without checking its arguments each time.
+ *
+ * It returns NULL and set errno to EINVAL if act is not valid */
+tensor_activation_fn_t tensor_get_activation_fn(tensor_activation_t act)
+{
+    if((int)act < 0 || act >= TENSOR_NACTIVATIONS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return *act_select(act, 0);
+}
+
+/* tensor_exp_array: Compute y = exp(x) for n doubles on the calling thread
+ * with the exponential of the activations, y can be x. It gives the same
+ * bits on every CPU level and uses libm in the accurate mode.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if x or y is NULL */
+int tensor_exp_array(size_t n, const double *x, double *y)
+{
+    if(x == NULL || y == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    const struct act_kernels *kernels = &act_kernels[cpu_get_level()];
+    if(tensor_get_activation_accurate()) kernels = &act_libm_kernels;
+    kernels->exp(n, x, y);
+    return 0;
+}
+
+/* tensor_sigmoid: Compute Y = 1 / (1 + exp(-X)), see tensor_activate */
+int tensor_sigmoid(const tensor_t *X, tensor_t *Y)
+{
+    return act_run(TENSOR_SIGMOID, 0, X, Y);
+}
+
+/* tensor_tanh: Compute Y = tanh(X), see tensor_activate */
+int tensor_tanh(const tensor_t *X, tensor_t *Y)
+{
+    return act_run(TENSOR_TANH, 0, X, Y);
+}
+
+/* tensor_relu: Compute Y = max(0, X), see tensor_activate */
+int tensor_relu(const tensor_t *X, tensor_t *Y)
+{
+    return act_run(TENSOR_RELU, 0, X, Y);
+}
+
+/* tensor_gelu: Compute the tanh approximation of GELU, see
+ * tensor_activate */
+int tensor_gelu(const tensor_t *X, tensor_t *Y)
+{
+    return act_run(TENSOR_GELU, 0, X, Y);
+}
+
+/* tensor_sigmoid_derivative: Compute D = sigmoid'(X), see
+ * tensor_activate_derivative */
+int tensor_sigmoid_derivative(const tensor_t *X, tensor_t *D)
+{
+    return act_run(TENSOR_SIGMOID, 1, X, D);
+}
+
+/* tensor_tanh_derivative: Compute D = 1 - tanh(X)^2, see
+ * tensor_activate_derivative */
+int tensor_tanh_derivative(const tensor_t *X, tensor_t *D)
+{
+    return act_run(TENSOR_TANH, 1, X, D);
+}
+
+/* tensor_relu_derivative: Compute D = 1 where X > 0 and 0 elsewhere, see
+ * tensor_activate_derivative */
+int tensor_relu_derivative(const tensor_t *X, tensor_t *D)
+{
+    return act_run(TENSOR_RELU, 1, X, D);
+}
+
+/* tensor_gelu_derivative: Compute D = gelu'(X), see
+ * tensor_activate_derivative */
+int tensor_gelu_derivative(const tensor_t *X, tensor_t *D)
+{
+    return act_run(TENSOR_GELU, 1, X, D);
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_ACTIVATION_C_TEST
+#include <assert.h>
+#include <stdio.h>
+#include <float.h>
+
+/* test_ulp: distance between value and the reference in units of the last
+ * place of the reference */
+static double test_ulp(double value, double reference)
+{
+    if(value == reference) return 0.0;
+    if(isnan(value) || isnan(reference)) return isnan(value)
+                                                && isnan(reference) ? 0.0
+                                                                    : 1e300;
+    double ulp = nextafter(fabs(reference), INFINITY) - fabs(reference);
+    return fabs(value - reference) / ulp;
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+
+    /* inputs: a dense grid, the edges of the ranges and special values */
+    size_t n = 0, capacity = 50000;
+    double *x = malloc(capacity * sizeof(double));
+    double *y = malloc(capacity * sizeof(double));
+    double *ref = malloc(capacity * sizeof(double));
+    for(double v = -60.0; v <= 60.0; v += 0.00317) x[n++] = v;
+    double specials[] = {0.0, -0.0, 1e-300, -1e-300, 4.9e-324, 1e-8, -1e-8,
+                         0.5, -0.5, 19.99, 20.01, -20.01, 700.0, -700.0,
+                         709.78, 710.0, -708.5, -745.0, -746.0, 1e5, -1e5,
+                         1e200, -1e200, INFINITY, -INFINITY, NAN};
+    for(size_t i = 0; i < sizeof specials / sizeof specials[0]; i++) {
+        x[n++] = specials[i];
+    }
+    assert(n <= capacity);
+
+    /* measured error against libm, documented in activation.h */
+    double bounds[2][TENSOR_NACTIVATIONS] = {
+        {0.0, 3.0, 3.0, 0.0, 3.0}, {0.0, 4.0, 3.0, 0.0, 1.0}
+    };
+    for(int derivative = 0; derivative < 2; derivative++) {
+        for(int act = 0; act < TENSOR_NACTIVATIONS; act++) {
+            tensor_set_activation_accurate(1);
+            (*act_select((tensor_activation_t)act, derivative))(n, x, ref);
+            tensor_set_activation_accurate(0);
+
+            /* every level gives the same bits */
+            for(int level = 0; level <= (int)cpu_get_max_level(); level++) {
+                cpu_set_level((cpu_level_t)level);
+                (*act_select((tensor_activation_t)act, derivative))(n, x, y);
+                double worst = 0.0;
+                for(size_t i = 0; i < n; i++) {
+                    double e = test_ulp(y[i], ref[i]);
+                    if(fabs(ref[i]) < 0x1p-1022) e = fabs(y[i] - ref[i])
+                                                     > 0x1p-1070 ? 1e300 : 0;
+                    /* gelu' cancels around its zero at x = -0.75 */
+                    if(derivative && act == TENSOR_GELU) {
+                        e = fmin(e, fabs(y[i] - ref[i]) / DBL_EPSILON);
+                    }
+                    if(e > worst) worst = e;
+                    if(level > 0) {
+                        double generic;
+                        cpu_set_level(CPU_GENERIC);
+                        (*act_select((tensor_activation_t)act,
+                                     derivative))(1, x + i, &generic);
+                        cpu_set_level((cpu_level_t)level);
+                        assert(memcmp(&generic, &y[i], sizeof generic) == 0);
+                    }
+                }
+                assert(worst <= bounds[derivative][act]);
+            }
+        }
+    }
+    cpu_set_level(cpu_get_max_level());
+
+    /* the exponential, documented in activation.h */
+    for(size_t i = 0; i < n; i++) ref[i] = exp(x[i]);
+    for(int level = 0; level <= (int)cpu_get_max_level(); level++) {
+        cpu_set_level((cpu_level_t)level);
+        err = tensor_exp_array(n, x, y);
+        assert(err == 0);
+        for(size_t i = 0; i < n; i++) {
+            if(isnan(ref[i])) {
+                assert(isnan(y[i]));
+            } else if(fabs(ref[i]) < 0x1p-1022 || isinf(ref[i])) {
+                assert(fabs(y[i] - ref[i]) <= 0x1p-1070 || y[i] == ref[i]);
+            } else {
+                assert(test_ulp(y[i], ref[i]) <= 1.0);
+            }
+        }
+    }
+    cpu_set_level(cpu_get_max_level());
+    err = tensor_exp_array(n, NULL, y);
+    assert(err != 0 && errno == EINVAL);
+
+    /* a few exact values */
+    double in[] = {0.0, -3.0, 2.5, 1e3};
+    double out[4];
+    tensor_activate_array(TENSOR_SIGMOID, 1, in, out);
+    assert(out[0] == 0.5);
+    tensor_activate_array(TENSOR_TANH, 4, in, out);
+    assert(out[0] == 0.0 && out[3] == 1.0 && out[1] < -0.99);
+    tensor_activate_array(TENSOR_RELU, 4, in, out);
+    assert(out[0] == 0.0 && out[1] == 0.0 && out[2] == 2.5);
+    tensor_activate_array(TENSOR_GELU, 4, in, out);
+    assert(out[0] == 0.0 && out[3] == 1e3);
+    err = tensor_activate_array(TENSOR_NACTIVATIONS, 4, in, out);
+    assert(err != 0 && errno == EINVAL);
+    tensor_activation_fn_t fn = tensor_get_activation_fn(TENSOR_RELU);
+    assert(fn != NULL);
+    fn(4, in, out);
+    assert(out[1] == 0.0 && out[2] == 2.5);
+    assert(tensor_get_activation_fn(TENSOR_NACTIVATIONS) == NULL);
+
+    /* tensors of other types, in place */
+    tensor_t *X = allocate_typed_tensor(13, 21, TENSOR_FLOAT32);
+    tensor_t *D = allocate_tensor(13, 21);
+    for(size_t i = 0; i < 13; i++) {
+        for(size_t j = 0; j < 21; j++) {
+            tensor_set_value(X, i, j, (double)i - (double)j * 0.5);
+        }
+    }
+    err = tensor_relu_derivative(X, D);
+    assert(err == 0);
+    assert(TENSOR_AT(D, 12, 0) == 1.0 && TENSOR_AT(D, 0, 20) == 0.0);
+    err = tensor_sigmoid_derivative(X, D);
+    assert(err == 0 && TENSOR_AT(D, 0, 0) == 0.25);
+    err = tensor_tanh_derivative(X, D);
+    assert(err == 0 && TENSOR_AT(D, 0, 0) == 1.0);
+    err = tensor_gelu_derivative(X, D);
+    assert(err == 0 && TENSOR_AT(D, 0, 0) == 0.5);
+    err = tensor_tanh(X, X);
+    assert(err == 0);
+    assert(TENSOR_ELEMENT(X, float, 0, 0) == 0.0f);
+    assert(TENSOR_ELEMENT(X, float, 12, 0) == 1.0f);
+    err = tensor_sigmoid(X, X);
+    assert(err == 0);
+    tensor_t *R = allocate_tensor(21, 13);
+    err = tensor_gelu(X, R);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_activate(TENSOR_NACTIVATIONS, X, X);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_relu(NULL, X);
+    assert(err != 0 && errno == EINVAL);
+
+    free_tensor(R);
+    free_tensor(X);
+    free_tensor(D);
+    free(x);
+    free(y);
+    free(ref);
+    return 0;
+}
+#endif
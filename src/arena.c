@@ -0,0 +1,270 @@
+/* arena - Bump allocator for short-lived tensors
+ * A training step creates many intermediate tensors (activations, gradients)
+ * that all die at the end of the step. The arena hands them out from one
+ * contiguous block, header and data together, and releases all of them at
+ * once in O(1).
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <errno.h>
+
+#include "tensor.h"
+#include "arena.h"
+
+/* Extra block allocated when the main block is full. Its header takes the
+ * first TENSOR_ALIGNMENT bytes so the allocations stay aligned. */
+struct tensor_arena_chunk {
+    struct tensor_arena_chunk *next;
+    size_t capacity;
+    size_t used;
+};
+
+/* tensor_arena_round: round size up to a multiple of TENSOR_ALIGNMENT */
+static size_t tensor_arena_round(size_t size)
+{
+    return (size + TENSOR_ALIGNMENT - 1) / TENSOR_ALIGNMENT * TENSOR_ALIGNMENT;
+}
+
+/* allocate_tensor_arena: Allocate new arena on the heap whose main block
+ * holds capacity bytes.
+ *
+ * It returns NULL and set errno to EINVAL if capacity is zero.
+ * It returns NULL and set errno to ENOMEM if the allocation fails.
+ * It returns pointer to new allocated tensor_arena_t if success. */
+tensor_arena_t *allocate_tensor_arena(size_t capacity)
+{
+    if(capacity == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    tensor_arena_t *arena = malloc(sizeof *arena);
+    if(arena == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *base = NULL;
+    capacity = tensor_arena_round(capacity);
+    if(posix_memalign(&base, TENSOR_ALIGNMENT, capacity) != 0) {
+        free(arena);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    arena->base = base;
+    arena->capacity = capacity;
+    arena->used = 0;
+    arena->high_water = 0;
+    arena->overflow = NULL;
+    return arena;
+}
+
+/* tensor_arena_free_overflow: free the blocks added when the main block of
+ * arena was full */
+static void tensor_arena_free_overflow(tensor_arena_t *arena)
+{
+    struct tensor_arena_chunk *chunk = arena->overflow;
+    while(chunk != NULL) {
+        struct tensor_arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->overflow = NULL;
+}
+
+/* free_tensor_arena: Free arena and every tensor allocated from it.
+ * It does nothing if arena is NULL */
+void free_tensor_arena(tensor_arena_t *arena)
+{
+    if(arena == NULL) return;
+    tensor_arena_free_overflow(arena);
+    free(arena->base);
+    free(arena);
+}
+
+/* tensor_arena_reset: Release every tensor allocated from arena. The
+ * tensors must not be used afterwards.
+ * If the main block overflowed since the last reset, it is replaced by one
+ * block large enough for everything that was allocated, so a loop that
+ * allocates the same tensors every step stops allocating after its first
+ * step. Otherwise the reset is O(1).
+ * It does nothing if arena is NULL */
+void tensor_arena_reset(tensor_arena_t *arena)
+{
+    if(arena == NULL) return;
+
+    if(arena->overflow != NULL) {
+        tensor_arena_free_overflow(arena);
+
+        /* keep the old block if the larger one cannot be allocated */
+        void *base = NULL;
+        size_t capacity = tensor_arena_round(arena->high_water);
+        if(posix_memalign(&base, TENSOR_ALIGNMENT, capacity) == 0) {
+            free(arena->base);
+            arena->base = base;
+            arena->capacity = capacity;
+        }
+    }
+
+    arena->used = 0;
+    arena->high_water = 0;
+}
+
+/* tensor_arena_bump: take size bytes, aligned to TENSOR_ALIGNMENT, from
+ * arena. A new overflow block is allocated when the current blocks are
+ * full.
+ * It returns NULL and set errno to ENOMEM if the allocation fails */
+static void *tensor_arena_bump(tensor_arena_t *arena, size_t size)
+{
+    size = tensor_arena_round(size);
+
+    if(size <= arena->capacity - arena->used) {
+        void *p = arena->base + arena->used;
+        arena->used += size;
+        arena->high_water += size;
+        return p;
+    }
+
+    struct tensor_arena_chunk *chunk = arena->overflow;
+    if(chunk == NULL || size > chunk->capacity - chunk->used) {
+        void *mem = NULL;
+        size_t capacity = size > arena->capacity ? size : arena->capacity;
+        if(posix_memalign(&mem, TENSOR_ALIGNMENT,
+                          TENSOR_ALIGNMENT + capacity) != 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        chunk = mem;
+        chunk->next = arena->overflow;
+        chunk->capacity = capacity;
+        chunk->used = 0;
+        arena->overflow = chunk;
+    }
+
+    void *p = (char *)chunk + TENSOR_ALIGNMENT + chunk->used;
+    chunk->used += size;
+    arena->high_water += size;
+    return p;
+}
+
+/* tensor_arena_allocate: Allocate new tensor from arena. The header and
+ * the data share one block of the arena and the data has the layout of
+ * allocate_typed_tensor. The elements are NOT initialized, only the row
+ * padding is zero-filled.
+ * The tensor lives until the next tensor_arena_reset or free_tensor_arena;
+ * free_tensor does nothing on it.
+ *
+ * It returns NULL and set errno to EINVAL if arena is NULL, nrows/ncols is
+ * zero or dtype is unknown.
+ * It returns NULL and set errno to ENOMEM if the arena cannot grow.
+ * It returns pointer to new allocated tensor_t if operation succeed. */
+tensor_t *tensor_arena_allocate(tensor_arena_t *arena, size_t nrows,
+                                size_t ncols, tensor_dtype_t dtype)
+{
+    size_t elsize = tensor_dtype_size(dtype);
+
+    /* check the arguments */
+    if(arena == NULL || nrows == 0 || ncols == 0 || elsize == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t header_size = tensor_arena_round(sizeof(tensor_t));
+    size_t data_size = nrows * tensor_leading_dimension(ncols, dtype) * elsize;
+    char *block = tensor_arena_bump(arena, header_size + data_size);
+    if(block == NULL) return NULL;
+
+    tensor_t *tensor = (tensor_t *)block;
+    tensor_init(tensor, nrows, ncols, dtype, block + header_size);
+    tensor->arena = arena;
+    return tensor;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_ARENA_C_TEST
+#include <assert.h>
+#include <stdint.h>
+
+#include "matmul.h"
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+
+    /* it returns NULL if capacity is zero */
+    tensor_arena_t *arena = allocate_tensor_arena(0);
+    assert(arena == NULL);
+    assert(errno == EINVAL);
+
+    arena = allocate_tensor_arena(4096);
+    assert(arena != NULL);
+
+    /* header and data are in the main block, the data is aligned */
+    tensor_t *a = tensor_arena_allocate(arena, 4, 3, TENSOR_FLOAT64);
+    assert(a != NULL);
+    assert((char *)a >= arena->base);
+    assert((char *)a->data < arena->base + arena->capacity);
+    assert((uintptr_t)a->data % TENSOR_ALIGNMENT == 0);
+    assert(a->arena == arena);
+    assert(arena->overflow == NULL);
+
+    /* arena tensors work with the tensor operations */
+    tensor_t *b = tensor_arena_allocate(arena, 3, 2, TENSOR_FLOAT64);
+    tensor_t *c = tensor_arena_allocate(arena, 4, 2, TENSOR_FLOAT64);
+    assert(b != NULL && c != NULL);
+    for(int i = 0; i < 4; i++) {
+        for(int j = 0; j < 3; j++) {
+            tensor_set_value(a, i, j, i + j);
+        }
+    }
+    for(int i = 0; i < 3; i++) {
+        for(int j = 0; j < 2; j++) {
+            tensor_set_value(b, i, j, i == j);
+        }
+    }
+    err = tensor_matmul(a, b, c);
+    assert(err == 0);
+    double output;
+    tensor_get_value(*c, 3, 1, &output);
+    assert(output == 4.0);
+
+    /* free_tensor does nothing on arena tensors */
+    free_tensor(c);
+
+    /* the arena grows past its capacity */
+    tensor_t *big = tensor_arena_allocate(arena, 64, 64, TENSOR_FLOAT32);
+    assert(big != NULL);
+    assert(arena->overflow != NULL);
+    size_t high_water = arena->high_water;
+
+    /* after the reset one block holds the whole step */
+    tensor_arena_reset(arena);
+    assert(arena->overflow == NULL);
+    assert(arena->used == 0);
+    assert(arena->capacity >= high_water);
+    for(int step = 0; step < 3; step++) {
+        a = tensor_arena_allocate(arena, 4, 3, TENSOR_FLOAT64);
+        b = tensor_arena_allocate(arena, 3, 2, TENSOR_FLOAT64);
+        c = tensor_arena_allocate(arena, 4, 2, TENSOR_FLOAT64);
+        big = tensor_arena_allocate(arena, 64, 64, TENSOR_FLOAT32);
+        assert(a != NULL && b != NULL && c != NULL && big != NULL);
+        assert(arena->overflow == NULL);
+        tensor_arena_reset(arena);
+    }
+
+    /* invalid arguments */
+    assert(tensor_arena_allocate(NULL, 1, 1, TENSOR_FLOAT64) == NULL);
+    assert(errno == EINVAL);
+    assert(tensor_arena_allocate(arena, 0, 1, TENSOR_FLOAT64) == NULL);
+    assert(errno == EINVAL);
+
+    /* test free; checked by valgrind */
+    free_tensor_arena(arena);
+    free_tensor_arena(NULL);
+}
+#endif
@@ -0,0 +1,35 @@
+/* arena - Bump allocator for short-lived tensors
+ * A training step creates many intermediate tensors (activations, gradients)
+ * that all die at the end of the step. The arena hands them out from one
+ * contiguous block, header and data together, and releases all of them at
+ * once in O(1).
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_ARENA_H
+#define SIMPLE_NN_ARENA_H
+
+#include "tensor.h"
+
+struct tensor_arena_chunk;
+
+struct tensor_arena {
+    char *base; // main block
+    size_t capacity; // size of the main block in bytes
+    size_t used; // bytes used in the main block
+    size_t high_water; // bytes requested since the last reset
+    struct tensor_arena_chunk *overflow; // blocks added when base is full
+};
+typedef struct tensor_arena tensor_arena_t;
+
+tensor_arena_t *allocate_tensor_arena(size_t capacity);
+
+void free_tensor_arena(tensor_arena_t *arena);
+
+void tensor_arena_reset(tensor_arena_t *arena);
+
+tensor_t *tensor_arena_allocate(tensor_arena_t *arena, size_t nrows,
+                                size_t ncols, tensor_dtype_t dtype);
+
+#endif
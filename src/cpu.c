@@ -0,0 +1,169 @@
+/* cpu - Runtime detection of the instruction sets of the CPU
+ * The library is built without -march so one binary runs on every x86
+ * host. Each module compiles its kernels in several variants with the
+ * target attribute and keeps them in a dispatch table indexed by the
+ * level returned by cpu_get_level, which is detected once with cpuid.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "cpu.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_X86 1
+#endif
+
+static const char *cpu_level_names[CPU_NLEVELS] = {
+    "generic", "sse2", "avx2", "avx512"
+};
+
+static pthread_once_t cpu_once = PTHREAD_ONCE_INIT;
+static cpu_level_t cpu_max_level = CPU_GENERIC;
+static int cpu_level = CPU_GENERIC;
+/* Features left at every level */
+static cpu_features_t cpu_features[CPU_NLEVELS];
+
+/* cpu_detect: Read the CPU features with cpuid. __builtin_cpu_supports
+ * also checks that the OS saves the AVX and AVX-512 registers. The
+ * SIMPLE_NN_CPU environment variable, set to one of the level names, can
+ * lower the level. */
+static void cpu_detect(void)
+{
+    cpu_features_t detected;
+    memset(&detected, 0, sizeof detected);
+
+#ifdef CPU_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) cpu_max_level = CPU_SSE2;
+    if(cpu_max_level == CPU_SSE2 && __builtin_cpu_supports("avx2")
+       && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+        cpu_max_level = CPU_AVX2;
+    }
+    if(cpu_max_level == CPU_AVX2 && __builtin_cpu_supports("avx512f")
+       && __builtin_cpu_supports("avx512bw")
+       && __builtin_cpu_supports("avx512vl")
+       && __builtin_cpu_supports("avx512dq")) {
+        cpu_max_level = CPU_AVX512;
+    }
+    detected.f16c = __builtin_cpu_supports("f16c") != 0;
+#ifdef CPU_HAVE_AVXVNNI
+    detected.avxvnni = __builtin_cpu_supports("avxvnni") != 0;
+#endif
+    detected.avx512bf16 = __builtin_cpu_supports("avx512bf16") != 0;
+    detected.avx512vnni = __builtin_cpu_supports("avx512vnni") != 0;
+#endif
+
+    for(int level = 0; level < CPU_NLEVELS; level++) {
+        cpu_features_t *features = &cpu_features[level];
+        *features = detected;
+        if(level < CPU_AVX2 || level > (int)cpu_max_level) {
+            features->f16c = 0;
+            features->avxvnni = 0;
+        }
+        if(level < CPU_AVX512 || level > (int)cpu_max_level) {
+            features->avx512bf16 = 0;
+            features->avx512vnni = 0;
+        }
+    }
+
+    int level = cpu_max_level;
+    const char *name = getenv("SIMPLE_NN_CPU");
+    for(int i = 0; name != NULL && i <= (int)cpu_max_level; i++) {
+        if(strcmp(name, cpu_level_names[i]) == 0) level = i;
+    }
+    __atomic_store_n(&cpu_level, level, __ATOMIC_RELAXED);
+}
+
+/* cpu_get_level: Get the level the kernels are dispatched to, the highest
+ * one the CPU supports unless it was lowered.
+ * It returns the current level */
+cpu_level_t cpu_get_level(void)
+{
+    pthread_once(&cpu_once, cpu_detect);
+    return (cpu_level_t)__atomic_load_n(&cpu_level, __ATOMIC_RELAXED);
+}
+
+/* cpu_get_max_level: Get the highest level the CPU supports.
+ * It returns the detected level */
+cpu_level_t cpu_get_max_level(void)
+{
+    pthread_once(&cpu_once, cpu_detect);
+    return cpu_max_level;
+}
+
+/* cpu_set_level: Dispatch the kernels to level, to validate or compare
+ * the variants on one host. It should not be called while kernels are
+ * running on other threads.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if the CPU doesn't
+ * support level */
+int cpu_set_level(cpu_level_t level)
+{
+    pthread_once(&cpu_once, cpu_detect);
+    if((int)level < 0 || level > cpu_max_level) {
+        errno = EINVAL;
+        return -1;
+    }
+    __atomic_store_n(&cpu_level, (int)level, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* cpu_get_features: Get the extensions usable at the current level.
+ * It returns pointer to the features, valid for the whole program */
+const cpu_features_t *cpu_get_features(void)
+{
+    return &cpu_features[cpu_get_level()];
+}
+
+/* cpu_level_name: Get the name of level, as accepted by SIMPLE_NN_CPU.
+ * It returns NULL if level is not valid */
+const char *cpu_level_name(cpu_level_t level)
+{
+    if((int)level < 0 || level >= CPU_NLEVELS) return NULL;
+    return cpu_level_names[level];
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_CPU_C_TEST
+#include <assert.h>
+#include <stdio.h>
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    cpu_level_t max = cpu_get_max_level();
+    assert(cpu_get_level() <= max);
+#ifdef CPU_X86
+    assert(max >= CPU_SSE2);
+#endif
+
+    /* every supported level can be selected, the others can't */
+    for(int level = 0; level < CPU_NLEVELS; level++) {
+        err = cpu_set_level((cpu_level_t)level);
+        if(level > (int)max) {
+            assert(err != 0 && errno == EINVAL);
+            continue;
+        }
+        assert(err == 0 && cpu_get_level() == (cpu_level_t)level);
+        const cpu_features_t *features = cpu_get_features();
+        if(level < CPU_AVX2) assert(!features->f16c && !features->avxvnni);
+        if(level < CPU_AVX512) {
+            assert(!features->avx512bf16 && !features->avx512vnni);
+        }
+    }
+    err = cpu_set_level(CPU_NLEVELS);
+    assert(err != 0 && errno == EINVAL);
+    err = cpu_set_level(max);
+    assert(err == 0);
+
+    assert(strcmp(cpu_level_name(CPU_AVX2), "avx2") == 0);
+    assert(cpu_level_name(CPU_NLEVELS) == NULL);
+    return 0;
+}
+#endif
@@ -0,0 +1,50 @@
+/* cpu - Runtime detection of the instruction sets of the CPU
+ * The library is built without -march so one binary runs on every x86
+ * host. Each module compiles its kernels in several variants with the
+ * target attribute and keeps them in a dispatch table indexed by the
+ * level returned by cpu_get_level, which is detected once with cpuid.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_CPU_H
+#define SIMPLE_NN_CPU_H
+
+/* Each level includes the ones below it */
+enum cpu_level {
+    CPU_GENERIC, // portable C only
+    CPU_SSE2, // x86-64 baseline
+    CPU_AVX2, // AVX2, FMA and F16C
+    CPU_AVX512, // AVX-512 F, BW, VL and DQ
+    CPU_NLEVELS
+};
+typedef enum cpu_level cpu_level_t;
+
+/* AVX-VNNI is detected and its kernels are compiled with GCC 11 or clang 12
+ * and newer, which also need binutils 2.36 to assemble them. Older
+ * compilers leave the feature cleared and use the AVX2 kernels. */
+#if defined(__clang__)
+#if __clang_major__ >= 12
+#define CPU_HAVE_AVXVNNI 1
+#endif
+#elif defined(__GNUC__) && __GNUC__ >= 11
+#define CPU_HAVE_AVXVNNI 1
+#endif
+
+/* Instruction set extensions that don't define a level. They are cleared
+ * when the level is lowered below the one they need. */
+struct cpu_features {
+    int f16c; // half precision conversions
+    int avxvnni; // VEX encoded int8 dot products
+    int avx512bf16; // bfloat16 conversions and dot products
+    int avx512vnni; // EVEX encoded int8 dot products
+};
+typedef struct cpu_features cpu_features_t;
+
+cpu_level_t cpu_get_level(void);
+cpu_level_t cpu_get_max_level(void);
+int cpu_set_level(cpu_level_t level);
+const cpu_features_t *cpu_get_features(void);
+const char *cpu_level_name(cpu_level_t level);
+
+#endif
@@ -0,0 +1,889 @@
+/* csv - Streaming loader for numeric CSV/TSV data
+ * The rows are parsed straight into tensors: one column can be split off
+ * as the label tensor y and the others become the feature tensor X. The
+ * separators are found 64 bytes at a time with SIMD compares and numbers
+ * are converted with a fast exact path that falls back to strtod(3) only
+ * for long or extreme values. Large files are split into byte ranges that
+ * are parsed by several threads.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tensor.h"
+#include "csv.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define CSV_SSE2
+#include <emmintrin.h>
+#endif
+
+#define CSV_BLOCK 64
+/* Bytes read at once by csv_read */
+#define CSV_CHUNK_SIZE (1 << 20)
+/* Rows allocated by csv_read before the first growth */
+#define CSV_MIN_ROWS 1024
+/* csv_load gives each thread at least this many bytes */
+#define CSV_MIN_SPLIT (64 * 1024)
+#define CSV_MAX_THREADS 64
+/* Longest field handed to strtod */
+#define CSV_MAX_FIELD 128
+
+/* csv_separator_mask: Bit i of the result is set if p[i] is the delimiter
+ * or a newline. n is at most CSV_BLOCK. */
+static uint64_t csv_separator_mask(const char *p, size_t n, char delimiter)
+{
+    uint64_t mask = 0;
+#ifdef CSV_SSE2
+    if(n == CSV_BLOCK) {
+        __m128i delim = _mm_set1_epi8(delimiter);
+        __m128i newline = _mm_set1_epi8('\n');
+        for(int i = 0; i < 4; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+            __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(v, delim),
+                                      _mm_cmpeq_epi8(v, newline));
+            mask |= (uint64_t)(uint32_t)_mm_movemask_epi8(eq) << (16 * i);
+        }
+        return mask;
+    }
+#endif
+    for(size_t i = 0; i < n; i++) {
+        if(p[i] == delimiter || p[i] == '\n') mask |= (uint64_t)1 << i;
+    }
+    return mask;
+}
+
+static int csv_lowest_bit(uint64_t mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask);
+#else
+    int i = 0;
+    while(!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/* Powers of ten that are exact in a double */
+static const double csv_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+    1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* csv_parse_double: Convert the field [s, e) to a double.
+ * A decimal with at most 19 significant digits whose mantissa fits in 53
+ * bits and whose exponent is within 1e22 is converted with a single
+ * correctly rounded multiply or divide, so the result is the same as
+ * strtod(3). Anything else, including nan and inf, goes to strtod. Spaces
+ * around the number are ignored and an empty field is NaN.
+ *
+ * It returns zero on success and non-zero value if the field is not a
+ * number */
+static int csv_parse_double(const char *s, const char *e, double *value)
+{
+    while(s < e && (*s == ' ' || *s == '\t')) s++;
+    while(e > s && (e[-1] == ' ' || e[-1] == '\t')) e--;
+    if(s == e) {
+        *value = NAN;
+        return 0;
+    }
+
+    const char *p = s;
+    int negative = 0;
+    if(*p == '-' || *p == '+') {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int ndigits = 0, exponent = 0, truncated = 0, any = 0;
+    for(; p < e && *p >= '0' && *p <= '9'; p++) {
+        any = 1;
+        if(ndigits < 19) {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            if(mantissa != 0) ndigits++;
+        } else {
+            truncated |= *p != '0';
+            exponent++;
+        }
+    }
+    if(p < e && *p == '.') {
+        for(p++; p < e && *p >= '0' && *p <= '9'; p++) {
+            any = 1;
+            if(ndigits < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                if(mantissa != 0) ndigits++;
+                exponent--;
+            } else {
+                truncated |= *p != '0';
+            }
+        }
+    }
+    if(any && p < e && (*p == 'e' || *p == 'E')) {
+        int negative_exponent = 0, value = 0;
+        p++;
+        if(p < e && (*p == '-' || *p == '+')) {
+            negative_exponent = *p == '-';
+            p++;
+        }
+        if(p == e || *p < '0' || *p > '9') any = 0;
+        for(; p < e && *p >= '0' && *p <= '9'; p++) {
+            if(value < 100000) value = value * 10 + (*p - '0');
+        }
+        exponent += negative_exponent ? -value : value;
+    }
+
+    if(any && p == e && !truncated && mantissa <= ((uint64_t)1 << 53)
+       && exponent >= -22 && exponent <= 22) {
+        double result = (double)mantissa;
+        if(exponent < 0) result /= csv_pow10[-exponent];
+        else result *= csv_pow10[exponent];
+        *value = negative ? -result : result;
+        return 0;
+    }
+
+    /* slow path, strtod needs a terminated string */
+    char field[CSV_MAX_FIELD];
+    size_t n = (size_t)(e - s);
+    if(n >= CSV_MAX_FIELD) return -1;
+    memcpy(field, s, n);
+    field[n] = '\0';
+    char *stop;
+    *value = strtod(field, &stop);
+    return stop == field + n ? 0 : -1;
+}
+
+/* csv_scanner_init: Start scanning the rows of the len bytes at buf. The
+ * buffer must stay valid while the scanner is used. */
+void csv_scanner_init(csv_scanner_t *s, const char *buf, size_t len,
+                      char delimiter)
+{
+    s->block = buf;
+    s->end = buf + len;
+    s->field = buf;
+    s->delimiter = delimiter;
+    s->mask = len > 0 ? csv_separator_mask(buf,
+                                           len < CSV_BLOCK ? len : CSV_BLOCK,
+                                           delimiter)
+                      : 0;
+}
+
+/* csv_next_separator: Return the next delimiter or newline, or NULL at
+ * the end of the buffer */
+static const char *csv_next_separator(csv_scanner_t *s)
+{
+    while(s->mask == 0) {
+        size_t left = (size_t)(s->end - s->block);
+        if(left <= CSV_BLOCK) return NULL;
+        s->block += CSV_BLOCK;
+        left -= CSV_BLOCK;
+        s->mask = csv_separator_mask(s->block,
+                                     left < CSV_BLOCK ? left : CSV_BLOCK,
+                                     s->delimiter);
+    }
+    const char *separator = s->block + csv_lowest_bit(s->mask);
+    s->mask &= s->mask - 1;
+    return separator;
+}
+
+/* csv_next_row: Parse the next non-empty row of scanner s. The first
+ * max_values fields are stored in values and the number of fields in the
+ * row, which may be larger than max_values, is stored in nvalues.
+ *
+ * It returns 1 if a row is parsed
+ * It returns zero at the end of the buffer
+ * It returns -1 and set errno to EINVAL if a field of the row is not a
+ * number, the scanner is still moved past the row */
+int csv_next_row(csv_scanner_t *s, double *values, size_t max_values,
+                 size_t *nvalues)
+{
+    size_t n = 0;
+    int bad = 0;
+    for(;;) {
+        const char *start = s->field;
+        if(n == 0 && start >= s->end) {
+            *nvalues = 0;
+            return 0;
+        }
+
+        const char *separator = csv_next_separator(s);
+        const char *stop = separator != NULL ? separator : s->end;
+        int last = separator == NULL || *separator == '\n';
+        s->field = separator != NULL ? separator + 1 : s->end;
+
+        const char *field_end = stop;
+        if(last && field_end > start && field_end[-1] == '\r') field_end--;
+        if(last && n == 0 && field_end == start) {
+            /* empty line */
+            if(separator == NULL) {
+                *nvalues = 0;
+                return 0;
+            }
+            continue;
+        }
+
+        if(n < max_values) {
+            bad |= csv_parse_double(start, field_end, &values[n]);
+        }
+        n++;
+        if(last) break;
+    }
+    *nvalues = n;
+    if(bad) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 1;
+}
+
+/* csv_count_rows: Count the non-empty lines of the len bytes at buf, a
+ * line that is only "\r" is empty.
+ * It returns the number of rows csv_next_row finds in the buffer */
+size_t csv_count_rows(const char *buf, size_t len)
+{
+    size_t nrows = 0;
+    const char *p = buf, *end = buf + len;
+    while(p < end) {
+        const char *newline = memchr(p, '\n', (size_t)(end - p));
+        const char *stop = newline != NULL ? newline : end;
+        size_t n = (size_t)(stop - p);
+        if(n > 0 && p[n - 1] == '\r') n--;
+        if(n > 0) nrows++;
+        if(newline == NULL) break;
+        p = newline + 1;
+    }
+    return nrows;
+}
+
+/* csv_count_cols: Count the fields of the first non-empty line of the len
+ * bytes at buf.
+ * It returns zero if there is no such line */
+size_t csv_count_cols(const char *buf, size_t len, char delimiter)
+{
+    const char *p = buf, *end = buf + len;
+    while(p < end) {
+        const char *newline = memchr(p, '\n', (size_t)(end - p));
+        const char *stop = newline != NULL ? newline : end;
+        if(stop > p && stop[-1] == '\r') stop--;
+        if(stop > p) {
+            size_t ncols = 1;
+            for(; p < stop; p++) ncols += *p == delimiter;
+            return ncols;
+        }
+        if(newline == NULL) break;
+        p = newline + 1;
+    }
+    return 0;
+}
+
+/* csv_store: Store n values at column colj of row rowi of t */
+static void csv_store(tensor_t *t, size_t rowi, size_t colj,
+                      const double *values, size_t n)
+{
+    size_t elsize = tensor_dtype_size(t->dtype);
+    char *dst = (char *)t->data
+                + (t->offset + rowi * t->ld + colj * t->col_stride) * elsize;
+    if(t->col_stride == 1) {
+        tensor_convert_array(values, TENSOR_FLOAT64, dst, t->dtype, n);
+        return;
+    }
+    for(size_t j = 0; j < n; j++) {
+        tensor_convert_array(values + j, TENSOR_FLOAT64,
+                             dst + j * t->col_stride * elsize, t->dtype, 1);
+    }
+}
+
+/* csv_parse_into: Parse the rows of the len bytes at buf into the
+ * preallocated tensors X and y, starting at row rowi. Every row must have
+ * X->ncols fields, plus the label field if opts->label_column is not
+ * negative; the label is stored in the first column of y. The header
+ * option is ignored, buf must start at a line. Apart from one row buffer
+ * nothing is allocated. The number of rows stored is written to nrows if
+ * nrows is not NULL, also on failure.
+ *
+ * It returns zero on success
+ * It returns non-zero value and set errno to EINVAL if the arguments are
+ * invalid, a field is not a number or a row has the wrong number of fields
+ * It returns non-zero value and set errno to ERANGE if X or y has too few
+ * rows
+ * It returns non-zero value and set errno to ENOMEM if the row buffer
+ * cannot be allocated */
+int csv_parse_into(const char *buf, size_t len, const csv_options_t *opts,
+                   tensor_t *X, tensor_t *y, size_t rowi, size_t *nrows)
+{
+    if(nrows != NULL) *nrows = 0;
+
+    /* NULL checking */
+    long label = opts != NULL ? opts->label_column : -1;
+    if((buf == NULL && len > 0) || opts == NULL || X == NULL
+       || (label >= 0 && (y == NULL || y->ncols == 0))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t nfields = X->ncols + (label >= 0);
+    if(nfields == 0 || label >= (long)nfields) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    double *values = malloc(nfields * sizeof(double));
+    if(values == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    csv_scanner_t scanner;
+    csv_scanner_init(&scanner, buf, len, opts->delimiter);
+
+    size_t row = rowi, n;
+    int status, err = 0;
+    while((status = csv_next_row(&scanner, values, nfields, &n)) != 0) {
+        if(status < 0 || n != nfields) {
+            err = EINVAL;
+            break;
+        }
+        if(row >= X->nrows || (label >= 0 && row >= y->nrows)) {
+            err = ERANGE;
+            break;
+        }
+        if(label < 0) {
+            csv_store(X, row, 0, values, nfields);
+        } else {
+            size_t split = (size_t)label;
+            csv_store(X, row, 0, values, split);
+            csv_store(X, row, split, values + split + 1, nfields - split - 1);
+            csv_store(y, row, 0, values + split, 1);
+        }
+        row++;
+    }
+    free(values);
+
+    if(nrows != NULL) *nrows = row - rowi;
+    if(err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* One byte range of a multithreaded load */
+struct csv_task {
+    const char *begin;
+    const char *end;
+    const csv_options_t *opts;
+    tensor_t *X;
+    tensor_t *y;
+    size_t rowi;
+    size_t nrows;
+    int err;
+};
+
+static void *csv_count_task(void *arg)
+{
+    struct csv_task *task = arg;
+    task->nrows = csv_count_rows(task->begin,
+                                 (size_t)(task->end - task->begin));
+    return NULL;
+}
+
+static void *csv_parse_task(void *arg)
+{
+    struct csv_task *task = arg;
+    size_t nrows;
+    if(csv_parse_into(task->begin, (size_t)(task->end - task->begin),
+                      task->opts, task->X, task->y, task->rowi,
+                      &nrows) != 0) {
+        task->err = errno;
+    }
+    return NULL;
+}
+
+/* csv_run: Run fn on every task, the first one on the calling thread. A
+ * task whose thread cannot be started runs on the calling thread too. */
+static void csv_run(struct csv_task *tasks, size_t ntasks,
+                    void *(*fn)(void *))
+{
+    pthread_t threads[CSV_MAX_THREADS];
+    int started[CSV_MAX_THREADS];
+    for(size_t i = 1; i < ntasks; i++) {
+        started[i] = pthread_create(&threads[i], NULL, fn, &tasks[i]) == 0;
+        if(!started[i]) fn(&tasks[i]);
+    }
+    fn(&tasks[0]);
+    for(size_t i = 1; i < ntasks; i++) {
+        if(started[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+/* csv_skip_line: Return the start of the line after the one at p */
+static const char *csv_skip_line(const char *p, const char *end)
+{
+    const char *newline = memchr(p, '\n', (size_t)(end - p));
+    return newline != NULL ? newline + 1 : end;
+}
+
+/* csv_load_buffer: Parse the whole buffer into new tensors. The buffer is
+ * cut into byte ranges at line starts; every range counts its rows, the
+ * counts give the first row of every range and then all ranges are parsed
+ * in parallel straight into X and y. */
+static int csv_load_buffer(const char *buf, size_t len,
+                           const csv_options_t *opts, tensor_t **X,
+                           tensor_t **y)
+{
+    const char *begin = buf, *end = buf + len;
+    if(opts->has_header) begin = csv_skip_line(begin, end);
+
+    long label = opts->label_column;
+    size_t nfields = csv_count_cols(begin, (size_t)(end - begin),
+                                    opts->delimiter);
+    if(nfields == 0 || label >= (long)nfields
+       || (label >= 0 && nfields == 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t size = (size_t)(end - begin);
+    size_t nthreads = opts->nthreads > 0 ? opts->nthreads : 1;
+    if(nthreads > CSV_MAX_THREADS) nthreads = CSV_MAX_THREADS;
+    if(nthreads > size / CSV_MIN_SPLIT) nthreads = size / CSV_MIN_SPLIT;
+    if(nthreads == 0) nthreads = 1;
+
+    struct csv_task tasks[CSV_MAX_THREADS];
+    const char *p = begin;
+    for(size_t i = 0; i < nthreads; i++) {
+        const char *stop = end;
+        if(i + 1 < nthreads) {
+            stop = begin + size / nthreads * (i + 1);
+            if(stop < p) stop = p;
+            stop = csv_skip_line(stop, end);
+        }
+        tasks[i].begin = p;
+        tasks[i].end = stop;
+        tasks[i].opts = opts;
+        tasks[i].err = 0;
+        p = stop;
+    }
+
+    csv_run(tasks, nthreads, csv_count_task);
+    size_t total = 0;
+    for(size_t i = 0; i < nthreads; i++) {
+        tasks[i].rowi = total;
+        total += tasks[i].nrows;
+    }
+
+    tensor_t *xs = allocate_typed_tensor(total, nfields - (label >= 0),
+                                         opts->dtype);
+    tensor_t *ys = label >= 0 ? allocate_typed_tensor(total, 1,
+                                                      TENSOR_FLOAT64)
+                              : NULL;
+    if(xs == NULL || (label >= 0 && ys == NULL)) {
+        free_tensor(xs);
+        free_tensor(ys);
+        errno = ENOMEM;
+        return -1;
+    }
+    for(size_t i = 0; i < nthreads; i++) {
+        tasks[i].X = xs;
+        tasks[i].y = ys;
+    }
+
+    csv_run(tasks, nthreads, csv_parse_task);
+    for(size_t i = 0; i < nthreads; i++) {
+        if(tasks[i].err) {
+            free_tensor(xs);
+            free_tensor(ys);
+            errno = tasks[i].err;
+            return -1;
+        }
+    }
+
+    *X = xs;
+    if(y != NULL) *y = ys;
+    return 0;
+}
+
+/* csv_load: Load the CSV/TSV file at path into a new tensor X of
+ * opts->dtype and, if opts->label_column is not negative, a new float64
+ * column tensor y. The number of columns is taken from the first row. The
+ * file is mapped with mmap(2) and parsed by up to opts->nthreads threads.
+ *
+ * It returns zero on success
+ * It returns non-zero value and set errno to EINVAL if the arguments are
+ * invalid or the file is empty or malformed
+ * It returns non-zero value and set errno to ENOMEM if the tensors cannot
+ * be allocated
+ * It returns non-zero value and keep errno of open(2) or mmap(2) if the
+ * file cannot be mapped */
+int csv_load(const char *path, const csv_options_t *opts, tensor_t **X,
+             tensor_t **y)
+{
+    /* NULL checking */
+    if(path == NULL || opts == NULL || X == NULL
+       || (opts->label_column >= 0 && y == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return -1;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    size_t length = (size_t)st.st_size;
+    if(length == 0) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved = errno;
+    close(fd);
+    if(base == MAP_FAILED) {
+        errno = saved;
+        return -1;
+    }
+    posix_madvise(base, length, POSIX_MADV_SEQUENTIAL);
+
+    int err = csv_load_buffer(base, length, opts, X, y);
+    saved = errno;
+    munmap(base, length);
+    errno = saved;
+    return err;
+}
+
+/* csv_grow: Replace *t by a tensor of nrows rows holding its first used
+ * rows */
+static int csv_grow(tensor_t **t, size_t nrows, size_t used)
+{
+    tensor_t *grown = allocate_typed_tensor(nrows, (*t)->ncols, (*t)->dtype);
+    if(grown == NULL) return -1;
+    if(used > 0) tensor_copy_rows(*t, 0, used, grown, 0);
+    free_tensor(*t);
+    *t = grown;
+    return 0;
+}
+
+/* csv_read: Read CSV/TSV rows from file into new tensors like csv_load.
+ * The input is read in chunks of opts->chunk_size bytes, every chunk is
+ * parsed up to its last complete line and the tensors grow by doubling,
+ * so the data is never held as text. The memory of X and y may have room
+ * for up to twice their rows.
+ *
+ * It returns zero on success
+ * It returns non-zero value and set errno to EINVAL if the arguments are
+ * invalid or the input is empty or malformed
+ * It returns non-zero value and set errno to ENOMEM if the memory cannot
+ * be allocated
+ * It returns non-zero value and set errno to EIO if the file cannot be
+ * read */
+int csv_read(FILE *file, const csv_options_t *opts, tensor_t **X,
+             tensor_t **y)
+{
+    /* NULL checking */
+    if(file == NULL || opts == NULL || X == NULL
+       || (opts->label_column >= 0 && y == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    long label = opts->label_column;
+    size_t capacity = opts->chunk_size > 0 ? opts->chunk_size
+                                           : CSV_CHUNK_SIZE;
+    char *buf = malloc(capacity);
+    if(buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    tensor_t *xs = NULL, *ys = NULL;
+    size_t len = 0, rows = 0;
+    int skip_header = opts->has_header, eof = 0, err = 0;
+    while(!eof) {
+        /* a line longer than the buffer */
+        if(len == capacity) {
+            char *larger = realloc(buf, capacity * 2);
+            if(larger == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            buf = larger;
+            capacity *= 2;
+        }
+
+        size_t n = fread(buf + len, 1, capacity - len, file);
+        if(n < capacity - len) {
+            if(ferror(file)) {
+                err = EIO;
+                break;
+            }
+            eof = 1;
+        }
+        len += n;
+
+        /* keep the partial last line for the next chunk */
+        size_t complete = len;
+        if(!eof) {
+            while(complete > 0 && buf[complete - 1] != '\n') complete--;
+            if(complete == 0) continue;
+        }
+
+        const char *p = buf;
+        if(skip_header) {
+            p = csv_skip_line(p, buf + complete);
+            skip_header = 0;
+        }
+        size_t size = (size_t)(buf + complete - p);
+        size_t more = csv_count_rows(p, size);
+        if(more > 0) {
+            if(xs == NULL) {
+                size_t nfields = csv_count_cols(p, size, opts->delimiter);
+                if(label >= (long)nfields || (label >= 0 && nfields == 1)) {
+                    err = EINVAL;
+                    break;
+                }
+                size_t nrows = more > CSV_MIN_ROWS ? more : CSV_MIN_ROWS;
+                xs = allocate_typed_tensor(nrows, nfields - (label >= 0),
+                                           opts->dtype);
+                if(label >= 0) {
+                    ys = allocate_typed_tensor(nrows, 1, TENSOR_FLOAT64);
+                }
+                if(xs == NULL || (label >= 0 && ys == NULL)) {
+                    err = ENOMEM;
+                    break;
+                }
+            } else if(rows + more > xs->nrows) {
+                size_t nrows = xs->nrows * 2;
+                if(nrows < rows + more) nrows = rows + more;
+                if(csv_grow(&xs, nrows, rows) != 0
+                   || (ys != NULL && csv_grow(&ys, nrows, rows) != 0)) {
+                    err = ENOMEM;
+                    break;
+                }
+            }
+
+            size_t parsed;
+            if(csv_parse_into(p, size, opts, xs, ys, rows, &parsed) != 0) {
+                err = errno;
+                break;
+            }
+            rows += parsed;
+        }
+
+        memmove(buf, buf + complete, len - complete);
+        len -= complete;
+    }
+    free(buf);
+
+    if(!err && rows == 0) err = EINVAL;
+    if(err) {
+        free_tensor(xs);
+        free_tensor(ys);
+        errno = err;
+        return -1;
+    }
+
+    xs->nrows = rows;
+    if(ys != NULL) ys->nrows = rows;
+    *X = xs;
+    if(y != NULL) *y = ys;
+    return 0;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_CSV_C_TEST
+#include <assert.h>
+
+static void write_file(const char *path, const char *text, size_t len)
+{
+    FILE *file = fopen(path, "wb");
+    assert(file != NULL);
+    assert(fwrite(text, 1, len, file) == len);
+    fclose(file);
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    double value = 0.0;
+
+    /* the fast path gives the same doubles as strtod */
+    char number[64];
+    uint64_t state = 88172645463325252ULL;
+    for(int i = 0; i < 20000; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int exponent = (int)(state % 61) - 30;
+        sprintf(number, "%s%llu.%llue%d", state & 1 ? "-" : "",
+                (unsigned long long)(state >> 40),
+                (unsigned long long)(state % 100000000), exponent);
+        err = csv_parse_double(number, number + strlen(number), &value);
+        assert(err == 0);
+        assert(value == strtod(number, NULL));
+    }
+    const char *numbers[] = {"0", "-0.0", "+12", ".5", "5.", "1e22",
+                             "9007199254740993", "123456789012345678901234",
+                             "1e-400", "2.2250738585072014e-308", "inf",
+                             "-nan", "0x1p3", "  7.25  "};
+    for(size_t i = 0; i < sizeof numbers / sizeof numbers[0]; i++) {
+        const char *s = numbers[i];
+        err = csv_parse_double(s, s + strlen(s), &value);
+        assert(err == 0);
+        double expected = strtod(s, NULL);
+        assert(value == expected || (isnan(value) && isnan(expected)));
+    }
+    const char *junk[] = {"-", "e5", "1e", "1.2.3", "abc", "1,5"};
+    for(size_t i = 0; i < sizeof junk / sizeof junk[0]; i++) {
+        const char *s = junk[i];
+        assert(csv_parse_double(s, s + strlen(s), &value) != 0);
+    }
+    assert(csv_parse_double(number, number, &value) == 0 && isnan(value));
+
+    /* rows: blank lines, CRLF, an empty field and no final newline */
+    const char *text = "1,2,3\r\n\n\r\n4, 5 ,6\n7,,9";
+    size_t len = strlen(text);
+    assert(csv_count_rows(text, len) == 3);
+    assert(csv_count_cols(text, len, ',') == 3);
+    csv_scanner_t scanner;
+    double values[4];
+    size_t n;
+    csv_scanner_init(&scanner, text, len, ',');
+    assert(csv_next_row(&scanner, values, 4, &n) == 1 && n == 3);
+    assert(values[0] == 1.0 && values[2] == 3.0);
+    assert(csv_next_row(&scanner, values, 4, &n) == 1 && n == 3);
+    assert(values[1] == 5.0);
+    assert(csv_next_row(&scanner, values, 4, &n) == 1 && n == 3);
+    assert(values[0] == 7.0 && isnan(values[1]) && values[2] == 9.0);
+    assert(csv_next_row(&scanner, values, 4, &n) == 0);
+
+    /* rows longer than a SIMD block */
+    char line[1024];
+    size_t used = 0;
+    for(int j = 0; j < 40; j++) {
+        used += sprintf(line + used, "%s%d.5", j ? "\t" : "", j);
+    }
+    line[used++] = '\n';
+    line[used] = '\0';
+    csv_scanner_init(&scanner, line, used, '\t');
+    double wide[40];
+    assert(csv_next_row(&scanner, wide, 40, &n) == 1 && n == 40);
+    for(int j = 0; j < 40; j++) assert(wide[j] == j + 0.5);
+
+    /* the label column is split into y */
+    csv_options_t opts = CSV_OPTIONS_DEFAULT;
+    opts.label_column = 1;
+    tensor_t *X = allocate_tensor(3, 2);
+    tensor_t *y = allocate_tensor(3, 1);
+    err = csv_parse_into(text, len, &opts, X, y, 0, &n);
+    assert(err == 0 && n == 3);
+    assert(TENSOR_AT(X, 0, 0) == 1.0 && TENSOR_AT(X, 0, 1) == 3.0);
+    assert(TENSOR_AT(y, 1, 0) == 5.0 && isnan(TENSOR_AT(y, 2, 0)));
+
+    /* too few rows, wrong field count and junk fields */
+    err = csv_parse_into(text, len, &opts, X, y, 1, &n);
+    assert(err != 0 && errno == ERANGE && n == 2);
+    err = csv_parse_into("1,2\n", 4, &opts, X, y, 0, &n);
+    assert(err != 0 && errno == EINVAL);
+    err = csv_parse_into("1,x,3\n", 6, &opts, X, y, 0, &n);
+    assert(err != 0 && errno == EINVAL);
+    free_tensor(X);
+    free_tensor(y);
+
+    /* a file with a header loads the same with one and several threads */
+    char path[] = "/tmp/simple-nn-csv-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    size_t nrows = 20000, capacity = nrows * 64 + 64;
+    char *data = malloc(capacity);
+    used = (size_t)sprintf(data, "a,b,label,c\n");
+    for(size_t i = 0; i < nrows; i++) {
+        used += (size_t)sprintf(data + used, "%zu.25,-%zue-3,%zu,%zu\n",
+                                i, i, i % 10, i * 7);
+    }
+    write_file(path, data, used);
+
+    opts.label_column = 2;
+    opts.has_header = 1;
+    tensor_t *X1, *y1, *X4, *y4;
+    err = csv_load(path, &opts, &X1, &y1);
+    assert(err == 0);
+    assert(X1->nrows == nrows && X1->ncols == 3 && y1->nrows == nrows);
+    opts.nthreads = 4;
+    err = csv_load(path, &opts, &X4, &y4);
+    assert(err == 0);
+    for(size_t i = 0; i < nrows; i++) {
+        assert(TENSOR_AT(X1, i, 0) == i + 0.25);
+        assert(TENSOR_AT(X1, i, 1) == -(double)i / 1000.0);
+        assert(TENSOR_AT(X1, i, 2) == i * 7.0);
+        assert(TENSOR_AT(y1, i, 0) == (double)(i % 10));
+        for(size_t j = 0; j < 3; j++) {
+            assert(TENSOR_AT(X4, i, j) == TENSOR_AT(X1, i, j));
+        }
+        assert(TENSOR_AT(y4, i, 0) == TENSOR_AT(y1, i, 0));
+    }
+
+    /* streaming with chunks smaller than some lines and a float32 X */
+    opts.chunk_size = 16;
+    opts.dtype = TENSOR_FLOAT32;
+    FILE *file = fopen(path, "rb");
+    tensor_t *Xs, *ys;
+    err = csv_read(file, &opts, &Xs, &ys);
+    fclose(file);
+    assert(err == 0);
+    assert(Xs->nrows == nrows && Xs->dtype == TENSOR_FLOAT32);
+    for(size_t i = 0; i < nrows; i += 97) {
+        assert(TENSOR_ELEMENT(Xs, float, i, 2) == (float)(i * 7));
+        assert(TENSOR_AT(ys, i, 0) == TENSOR_AT(y1, i, 0));
+    }
+    free_tensor(Xs);
+    free_tensor(ys);
+
+    /* no label column */
+    opts = (csv_options_t)CSV_OPTIONS_DEFAULT;
+    opts.has_header = 1;
+    tensor_t *Xn;
+    err = csv_load(path, &opts, &Xn, NULL);
+    assert(err == 0 && Xn->ncols == 4);
+    assert(TENSOR_AT(Xn, 3, 3) == 21.0);
+    free_tensor(Xn);
+
+    /* empty and malformed files */
+    write_file(path, "", 0);
+    err = csv_load(path, &opts, &Xn, NULL);
+    assert(err != 0 && errno == EINVAL);
+    write_file(path, "1,2\n3\n", 6);
+    opts.has_header = 0;
+    err = csv_load(path, &opts, &Xn, NULL);
+    assert(err != 0 && errno == EINVAL);
+
+    free_tensor(X1);
+    free_tensor(y1);
+    free_tensor(X4);
+    free_tensor(y4);
+    free(data);
+    unlink(path);
+    return 0;
+}
+#endif
@@ -0,0 +1,61 @@
+/* csv - Streaming loader for numeric CSV/TSV data
+ * The rows are parsed straight into tensors: one column can be split off
+ * as the label tensor y and the others become the feature tensor X. The
+ * separators are found 64 bytes at a time with SIMD compares and numbers
+ * are converted with a fast exact path that falls back to strtod(3) only
+ * for long or extreme values. Large files are split into byte ranges that
+ * are parsed by several threads.
+ *
+ * Only numeric fields are supported: no quoting, an empty field is NaN.
+ * Empty lines are skipped.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_CSV_H
+#define SIMPLE_NN_CSV_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "tensor.h"
+
+struct csv_options {
+    char delimiter; // ',' for CSV, '\t' for TSV
+    int has_header; // non-zero to skip the first line
+    long label_column; // column stored in y, negative if there is none
+    tensor_dtype_t dtype; // element type of X
+    size_t nthreads; // threads used by csv_load, 0 or 1 parses serially
+    size_t chunk_size; // bytes read at once by csv_read, 0 for the default
+};
+typedef struct csv_options csv_options_t;
+
+#define CSV_OPTIONS_DEFAULT {',', 0, -1, TENSOR_FLOAT64, 1, 0}
+
+/* Cursor over the rows of a buffer, see csv_next_row */
+struct csv_scanner {
+    const char *block; // 64-byte block the mask belongs to
+    const char *end; // end of the buffer
+    uint64_t mask; // separators of block not consumed yet
+    const char *field; // start of the next field
+    char delimiter;
+};
+typedef struct csv_scanner csv_scanner_t;
+
+void csv_scanner_init(csv_scanner_t *s, const char *buf, size_t len,
+                      char delimiter);
+int csv_next_row(csv_scanner_t *s, double *values, size_t max_values,
+                 size_t *nvalues);
+
+size_t csv_count_rows(const char *buf, size_t len);
+size_t csv_count_cols(const char *buf, size_t len, char delimiter);
+
+int csv_parse_into(const char *buf, size_t len, const csv_options_t *opts,
+                   tensor_t *X, tensor_t *y, size_t rowi, size_t *nrows);
+
+int csv_load(const char *path, const csv_options_t *opts, tensor_t **X,
+             tensor_t **y);
+int csv_read(FILE *file, const csv_options_t *opts, tensor_t **X,
+             tensor_t **y);
+
+#endif
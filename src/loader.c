@@ -0,0 +1,566 @@
+/* loader - Background prefetching of minibatches
+ * The loader threads and the caller share one lock. A loader thread
+ * claims the next batch number under the lock once the slot of that batch
+ * is free, fills the slot without the lock and marks it ready; the caller
+ * waits for the slot of the batch it needs to be ready. Every slot owns a
+ * tensor and a labels array allocated with the loader, so the loaders
+ * never allocate. The end of the data and the failure of a fill stop the
+ * claims, the batches claimed before them are still handed out in order.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tensor.h"
+#include "loader.h"
+
+enum loader_state {
+    LOADER_FREE,
+    LOADER_FILLING,
+    LOADER_READY,
+    LOADER_TAKEN // held by the caller until loader_release
+};
+
+struct loader_slot {
+    loader_batch_t batch;
+    tensor_t *data; // batch_size x ncols rows of the batch
+    enum loader_state state;
+    int err; // errno of a failed fill, zero if none
+};
+
+struct loader {
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // signaled when a slot is ready
+    pthread_cond_t released; // signaled when a slot is free
+    size_t nslots;
+    struct loader_slot *slots;
+    size_t nthreads;
+    pthread_t *threads;
+    loader_fill_t fill;
+    void *ctx;
+    size_t produce; // next batch to claim
+    size_t consume; // next batch to hand out
+    size_t nready;
+    int done; // no more claims: end of the data or a failed fill
+    int stopping;
+    int end; // errno of the last batch handed out, -1 at the end of data
+    size_t depth_sum;
+    loader_stats_t stats;
+};
+
+/* loader_now: monotonic time in seconds */
+static double loader_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* loader_run: body of a loader thread */
+static void *loader_run(void *arg)
+{
+    loader_t *loader = arg;
+    pthread_mutex_lock(&loader->lock);
+    for(;;) {
+        struct loader_slot *slot;
+        slot = &loader->slots[loader->produce % loader->nslots];
+        if(!loader->stopping && !loader->done
+           && slot->state != LOADER_FREE) {
+            double start = loader_now();
+            loader->stats.producer_waits++;
+            while(!loader->stopping && !loader->done
+                  && slot->state != LOADER_FREE) {
+                pthread_cond_wait(&loader->released, &loader->lock);
+                slot = &loader->slots[loader->produce % loader->nslots];
+            }
+            loader->stats.producer_stall += loader_now() - start;
+        }
+        if(loader->stopping || loader->done) break;
+
+        size_t index = loader->produce++;
+        slot->state = LOADER_FILLING;
+        pthread_mutex_unlock(&loader->lock);
+
+        double start = loader_now();
+        size_t nrows = 0;
+        int err = 0;
+        if(loader->fill(loader->ctx, index, slot->data, slot->batch.labels,
+                        &nrows) != 0) {
+            err = errno != 0 ? errno : EINVAL;
+        } else if(nrows > slot->data->nrows) {
+            err = EINVAL;
+        }
+        if(err == 0 && nrows > 0) {
+            tensor_view_rows(slot->data, 0, nrows, &slot->batch.X);
+        }
+        double elapsed = loader_now() - start;
+
+        pthread_mutex_lock(&loader->lock);
+        loader->stats.fill_time += elapsed;
+        slot->batch.index = index;
+        slot->batch.nrows = err == 0 ? nrows : 0;
+        slot->err = err;
+        slot->state = LOADER_READY;
+        loader->nready++;
+        if(err != 0 || nrows == 0) {
+            loader->done = 1;
+            pthread_cond_broadcast(&loader->released);
+        }
+        pthread_cond_broadcast(&loader->ready);
+    }
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+
+/* loader_stop: stop and join the first nthreads threads of loader */
+static void loader_stop(loader_t *loader, size_t nthreads)
+{
+    pthread_mutex_lock(&loader->lock);
+    loader->stopping = 1;
+    pthread_cond_broadcast(&loader->released);
+    pthread_mutex_unlock(&loader->lock);
+    for(size_t t = 0; t < nthreads; t++) {
+        pthread_join(loader->threads[t], NULL);
+    }
+}
+
+/* loader_free_slots: free the slots of loader and the loader */
+static void loader_free_slots(loader_t *loader)
+{
+    for(size_t s = 0; loader->slots != NULL && s < loader->nslots; s++) {
+        free_tensor(loader->slots[s].data);
+        free(loader->slots[s].batch.labels);
+    }
+    free(loader->slots);
+    free(loader->threads);
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->ready);
+    pthread_cond_destroy(&loader->released);
+    free(loader);
+}
+
+/* allocate_loader: Allocate new loader on the heap and start nthreads
+ * loader threads, or one if nthreads is zero, that call fill with ctx to
+ * prepare up to depth batches of batch_size x ncols tensors of element
+ * type dtype ahead of the caller.
+ *
+ * It returns NULL and set errno to EINVAL if batch_size, ncols or depth is
+ * zero or fill is NULL.
+ * It returns NULL and set errno to ENOMEM if the allocation fails or the
+ * threads cannot be started.
+ * It returns pointer to new allocated loader_t if success. */
+loader_t *allocate_loader(size_t batch_size, size_t ncols,
+                          tensor_dtype_t dtype, size_t depth,
+                          size_t nthreads, loader_fill_t fill, void *ctx)
+{
+    if(batch_size == 0 || ncols == 0 || depth == 0 || fill == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if(nthreads == 0) nthreads = 1;
+
+    loader_t *loader = calloc(1, sizeof *loader);
+    if(loader == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->ready, NULL);
+    pthread_cond_init(&loader->released, NULL);
+    loader->nslots = depth + 1;
+    loader->fill = fill;
+    loader->ctx = ctx;
+    loader->slots = calloc(loader->nslots, sizeof *loader->slots);
+    loader->threads = malloc(nthreads * sizeof *loader->threads);
+    if(loader->slots == NULL || loader->threads == NULL) {
+        loader_free_slots(loader);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for(size_t s = 0; s < loader->nslots; s++) {
+        struct loader_slot *slot = &loader->slots[s];
+        slot->data = allocate_typed_tensor(batch_size, ncols, dtype);
+        slot->batch.labels = malloc(batch_size * sizeof(size_t));
+        if(slot->data == NULL || slot->batch.labels == NULL) {
+            loader_free_slots(loader);
+            errno = ENOMEM;
+            return NULL;
+        }
+        slot->state = LOADER_FREE;
+    }
+
+    for(size_t t = 0; t < nthreads; t++) {
+        if(pthread_create(&loader->threads[t], NULL, loader_run,
+                          loader) != 0) {
+            loader_stop(loader, t);
+            loader_free_slots(loader);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    loader->nthreads = nthreads;
+    return loader;
+}
+
+/* free_loader: Stop the loader threads, waiting for the fills in progress,
+ * and free loader with its batches. It does nothing if loader is NULL */
+void free_loader(loader_t *loader)
+{
+    if(loader == NULL) return;
+    loader_stop(loader, loader->nthreads);
+    loader_free_slots(loader);
+}
+
+/* loader_next: Wait for the next batch of loader and store it in batch,
+ * or NULL once the fill function reported the end of the data. The batch
+ * belongs to the caller until it is given back with loader_release; the
+ * caller can hold up to depth + 1 batches.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if loader or batch is
+ * NULL
+ * It returns non-zero value and set errno to EBUSY if the caller holds
+ * depth + 1 batches
+ * It returns non-zero value and set errno to the errno of the fill
+ * function if the batch cannot be filled, the next calls fail the same
+ * way */
+int loader_next(loader_t *loader, loader_batch_t **batch)
+{
+    /* NULL checking */
+    if(loader == NULL || batch == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    *batch = NULL;
+    if(loader->end != 0) {
+        int end = loader->end;
+        pthread_mutex_unlock(&loader->lock);
+        if(end < 0) return 0;
+        errno = end;
+        return -1;
+    }
+
+    struct loader_slot *slot;
+    slot = &loader->slots[loader->consume % loader->nslots];
+    if(slot->state == LOADER_TAKEN) {
+        pthread_mutex_unlock(&loader->lock);
+        errno = EBUSY;
+        return -1;
+    }
+
+    size_t depth = loader->nready;
+    if(slot->state != LOADER_READY) {
+        double start = loader_now();
+        loader->stats.nwaits++;
+        while(slot->state != LOADER_READY) {
+            pthread_cond_wait(&loader->ready, &loader->lock);
+        }
+        loader->stats.consumer_stall += loader_now() - start;
+    }
+    loader->nready--;
+
+    if(slot->err != 0 || slot->batch.nrows == 0) {
+        loader->end = slot->err != 0 ? slot->err : -1;
+        slot->state = LOADER_FREE;
+        int err = slot->err;
+        pthread_mutex_unlock(&loader->lock);
+        if(err == 0) return 0;
+        errno = err;
+        return -1;
+    }
+
+    slot->state = LOADER_TAKEN;
+    loader->consume++;
+    loader->stats.nbatches++;
+    loader->depth_sum += depth;
+    if(depth > loader->stats.max_depth) loader->stats.max_depth = depth;
+    *batch = &slot->batch;
+    pthread_mutex_unlock(&loader->lock);
+    return 0;
+}
+
+/* loader_release: Give batch, returned by loader_next, back to loader so
+ * its slot can be filled again.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if loader or batch is
+ * NULL or batch is not a batch of loader held by the caller */
+int loader_release(loader_t *loader, loader_batch_t *batch)
+{
+    /* NULL checking */
+    if(loader == NULL || batch == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    struct loader_slot *slot;
+    slot = &loader->slots[batch->index % loader->nslots];
+    if(&slot->batch != batch || slot->state != LOADER_TAKEN) {
+        pthread_mutex_unlock(&loader->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    slot->state = LOADER_FREE;
+    pthread_cond_broadcast(&loader->released);
+    pthread_mutex_unlock(&loader->lock);
+    return 0;
+}
+
+/* loader_get_stats: Store the statistics of loader since it started in
+ * stats.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if loader or stats is
+ * NULL */
+int loader_get_stats(loader_t *loader, loader_stats_t *stats)
+{
+    /* NULL checking */
+    if(loader == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    *stats = loader->stats;
+    if(stats->nbatches > 0) {
+        stats->mean_depth = (double)loader->depth_sum
+                            / (double)stats->nbatches;
+    }
+    pthread_mutex_unlock(&loader->lock);
+    return 0;
+}
+
+/* loader_fill_rows: Fill function of a loader_rows_t source: batch index
+ * holds the rows of pass index / nbatches starting from row
+ * (index % nbatches) * batch size, with nbatches the number of batches of
+ * a pass. The rows are converted to the element type of the batch.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if ctx, its rows or
+ * labels, X, labels or nrows is NULL or the columns do not match */
+int loader_fill_rows(void *ctx, size_t index, tensor_t *X, size_t *labels,
+                     size_t *nrows)
+{
+    const loader_rows_t *rows = ctx;
+
+    /* NULL checking */
+    if(rows == NULL || rows->X == NULL || rows->labels == NULL || X == NULL
+       || labels == NULL || nrows == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(rows->X->ncols != X->ncols || X->nrows == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t m = rows->X->nrows;
+    size_t nbatches = (m + X->nrows - 1) / X->nrows;
+    *nrows = 0;
+    if(nbatches == 0 || index / nbatches >= rows->nepochs) return 0;
+
+    size_t first = index % nbatches * X->nrows;
+    size_t n = m - first < X->nrows ? m - first : X->nrows;
+    int err = tensor_copy_rows(rows->X, first, n, X, 0);
+    if(err != 0) return err;
+    memcpy(labels, rows->labels + first, n * sizeof *labels);
+    *nrows = n;
+    return 0;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_LOADER_C_TEST
+#include <assert.h>
+
+/* test_sleep: sleep for ms milliseconds */
+static void test_sleep(long ms)
+{
+    struct timespec ts = {ms / 1000, ms % 1000 * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+/* A source that fills row i of batch index with index * 1000 + i, counts
+ * its calls, sleeps for delay milliseconds and fails at batch fail */
+struct test_source {
+    size_t nbatches;
+    size_t fail;
+    long delay;
+    size_t ncalls;
+};
+
+static int test_fill(void *ctx, size_t index, tensor_t *X, size_t *labels,
+                     size_t *nrows)
+{
+    struct test_source *src = ctx;
+    __atomic_add_fetch(&src->ncalls, 1, __ATOMIC_RELAXED);
+    if(src->delay > 0) test_sleep(src->delay);
+    if(index == src->fail) {
+        errno = EIO;
+        return -1;
+    }
+    *nrows = 0;
+    if(index >= src->nbatches) return 0;
+    for(size_t i = 0; i < X->nrows; i++) {
+        for(size_t j = 0; j < X->ncols; j++) {
+            TENSOR_AT(X, i, j) = (double)(index * 1000 + i);
+        }
+        labels[i] = index + i;
+    }
+    *nrows = X->nrows;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    loader_batch_t *batch, *held[4];
+    loader_stats_t stats;
+
+    /* the rows of a tensor in order over two passes, the last batch of a
+     * pass is shorter; any number of loader threads */
+    const size_t m = 1000, n = 5, bs = 64;
+    tensor_t *X = allocate_tensor(m, n);
+    size_t labels[1000];
+    assert(X != NULL);
+    for(size_t i = 0; i < m; i++) {
+        for(size_t j = 0; j < n; j++) TENSOR_AT(X, i, j) = i * 8.0 + j;
+        labels[i] = i % 7;
+    }
+    loader_rows_t rows = {X, labels, 2};
+    size_t threads[3] = {1, 2, 4};
+    for(size_t t = 0; t < 3; t++) {
+        loader_t *loader = allocate_loader(bs, n, TENSOR_FLOAT32, 3,
+                                           threads[t], loader_fill_rows,
+                                           &rows);
+        assert(loader != NULL);
+        size_t index = 0, first = 0;
+        for(;;) {
+            err = loader_next(loader, &batch);
+            assert(err == 0);
+            if(batch == NULL) break;
+            size_t expected = m - first < bs ? m - first : bs;
+            assert(batch->index == index);
+            assert(batch->nrows == expected && batch->X.nrows == expected);
+            assert(batch->X.dtype == TENSOR_FLOAT32);
+            for(size_t i = 0; i < batch->nrows; i++) {
+                double v;
+                tensor_get_value(batch->X, i, 4, &v);
+                assert(v == (first + i) * 8.0 + 4);
+                assert(batch->labels[i] == labels[first + i]);
+            }
+            first = (first + expected) % m;
+            index++;
+            assert(loader_release(loader, batch) == 0);
+        }
+        assert(index == 2 * ((m + bs - 1) / bs));
+
+        /* the end is sticky */
+        err = loader_next(loader, &batch);
+        assert(err == 0 && batch == NULL);
+        assert(loader_get_stats(loader, &stats) == 0);
+        assert(stats.nbatches == index);
+        assert(stats.max_depth <= 4);
+        assert(stats.mean_depth >= 0.0 && stats.mean_depth <= 4.0);
+        free_loader(loader);
+    }
+
+    /* backpressure: the loaders fill the free slots and wait */
+    struct test_source src = {100, (size_t)-1, 0, 0};
+    loader_t *loader = allocate_loader(8, 3, TENSOR_FLOAT64, 3, 2,
+                                       test_fill, &src);
+    assert(loader != NULL);
+    for(size_t i = 0; i < 4; i++) {
+        err = loader_next(loader, &held[i]);
+        assert(err == 0 && held[i] != NULL && held[i]->index == i);
+        assert(TENSOR_AT(&held[i]->X, 7, 2) == i * 1000.0 + 7);
+    }
+
+    /* every slot is held: a loader waits for one, nothing more is filled
+     * and next can't wait */
+    do {
+        assert(loader_get_stats(loader, &stats) == 0);
+        if(stats.producer_waits == 0) test_sleep(1);
+    } while(stats.producer_waits == 0);
+    assert(__atomic_load_n(&src.ncalls, __ATOMIC_RELAXED) == 4);
+    err = loader_next(loader, &batch);
+    assert(err != 0 && errno == EBUSY && batch == NULL);
+    assert(loader_release(loader, held[1]) == 0);
+    assert(loader_release(loader, held[1]) != 0 && errno == EINVAL);
+    assert(loader_release(loader, held[0]) == 0);
+    err = loader_next(loader, &batch);
+    assert(err == 0 && batch->index == 4);
+    assert(loader_get_stats(loader, &stats) == 0);
+    assert(stats.producer_waits > 0 && stats.producer_stall > 0.0);
+    assert(stats.max_depth <= 4 && stats.nbatches == 5);
+
+    /* a loader stops with batches held and loaders waiting */
+    free_loader(loader);
+
+    /* a slow loader makes the caller wait */
+    struct test_source slow = {6, (size_t)-1, 5, 0};
+    loader = allocate_loader(4, 2, TENSOR_FLOAT64, 2, 1, test_fill, &slow);
+    assert(loader != NULL);
+    size_t count = 0;
+    while((err = loader_next(loader, &batch)) == 0 && batch != NULL) {
+        assert(loader_release(loader, batch) == 0);
+        count++;
+    }
+    assert(err == 0 && count == 6);
+    assert(loader_get_stats(loader, &stats) == 0);
+    assert(stats.nwaits > 0 && stats.consumer_stall > 0.0);
+    assert(stats.fill_time >= 0.035);
+    free_loader(loader);
+
+    /* a failed fill is reported in order, after the batches before it */
+    struct test_source failing = {100, 5, 0, 0};
+    loader = allocate_loader(4, 2, TENSOR_FLOAT64, 2, 3, test_fill,
+                             &failing);
+    assert(loader != NULL);
+    for(size_t i = 0; i < 5; i++) {
+        err = loader_next(loader, &batch);
+        assert(err == 0 && batch != NULL && batch->index == i);
+        assert(loader_release(loader, batch) == 0);
+    }
+    errno = 0;
+    assert(loader_next(loader, &batch) != 0 && errno == EIO);
+    assert(batch == NULL);
+    assert(loader_next(loader, &batch) != 0 && errno == EIO);
+    free_loader(loader);
+
+    /* invalid arguments */
+    size_t nrows;
+    tensor_t *Y = allocate_tensor(4, 3);
+    assert(Y != NULL);
+    assert(allocate_loader(0, 2, TENSOR_FLOAT64, 2, 1, test_fill, &src)
+           == NULL && errno == EINVAL);
+    assert(allocate_loader(4, 2, TENSOR_FLOAT64, 0, 1, test_fill, &src)
+           == NULL && errno == EINVAL);
+    assert(allocate_loader(4, 2, TENSOR_FLOAT64, 2, 1, NULL, &src)
+           == NULL && errno == EINVAL);
+    assert(loader_next(NULL, &batch) != 0 && errno == EINVAL);
+    assert(loader_release(NULL, batch) != 0 && errno == EINVAL);
+    assert(loader_get_stats(NULL, &stats) != 0 && errno == EINVAL);
+    assert(loader_fill_rows(&rows, 0, Y, labels, &nrows) != 0);
+    assert(errno == EINVAL);
+    assert(loader_fill_rows(NULL, 0, X, labels, &nrows) != 0);
+    assert(errno == EINVAL);
+
+    free_loader(NULL);
+    free_tensor(Y);
+    free_tensor(X);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,76 @@
+/* loader - Background prefetching of minibatches
+ * A loader fills minibatches on threads of its own while the caller
+ * trains on the current one. The batches live in a ring of depth + 1
+ * slots allocated once: batch i is filled into slot i % (depth + 1), so up
+ * to depth batches are prepared ahead of the one in use and a loader
+ * thread waits for the slot of its next batch to be released, which keeps
+ * the loaders at most depth batches ahead of the training. Batches are
+ * handed out in order whatever the number of loader threads.
+ *
+ * The statistics tell which side is the bottleneck: time the caller waits
+ * in loader_next means the loaders can't keep up, time the loaders wait
+ * for a free slot and a queue that stays full mean the training is the
+ * slower side.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_LOADER_H
+#define SIMPLE_NN_LOADER_H
+
+#include "tensor.h"
+
+/* loader_fill_t: fill batch number index into the rows of X, a tensor of
+ * the batch size, and their labels; the number of rows filled goes to
+ * nrows, zero once there are no more batches. It returns non-zero and
+ * sets errno if the batch cannot be filled. Several loader threads call
+ * it at the same time for different batches. */
+typedef int (*loader_fill_t)(void *ctx, size_t index, tensor_t *X,
+                             size_t *labels, size_t *nrows);
+
+/* A filled batch, X is a view of its first nrows rows */
+struct loader_batch {
+    size_t index;
+    size_t nrows;
+    tensor_t X;
+    size_t *labels;
+};
+typedef struct loader_batch loader_batch_t;
+
+struct loader_stats {
+    size_t nbatches; // batches returned by loader_next
+    size_t nwaits; // calls of loader_next that found no batch ready
+    double mean_depth; // mean number of ready batches seen by loader_next
+    size_t max_depth;
+    double consumer_stall; // seconds spent waiting in loader_next
+    size_t producer_waits; // times a loader waited for a free slot
+    double producer_stall; // seconds the loaders waited for a free slot
+    double fill_time; // seconds spent in the fill function
+};
+typedef struct loader_stats loader_stats_t;
+
+/* The rows of X and their labels as a source of batches, nepochs passes
+ * over them in order. The last batch of a pass can be shorter. */
+struct loader_rows {
+    const tensor_t *X;
+    const size_t *labels;
+    size_t nepochs;
+};
+typedef struct loader_rows loader_rows_t;
+
+struct loader;
+typedef struct loader loader_t;
+
+loader_t *allocate_loader(size_t batch_size, size_t ncols,
+                          tensor_dtype_t dtype, size_t depth,
+                          size_t nthreads, loader_fill_t fill, void *ctx);
+void free_loader(loader_t *loader);
+
+int loader_next(loader_t *loader, loader_batch_t **batch);
+int loader_release(loader_t *loader, loader_batch_t *batch);
+int loader_get_stats(loader_t *loader, loader_stats_t *stats);
+
+int loader_fill_rows(void *ctx, size_t index, tensor_t *X, size_t *labels,
+                     size_t *nrows);
+
+#endif
@@ -0,0 +1,423 @@
+/* loss - Loss functions of the network outputs and their gradients
+ * The rows are independent, they are split across threads and every row is
+ * handled by loss_row: it loads the logits once as doubles, and the
+ * softmax is computed in the output row itself, or in a scratch row when
+ * the output is not a row of contiguous doubles.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+
+#include "tensor.h"
+#include "loss.h"
+#include "activation.h"
+#include "reduce.h"
+#include "pool.h"
+#include "parallel.h"
+
+/* Number of elements below which a piece of work is not worth a thread */
+#define LOSS_GRAIN 32768
+
+/* One softmax over the rows of x, scored against labels unless it is NULL.
+ * The softmax or the gradient goes to out if has_out is non-zero. */
+struct loss_task {
+    tensor_t x;
+    tensor_t out;
+    int has_out;
+    const size_t *labels;
+    double *losses;
+    int failed;
+};
+
+/* loss_is_doubles: check if the rows of t are contiguous doubles */
+static int loss_is_doubles(const tensor_t *t)
+{
+    return t->dtype == TENSOR_FLOAT64 && (t->col_stride == 1 || t->ncols == 1);
+}
+
+/* loss_load: get the row i of t as doubles. It is converted into buf
+ * unless it already is a row of contiguous doubles. */
+static const double *loss_load(const tensor_t *t, size_t i, double *buf)
+{
+    size_t elsize = tensor_dtype_size(t->dtype);
+    const char *src = (const char *)t->data + (t->offset + i * t->ld) * elsize;
+
+    if(loss_is_doubles(t)) return (const double *)src;
+    if(t->col_stride == 1) {
+        tensor_convert_array(src, t->dtype, buf, TENSOR_FLOAT64, t->ncols);
+        return buf;
+    }
+    for(size_t j = 0; j < t->ncols; j++) {
+        tensor_convert_array(src + j * t->col_stride * elsize, t->dtype,
+                             buf + j, TENSOR_FLOAT64, 1);
+    }
+    return buf;
+}
+
+/* loss_store: write the doubles of p to the row i of t, unless p is that
+ * row already */
+static void loss_store(tensor_t *t, size_t i, const double *p)
+{
+    size_t elsize = tensor_dtype_size(t->dtype);
+    char *dst = (char *)t->data + (t->offset + i * t->ld) * elsize;
+
+    if((const void *)dst == (const void *)p) return;
+    if(t->col_stride == 1) {
+        tensor_convert_array(p, TENSOR_FLOAT64, dst, t->dtype, t->ncols);
+        return;
+    }
+    for(size_t j = 0; j < t->ncols; j++) {
+        tensor_convert_array(p + j, TENSOR_FLOAT64,
+                             dst + j * t->col_stride * elsize, t->dtype, 1);
+    }
+}
+
+/* loss_max: the maximum of n doubles, NaN if one of them is NaN */
+static double loss_max(size_t n, const double *x)
+{
+    double m = x[0];
+    for(size_t j = 1; j < n; j++) {
+        if(x[j] > m || x[j] != x[j]) m = x[j];
+    }
+    return m;
+}
+
+/* loss_softmax: store exp(x - m) / s in p for the n logits x with maximum m,
+ * p can be x. It returns log(s). */
+static double loss_softmax(size_t n, const double *x, double m, double *p)
+{
+    double s[4] = {0.0, 0.0, 0.0, 0.0};
+    size_t j;
+
+    for(j = 0; j < n; j++) p[j] = x[j] - m;
+    tensor_exp_array(n, p, p);
+    for(j = 0; j + 4 <= n; j += 4) {
+        s[0] += p[j];
+        s[1] += p[j + 1];
+        s[2] += p[j + 2];
+        s[3] += p[j + 3];
+    }
+    for(; j < n; j++) s[0] += p[j];
+    double sum = (s[0] + s[1]) + (s[2] + s[3]);
+    for(j = 0; j < n; j++) p[j] /= sum;
+    return log(sum);
+}
+
+/* loss_row: the softmax of the row i of the task, with its loss and
+ * gradient if it has labels. buf holds two rows of doubles. */
+static void loss_row(struct loss_task *task, size_t i, double *buf)
+{
+    size_t n = task->x.ncols;
+    const double *x = loss_load(&task->x, i, buf);
+    double *p = buf + n;
+    if(task->has_out && loss_is_doubles(&task->out)) {
+        p = (double *)task->out.data + task->out.offset + i * task->out.ld;
+    }
+
+    /* p can be x when the gradient overwrites the logits */
+    double m = loss_max(n, x);
+    double xl = task->labels != NULL ? x[task->labels[i]] : 0.0;
+    double logs = loss_softmax(n, x, m, p);
+    if(task->labels != NULL) {
+        task->losses[i] = logs - (xl - m);
+        p[task->labels[i]] -= 1.0;
+    }
+    if(task->has_out) loss_store(&task->out, i, p);
+}
+
+/* loss_range: parallel_for body over the rows */
+static void loss_range(void *ctx, size_t begin, size_t end)
+{
+    struct loss_task *task = ctx;
+    double *buf = tensor_pool_alloc(2 * task->x.ncols * sizeof(double));
+    if(buf == NULL) {
+        __atomic_store_n(&task->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    for(size_t i = begin; i < end; i++) loss_row(task, i, buf);
+    tensor_pool_free(buf);
+}
+
+/* loss_run: run the task over every row.
+ * It returns non-zero value and set errno to ENOMEM if the scratch rows
+ * cannot be allocated */
+static int loss_run(struct loss_task *task)
+{
+    size_t grain = LOSS_GRAIN / task->x.ncols;
+    task->failed = 0;
+    int err = parallel_for(0, task->x.nrows, grain > 0 ? grain : 1,
+                           loss_range, task);
+    if(err == 0 && task->failed) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return err;
+}
+
+/* tensor_softmax: Compute the softmax of every row of X into Y. X and Y
+ * can have any element type and strides and Y can be X.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X or Y is NULL or
+ * their shapes differ */
+int tensor_softmax(const tensor_t *X, tensor_t *Y)
+{
+    /* NULL checking */
+    if(X == NULL || Y == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(X->nrows != Y->nrows || X->ncols != Y->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct loss_task task = {*X, *Y, 1, NULL, NULL, 0};
+    return loss_run(&task);
+}
+
+/* tensor_softmax_cross_entropy: Compute the cross-entropy of the softmax of
+ * every row i of logits against the class labels[i]. The mean of the
+ * losses of the rows is stored in loss and the gradient of the loss of
+ * every row, softmax - onehot(labels[i]), in grad. The mean loss has the
+ * gradient grad / nrows. Either loss or grad can be NULL. logits and grad
+ * can have any element type and strides and grad can be logits.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if logits or labels is
+ * NULL, both loss and grad are NULL, the shapes of logits and grad differ
+ * or a label is not smaller than the number of columns
+ * It returns non-zero value and set errno to ENOMEM if the losses cannot be
+ * allocated */
+int tensor_softmax_cross_entropy(const tensor_t *logits, const size_t *labels,
+                                 double *loss, tensor_t *grad)
+{
+    /* NULL checking */
+    if(logits == NULL || labels == NULL || (loss == NULL && grad == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(grad != NULL && (logits->nrows != grad->nrows
+                        || logits->ncols != grad->ncols)) {
+        errno = EINVAL;
+        return -1;
+    }
+    for(size_t i = 0; i < logits->nrows; i++) {
+        if(labels[i] >= logits->ncols) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    /* the losses of the rows are added pairwise, in the same order for any
+     * number of threads */
+    size_t ld = tensor_leading_dimension(logits->nrows, TENSOR_FLOAT64);
+    double *losses = tensor_pool_alloc(ld * sizeof(double));
+    if(losses == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct loss_task task = {*logits, {0}, grad != NULL, labels, losses, 0};
+    if(grad != NULL) task.out = *grad;
+    int err = loss_run(&task);
+    if(err == 0 && loss != NULL) {
+        tensor_t t;
+        double sum;
+        tensor_init(&t, 1, logits->nrows, TENSOR_FLOAT64, losses);
+        err = tensor_sum(&t, &sum);
+        if(err == 0) *loss = sum / (double)logits->nrows;
+    }
+    tensor_pool_free(losses);
+    return err;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_LOSS_C_TEST
+#include <assert.h>
+#include <string.h>
+#include "cpu.h"
+
+/* test_reference: loss of the row x against label in long double, the
+ * softmax goes to p */
+static long double test_reference(size_t n, const double *x, size_t label,
+                                  long double *p)
+{
+    long double m = x[0], s = 0.0L;
+    for(size_t j = 1; j < n; j++) if(x[j] > m) m = x[j];
+    for(size_t j = 0; j < n; j++) s += expl((long double)x[j] - m);
+    for(size_t j = 0; j < n; j++) p[j] = expl((long double)x[j] - m) / s;
+    return logl(s) - ((long double)x[label] - m);
+}
+
+/* test_fill: pseudo random logits in [-scale, scale) and labels */
+static void test_fill(tensor_t *t, size_t *labels, double scale,
+                      unsigned seed)
+{
+    for(size_t i = 0; i < t->nrows; i++) {
+        for(size_t j = 0; j < t->ncols; j++) {
+            seed = seed * 1103515245u + 12345u;
+            double u = (double)(seed >> 8) / (1 << 23) - 1.0;
+            tensor_set_value(t, i, j, scale * u);
+        }
+        seed = seed * 1103515245u + 12345u;
+        labels[i] = (seed >> 8) % t->ncols;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    double loss;
+
+    /* a small batch against long double references */
+    double values[] = {
+        1.0, 2.0, 3.0, 4.0,
+        -1.0, 0.5, 0.0, 0.25,
+        10.0, -10.0, 0.0, 9.0,
+    };
+    size_t labels[] = {3, 0, 1};
+    tensor_t *X = tensor_from_array(3, 4, values, TENSOR_FLOAT64);
+    tensor_t *G = allocate_tensor(3, 4);
+    long double p[4], expected = 0.0L;
+    err = tensor_softmax_cross_entropy(X, labels, &loss, G);
+    assert(err == 0);
+    for(size_t i = 0; i < 3; i++) {
+        expected += test_reference(4, values + 4 * i, labels[i], p);
+        for(size_t j = 0; j < 4; j++) {
+            long double g = p[j] - (j == labels[i] ? 1.0L : 0.0L);
+            assert(fabsl(TENSOR_AT(G, i, j) - g) < 1e-16L);
+        }
+    }
+    expected /= 3.0L;
+    assert(fabsl(loss - expected) / expected < 1e-15L);
+
+    /* the gradient rows sum to zero and the softmax rows to one */
+    tensor_t *S = allocate_typed_tensor(3, 4, TENSOR_FLOAT32);
+    err = tensor_softmax(X, S);
+    assert(err == 0);
+    for(size_t i = 0; i < 3; i++) {
+        double gsum = 0.0, ssum = 0.0;
+        for(size_t j = 0; j < 4; j++) {
+            gsum += TENSOR_AT(G, i, j);
+            ssum += TENSOR_ELEMENT(S, float, i, j);
+        }
+        assert(fabs(gsum) < 1e-15 && fabs(ssum - 1.0) < 1e-6);
+    }
+
+    /* shifting the logits changes nothing and large ones don't overflow */
+    double shifted[12];
+    tensor_t *G2 = allocate_tensor(3, 4);
+    double loss2;
+    for(size_t k = 0; k < 12; k++) shifted[k] = values[k] + 1024.0;
+    tensor_t *X2 = tensor_from_array(3, 4, shifted, TENSOR_FLOAT64);
+    err = tensor_softmax_cross_entropy(X2, labels, &loss2, G2);
+    assert(err == 0 && loss2 == loss);
+    for(size_t i = 0; i < 3; i++) {
+        for(size_t j = 0; j < 4; j++) {
+            assert(TENSOR_AT(G2, i, j) == TENSOR_AT(G, i, j));
+        }
+    }
+    TENSOR_AT(X2, 0, 0) = 1e300;
+    TENSOR_AT(X2, 1, 1) = -INFINITY;
+    err = tensor_softmax_cross_entropy(X2, labels, NULL, G2);
+    assert(err == 0);
+    assert(TENSOR_AT(G2, 0, 0) == 1.0 && TENSOR_AT(G2, 0, 3) == -1.0);
+    assert(TENSOR_AT(G2, 1, 1) == 0.0);
+    TENSOR_AT(X2, 2, 2) = NAN;
+    err = tensor_softmax_cross_entropy(X2, labels, &loss2, NULL);
+    assert(err == 0 && isnan(loss2));
+
+    /* the gradient overwrites the logits */
+    err = tensor_softmax_cross_entropy(X, labels, &loss2, X);
+    assert(err == 0 && loss2 == loss);
+    assert(memcmp(X->data, G->data, 3 * G->ld * sizeof(double)) == 0);
+
+    /* it returns non-zero value if a label is out of range */
+    labels[2] = 4;
+    err = tensor_softmax_cross_entropy(X, labels, &loss, G);
+    assert(err != 0 && errno == EINVAL);
+    labels[2] = 1;
+
+    /* it returns non-zero value if the shapes do not match */
+    tensor_t view;
+    tensor_view_cols(G, 0, 3, &view);
+    err = tensor_softmax_cross_entropy(X, labels, &loss, &view);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_softmax(X, &view);
+    assert(err != 0 && errno == EINVAL);
+
+    /* it returns non-zero value if one of the arguments is NULL */
+    err = tensor_softmax_cross_entropy(NULL, labels, &loss, G);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_softmax_cross_entropy(X, NULL, &loss, G);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_softmax_cross_entropy(X, labels, NULL, NULL);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_softmax(X, NULL);
+    assert(err != 0 && errno == EINVAL);
+    free_tensor(X2);
+    free_tensor(G2);
+    free_tensor(S);
+    free_tensor(G);
+    free_tensor(X);
+
+    /* a larger batch: float logits, a transposed gradient, every CPU level
+     * and thread count give the same bits */
+    size_t m = 300, n = 1000;
+    size_t *y = malloc(m * sizeof(size_t));
+    long double *q = malloc(n * sizeof(long double));
+    tensor_t *L = allocate_typed_tensor(m, n, TENSOR_FLOAT32);
+    tensor_t *T = allocate_tensor(n, m);
+    tensor_t *R = allocate_tensor(m, n);
+    tensor_t Tt;
+    double first;
+    test_fill(L, y, 30.0, 11);
+    tensor_transpose_view(T, &Tt);
+    err = tensor_softmax_cross_entropy(L, y, &first, R);
+    assert(err == 0);
+    for(int level = 0; level <= (int)cpu_get_max_level(); level++) {
+        cpu_set_level((cpu_level_t)level);
+        for(size_t threads = 1; threads <= 4; threads += 3) {
+            parallel_set_nthreads(threads);
+            err = tensor_softmax_cross_entropy(L, y, &loss, &Tt);
+            assert(err == 0 && memcmp(&loss, &first, sizeof loss) == 0);
+            for(size_t i = 0; i < m; i++) {
+                for(size_t j = 0; j < n; j++) {
+                    assert(TENSOR_AT(T, j, i) == TENSOR_AT(R, i, j));
+                }
+            }
+        }
+    }
+    cpu_set_level(cpu_get_max_level());
+
+    /* against the references */
+    double *row = malloc(n * sizeof(double));
+    expected = 0.0L;
+    for(size_t i = 0; i < m; i++) {
+        for(size_t j = 0; j < n; j++) tensor_get_value(*L, i, j, &row[j]);
+        expected += test_reference(n, row, y[i], q);
+        for(size_t j = 0; j < n; j++) {
+            long double g = q[j] - (j == y[i] ? 1.0L : 0.0L);
+            assert(fabsl(TENSOR_AT(R, i, j) - g) < 1e-15L);
+        }
+    }
+    expected /= m;
+    assert(fabsl(first - expected) / expected < 1e-14L);
+
+    free(row);
+    free_tensor(R);
+    free_tensor(T);
+    free_tensor(L);
+    free(q);
+    free(y);
+    return 0;
+}
+#endif
@@ -0,0 +1,33 @@
+/* loss - Loss functions of the network outputs and their gradients
+ * The softmax cross-entropy takes the logits x of a row and the integer
+ * label of its class, it never builds one-hot targets:
+ *
+ *   m = max(x), s = sum(exp(x - m))
+ *   softmax(x) = exp(x - m) / s
+ *   loss = log(s) - (x[label] - m)
+ *   gradient = softmax(x) - onehot(label)
+ *
+ * Subtracting the maximum keeps the exponentials in (0, 1], so large
+ * logits can't overflow and the loss doesn't cancel when the label has
+ * the largest logit. The maximum, the exponentials and their sum and the
+ * normalization are separate passes over a row, one row at a time, so the
+ * row stays in the cache between them. The exponentials need the maximum
+ * first and are computed by tensor_exp_array over the whole row, a single
+ * pass would have to rescale its sum every time the maximum grows.
+ *
+ * The exponential is tensor_exp_array, so the results are the same on
+ * every CPU level and with any number of threads.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_LOSS_H
+#define SIMPLE_NN_LOSS_H
+
+#include "tensor.h"
+
+int tensor_softmax(const tensor_t *X, tensor_t *Y);
+int tensor_softmax_cross_entropy(const tensor_t *logits, const size_t *labels,
+                                 double *loss, tensor_t *grad);
+
+#endif
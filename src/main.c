@@ -2,6 +2,8 @@
 #include <stdlib.h>
 
 #include "tensor.h"
+#include "matmul.h"
+#include "activation.h"
 
 int
 main(int argc, char **argv)
@@ -9,65 +11,35 @@ main(int argc, char **argv)
     /* Define dataset */
     size_t nsamples = 4;
     size_t nfeatures = 3;
-    int err = 0;
 
-    tensor_t *X = tensor_allocate(nsamples, nfeatures);
+    double X_values[] = {
+        0, 0, 1, /* first sample */
+        1, 1, 1, /* second sample */
+        1, 0, 1, /* third sample */
+        0, 1, 1, /* forth sample */
+    };
+    tensor_t *X = tensor_from_array(nsamples, nfeatures, X_values,
+                                    TENSOR_FLOAT64);
     if(X == NULL) {
         printf("Cannot allocate tensor X\n");
         return 1;
     }
-    /* first sample */
-    tensor_set_value(X, 0, 0, 0);
-    tensor_set_value(X, 0, 1, 0);
-    tensor_set_value(X, 0, 2, 1);
-    /* second sample */
-    tensor_set_value(X, 1, 0, 1);
-    tensor_set_value(X, 1, 1, 1);
-    tensor_set_value(X, 1, 2, 1);
-    /* third sample */
-    tensor_set_value(X, 2, 0, 1);
-    tensor_set_value(X, 2, 1, 0);
-    tensor_set_value(X, 2, 2, 1);
-    /* forth sample */
-    tensor_set_value(X, 3, 0, 0);
-    tensor_set_value(X, 3, 1, 1);
-    tensor_set_value(X, 3, 2, 1);
 
-    tensor_t *y = tensor_allocate(nsamples, 1);
+    /* output for each sample */
+    double y_values[] = {0, 1, 1, 0};
+    tensor_t *y = tensor_from_array(nsamples, 1, y_values, TENSOR_FLOAT64);
     if(y == NULL) {
         printf("Cannot allocate tensor y\n");
         return 1;
     }
-    /* output for each sample */
-    tensor_set_value(y, 0, 0, 0);
-    tensor_set_value(y, 1, 0, 1);
-    tensor_set_value(y, 2, 0, 1);
-    tensor_set_value(y, 3, 0, 0);
 
     /* print dataset */
     printf("X                 y\n");
-    for(int i = 0; i < nsamples; i++) {
-        for(int j = 0; j < nfeatures; j++) {
-            double output;
-
-            err = tensor_get_value(*X, i, j, &output);
-            if(err != 0) {
-                printf("err: index out of bound X\n");
-                exit(EXIT_FAILURE);
-            }
-
-            printf("%.2f ", output);
-        }
-
-        double output;
-
-        err = tensor_get_value(*y, i, 0, &output);
-        if(err != 0) {
-            printf("err: index out of bound y\n");
-            exit(EXIT_FAILURE);
+    for(size_t i = 0; i < nsamples; i++) {
+        for(size_t j = 0; j < nfeatures; j++) {
+            printf("%.2f ", TENSOR_AT(X, i, j));
         }
-
-        printf("   %.2f\n", output);
+        printf("   %.2f\n", TENSOR_AT(y, i, 0));
     }
 
     /* Implementation of Single-layer perceptron
@@ -77,9 +49,31 @@ main(int argc, char **argv)
      * y_hat matrix 4x1 represent the output of the neural networks
      *
      * Formula:
-     * y_hat = activation_func(X * W) */
+     * y_hat = activation_func(X * W + b) */
+    double W_values[] = {0.5, -0.25, 0.1};
+    tensor_t *W = tensor_from_array(nfeatures, 1, W_values, TENSOR_FLOAT64);
+    double b_values[] = {-0.05};
+    tensor_t *b = tensor_from_array(1, 1, b_values, TENSOR_FLOAT64);
+    tensor_t *y_hat = allocate_tensor(nsamples, 1);
+    if(W == NULL || b == NULL || y_hat == NULL) {
+        printf("Cannot allocate the perceptron\n");
+        return 1;
+    }
+
+    /* the bias and the activation are applied in the same pass */
+    if(tensor_linear_fused(X, W, b, TENSOR_SIGMOID, y_hat, NULL) != 0) {
+        printf("Cannot compute y_hat\n");
+        return 1;
+    }
+    printf("\ny_hat\n");
+    for(size_t i = 0; i < nsamples; i++) {
+        printf("%.2f\n", TENSOR_AT(y_hat, i, 0));
+    }
 
     /* free the heap */
-    tensor_free(y);
-    tensor_free(X);
+    free_tensor(y_hat);
+    free_tensor(b);
+    free_tensor(W);
+    free_tensor(y);
+    free_tensor(X);
 }
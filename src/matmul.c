@@ -0,0 +1,1959 @@
+/* matmul - Matrix multiplication of tensors
+ * The product is computed by a cache-blocked GEMM: the operands are packed
+ * into contiguous panels sized for the L1, L2 and L3 caches and a small
+ * register-blocked microkernel computes the output tile by tile.
+ * tensor_linear_fused adds the bias and the activation of a layer to each
+ * tile as it is stored, while it is still in cache.
+ *
+ * Products where B has one column or A has one row don't go through the
+ * GEMM: they are bound by the bandwidth of reading the matrix, so they run
+ * on GEMV kernels that stream it once and are split across threads over
+ * its rows. Tiny layers, where B is K x N with K and N in {1, 2, 3, 4, 8,
+ * 16, 32}, have fully unrolled kernels generated for their shape.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "tensor.h"
+#include "matmul.h"
+#include "activation.h"
+#include "pool.h"
+#include "cpu.h"
+#include "parallel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MATMUL_X86 1
+#include <immintrin.h>
+#endif
+
+/* Register block: the microkernel computes an MR x NR tile of C while
+ * keeping the whole tile in registers */
+#define MATMUL_MR 6
+#define MATMUL_NR 8
+
+/* Cache blocks: a KC x NR micro-panel of B stays in L1, an MC x KC block
+ * of A stays in L2 and a KC x NC panel of B stays in L3 */
+#define MATMUL_MC 72
+#define MATMUL_KC 256
+#define MATMUL_NC 4080
+
+/* Threads of the blocked product: items each thread should get to even
+ * out by stealing, and the elements packed and multiply-adds computed
+ * below which a piece of the product is not worth a thread */
+#define MATMUL_ITEMS_PER_THREAD 4
+#define MATMUL_PACK_GRAIN 65536
+#define MATMUL_GEMM_GRAIN (1 << 20)
+
+/* Matrix-vector products: outputs computed per block, which stays in L1
+ * for the epilogue, and multiply-adds below which a piece of the product
+ * is not worth a thread */
+#define MATMUL_GEMV_BLOCK 2048
+#define MATMUL_GEMV_GRAIN 32768
+
+/* matmul_epilogue: work done on the tiles of C after their last block of
+ * k, see tensor_linear_fused. The bias, the copy to pre and relu are done
+ * by the microkernel on the registers it stores; other activations run on
+ * the stored tile while it is in L1. */
+struct matmul_epilogue {
+    const double *bias; // values added to every row of C, or NULL
+    double *pre; // output of the pre-activations, or NULL
+    size_t ldpre;
+    int relu; // replace the negative values by zero
+    tensor_activation_fn_t act; // applied to the stored tile, or NULL
+};
+
+/* matmul_kernel_t: computes the MR x NR tile c = a * b from the packed
+ * micro-panels a (kc x MR) and b (kc x NR). The tile is added to c if
+ * accumulate is non-zero, otherwise it overwrites c. If ep is not NULL,
+ * its bias, pre and relu, which start at the tile, are applied as the tile
+ * is stored. */
+typedef void (*matmul_kernel_t)(size_t kc, const double *a, const double *b,
+                                double *c, size_t ldc, int accumulate,
+                                const struct matmul_epilogue *ep);
+
+/* matmul_epilogue_value: apply the bias, pre and relu of ep to the value
+ * at (i, j) of the tile */
+static double matmul_epilogue_value(const struct matmul_epilogue *ep,
+                                    size_t i, size_t j, double value)
+{
+    if(ep->bias != NULL) value += ep->bias[j];
+    if(ep->pre != NULL) ep->pre[i * ep->ldpre + j] = value;
+    if(ep->relu) value = value > 0.0 ? value : 0.0;
+    return value;
+}
+
+/* matmul_kernel_generic: portable microkernel */
+static void matmul_kernel_generic(size_t kc, const double *a, const double *b,
+                                  double *c, size_t ldc, int accumulate,
+                                  const struct matmul_epilogue *ep)
+{
+    double ab[MATMUL_MR * MATMUL_NR] = {0};
+
+    for(size_t p = 0; p < kc; p++) {
+        for(int i = 0; i < MATMUL_MR; i++) {
+            double ai = a[i];
+            for(int j = 0; j < MATMUL_NR; j++) {
+                ab[i * MATMUL_NR + j] += ai * b[j];
+            }
+        }
+        a += MATMUL_MR;
+        b += MATMUL_NR;
+    }
+
+    for(int i = 0; i < MATMUL_MR; i++) {
+        for(int j = 0; j < MATMUL_NR; j++) {
+            double cij = ab[i * MATMUL_NR + j];
+            if(accumulate) cij += c[i * ldc + j];
+            if(ep != NULL) cij = matmul_epilogue_value(ep, i, j, cij);
+            c[i * ldc + j] = cij;
+        }
+    }
+}
+
+#ifdef MATMUL_X86
+/* matmul_kernel_sse2_half: 6x4 half of the tile with SSE2. The 6x8 tile
+ * needs 24 xmm accumulators, more than there are registers, so the
+ * SSE2 kernel runs over the packed a once for each half of b. */
+__attribute__((target("sse2")))
+static void matmul_kernel_sse2_half(size_t kc, const double *a,
+                                    const double *b, double *c, size_t ldc,
+                                    int accumulate,
+                                    const struct matmul_epilogue *ep)
+{
+    __m128d c00 = _mm_setzero_pd(), c01 = _mm_setzero_pd();
+    __m128d c10 = _mm_setzero_pd(), c11 = _mm_setzero_pd();
+    __m128d c20 = _mm_setzero_pd(), c21 = _mm_setzero_pd();
+    __m128d c30 = _mm_setzero_pd(), c31 = _mm_setzero_pd();
+    __m128d c40 = _mm_setzero_pd(), c41 = _mm_setzero_pd();
+    __m128d c50 = _mm_setzero_pd(), c51 = _mm_setzero_pd();
+
+    for(size_t p = 0; p < kc; p++) {
+        __m128d b0 = _mm_load_pd(b);
+        __m128d b1 = _mm_load_pd(b + 2);
+        __m128d ai;
+
+#define MATMUL_SSE2_STEP(i, lo, hi)                                     \
+        ai = _mm_set1_pd(a[i]);                                         \
+        lo = _mm_add_pd(lo, _mm_mul_pd(ai, b0));                        \
+        hi = _mm_add_pd(hi, _mm_mul_pd(ai, b1))
+
+        MATMUL_SSE2_STEP(0, c00, c01);
+        MATMUL_SSE2_STEP(1, c10, c11);
+        MATMUL_SSE2_STEP(2, c20, c21);
+        MATMUL_SSE2_STEP(3, c30, c31);
+        MATMUL_SSE2_STEP(4, c40, c41);
+        MATMUL_SSE2_STEP(5, c50, c51);
+#undef MATMUL_SSE2_STEP
+
+        a += MATMUL_MR;
+        b += MATMUL_NR;
+    }
+
+    const double *bias = ep != NULL ? ep->bias : NULL;
+    double *pre = ep != NULL ? ep->pre : NULL;
+    int relu = ep != NULL && ep->relu;
+    __m128d bias0 = _mm_setzero_pd(), bias1 = _mm_setzero_pd();
+    if(bias != NULL) {
+        bias0 = _mm_loadu_pd(bias);
+        bias1 = _mm_loadu_pd(bias + 2);
+    }
+
+#define MATMUL_SSE2_STORE(row, lo, hi)                                  \
+    do {                                                                \
+        double *ci = c + (row) * ldc;                                   \
+        if(accumulate) {                                                \
+            lo = _mm_add_pd(lo, _mm_loadu_pd(ci));                      \
+            hi = _mm_add_pd(hi, _mm_loadu_pd(ci + 2));                  \
+        }                                                               \
+        if(bias != NULL) {                                              \
+            lo = _mm_add_pd(lo, bias0);                                 \
+            hi = _mm_add_pd(hi, bias1);                                 \
+        }                                                               \
+        if(pre != NULL) {                                               \
+            _mm_storeu_pd(pre + (row) * ep->ldpre, lo);                 \
+            _mm_storeu_pd(pre + (row) * ep->ldpre + 2, hi);             \
+        }                                                               \
+        if(relu) {                                                      \
+            lo = _mm_max_pd(lo, _mm_setzero_pd());                      \
+            hi = _mm_max_pd(hi, _mm_setzero_pd());                      \
+        }                                                               \
+        _mm_storeu_pd(ci, lo);                                          \
+        _mm_storeu_pd(ci + 2, hi);                                      \
+    } while(0)
+
+    MATMUL_SSE2_STORE(0, c00, c01);
+    MATMUL_SSE2_STORE(1, c10, c11);
+    MATMUL_SSE2_STORE(2, c20, c21);
+    MATMUL_SSE2_STORE(3, c30, c31);
+    MATMUL_SSE2_STORE(4, c40, c41);
+    MATMUL_SSE2_STORE(5, c50, c51);
+#undef MATMUL_SSE2_STORE
+}
+
+/* matmul_kernel_sse2: 6x8 microkernel for x86 hosts without AVX2 */
+static void matmul_kernel_sse2(size_t kc, const double *a, const double *b,
+                               double *c, size_t ldc, int accumulate,
+                               const struct matmul_epilogue *ep)
+{
+    matmul_kernel_sse2_half(kc, a, b, c, ldc, accumulate, ep);
+    if(ep == NULL) {
+        matmul_kernel_sse2_half(kc, a, b + 4, c + 4, ldc, accumulate, NULL);
+        return;
+    }
+
+    /* the epilogue of the right half */
+    struct matmul_epilogue right = *ep;
+    if(right.bias != NULL) right.bias += 4;
+    if(right.pre != NULL) right.pre += 4;
+    matmul_kernel_sse2_half(kc, a, b + 4, c + 4, ldc, accumulate, &right);
+}
+
+/* matmul_kernel_avx2: 6x8 microkernel using AVX2 and FMA. The tile is held
+ * in 12 ymm accumulators, each step of k loads two vectors of b and
+ * broadcasts six scalars of a. */
+__attribute__((target("avx2,fma")))
+static void matmul_kernel_avx2(size_t kc, const double *a, const double *b,
+                               double *c, size_t ldc, int accumulate,
+                               const struct matmul_epilogue *ep)
+{
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+    __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+
+    for(size_t p = 0; p < kc; p++) {
+        __m256d b0 = _mm256_load_pd(b);
+        __m256d b1 = _mm256_load_pd(b + 4);
+        __m256d ai;
+
+        ai = _mm256_broadcast_sd(a + 0);
+        c00 = _mm256_fmadd_pd(ai, b0, c00);
+        c01 = _mm256_fmadd_pd(ai, b1, c01);
+        ai = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(ai, b0, c10);
+        c11 = _mm256_fmadd_pd(ai, b1, c11);
+        ai = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(ai, b0, c20);
+        c21 = _mm256_fmadd_pd(ai, b1, c21);
+        ai = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(ai, b0, c30);
+        c31 = _mm256_fmadd_pd(ai, b1, c31);
+        ai = _mm256_broadcast_sd(a + 4);
+        c40 = _mm256_fmadd_pd(ai, b0, c40);
+        c41 = _mm256_fmadd_pd(ai, b1, c41);
+        ai = _mm256_broadcast_sd(a + 5);
+        c50 = _mm256_fmadd_pd(ai, b0, c50);
+        c51 = _mm256_fmadd_pd(ai, b1, c51);
+
+        a += MATMUL_MR;
+        b += MATMUL_NR;
+    }
+
+    const double *bias = ep != NULL ? ep->bias : NULL;
+    double *pre = ep != NULL ? ep->pre : NULL;
+    int relu = ep != NULL && ep->relu;
+    __m256d bias0 = _mm256_setzero_pd(), bias1 = _mm256_setzero_pd();
+    if(bias != NULL) {
+        bias0 = _mm256_loadu_pd(bias);
+        bias1 = _mm256_loadu_pd(bias + 4);
+    }
+
+#define MATMUL_AVX2_STORE(row, lo, hi)                                  \
+    do {                                                                \
+        double *ci = c + (row) * ldc;                                   \
+        if(accumulate) {                                                \
+            lo = _mm256_add_pd(lo, _mm256_loadu_pd(ci));                \
+            hi = _mm256_add_pd(hi, _mm256_loadu_pd(ci + 4));            \
+        }                                                               \
+        if(bias != NULL) {                                              \
+            lo = _mm256_add_pd(lo, bias0);                              \
+            hi = _mm256_add_pd(hi, bias1);                              \
+        }                                                               \
+        if(pre != NULL) {                                               \
+            _mm256_storeu_pd(pre + (row) * ep->ldpre, lo);              \
+            _mm256_storeu_pd(pre + (row) * ep->ldpre + 4, hi);          \
+        }                                                               \
+        if(relu) {                                                      \
+            lo = _mm256_max_pd(lo, _mm256_setzero_pd());                \
+            hi = _mm256_max_pd(hi, _mm256_setzero_pd());                \
+        }                                                               \
+        _mm256_storeu_pd(ci, lo);                                       \
+        _mm256_storeu_pd(ci + 4, hi);                                   \
+    } while(0)
+
+    MATMUL_AVX2_STORE(0, c00, c01);
+    MATMUL_AVX2_STORE(1, c10, c11);
+    MATMUL_AVX2_STORE(2, c20, c21);
+    MATMUL_AVX2_STORE(3, c30, c31);
+    MATMUL_AVX2_STORE(4, c40, c41);
+    MATMUL_AVX2_STORE(5, c50, c51);
+#undef MATMUL_AVX2_STORE
+}
+
+/* matmul_kernel_avx512: 6x8 microkernel using AVX-512. A row of the tile
+ * fits in one zmm register; two sets of six accumulators take the even
+ * and odd steps of k so enough FMAs are in flight to hide their latency.
+ * The sets are added at the end. */
+__attribute__((target("avx512f")))
+static void matmul_kernel_avx512(size_t kc, const double *a, const double *b,
+                                 double *c, size_t ldc, int accumulate,
+                                 const struct matmul_epilogue *ep)
+{
+    __m512d e0 = _mm512_setzero_pd(), o0 = _mm512_setzero_pd();
+    __m512d e1 = _mm512_setzero_pd(), o1 = _mm512_setzero_pd();
+    __m512d e2 = _mm512_setzero_pd(), o2 = _mm512_setzero_pd();
+    __m512d e3 = _mm512_setzero_pd(), o3 = _mm512_setzero_pd();
+    __m512d e4 = _mm512_setzero_pd(), o4 = _mm512_setzero_pd();
+    __m512d e5 = _mm512_setzero_pd(), o5 = _mm512_setzero_pd();
+
+    size_t p = 0;
+    for(; p + 2 <= kc; p += 2) {
+        __m512d b0 = _mm512_load_pd(b);
+        __m512d b1 = _mm512_load_pd(b + MATMUL_NR);
+        const double *a1 = a + MATMUL_MR;
+
+        e0 = _mm512_fmadd_pd(_mm512_set1_pd(a[0]), b0, e0);
+        e1 = _mm512_fmadd_pd(_mm512_set1_pd(a[1]), b0, e1);
+        e2 = _mm512_fmadd_pd(_mm512_set1_pd(a[2]), b0, e2);
+        e3 = _mm512_fmadd_pd(_mm512_set1_pd(a[3]), b0, e3);
+        e4 = _mm512_fmadd_pd(_mm512_set1_pd(a[4]), b0, e4);
+        e5 = _mm512_fmadd_pd(_mm512_set1_pd(a[5]), b0, e5);
+        o0 = _mm512_fmadd_pd(_mm512_set1_pd(a1[0]), b1, o0);
+        o1 = _mm512_fmadd_pd(_mm512_set1_pd(a1[1]), b1, o1);
+        o2 = _mm512_fmadd_pd(_mm512_set1_pd(a1[2]), b1, o2);
+        o3 = _mm512_fmadd_pd(_mm512_set1_pd(a1[3]), b1, o3);
+        o4 = _mm512_fmadd_pd(_mm512_set1_pd(a1[4]), b1, o4);
+        o5 = _mm512_fmadd_pd(_mm512_set1_pd(a1[5]), b1, o5);
+
+        a += 2 * MATMUL_MR;
+        b += 2 * MATMUL_NR;
+    }
+    if(p < kc) {
+        __m512d b0 = _mm512_load_pd(b);
+        e0 = _mm512_fmadd_pd(_mm512_set1_pd(a[0]), b0, e0);
+        e1 = _mm512_fmadd_pd(_mm512_set1_pd(a[1]), b0, e1);
+        e2 = _mm512_fmadd_pd(_mm512_set1_pd(a[2]), b0, e2);
+        e3 = _mm512_fmadd_pd(_mm512_set1_pd(a[3]), b0, e3);
+        e4 = _mm512_fmadd_pd(_mm512_set1_pd(a[4]), b0, e4);
+        e5 = _mm512_fmadd_pd(_mm512_set1_pd(a[5]), b0, e5);
+    }
+
+    const double *bias = ep != NULL ? ep->bias : NULL;
+    double *pre = ep != NULL ? ep->pre : NULL;
+    int relu = ep != NULL && ep->relu;
+    __m512d bias0 = _mm512_setzero_pd();
+    if(bias != NULL) bias0 = _mm512_loadu_pd(bias);
+
+#define MATMUL_AVX512_STORE(row, even, odd)                             \
+    do {                                                                \
+        double *ci = c + (row) * ldc;                                   \
+        __m512d tile = _mm512_add_pd(even, odd);                        \
+        if(accumulate) tile = _mm512_add_pd(tile, _mm512_loadu_pd(ci)); \
+        if(bias != NULL) tile = _mm512_add_pd(tile, bias0);             \
+        if(pre != NULL) _mm512_storeu_pd(pre + (row) * ep->ldpre, tile); \
+        if(relu) tile = _mm512_max_pd(tile, _mm512_setzero_pd());       \
+        _mm512_storeu_pd(ci, tile);                                     \
+    } while(0)
+
+    MATMUL_AVX512_STORE(0, e0, o0);
+    MATMUL_AVX512_STORE(1, e1, o1);
+    MATMUL_AVX512_STORE(2, e2, o2);
+    MATMUL_AVX512_STORE(3, e3, o3);
+    MATMUL_AVX512_STORE(4, e4, o4);
+    MATMUL_AVX512_STORE(5, e5, o5);
+#undef MATMUL_AVX512_STORE
+}
+#endif
+
+/* Microkernel of every cpu_level_t */
+#ifdef MATMUL_X86
+static const matmul_kernel_t matmul_kernels[CPU_NLEVELS] = {
+    matmul_kernel_generic, matmul_kernel_sse2, matmul_kernel_avx2,
+    matmul_kernel_avx512
+};
+#else
+static const matmul_kernel_t matmul_kernels[CPU_NLEVELS] = {
+    matmul_kernel_generic, matmul_kernel_generic, matmul_kernel_generic,
+    matmul_kernel_generic
+};
+#endif
+
+/* matmul_select_kernel: pick the microkernel of the current CPU level */
+static matmul_kernel_t matmul_select_kernel(void)
+{
+    return matmul_kernels[cpu_get_level()];
+}
+
+/* GEMV kernels: compute y = M * v for mb rows of M and a vector v of k
+ * doubles. The row kernel takes rows stored contiguously, the row i at
+ * a + i * lda, and computes one dot product per row. The column kernel
+ * takes rows stored column by column, the column p at a + p * lda. */
+typedef void (*matmul_gemv_kernel_t)(size_t mb, size_t k, const double *a,
+                                     size_t lda, const double *v, double *y);
+
+struct matmul_gemv_kernels {
+    matmul_gemv_kernel_t rows;
+    matmul_gemv_kernel_t columns;
+};
+
+static void matmul_rows_generic(size_t mb, size_t k, const double *a,
+                                size_t lda, const double *v, double *y)
+{
+    for(size_t i = 0; i < mb; i++, a += lda) {
+        double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+        size_t p = 0;
+        for(; p + 4 <= k; p += 4) {
+            s0 += a[p] * v[p];
+            s1 += a[p + 1] * v[p + 1];
+            s2 += a[p + 2] * v[p + 2];
+            s3 += a[p + 3] * v[p + 3];
+        }
+        for(; p < k; p++) s0 += a[p] * v[p];
+        y[i] = (s0 + s1) + (s2 + s3);
+    }
+}
+
+static void matmul_columns_generic(size_t mb, size_t k, const double *a,
+                                   size_t lda, const double *v, double *y)
+{
+    for(size_t i = 0; i < mb; i++) y[i] = 0.0;
+    for(size_t p = 0; p < k; p++) {
+        const double *col = a + p * lda;
+        for(size_t i = 0; i < mb; i++) y[i] += v[p] * col[i];
+    }
+}
+
+#ifdef MATMUL_X86
+/* The SIMD GEMV kernels are written once over the vector primitives
+ * MATMUL_V_* and instantiated for every level. The row kernel walks four
+ * rows at once and loads each element of v once for them, the column
+ * kernel streams four columns at once through the outputs, which stay in
+ * L1. */
+#define MATMUL_GEMV_DEFINE(level)                                       \
+    MATMUL_V_TARGET                                                     \
+    static void matmul_rows_##level(size_t mb, size_t k,                \
+                                    const double *a, size_t lda,        \
+                                    const double *v, double *y)         \
+    {                                                                   \
+        const size_t w = MATMUL_V_WIDTH;                                \
+        size_t i = 0;                                                   \
+        for(; i + 4 <= mb; i += 4) {                                    \
+            const double *a0 = a + i * lda, *a1 = a0 + lda;             \
+            const double *a2 = a1 + lda, *a3 = a2 + lda;                \
+            MATMUL_V s0 = MATMUL_V_ZERO(), s1 = MATMUL_V_ZERO();        \
+            MATMUL_V s2 = MATMUL_V_ZERO(), s3 = MATMUL_V_ZERO();        \
+            size_t p = 0;                                               \
+            for(; p + w <= k; p += w) {                                 \
+                MATMUL_V vp = MATMUL_V_LOAD(v + p);                     \
+                s0 = MATMUL_V_FMA(MATMUL_V_LOAD(a0 + p), vp, s0);       \
+                s1 = MATMUL_V_FMA(MATMUL_V_LOAD(a1 + p), vp, s1);       \
+                s2 = MATMUL_V_FMA(MATMUL_V_LOAD(a2 + p), vp, s2);       \
+                s3 = MATMUL_V_FMA(MATMUL_V_LOAD(a3 + p), vp, s3);       \
+            }                                                           \
+            double y0 = MATMUL_V_SUM(s0), y1 = MATMUL_V_SUM(s1);        \
+            double y2 = MATMUL_V_SUM(s2), y3 = MATMUL_V_SUM(s3);        \
+            for(; p < k; p++) {                                         \
+                y0 += a0[p] * v[p];                                     \
+                y1 += a1[p] * v[p];                                     \
+                y2 += a2[p] * v[p];                                     \
+                y3 += a3[p] * v[p];                                     \
+            }                                                           \
+            y[i] = y0;                                                  \
+            y[i + 1] = y1;                                              \
+            y[i + 2] = y2;                                              \
+            y[i + 3] = y3;                                              \
+        }                                                               \
+        for(; i < mb; i++) {                                            \
+            const double *a0 = a + i * lda;                             \
+            MATMUL_V s0 = MATMUL_V_ZERO();                              \
+            size_t p = 0;                                               \
+            for(; p + w <= k; p += w) {                                 \
+                s0 = MATMUL_V_FMA(MATMUL_V_LOAD(a0 + p),                \
+                                  MATMUL_V_LOAD(v + p), s0);            \
+            }                                                           \
+            double sum = MATMUL_V_SUM(s0);                              \
+            for(; p < k; p++) sum += a0[p] * v[p];                      \
+            y[i] = sum;                                                 \
+        }                                                               \
+    }                                                                   \
+                                                                        \
+    MATMUL_V_TARGET                                                     \
+    static void matmul_columns_##level(size_t mb, size_t k,             \
+                                       const double *a, size_t lda,     \
+                                       const double *v, double *y)      \
+    {                                                                   \
+        const size_t w = MATMUL_V_WIDTH;                                \
+        size_t p = 0, i;                                                \
+        for(i = 0; i < mb; i++) y[i] = 0.0;                             \
+        for(; p + 4 <= k; p += 4) {                                     \
+            const double *c0 = a + p * lda, *c1 = c0 + lda;             \
+            const double *c2 = c1 + lda, *c3 = c2 + lda;                \
+            MATMUL_V v0 = MATMUL_V_SET1(v[p]);                          \
+            MATMUL_V v1 = MATMUL_V_SET1(v[p + 1]);                      \
+            MATMUL_V v2 = MATMUL_V_SET1(v[p + 2]);                      \
+            MATMUL_V v3 = MATMUL_V_SET1(v[p + 3]);                      \
+            for(i = 0; i + w <= mb; i += w) {                           \
+                MATMUL_V t = MATMUL_V_LOAD(y + i);                      \
+                t = MATMUL_V_FMA(v0, MATMUL_V_LOAD(c0 + i), t);         \
+                t = MATMUL_V_FMA(v1, MATMUL_V_LOAD(c1 + i), t);         \
+                t = MATMUL_V_FMA(v2, MATMUL_V_LOAD(c2 + i), t);         \
+                t = MATMUL_V_FMA(v3, MATMUL_V_LOAD(c3 + i), t);         \
+                MATMUL_V_STORE(y + i, t);                               \
+            }                                                           \
+            for(; i < mb; i++) {                                        \
+                y[i] += v[p] * c0[i] + v[p + 1] * c1[i]                 \
+                        + v[p + 2] * c2[i] + v[p + 3] * c3[i];          \
+            }                                                           \
+        }                                                               \
+        for(; p < k; p++) {                                             \
+            const double *c0 = a + p * lda;                             \
+            MATMUL_V v0 = MATMUL_V_SET1(v[p]);                          \
+            for(i = 0; i + w <= mb; i += w) {                           \
+                MATMUL_V_STORE(y + i, MATMUL_V_FMA(v0,                  \
+                                                   MATMUL_V_LOAD(c0 + i), \
+                                                   MATMUL_V_LOAD(y + i))); \
+            }                                                           \
+            for(; i < mb; i++) y[i] += v[p] * c0[i];                    \
+        }                                                               \
+    }
+
+/* SSE2 has no FMA */
+#define MATMUL_V_TARGET __attribute__((target("sse2")))
+#define MATMUL_V __m128d
+#define MATMUL_V_WIDTH 2
+#define MATMUL_V_ZERO() _mm_setzero_pd()
+#define MATMUL_V_SET1(a) _mm_set1_pd(a)
+#define MATMUL_V_LOAD(p) _mm_loadu_pd(p)
+#define MATMUL_V_STORE(p, v) _mm_storeu_pd(p, v)
+#define MATMUL_V_ADD(a, b) _mm_add_pd(a, b)
+#define MATMUL_V_FMA(a, b, c) _mm_add_pd(_mm_mul_pd(a, b), c)
+#define MATMUL_V_SUM(v) _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)))
+MATMUL_GEMV_DEFINE(sse2)
+#undef MATMUL_V_TARGET
+#undef MATMUL_V
+#undef MATMUL_V_WIDTH
+#undef MATMUL_V_ZERO
+#undef MATMUL_V_SET1
+#undef MATMUL_V_LOAD
+#undef MATMUL_V_STORE
+#undef MATMUL_V_ADD
+#undef MATMUL_V_FMA
+#undef MATMUL_V_SUM
+
+__attribute__((target("avx2")))
+static double matmul_sum_avx2(__m256d v)
+{
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v),
+                           _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+#define MATMUL_V_TARGET __attribute__((target("avx2,fma")))
+#define MATMUL_V __m256d
+#define MATMUL_V_WIDTH 4
+#define MATMUL_V_ZERO() _mm256_setzero_pd()
+#define MATMUL_V_SET1(a) _mm256_set1_pd(a)
+#define MATMUL_V_LOAD(p) _mm256_loadu_pd(p)
+#define MATMUL_V_STORE(p, v) _mm256_storeu_pd(p, v)
+#define MATMUL_V_ADD(a, b) _mm256_add_pd(a, b)
+#define MATMUL_V_FMA(a, b, c) _mm256_fmadd_pd(a, b, c)
+#define MATMUL_V_SUM(v) matmul_sum_avx2(v)
+MATMUL_GEMV_DEFINE(avx2)
+#undef MATMUL_V_TARGET
+#undef MATMUL_V
+#undef MATMUL_V_WIDTH
+#undef MATMUL_V_ZERO
+#undef MATMUL_V_SET1
+#undef MATMUL_V_LOAD
+#undef MATMUL_V_STORE
+#undef MATMUL_V_ADD
+#undef MATMUL_V_FMA
+#undef MATMUL_V_SUM
+
+#define MATMUL_V_TARGET __attribute__((target("avx512f")))
+#define MATMUL_V __m512d
+#define MATMUL_V_WIDTH 8
+#define MATMUL_V_ZERO() _mm512_setzero_pd()
+#define MATMUL_V_SET1(a) _mm512_set1_pd(a)
+#define MATMUL_V_LOAD(p) _mm512_loadu_pd(p)
+#define MATMUL_V_STORE(p, v) _mm512_storeu_pd(p, v)
+#define MATMUL_V_ADD(a, b) _mm512_add_pd(a, b)
+#define MATMUL_V_FMA(a, b, c) _mm512_fmadd_pd(a, b, c)
+#define MATMUL_V_SUM(v) _mm512_reduce_add_pd(v)
+MATMUL_GEMV_DEFINE(avx512)
+#undef MATMUL_V_TARGET
+#undef MATMUL_V
+#undef MATMUL_V_WIDTH
+#undef MATMUL_V_ZERO
+#undef MATMUL_V_SET1
+#undef MATMUL_V_LOAD
+#undef MATMUL_V_STORE
+#undef MATMUL_V_ADD
+#undef MATMUL_V_FMA
+#undef MATMUL_V_SUM
+
+/* GEMV kernels of every cpu_level_t */
+static const struct matmul_gemv_kernels matmul_gemv_kernels[CPU_NLEVELS] = {
+    {matmul_rows_generic, matmul_columns_generic},
+    {matmul_rows_sse2, matmul_columns_sse2},
+    {matmul_rows_avx2, matmul_columns_avx2},
+    {matmul_rows_avx512, matmul_columns_avx512}
+};
+#else
+static const struct matmul_gemv_kernels matmul_gemv_kernels[CPU_NLEVELS] = {
+    {matmul_rows_generic, matmul_columns_generic},
+    {matmul_rows_generic, matmul_columns_generic},
+    {matmul_rows_generic, matmul_columns_generic},
+    {matmul_rows_generic, matmul_columns_generic}
+};
+#endif
+
+/* Tiny layers: for a K x N matrix B with K and N in MATMUL_TINY_SIZES, the
+ * product is computed by a kernel generated for that shape. Its loops have
+ * constant bounds and are fully unrolled, a row of C stays in registers
+ * and there is no packing. The sums are added in the same order on every
+ * level (ISO C doesn't contract them into FMAs), so every level gives the
+ * same bits. */
+#define MATMUL_TINY_NSIZES 7
+/* Outputs the epilogue runs on at once, several rows when they are short */
+#define MATMUL_TINY_BLOCK 256
+static const size_t matmul_tiny_sizes[MATMUL_TINY_NSIZES] = {
+    1, 2, 3, 4, 8, 16, 32
+};
+
+/* matmul_tiny_t: compute the m rows c = a * b for a K x N matrix b with
+ * contiguous rows. If ep is not NULL its epilogue is applied, its bias and
+ * pre start at the first row. */
+typedef void (*matmul_tiny_t)(size_t m, const double *a, size_t lda,
+                              const double *b, size_t ldb, double *c,
+                              size_t ldc, const struct matmul_epilogue *ep);
+
+#if defined(__GNUC__) && __GNUC__ >= 8
+#define MATMUL_UNROLL _Pragma("GCC unroll 32")
+#else
+#define MATMUL_UNROLL
+#endif
+
+#define MATMUL_TINY_DEFINE(K, N, level)                                 \
+    MATMUL_TINY_TARGET                                                  \
+    static void matmul_tiny_##K##x##N##_##level(                        \
+        size_t m, const double *a, size_t lda, const double *b,         \
+        size_t ldb, double *c, size_t ldc,                              \
+        const struct matmul_epilogue *ep)                               \
+    {                                                                   \
+        double out[MATMUL_TINY_BLOCK];                                  \
+        const size_t rows = MATMUL_TINY_BLOCK / N;                      \
+        for(size_t i0 = 0; i0 < m; i0 += rows) {                        \
+            size_t mb = m - i0 < rows ? m - i0 : rows;                  \
+            for(size_t i = 0; i < mb; i++, a += lda) {                  \
+                double y[N] = {0.0};                                    \
+                MATMUL_UNROLL                                           \
+                for(int p = 0; p < K; p++) {                            \
+                    double ap = a[p];                                   \
+                    MATMUL_UNROLL                                       \
+                    for(int j = 0; j < N; j++) {                        \
+                        y[j] += ap * b[p * ldb + j];                    \
+                    }                                                   \
+                }                                                       \
+                double *ci = c + (i0 + i) * ldc;                        \
+                if(ep == NULL) {                                        \
+                    MATMUL_UNROLL                                       \
+                    for(int j = 0; j < N; j++) ci[j] = y[j];            \
+                    continue;                                           \
+                }                                                       \
+                for(int j = 0; j < N; j++) {                            \
+                    out[i * N + j] = matmul_epilogue_value(ep, i0 + i,  \
+                                                           j, y[j]);    \
+                }                                                       \
+            }                                                           \
+            if(ep == NULL) continue;                                    \
+            if(ep->act != NULL) ep->act(mb * N, out, out);              \
+            for(size_t i = 0; i < mb; i++) {                            \
+                double *ci = c + (i0 + i) * ldc;                        \
+                for(int j = 0; j < N; j++) ci[j] = out[i * N + j];      \
+            }                                                           \
+        }                                                               \
+    }
+
+#define MATMUL_TINY_DEFINE_ROW(K, level)                                \
+    MATMUL_TINY_DEFINE(K, 1, level) MATMUL_TINY_DEFINE(K, 2, level)     \
+    MATMUL_TINY_DEFINE(K, 3, level) MATMUL_TINY_DEFINE(K, 4, level)     \
+    MATMUL_TINY_DEFINE(K, 8, level) MATMUL_TINY_DEFINE(K, 16, level)    \
+    MATMUL_TINY_DEFINE(K, 32, level)
+
+#define MATMUL_TINY_DEFINE_ALL(level)                                   \
+    MATMUL_TINY_DEFINE_ROW(1, level) MATMUL_TINY_DEFINE_ROW(2, level)   \
+    MATMUL_TINY_DEFINE_ROW(3, level) MATMUL_TINY_DEFINE_ROW(4, level)   \
+    MATMUL_TINY_DEFINE_ROW(8, level) MATMUL_TINY_DEFINE_ROW(16, level)  \
+    MATMUL_TINY_DEFINE_ROW(32, level)
+
+#define MATMUL_TINY_ROW(K, level)                                       \
+    {matmul_tiny_##K##x1_##level, matmul_tiny_##K##x2_##level,          \
+     matmul_tiny_##K##x3_##level, matmul_tiny_##K##x4_##level,          \
+     matmul_tiny_##K##x8_##level, matmul_tiny_##K##x16_##level,         \
+     matmul_tiny_##K##x32_##level}
+
+#define MATMUL_TINY_TABLE(level)                                        \
+    {MATMUL_TINY_ROW(1, level), MATMUL_TINY_ROW(2, level),              \
+     MATMUL_TINY_ROW(3, level), MATMUL_TINY_ROW(4, level),              \
+     MATMUL_TINY_ROW(8, level), MATMUL_TINY_ROW(16, level),             \
+     MATMUL_TINY_ROW(32, level)}
+
+/* The generic kernels are vectorized with the baseline instruction set,
+ * SSE2 on x86-64 */
+#define MATMUL_TINY_TARGET
+MATMUL_TINY_DEFINE_ALL(generic)
+#undef MATMUL_TINY_TARGET
+
+#ifdef MATMUL_X86
+#define MATMUL_TINY_TARGET __attribute__((target("avx2")))
+MATMUL_TINY_DEFINE_ALL(avx2)
+#undef MATMUL_TINY_TARGET
+#define MATMUL_TINY_TARGET __attribute__((target("avx512f")))
+MATMUL_TINY_DEFINE_ALL(avx512)
+#undef MATMUL_TINY_TARGET
+
+/* Tiny kernels of every cpu_level_t */
+static const matmul_tiny_t
+matmul_tiny_kernels[CPU_NLEVELS][MATMUL_TINY_NSIZES][MATMUL_TINY_NSIZES] = {
+    MATMUL_TINY_TABLE(generic), MATMUL_TINY_TABLE(generic),
+    MATMUL_TINY_TABLE(avx2), MATMUL_TINY_TABLE(avx512)
+};
+#else
+static const matmul_tiny_t
+matmul_tiny_kernels[CPU_NLEVELS][MATMUL_TINY_NSIZES][MATMUL_TINY_NSIZES] = {
+    MATMUL_TINY_TABLE(generic), MATMUL_TINY_TABLE(generic),
+    MATMUL_TINY_TABLE(generic), MATMUL_TINY_TABLE(generic)
+};
+#endif
+
+/* matmul_tiny_index: position of size in matmul_tiny_sizes, or -1 */
+static int matmul_tiny_index(size_t size)
+{
+    for(int s = 0; s < MATMUL_TINY_NSIZES; s++) {
+        if(matmul_tiny_sizes[s] == size) return s;
+    }
+    return -1;
+}
+
+/* matmul_operand: an input matrix addressed through its strides. The
+ * elements can have any tensor_dtype_t, they are converted to double when
+ * packed. */
+struct matmul_operand {
+    const char *data; // first element
+    tensor_dtype_t dtype;
+    size_t elsize;
+    size_t rs; // row stride in elements
+    size_t cs; // column stride in elements
+};
+
+/* matmul_operand_init: describe tensor t, or its transpose if transpose is
+ * non-zero, as an operand */
+static void matmul_operand_init(struct matmul_operand *op, const tensor_t *t,
+                                int transpose)
+{
+    op->dtype = t->dtype;
+    op->elsize = tensor_dtype_size(t->dtype);
+    op->data = (const char *)t->data + t->offset * op->elsize;
+    op->rs = transpose ? t->col_stride : t->ld;
+    op->cs = transpose ? t->ld : t->col_stride;
+}
+
+/* matmul_load_line: get n elements of x starting from (i, j) and walking
+ * with stride as doubles. The elements are converted into tmp unless they
+ * already are contiguous doubles. */
+static const double *matmul_load_line(const struct matmul_operand *x,
+                                      size_t i, size_t j, size_t stride,
+                                      size_t n, double *tmp)
+{
+    const char *src = x->data + (i * x->rs + j * x->cs) * x->elsize;
+
+    if(x->dtype == TENSOR_FLOAT64 && stride == 1) {
+        return (const double *)src;
+    }
+    if(stride == 1) {
+        tensor_convert_array(src, x->dtype, tmp, TENSOR_FLOAT64, n);
+        return tmp;
+    }
+    for(size_t p = 0; p < n; p++) {
+        tensor_convert_array(src + p * stride * x->elsize, x->dtype,
+                             tmp + p, TENSOR_FLOAT64, 1);
+    }
+    return tmp;
+}
+
+/* matmul_pack_a: pack the mc x kc block of A at (ic, pc) into micro-panels
+ * of MR rows. Each micro-panel is stored column by column so the
+ * microkernel reads it sequentially. The last micro-panel is padded with
+ * zeros. tmp holds at least kc doubles. */
+static void matmul_pack_a(size_t mc, size_t kc, const struct matmul_operand *x,
+                          size_t ic, size_t pc, double *buf, double *tmp)
+{
+    if(x->dtype == TENSOR_FLOAT64) {
+        const double *a = (const double *)x->data + ic * x->rs + pc * x->cs;
+        for(size_t ir = 0; ir < mc; ir += MATMUL_MR) {
+            size_t mr = mc - ir < MATMUL_MR ? mc - ir : MATMUL_MR;
+            for(size_t p = 0; p < kc; p++) {
+                for(size_t i = 0; i < mr; i++) {
+                    buf[i] = a[(ir + i) * x->rs + p * x->cs];
+                }
+                for(size_t i = mr; i < MATMUL_MR; i++) {
+                    buf[i] = 0.0;
+                }
+                buf += MATMUL_MR;
+            }
+        }
+        return;
+    }
+
+    /* other element types are converted row by row */
+    for(size_t ir = 0; ir < mc; ir += MATMUL_MR) {
+        size_t mr = mc - ir < MATMUL_MR ? mc - ir : MATMUL_MR;
+        for(size_t i = 0; i < MATMUL_MR; i++) {
+            if(i >= mr) {
+                for(size_t p = 0; p < kc; p++) buf[p * MATMUL_MR + i] = 0.0;
+                continue;
+            }
+            const double *row = matmul_load_line(x, ic + ir + i, pc, x->cs,
+                                                 kc, tmp);
+            for(size_t p = 0; p < kc; p++) buf[p * MATMUL_MR + i] = row[p];
+        }
+        buf += kc * MATMUL_MR;
+    }
+}
+
+/* matmul_pack_b: pack the kc x nc panel of B at (pc, jc) into micro-panels
+ * of NR columns. Each micro-panel is stored row by row. The last
+ * micro-panel is padded with zeros. tmp holds at least nc doubles. */
+static void matmul_pack_b(size_t kc, size_t nc, const struct matmul_operand *x,
+                          size_t pc, size_t jc, double *buf, double *tmp)
+{
+    if(x->dtype == TENSOR_FLOAT64) {
+        const double *b = (const double *)x->data + pc * x->rs + jc * x->cs;
+        for(size_t jr = 0; jr < nc; jr += MATMUL_NR) {
+            size_t nr = nc - jr < MATMUL_NR ? nc - jr : MATMUL_NR;
+            for(size_t p = 0; p < kc; p++) {
+                for(size_t j = 0; j < nr; j++) {
+                    buf[j] = b[p * x->rs + (jr + j) * x->cs];
+                }
+                for(size_t j = nr; j < MATMUL_NR; j++) {
+                    buf[j] = 0.0;
+                }
+                buf += MATMUL_NR;
+            }
+        }
+        return;
+    }
+
+    /* other element types are converted row by row */
+    for(size_t p = 0; p < kc; p++) {
+        const double *row = matmul_load_line(x, pc + p, jc, x->cs, nc, tmp);
+        for(size_t jr = 0; jr < nc; jr += MATMUL_NR) {
+            size_t nr = nc - jr < MATMUL_NR ? nc - jr : MATMUL_NR;
+            double *panel = buf + jr * kc + p * MATMUL_NR;
+            for(size_t j = 0; j < nr; j++) {
+                panel[j] = row[jr + j];
+            }
+            for(size_t j = nr; j < MATMUL_NR; j++) {
+                panel[j] = 0.0;
+            }
+        }
+    }
+}
+
+/* matmul_macro_kernel: multiply the packed mc x kc block of A with the
+ * packed kc x nc panel of B into C. Partial tiles on the edges are computed
+ * into a temporary tile and then copied into C. If ep is not NULL this is
+ * the last block of k and the epilogue is applied to every tile; its bias
+ * and pre start at the first row and column of the block. */
+static void matmul_macro_kernel(matmul_kernel_t kernel, size_t mc, size_t nc,
+                                size_t kc, const double *abuf,
+                                const double *bbuf, double *c, size_t ldc,
+                                int accumulate,
+                                const struct matmul_epilogue *ep)
+{
+    double tile[MATMUL_MR * MATMUL_NR];
+
+    for(size_t jr = 0; jr < nc; jr += MATMUL_NR) {
+        size_t nr = nc - jr < MATMUL_NR ? nc - jr : MATMUL_NR;
+        const double *b = bbuf + jr * kc;
+
+        for(size_t ir = 0; ir < mc; ir += MATMUL_MR) {
+            size_t mr = mc - ir < MATMUL_MR ? mc - ir : MATMUL_MR;
+            const double *a = abuf + ir * kc;
+            double *cij = c + ir * ldc + jr;
+            struct matmul_epilogue tep, *tile_ep = NULL;
+
+            /* the epilogue starting at the tile */
+            if(ep != NULL) {
+                tep = *ep;
+                if(tep.bias != NULL) tep.bias += jr;
+                if(tep.pre != NULL) tep.pre += ir * tep.ldpre + jr;
+                tile_ep = &tep;
+            }
+
+            if(mr == MATMUL_MR && nr == MATMUL_NR) {
+                kernel(kc, a, b, cij, ldc, accumulate, tile_ep);
+            } else {
+                kernel(kc, a, b, tile, MATMUL_NR, 0, NULL);
+                for(size_t i = 0; i < mr; i++) {
+                    for(size_t j = 0; j < nr; j++) {
+                        double value = tile[i * MATMUL_NR + j];
+                        if(accumulate) value += cij[i * ldc + j];
+                        if(tile_ep != NULL) {
+                            value = matmul_epilogue_value(tile_ep, i, j,
+                                                          value);
+                        }
+                        cij[i * ldc + j] = value;
+                    }
+                }
+            }
+
+            /* the other activations run on the tile while it is in L1 */
+            if(ep != NULL && ep->act != NULL) {
+                for(size_t i = 0; i < mr; i++) {
+                    ep->act(nr, cij + i * ldc, cij + i * ldc);
+                }
+            }
+        }
+    }
+}
+
+/* One blocked product C = A * B split across threads. For every KC x NC
+ * panel of B, the threads first pack the panel together into the shared
+ * buffer, which stays in L3, then take work items: an MC block of rows of
+ * C against a chunk of the columns of the panel. Each thread packs the
+ * blocks of A of its items into its own buffer, which stays in its L2. */
+struct matmul_gemm {
+    matmul_kernel_t kernel;
+    const struct matmul_operand *a;
+    const struct matmul_operand *b;
+    double *c;
+    size_t ldc;
+    const struct matmul_epilogue *ep;
+    size_t m;
+    size_t k;
+    size_t jc, nc; // the current panel of B
+    size_t pc, kc;
+    double *bbuf; // the packed panel, shared by the threads
+    size_t chunk; // columns of an item, a multiple of NR
+    size_t nchunks;
+    int failed; // set when a packing buffer cannot be allocated
+};
+
+/* matmul_pack_b_range: parallel_for body over the micro-panels of the
+ * current panel of B */
+static void matmul_pack_b_range(void *ctx, size_t begin, size_t end)
+{
+    struct matmul_gemm *g = ctx;
+    size_t j0 = begin * MATMUL_NR;
+    size_t j1 = end * MATMUL_NR < g->nc ? end * MATMUL_NR : g->nc;
+    double *tmp = NULL;
+    if(g->b->dtype != TENSOR_FLOAT64) {
+        tmp = tensor_pool_alloc((j1 - j0) * sizeof(double));
+        if(tmp == NULL) {
+            __atomic_store_n(&g->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    matmul_pack_b(g->kc, j1 - j0, g->b, g->pc, g->jc + j0,
+                  g->bbuf + j0 * g->kc, tmp);
+    tensor_pool_free(tmp);
+}
+
+/* matmul_gemm_range: parallel_for body over the work items of the current
+ * panel of B. Items are numbered by block of rows first, so the items of
+ * a range reuse the packed block of A. */
+static void matmul_gemm_range(void *ctx, size_t begin, size_t end)
+{
+    struct matmul_gemm *g = ctx;
+    size_t mc_max = g->m < MATMUL_MC ? g->m : MATMUL_MC;
+    mc_max = (mc_max + MATMUL_MR - 1) / MATMUL_MR * MATMUL_MR;
+
+    /* the private block of A and the conversion buffer for its rows */
+    double *abuf = tensor_pool_alloc(mc_max * g->kc * sizeof(double));
+    double *tmp = tensor_pool_alloc(g->kc * sizeof(double));
+    if(abuf == NULL || tmp == NULL) {
+        tensor_pool_free(tmp);
+        tensor_pool_free(abuf);
+        __atomic_store_n(&g->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t packed = (size_t)-1;
+    for(size_t item = begin; item < end; item++) {
+        size_t ic = item / g->nchunks * MATMUL_MC;
+        size_t j0 = item % g->nchunks * g->chunk;
+        size_t mc = g->m - ic < MATMUL_MC ? g->m - ic : MATMUL_MC;
+        size_t nc = g->nc - j0 < g->chunk ? g->nc - j0 : g->chunk;
+        struct matmul_epilogue block, *last = NULL;
+
+        /* the epilogue of the block, run with its last kc */
+        if(g->ep != NULL && g->pc + g->kc == g->k) {
+            block = *g->ep;
+            if(block.bias != NULL) block.bias += g->jc + j0;
+            if(block.pre != NULL) {
+                block.pre += ic * block.ldpre + g->jc + j0;
+            }
+            last = &block;
+        }
+
+        if(packed != ic) {
+            matmul_pack_a(mc, g->kc, g->a, ic, g->pc, abuf, tmp);
+            packed = ic;
+        }
+        matmul_macro_kernel(g->kernel, mc, nc, g->kc, abuf,
+                            g->bbuf + j0 * g->kc,
+                            g->c + ic * g->ldc + g->jc + j0, g->ldc,
+                            g->pc > 0, last);
+    }
+
+    tensor_pool_free(tmp);
+    tensor_pool_free(abuf);
+}
+
+/* matmul_blocked: compute the m x n matrix C = A * B where A is m x k.
+ * C is row-major with leading dimension ldc. If ep is not NULL, its
+ * epilogue is applied to C. Every element of C is summed in the same order
+ * whatever the number of threads.
+ * It returns non-zero value and set errno to ENOMEM if the packing buffers
+ * cannot be allocated */
+static int matmul_blocked(matmul_kernel_t kernel, size_t m, size_t n,
+                          size_t k, const struct matmul_operand *a,
+                          const struct matmul_operand *b, double *c,
+                          size_t ldc, const struct matmul_epilogue *ep)
+{
+    size_t nc_max = n < MATMUL_NC ? n : MATMUL_NC;
+    size_t kc_max = k < MATMUL_KC ? k : MATMUL_KC;
+    nc_max = (nc_max + MATMUL_NR - 1) / MATMUL_NR * MATMUL_NR;
+
+    /* the panel of B is recycled through the tensor pool */
+    struct matmul_gemm g = {kernel, a, b, c, ldc, ep, m, k};
+    g.bbuf = tensor_pool_alloc(kc_max * nc_max * sizeof(double));
+    if(g.bbuf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* blocks of rows are the items when there are enough of them for the
+     * threads, otherwise the columns of a panel are cut into chunks too */
+    size_t nthreads = parallel_get_nthreads();
+    size_t nblocks = (m + MATMUL_MC - 1) / MATMUL_MC;
+    size_t nchunks = 1;
+    if(nthreads > 1 && nblocks < MATMUL_ITEMS_PER_THREAD * nthreads) {
+        nchunks = (MATMUL_ITEMS_PER_THREAD * nthreads + nblocks - 1)
+                  / nblocks;
+    }
+
+    for(size_t jc = 0; jc < n && !g.failed; jc += MATMUL_NC) {
+        g.jc = jc;
+        g.nc = n - jc < MATMUL_NC ? n - jc : MATMUL_NC;
+        size_t npanels = (g.nc + MATMUL_NR - 1) / MATMUL_NR;
+        g.chunk = (npanels + nchunks - 1) / nchunks * MATMUL_NR;
+        g.nchunks = (g.nc + g.chunk - 1) / g.chunk;
+
+        for(size_t pc = 0; pc < k && !g.failed; pc += MATMUL_KC) {
+            g.pc = pc;
+            g.kc = k - pc < MATMUL_KC ? k - pc : MATMUL_KC;
+
+            size_t grain = MATMUL_PACK_GRAIN / (g.kc * MATMUL_NR) + 1;
+            parallel_for(0, npanels, grain, matmul_pack_b_range, &g);
+            if(g.failed) break;
+
+            size_t work = MATMUL_MC * g.chunk * g.kc;
+            grain = MATMUL_GEMM_GRAIN / work + 1;
+            parallel_for(0, nblocks * g.nchunks, grain, matmul_gemm_range,
+                         &g);
+        }
+    }
+
+    tensor_pool_free(g.bbuf);
+    if(g.failed) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/* One matrix-vector product y = act(M * v + bias) where M is a rows x
+ * cols operand. Output i goes to y[i * incy], its bias is
+ * bias[i * incbias] and its pre-activation goes to pre[i * incpre]. */
+struct matmul_gemv {
+    const struct matmul_gemv_kernels *kernels;
+    struct matmul_operand mat;
+    size_t rows;
+    size_t cols;
+    const double *v;
+    double *y;
+    size_t incy;
+    const double *bias;
+    size_t incbias; // 0 when every output has the same bias
+    double *pre;
+    size_t incpre;
+    int relu;
+    tensor_activation_fn_t act;
+    int failed;
+};
+
+/* matmul_gemv_store: apply the epilogue to the outputs [i0, i0 + nb) in
+ * acc and store them */
+static void matmul_gemv_store(const struct matmul_gemv *g, size_t i0,
+                              size_t nb, double *acc)
+{
+    for(size_t i = 0; i < nb; i++) {
+        double value = acc[i];
+        if(g->bias != NULL) value += g->bias[(i0 + i) * g->incbias];
+        if(g->pre != NULL) g->pre[(i0 + i) * g->incpre] = value;
+        if(g->relu) value = value > 0.0 ? value : 0.0;
+        acc[i] = value;
+    }
+    if(g->act != NULL) g->act(nb, acc, acc);
+    for(size_t i = 0; i < nb; i++) g->y[(i0 + i) * g->incy] = acc[i];
+}
+
+/* matmul_gemv_range: parallel_for body over the rows of M. Rows stored
+ * contiguously use the row kernel, columns stored contiguously the column
+ * kernel, and rows of any other operand are converted to doubles first. */
+static void matmul_gemv_range(void *ctx, size_t begin, size_t end)
+{
+    struct matmul_gemv *g = ctx;
+    const struct matmul_operand *m = &g->mat;
+    size_t stride = g->cols == 1 ? 1 : m->cs;
+    int doubles = m->dtype == TENSOR_FLOAT64;
+    int rows = doubles && stride == 1;
+    int columns = doubles && !rows && m->rs == 1;
+    double acc[MATMUL_GEMV_BLOCK];
+    double *tmp = NULL;
+
+    if(!rows && !columns) {
+        tmp = tensor_pool_alloc(g->cols * sizeof(double));
+        if(tmp == NULL) {
+            __atomic_store_n(&g->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    for(size_t i0 = begin; i0 < end; i0 += MATMUL_GEMV_BLOCK) {
+        size_t nb = end - i0 < MATMUL_GEMV_BLOCK ? end - i0
+                                                  : MATMUL_GEMV_BLOCK;
+        if(columns) {
+            g->kernels->columns(nb, g->cols, (const double *)m->data + i0,
+                                m->cs, g->v, acc);
+        } else if(rows) {
+            g->kernels->rows(nb, g->cols, (const double *)m->data
+                             + i0 * m->rs, m->rs, g->v, acc);
+        } else {
+            for(size_t i = 0; i < nb; i++) {
+                const double *row = matmul_load_line(m, i0 + i, 0, stride,
+                                                     g->cols, tmp);
+                g->kernels->rows(1, g->cols, row, 0, g->v, acc + i);
+            }
+        }
+        matmul_gemv_store(g, i0, nb, acc);
+    }
+    tensor_pool_free(tmp);
+}
+
+/* matmul_is_gemv: check whether A * B is a matrix-vector product */
+static int matmul_is_gemv(const tensor_t *A, const tensor_t *B)
+{
+    return B->ncols == 1 || A->nrows == 1;
+}
+
+/* matmul_gemv: compute C = A * B where B has one column or A has one row,
+ * C(i, j) is c[i * rs + j * cs]. The product is split across threads over
+ * the rows of the matrix operand. If ep is not NULL its epilogue is
+ * applied; its pre has the row stride ep->ldpre and unit column stride.
+ * It returns non-zero value and set errno to ENOMEM if the buffers cannot
+ * be allocated */
+static int matmul_gemv(const tensor_t *A, const tensor_t *B, double *c,
+                       size_t rs, size_t cs, const struct matmul_epilogue *ep)
+{
+    struct matmul_gemv g;
+    struct matmul_operand x;
+    size_t stride;
+
+    memset(&g, 0, sizeof g);
+    g.kernels = &matmul_gemv_kernels[cpu_get_level()];
+    g.cols = A->ncols;
+    g.y = c;
+    if(B->ncols == 1) {
+        /* y = A * b */
+        matmul_operand_init(&g.mat, A, 0);
+        matmul_operand_init(&x, B, 0);
+        stride = x.rs;
+        g.rows = A->nrows;
+        g.incy = rs;
+        g.incpre = ep != NULL ? ep->ldpre : 0;
+    } else {
+        /* y^T = a^T * B, M is B^T */
+        matmul_operand_init(&g.mat, B, 1);
+        matmul_operand_init(&x, A, 0);
+        stride = x.cs;
+        g.rows = B->ncols;
+        g.incy = cs;
+        g.incbias = 1;
+        g.incpre = 1;
+    }
+    if(ep != NULL) {
+        g.bias = ep->bias;
+        g.pre = ep->pre;
+        g.relu = ep->relu;
+        g.act = ep->act;
+    }
+
+    /* the vector as contiguous doubles */
+    double *tmp = tensor_pool_alloc(g.cols * sizeof(double));
+    if(tmp == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    g.v = matmul_load_line(&x, 0, 0, stride, g.cols, tmp);
+
+    size_t grain = MATMUL_GEMV_GRAIN / g.cols;
+    int err = parallel_for(0, g.rows, grain > 0 ? grain : 1,
+                           matmul_gemv_range, &g);
+    tensor_pool_free(tmp);
+    if(err == 0 && g.failed) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return err;
+}
+
+/* One product of a tiny layer, see matmul_tiny */
+struct matmul_tiny {
+    matmul_tiny_t kernel;
+    const double *a;
+    size_t lda;
+    const double *b;
+    size_t ldb;
+    double *c;
+    size_t ldc;
+    const struct matmul_epilogue *ep;
+};
+
+/* matmul_tiny_range: parallel_for body over the rows of C */
+static void matmul_tiny_range(void *ctx, size_t begin, size_t end)
+{
+    const struct matmul_tiny *t = ctx;
+    struct matmul_epilogue ep, *rows = NULL;
+
+    /* the epilogue starting at the first row */
+    if(t->ep != NULL) {
+        ep = *t->ep;
+        if(ep.pre != NULL) ep.pre += begin * ep.ldpre;
+        rows = &ep;
+    }
+    t->kernel(end - begin, t->a + begin * t->lda, t->lda, t->b, t->ldb,
+              t->c + begin * t->ldc, t->ldc, rows);
+}
+
+/* matmul_is_rowmajor_double: check whether the rows of t are contiguous
+ * doubles, which the tiny kernels and the fused epilogue use directly */
+static int matmul_is_rowmajor_double(const tensor_t *t)
+{
+    return t->dtype == TENSOR_FLOAT64 && (t->col_stride == 1 || t->ncols == 1);
+}
+
+/* matmul_tiny: compute C = A * B with the kernel generated for the shape
+ * of B, where c is the first element of C and ldc its row stride. If ep
+ * is not NULL its epilogue is applied.
+ * It returns non-zero value if there is no kernel for the shape of B or
+ * the operands are not rows of doubles, without setting errno */
+static int matmul_tiny(const tensor_t *A, const tensor_t *B, double *c,
+                       size_t ldc, const struct matmul_epilogue *ep)
+{
+    int k = matmul_tiny_index(B->nrows);
+    int n = matmul_tiny_index(B->ncols);
+    if(k < 0 || n < 0 || !matmul_is_rowmajor_double(A)
+       || !matmul_is_rowmajor_double(B)) {
+        return -1;
+    }
+
+    struct matmul_tiny t = {
+        matmul_tiny_kernels[cpu_get_level()][k][n],
+        (const double *)A->data + A->offset, A->ld,
+        (const double *)B->data + B->offset, B->ld, c, ldc, ep
+    };
+    size_t grain = MATMUL_GEMV_GRAIN / (B->nrows * B->ncols);
+    return parallel_for(0, A->nrows, grain > 0 ? grain : 1,
+                        matmul_tiny_range, &t);
+}
+
+/* matmul_overlaps: check whether the elements of tensors x and y can share
+ * memory */
+static int matmul_overlaps(const tensor_t *x, const tensor_t *y)
+{
+    size_t xsize = tensor_dtype_size(x->dtype);
+    size_t ysize = tensor_dtype_size(y->dtype);
+    uintptr_t x0 = (uintptr_t)x->data + x->offset * xsize;
+    uintptr_t x1 = x0 + ((x->nrows - 1) * x->ld
+                         + (x->ncols - 1) * x->col_stride + 1) * xsize - 1;
+    uintptr_t y0 = (uintptr_t)y->data + y->offset * ysize;
+    uintptr_t y1 = y0 + ((y->nrows - 1) * y->ld
+                         + (y->ncols - 1) * y->col_stride + 1) * ysize - 1;
+    return x0 <= y1 && y0 <= x1;
+}
+
+/* matmul_double: compute C = A * B for a TENSOR_FLOAT64 tensor C */
+static int matmul_double(const tensor_t *A, const tensor_t *B, tensor_t *C)
+{
+    struct matmul_operand a, b;
+    double *c = (double *)C->data + C->offset;
+
+    if((C->col_stride == 1 || C->ncols == 1)
+       && matmul_tiny(A, B, c, C->ld, NULL) == 0) {
+        return 0;
+    }
+    if(matmul_is_gemv(A, B)) {
+        return matmul_gemv(A, B, c, C->ld, C->col_stride, NULL);
+    }
+    if(C->col_stride == 1 || C->ncols == 1) {
+        matmul_operand_init(&a, A, 0);
+        matmul_operand_init(&b, B, 0);
+        return matmul_blocked(matmul_select_kernel(), A->nrows, B->ncols,
+                              A->ncols, &a, &b, c, C->ld, NULL);
+    }
+
+    /* C is a transposed view: compute C^T = B^T * A^T instead */
+    if(C->ld == 1 || C->nrows == 1) {
+        matmul_operand_init(&a, A, 1);
+        matmul_operand_init(&b, B, 1);
+        return matmul_blocked(matmul_select_kernel(), B->ncols, A->nrows,
+                              A->ncols, &b, &a, c, C->col_stride, NULL);
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/* tensor_matmul: compute the matrix product C = A * B.
+ * A is m x k, B is k x n and C must be an allocated m x n tensor. The
+ * previous content of C is overwritten. A and B can be any views of any
+ * element type; the product is accumulated in double and rounded once to
+ * the element type of C. A TENSOR_FLOAT64 C must have either unit column
+ * stride or unit row stride (a transposed view), unless B has one column
+ * or A has one row. C must not overlap A or B.
+ *
+ * It returns zero if the operation succeed.
+ * It returns non-zero value and set errno to EINVAL if one of the tensors
+ * is NULL, the shapes do not match, C has no unit stride or C overlaps
+ * A or B.
+ * It returns non-zero value and set errno to ENOMEM if the packing buffers
+ * cannot be allocated */
+int tensor_matmul(const tensor_t *A, const tensor_t *B, tensor_t *C)
+{
+    /* NULL checking */
+    if(A == NULL || B == NULL || C == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(A->ncols != B->nrows || C->nrows != A->nrows || C->ncols != B->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* alias checking */
+    if(matmul_overlaps(C, A) || matmul_overlaps(C, B)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(C->dtype == TENSOR_FLOAT64) {
+        return matmul_double(A, B, C);
+    }
+
+    /* accumulate other element types in double, then round once */
+    tensor_t *product = allocate_tensor(C->nrows, C->ncols);
+    if(product == NULL) return -1;
+
+    int err = matmul_double(A, B, product);
+    if(err == 0) err = tensor_convert(product, C);
+    free_tensor(product);
+    return err;
+}
+
+/* matmul_fused_double: compute out = act(X * W + bias) for a TENSOR_FLOAT64
+ * tensor out with unit column stride. pre, if not NULL, is a TENSOR_FLOAT64
+ * tensor with unit column stride. */
+static int matmul_fused_double(const tensor_t *X, const tensor_t *W,
+                               const double *bias, tensor_activation_t act,
+                               tensor_t *out, tensor_t *pre)
+{
+    struct matmul_operand a, b;
+    struct matmul_epilogue ep = {bias, NULL, 0, act == TENSOR_RELU, NULL};
+
+    if(act != TENSOR_IDENTITY && act != TENSOR_RELU) {
+        ep.act = tensor_get_activation_fn(act);
+    }
+    if(pre != NULL) {
+        ep.pre = (double *)pre->data + pre->offset;
+        ep.ldpre = pre->ld;
+    }
+    double *c = (double *)out->data + out->offset;
+    if(matmul_tiny(X, W, c, out->ld, &ep) == 0) return 0;
+    if(matmul_is_gemv(X, W)) return matmul_gemv(X, W, c, out->ld, 1, &ep);
+    matmul_operand_init(&a, X, 0);
+    matmul_operand_init(&b, W, 0);
+    return matmul_blocked(matmul_select_kernel(), X->nrows, W->ncols,
+                          X->ncols, &a, &b,
+                          (double *)out->data + out->offset, out->ld, &ep);
+}
+
+/* tensor_linear_fused: compute the layer out = act(X * W + bias).
+ * X is m x k, W is k x n, bias is a 1 x n tensor or NULL and out must be an
+ * allocated m x n tensor. The bias and the activation are applied to each
+ * tile of the product as the GEMM microkernel stores it, so out is written
+ * once instead of once per operation. If pre is not NULL it must be an
+ * allocated m x n tensor, X * W + bias is stored in it for the backward
+ * pass. The operands can be any views of any element type, see
+ * tensor_matmul; an out or pre that is not a TENSOR_FLOAT64 tensor with
+ * unit column stride is computed in a temporary tensor and converted.
+ * out and pre must not overlap X, W or each other.
+ *
+ * It returns zero if the operation succeed.
+ * It returns non-zero value and set errno to EINVAL if X, W or out is
+ * NULL, act is not valid, the shapes do not match or the outputs overlap.
+ * It returns non-zero value and set errno to ENOMEM if the buffers cannot
+ * be allocated */
+int tensor_linear_fused(const tensor_t *X, const tensor_t *W,
+                        const tensor_t *bias, tensor_activation_t act,
+                        tensor_t *out, tensor_t *pre)
+{
+    /* NULL checking */
+    if(X == NULL || W == NULL || out == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((int)act < 0 || act >= TENSOR_NACTIVATIONS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(X->ncols != W->nrows || out->nrows != X->nrows
+       || out->ncols != W->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(bias != NULL && (bias->nrows != 1 || bias->ncols != W->ncols)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(pre != NULL && (pre->nrows != out->nrows || pre->ncols != out->ncols)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* alias checking */
+    if(matmul_overlaps(out, X) || matmul_overlaps(out, W)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(pre != NULL && (matmul_overlaps(pre, X) || matmul_overlaps(pre, W)
+                       || matmul_overlaps(pre, out))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* the bias as contiguous doubles */
+    size_t n = W->ncols;
+    double *tmp = NULL;
+    const double *b = NULL;
+    if(bias != NULL) {
+        struct matmul_operand op;
+        tmp = tensor_pool_alloc(n * sizeof(double));
+        if(tmp == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        matmul_operand_init(&op, bias, 0);
+        b = matmul_load_line(&op, 0, 0, op.cs, n, tmp);
+    }
+
+    /* outputs the epilogue can't write are computed in double first */
+    tensor_t *out64 = out, *pre64 = pre;
+    int err = 0;
+    if(!matmul_is_rowmajor_double(out)) {
+        out64 = allocate_tensor(out->nrows, out->ncols);
+        if(out64 == NULL) err = -1;
+    }
+    if(err == 0 && pre != NULL && !matmul_is_rowmajor_double(pre)) {
+        pre64 = allocate_tensor(pre->nrows, pre->ncols);
+        if(pre64 == NULL) err = -1;
+    }
+
+    if(err == 0) err = matmul_fused_double(X, W, b, act, out64, pre64);
+    if(err == 0 && out64 != out) err = tensor_convert(out64, out);
+    if(err == 0 && pre64 != pre) err = tensor_convert(pre64, pre);
+
+    if(pre64 != pre && pre64 != NULL) free_tensor(pre64);
+    if(out64 != out && out64 != NULL) free_tensor(out64);
+    tensor_pool_free(tmp);
+    return err;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_MATMUL_C_TEST
+#include <assert.h>
+#include <math.h>
+
+/* fill tensor t with small integers so every product is exact */
+static void test_fill(tensor_t *t, size_t seed)
+{
+    for(size_t i = 0; i < t->nrows; i++) {
+        for(size_t j = 0; j < t->ncols; j++) {
+            int value = (int)((i * 7 + j * 3 + seed) % 11) - 5;
+            tensor_set_value(t, i, j, value);
+        }
+    }
+}
+
+/* naive triple loop used as the reference result */
+static void test_reference(const tensor_t *A, const tensor_t *B, tensor_t *C)
+{
+    for(size_t i = 0; i < A->nrows; i++) {
+        for(size_t j = 0; j < B->ncols; j++) {
+            double sum = 0.0;
+            for(size_t p = 0; p < A->ncols; p++) {
+                double a, b;
+                tensor_get_value(*A, i, p, &a);
+                tensor_get_value(*B, p, j, &b);
+                sum += a * b;
+            }
+            tensor_set_value(C, i, j, sum);
+        }
+    }
+}
+
+static void test_shape(matmul_kernel_t kernel, size_t m, size_t n, size_t k)
+{
+    tensor_t *A = allocate_tensor(m, k);
+    tensor_t *B = allocate_tensor(k, n);
+    tensor_t *C = allocate_tensor(m, n);
+    tensor_t *R = allocate_tensor(m, n);
+    assert(A != NULL && B != NULL && C != NULL && R != NULL);
+    test_fill(A, 1);
+    test_fill(B, 4);
+    test_reference(A, B, R);
+
+    struct matmul_operand a, b;
+    matmul_operand_init(&a, A, 0);
+    matmul_operand_init(&b, B, 0);
+    int err = matmul_blocked(kernel, m, n, k, &a, &b, C->data, C->ld, NULL);
+    assert(err == 0);
+    assert(memcmp(C->data, R->data, m * C->ld * sizeof(double)) == 0);
+
+    free_tensor(R);
+    free_tensor(C);
+    free_tensor(B);
+    free_tensor(A);
+}
+
+/* test_threads: the blocked product of an m x k and a k x n tensor gives
+ * the same bits on any number of threads, also when B has to be converted
+ * as it is packed */
+static void test_threads(size_t m, size_t n, size_t k)
+{
+    tensor_t *A = allocate_tensor(m, k);
+    tensor_t *B = allocate_tensor(k, n);
+    tensor_t *Bh = allocate_typed_tensor(k, n, TENSOR_FLOAT16);
+    tensor_t *C = allocate_tensor(m, n);
+    tensor_t *D = allocate_tensor(m, n);
+    tensor_t *R = allocate_tensor(m, n);
+    for(size_t i = 0; i < m; i++) {
+        for(size_t p = 0; p < k; p++) TENSOR_AT(A, i, p) = 1.0 / (i + p + 1);
+    }
+    test_fill(B, 3);
+    tensor_convert(B, Bh);
+    test_reference(A, B, R);
+
+    size_t nthreads = parallel_get_nthreads();
+    parallel_set_nthreads(1);
+    assert(tensor_matmul(A, B, C) == 0);
+    for(size_t threads = 2; threads <= 5; threads++) {
+        parallel_set_nthreads(threads);
+        assert(tensor_matmul(A, B, D) == 0);
+        assert(memcmp(C->data, D->data, m * C->ld * sizeof(double)) == 0);
+        assert(tensor_matmul(A, Bh, D) == 0);
+        assert(memcmp(C->data, D->data, m * C->ld * sizeof(double)) == 0);
+    }
+    parallel_set_nthreads(nthreads);
+    for(size_t i = 0; i < m; i++) {
+        for(size_t j = 0; j < n; j++) {
+            double r = TENSOR_AT(R, i, j);
+            assert(fabs(TENSOR_AT(C, i, j) - r) <= 1e-12 * (1.0 + fabs(r)));
+        }
+    }
+
+    free_tensor(R);
+    free_tensor(D);
+    free_tensor(C);
+    free_tensor(Bh);
+    free_tensor(B);
+    free_tensor(A);
+}
+
+/* test_fused: tensor_linear_fused against the reference product with the
+ * bias and activation applied element by element */
+static void test_fused(size_t m, size_t n, size_t k, tensor_activation_t act)
+{
+    tensor_t *X = allocate_tensor(m, k);
+    tensor_t *W = allocate_tensor(k, n);
+    tensor_t *bias = allocate_typed_tensor(1, n, TENSOR_FLOAT32);
+    tensor_t *out = allocate_tensor(m, n);
+    tensor_t *pre = allocate_tensor(m, n);
+    tensor_t *R = allocate_tensor(m, n);
+    test_fill(X, 1);
+    test_fill(W, 4);
+    test_fill(bias, 2);
+    test_reference(X, W, R);
+    for(size_t i = 0; i < m; i++) {
+        for(size_t j = 0; j < n; j++) {
+            double b;
+            tensor_get_value(*bias, 0, j, &b);
+            TENSOR_AT(R, i, j) += b;
+        }
+    }
+
+    int err = tensor_linear_fused(X, W, bias, act, out, pre);
+    assert(err == 0);
+    for(size_t i = 0; i < m; i++) {
+        for(size_t j = 0; j < n; j++) {
+            double y;
+            assert(TENSOR_AT(pre, i, j) == TENSOR_AT(R, i, j));
+            tensor_activate_array(act, 1, &TENSOR_AT(R, i, j), &y);
+            assert(TENSOR_AT(out, i, j) == y);
+        }
+    }
+
+    free_tensor(R);
+    free_tensor(pre);
+    free_tensor(out);
+    free_tensor(bias);
+    free_tensor(W);
+    free_tensor(X);
+}
+
+/* test_gemv: a matrix-vector product through tensor_matmul. With
+ * transpose the operands are transposed views, so the matrix is stored
+ * column by column; dtype is the element type of A. */
+static void test_gemv(size_t m, size_t n, size_t k, int transpose,
+                      tensor_dtype_t dtype)
+{
+    tensor_t *A = transpose ? allocate_typed_tensor(k, m, dtype)
+                            : allocate_typed_tensor(m, k, dtype);
+    tensor_t *B = transpose ? allocate_tensor(n, k) : allocate_tensor(k, n);
+    tensor_t *C = allocate_tensor(m, n);
+    tensor_t *R = allocate_tensor(m, n);
+    tensor_t At, Bt, *a = A, *b = B;
+    if(transpose) {
+        tensor_transpose_view(A, &At);
+        tensor_transpose_view(B, &Bt);
+        a = &At;
+        b = &Bt;
+    }
+    test_fill(a, 1);
+    test_fill(b, 4);
+    test_reference(a, b, R);
+
+    int err = tensor_matmul(a, b, C);
+    assert(err == 0);
+    assert(memcmp(C->data, R->data, m * C->ld * sizeof(double)) == 0);
+
+    free_tensor(R);
+    free_tensor(C);
+    free_tensor(B);
+    free_tensor(A);
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+
+    /* edge tiles, multiple MC, KC and NC blocks */
+    size_t shapes[][3] = {
+        {1, 1, 1}, {4, 1, 3}, {6, 8, 5}, {7, 13, 9}, {13, 17, 300},
+        {150, 20, 260}, {73, 4100, 3},
+    };
+    size_t nshapes = sizeof shapes / sizeof shapes[0];
+    for(size_t s = 0; s < nshapes; s++) {
+        test_shape(matmul_kernel_generic, shapes[s][0], shapes[s][1],
+                   shapes[s][2]);
+        for(int level = CPU_SSE2; level <= (int)cpu_get_max_level();
+            level++) {
+            test_shape(matmul_kernels[level], shapes[s][0], shapes[s][1],
+                       shapes[s][2]);
+        }
+    }
+
+    /* the blocked product on several threads: blocks of rows, chunks of
+     * columns, several panels of k and of n */
+    test_threads(400, 50, 300);
+    test_threads(5, 3000, 70);
+    test_threads(150, 4100, 20);
+    test_threads(73, 200, 600);
+
+    /* the fused epilogue on every level */
+    for(int level = CPU_GENERIC; level <= (int)cpu_get_max_level(); level++) {
+        cpu_set_level((cpu_level_t)level);
+        test_fused(7, 13, 9, TENSOR_SIGMOID);
+        test_fused(150, 20, 300, TENSOR_RELU);
+        test_fused(6, 8, 5, TENSOR_IDENTITY);
+    }
+    cpu_set_level(cpu_get_max_level());
+
+    /* matrix-vector and vector-matrix products on every level, on one and
+     * on several threads */
+    size_t gemv[][3] = {
+        {1, 1, 1}, {4, 1, 3}, {1, 3, 4}, {37, 1, 5}, {1, 37, 5},
+        {300, 1, 70}, {1, 300, 70}, {5000, 1, 64}, {1, 5000, 64},
+    };
+    size_t ngemv = sizeof gemv / sizeof gemv[0];
+    size_t nthreads = parallel_get_nthreads();
+    for(int level = CPU_GENERIC; level <= (int)cpu_get_max_level(); level++) {
+        cpu_set_level((cpu_level_t)level);
+        for(size_t threads = 1; threads <= 4; threads += 3) {
+            parallel_set_nthreads(threads);
+            for(size_t s = 0; s < ngemv; s++) {
+                for(int transpose = 0; transpose < 2; transpose++) {
+                    test_gemv(gemv[s][0], gemv[s][1], gemv[s][2], transpose,
+                              TENSOR_FLOAT64);
+                }
+            }
+            test_gemv(300, 1, 70, 0, TENSOR_FLOAT16);
+            test_gemv(1, 300, 70, 1, TENSOR_FLOAT32);
+            test_fused(300, 1, 70, TENSOR_SIGMOID);
+            test_fused(1, 300, 70, TENSOR_RELU);
+            test_fused(4, 1, 3, TENSOR_IDENTITY);
+            test_fused(150, 20, 300, TENSOR_RELU);
+            test_fused(5, 3000, 70, TENSOR_SIGMOID);
+        }
+    }
+    cpu_set_level(cpu_get_max_level());
+    parallel_set_nthreads(nthreads);
+
+    /* every tiny kernel on every level against the reference, fused with
+     * the epilogue, and with an odd row stride for A */
+    for(int level = CPU_GENERIC; level <= (int)cpu_get_max_level(); level++) {
+        cpu_set_level((cpu_level_t)level);
+        for(int k = 0; k < MATMUL_TINY_NSIZES; k++) {
+            for(int n = 0; n < MATMUL_TINY_NSIZES; n++) {
+                size_t ks = matmul_tiny_sizes[k], ns = matmul_tiny_sizes[n];
+                test_gemv(1, ns, ks, 0, TENSOR_FLOAT64);
+                test_gemv(300, ns, ks, 0, TENSOR_FLOAT64);
+                test_fused(37, ns, ks, TENSOR_GELU);
+                test_fused(300, ns, ks, TENSOR_RELU);
+            }
+        }
+    }
+    cpu_set_level(cpu_get_max_level());
+
+    /* the tiny kernels give the same bits on every level */
+    tensor_t *TA = allocate_tensor(50, 17);
+    tensor_t *TB = allocate_tensor(16, 3);
+    tensor_t *TC = allocate_tensor(50, 3);
+    tensor_t *TD = allocate_tensor(50, 3);
+    tensor_t TAv;
+    for(size_t i = 0; i < 50; i++) {
+        for(size_t j = 0; j < 17; j++) TENSOR_AT(TA, i, j) = 1.0 / (i + j + 1);
+    }
+    for(size_t i = 0; i < 16; i++) {
+        for(size_t j = 0; j < 3; j++) TENSOR_AT(TB, i, j) = 0.1 * i - j / 7.0;
+    }
+    tensor_view_cols(TA, 1, 16, &TAv);
+    cpu_set_level(CPU_GENERIC);
+    err = tensor_matmul(&TAv, TB, TD);
+    assert(err == 0);
+    for(int level = CPU_SSE2; level <= (int)cpu_get_max_level(); level++) {
+        cpu_set_level((cpu_level_t)level);
+        err = tensor_matmul(&TAv, TB, TC);
+        assert(err == 0);
+        assert(memcmp(TC->data, TD->data, 50 * TC->ld * sizeof(double)) == 0);
+    }
+    cpu_set_level(cpu_get_max_level());
+    free_tensor(TD);
+    free_tensor(TC);
+    free_tensor(TB);
+    free_tensor(TA);
+
+    /* the public API */
+    tensor_t *A = allocate_tensor(4, 3);
+    tensor_t *B = allocate_tensor(3, 2);
+    tensor_t *C = allocate_tensor(4, 2);
+    test_fill(A, 2);
+    test_fill(B, 5);
+    err = tensor_matmul(A, B, C);
+    assert(err == 0);
+    tensor_t *R = allocate_tensor(4, 2);
+    test_reference(A, B, R);
+    assert(memcmp(C->data, R->data, 4 * C->ld * sizeof(double)) == 0);
+
+    /* it returns non-zero value if the shapes do not match */
+    err = tensor_matmul(A, A, C);
+    assert(err != 0);
+    assert(errno == EINVAL);
+
+    /* it returns non-zero value if one of the tensors is NULL */
+    err = tensor_matmul(NULL, B, C);
+    assert(err != 0);
+    assert(errno == EINVAL);
+
+    /* strided operands: C^T = B^T * A^T through transposed views */
+    tensor_t At, Bt, Ct;
+    tensor_t *D = allocate_tensor(2, 4);
+    tensor_transpose_view(A, &At);
+    tensor_transpose_view(B, &Bt);
+    tensor_transpose_view(D, &Ct);
+    err = tensor_matmul(&Bt, &At, D);
+    assert(err == 0);
+    for(size_t i = 0; i < 4; i++) {
+        for(size_t j = 0; j < 2; j++) {
+            double r, d;
+            tensor_get_value(*R, i, j, &r);
+            tensor_get_value(Ct, i, j, &d);
+            assert(r == d);
+        }
+    }
+
+    /* a transposed view as the output */
+    memset(D->data, 0, 2 * D->ld * sizeof(double));
+    err = tensor_matmul(A, B, &Ct);
+    assert(err == 0);
+    for(size_t i = 0; i < 4; i++) {
+        for(size_t j = 0; j < 2; j++) {
+            double r, d;
+            tensor_get_value(*R, i, j, &r);
+            tensor_get_value(Ct, i, j, &d);
+            assert(r == d);
+        }
+    }
+
+    /* row views of the same buffer: the top rows times a block of columns
+     * written to the bottom rows */
+    tensor_t *S = allocate_tensor(6, 3);
+    tensor_t top, mid, bottom, R2;
+    test_fill(S, 3);
+    tensor_view_rows(S, 0, 3, &top);
+    tensor_view_rows(S, 3, 3, &bottom);
+    tensor_view_cols(&top, 0, 3, &mid);
+    tensor_t *T = allocate_tensor(3, 3);
+    test_reference(&top, &mid, T);
+    err = tensor_matmul(&top, &mid, &bottom);
+    assert(err == 0);
+    for(size_t i = 0; i < 3; i++) {
+        for(size_t j = 0; j < 3; j++) {
+            double r, d;
+            tensor_get_value(*T, i, j, &r);
+            tensor_get_value(bottom, i, j, &d);
+            assert(r == d);
+        }
+    }
+
+    /* it returns non-zero value if the output overlaps an operand */
+    tensor_view_rows(S, 2, 3, &R2);
+    err = tensor_matmul(&top, &mid, &R2);
+    assert(err != 0);
+    assert(errno == EINVAL);
+
+    /* other element types: small integers are exact in all of them */
+    tensor_dtype_t dtypes[] = {
+        TENSOR_FLOAT32, TENSOR_FLOAT16, TENSOR_BFLOAT16, TENSOR_INT8
+    };
+    for(size_t t = 0; t < 4; t++) {
+        tensor_t *At = allocate_typed_tensor(4, 3, dtypes[t]);
+        tensor_t *Bt = allocate_typed_tensor(2, 3, TENSOR_FLOAT32);
+        tensor_t *Ct = allocate_typed_tensor(4, 2, dtypes[t]);
+        tensor_t Btt, Bttt;
+        err = tensor_convert(A, At);
+        assert(err == 0);
+        tensor_transpose_view(B, &Btt);
+        err = tensor_convert(&Btt, Bt);
+        assert(err == 0);
+        /* B as a strided view of float32 elements */
+        tensor_transpose_view(Bt, &Bttt);
+        err = tensor_matmul(At, &Bttt, Ct);
+        assert(err == 0);
+        for(size_t i = 0; i < 4; i++) {
+            for(size_t j = 0; j < 2; j++) {
+                double r, d;
+                tensor_get_value(*R, i, j, &r);
+                tensor_get_value(*Ct, i, j, &d);
+                assert(r == d);
+            }
+        }
+        free_tensor(Ct);
+        free_tensor(Bt);
+        free_tensor(At);
+    }
+
+    /* a typed operand wider than one packing block */
+    tensor_t *W = allocate_tensor(5, 300);
+    tensor_t *Wh = allocate_typed_tensor(5, 300, TENSOR_FLOAT16);
+    tensor_t *V = allocate_tensor(300, 9);
+    tensor_t *P = allocate_tensor(5, 9);
+    tensor_t *Q = allocate_tensor(5, 9);
+    test_fill(W, 2);
+    test_fill(V, 6);
+    tensor_convert(W, Wh);
+    test_reference(W, V, P);
+    err = tensor_matmul(Wh, V, Q);
+    assert(err == 0);
+    assert(memcmp(P->data, Q->data, 5 * P->ld * sizeof(double)) == 0);
+    free_tensor(Q);
+    free_tensor(P);
+    free_tensor(V);
+    free_tensor(Wh);
+    free_tensor(W);
+
+    /* fused layer without bias into a transposed float32 output, and
+     * without pre-activations */
+    tensor_t *F = allocate_typed_tensor(2, 4, TENSOR_FLOAT32);
+    tensor_t Ft;
+    tensor_transpose_view(F, &Ft);
+    err = tensor_linear_fused(A, B, NULL, TENSOR_RELU, &Ft, NULL);
+    assert(err == 0);
+    for(size_t i = 0; i < 4; i++) {
+        for(size_t j = 0; j < 2; j++) {
+            double r, d;
+            tensor_get_value(*R, i, j, &r);
+            tensor_get_value(Ft, i, j, &d);
+            assert(d == (r > 0.0 ? r : 0.0));
+        }
+    }
+
+    /* it returns non-zero value if the bias, pre or act is not valid */
+    err = tensor_linear_fused(A, B, A, TENSOR_RELU, C, NULL);
+    assert(err != 0);
+    assert(errno == EINVAL);
+    err = tensor_linear_fused(A, B, NULL, TENSOR_RELU, C, D);
+    assert(err != 0);
+    assert(errno == EINVAL);
+    err = tensor_linear_fused(A, B, NULL, TENSOR_NACTIVATIONS, C, NULL);
+    assert(err != 0);
+    assert(errno == EINVAL);
+    err = tensor_linear_fused(A, B, NULL, TENSOR_RELU, C, C);
+    assert(err != 0);
+    assert(errno == EINVAL);
+    free_tensor(F);
+
+    free_tensor(T);
+    free_tensor(S);
+    free_tensor(D);
+    free_tensor(R);
+    free_tensor(C);
+    free_tensor(B);
+    free_tensor(A);
+}
+#endif
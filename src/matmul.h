@@ -0,0 +1,31 @@
+/* matmul - Matrix multiplication of tensors
+ * The product is computed by a cache-blocked GEMM: the operands are packed
+ * into contiguous panels sized for the L1, L2 and L3 caches and a small
+ * register-blocked microkernel computes the output tile by tile. Large
+ * products are split across threads: they pack each panel of B together
+ * and share it in L3, and each thread multiplies it with blocks of A
+ * packed into its own buffer in L2.
+ * tensor_linear_fused adds the bias and the activation of a layer to each
+ * tile as it is stored, while it is still in cache.
+ *
+ * Products where B has one column or A has one row don't go through the
+ * GEMM: they are bound by the bandwidth of reading the matrix, so they run
+ * on GEMV kernels that stream it once and are split across threads over
+ * its rows. Tiny layers, where B is K x N with K and N in {1, 2, 3, 4, 8,
+ * 16, 32}, have fully unrolled kernels generated for their shape.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_MATMUL_H
+#define SIMPLE_NN_MATMUL_H
+
+#include "tensor.h"
+#include "activation.h"
+
+int tensor_matmul(const tensor_t *A, const tensor_t *B, tensor_t *C);
+int tensor_linear_fused(const tensor_t *X, const tensor_t *W,
+                        const tensor_t *bias, tensor_activation_t act,
+                        tensor_t *out, tensor_t *pre);
+
+#endif
@@ -0,0 +1,553 @@
+/* network - Multilayer perceptrons and their gradients
+ * The forward pass of every layer is one tensor_linear_fused call, which
+ * also keeps the pre-activations Z_l = A_(l-1) * W_l + b_l for the backward
+ * pass. The backward pass goes from the gradient G_L of the loss with
+ * respect to the logits down to the first layer:
+ *
+ *   D_l = G_l .* act_l'(Z_l)
+ *   dW_l = A_(l-1)^T * D_l,  db_l = sum of the rows of D_l
+ *   G_(l-1) = D_l * W_l^T
+ *
+ * The intermediate tensors of both passes come from the arena of the
+ * caller, so a training step allocates nothing once the arena is warm.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+
+#include "tensor.h"
+#include "activation.h"
+#include "arena.h"
+#include "matmul.h"
+#include "loss.h"
+#include "reduce.h"
+#include "ops.h"
+#include "rng.h"
+#include "network.h"
+
+/* allocate_network: Allocate new network on the heap with nlayers dense
+ * layers. Layer l has sizes[l] inputs, sizes[l + 1] outputs and the
+ * activation acts[l], so sizes holds nlayers + 1 sizes. The weights are
+ * drawn uniformly in [-a, a] with a = sqrt(6 / (inputs + outputs)) from
+ * rng, which must be a RNG_UNIFORM generator, and the biases are zero.
+ *
+ * It returns NULL and set errno to EINVAL if nlayers is zero, sizes or acts
+ * is NULL, a size is zero or an activation is not valid.
+ * It returns NULL and set errno to ENOMEM if the allocation fails.
+ * It returns pointer to new allocated network_t if success. */
+network_t *allocate_network(size_t nlayers, const size_t *sizes,
+                            const tensor_activation_t *acts, rng_t rng)
+{
+    /* NULL checking */
+    if(nlayers == 0 || sizes == NULL || acts == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* shape checking */
+    for(size_t l = 0; l < nlayers; l++) {
+        if(sizes[l] == 0 || sizes[l + 1] == 0
+           || (int)acts[l] < 0 || acts[l] >= TENSOR_NACTIVATIONS) {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    network_t *net = malloc(sizeof *net);
+    if(net == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    net->layers = calloc(nlayers, sizeof *net->layers);
+    if(net->layers == NULL) {
+        free(net);
+        errno = ENOMEM;
+        return NULL;
+    }
+    net->nlayers = nlayers;
+
+    for(size_t l = 0; l < nlayers; l++) {
+        struct network_layer *layer = &net->layers[l];
+        layer->act = acts[l];
+        layer->W = allocate_tensor(sizes[l], sizes[l + 1]);
+        layer->b = allocate_tensor(1, sizes[l + 1]);
+        if(layer->W == NULL || layer->b == NULL) {
+            free_network(net);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        double a = sqrt(6.0 / (double)(sizes[l] + sizes[l + 1]));
+        for(size_t i = 0; i < sizes[l]; i++) {
+            for(size_t j = 0; j < sizes[l + 1]; j++) {
+                double u;
+                if(rng_get_random_value(rng, &u) != 0) {
+                    free_network(net);
+                    errno = EINVAL;
+                    return NULL;
+                }
+                TENSOR_AT(layer->W, i, j) = (2.0 * u - 1.0) * a;
+            }
+        }
+    }
+    return net;
+}
+
+/* free_network: Free the layers of net and net itself.
+ * It does nothing if net is NULL */
+void free_network(network_t *net)
+{
+    if(net == NULL) return;
+    for(size_t l = 0; l < net->nlayers; l++) {
+        free_tensor(net->layers[l].W);
+        free_tensor(net->layers[l].b);
+    }
+    free(net->layers);
+    free(net);
+}
+
+/* allocate_network_grads: Allocate zeroed gradients for the parameters of
+ * net. Every gradient is a tensor of its own, so the rows of two gradients
+ * never share a cache line.
+ *
+ * It returns NULL and set errno to EINVAL if net is NULL.
+ * It returns NULL and set errno to ENOMEM if the allocation fails.
+ * It returns pointer to new allocated network_grads_t if success. */
+network_grads_t *allocate_network_grads(const network_t *net)
+{
+    /* NULL checking */
+    if(net == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    network_grads_t *grads = malloc(sizeof *grads);
+    if(grads == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    grads->nlayers = net->nlayers;
+    grads->dW = calloc(net->nlayers, sizeof *grads->dW);
+    grads->db = calloc(net->nlayers, sizeof *grads->db);
+    if(grads->dW == NULL || grads->db == NULL) {
+        free_network_grads(grads);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for(size_t l = 0; l < net->nlayers; l++) {
+        const struct network_layer *layer = &net->layers[l];
+        grads->dW[l] = allocate_tensor(layer->W->nrows, layer->W->ncols);
+        grads->db[l] = allocate_tensor(1, layer->b->ncols);
+        if(grads->dW[l] == NULL || grads->db[l] == NULL) {
+            free_network_grads(grads);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    return grads;
+}
+
+/* free_network_grads: Free the gradients in grads and grads itself.
+ * It does nothing if grads is NULL */
+void free_network_grads(network_grads_t *grads)
+{
+    if(grads == NULL) return;
+    for(size_t l = 0; l < grads->nlayers; l++) {
+        if(grads->dW != NULL) free_tensor(grads->dW[l]);
+        if(grads->db != NULL) free_tensor(grads->db[l]);
+    }
+    free(grads->dW);
+    free(grads->db);
+    free(grads);
+}
+
+/* network_check_input: check that the rows of X are inputs of net */
+static int network_check_input(const network_t *net, const tensor_t *X)
+{
+    return X->ncols == net->layers[0].W->nrows;
+}
+
+/* network_forward: Compute the outputs of the last layer of net for every
+ * row of X and store them in out. X must be an m x sizes[0] tensor and out
+ * an allocated m x sizes[nlayers] tensor.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if net, X or out is
+ * NULL or the shapes do not match
+ * It returns non-zero value and set errno to ENOMEM if the activations
+ * cannot be allocated */
+int network_forward(const network_t *net, const tensor_t *X, tensor_t *out)
+{
+    /* NULL checking */
+    if(net == NULL || X == NULL || out == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    const tensor_t *last = net->layers[net->nlayers - 1].W;
+    if(!network_check_input(net, X) || out->nrows != X->nrows
+       || out->ncols != last->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const tensor_t *A = X;
+    tensor_t *prev = NULL;
+    int err = 0;
+    for(size_t l = 0; l < net->nlayers && err == 0; l++) {
+        const struct network_layer *layer = &net->layers[l];
+        tensor_t *next = out;
+        if(l + 1 < net->nlayers) {
+            next = allocate_tensor(X->nrows, layer->W->ncols);
+            if(next == NULL) {
+                errno = ENOMEM;
+                err = -1;
+                break;
+            }
+        }
+        err = tensor_linear_fused(A, layer->W, layer->b, layer->act, next,
+                                  NULL);
+        if(prev != NULL) free_tensor(prev);
+        prev = next != out ? next : NULL;
+        A = next;
+    }
+    if(prev != NULL) free_tensor(prev);
+    return err;
+}
+
+/* network_backward: Compute the softmax cross-entropy of the outputs of net
+ * for the rows of X against labels and its gradient with respect to the
+ * parameters of net. The gradients of the sum of the losses of the rows are
+ * stored in grads and the sum itself in loss, which can be NULL; divide
+ * both by the number of rows for the mean. The intermediate tensors are
+ * allocated from arena, the caller resets it.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if net, X, labels,
+ * arena or grads is NULL, the shapes do not match or a label is out of
+ * range
+ * It returns non-zero value and set errno to ENOMEM if the intermediate
+ * tensors cannot be allocated */
+int network_backward(const network_t *net, const tensor_t *X,
+                     const size_t *labels, tensor_arena_t *arena,
+                     network_grads_t *grads, double *loss)
+{
+    /* NULL checking */
+    if(net == NULL || X == NULL || labels == NULL || arena == NULL
+       || grads == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(!network_check_input(net, X) || grads->nlayers != net->nlayers) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t m = X->nrows;
+    size_t L = net->nlayers;
+    tensor_t **Z = calloc(2 * L + 1, sizeof *Z);
+    if(Z == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    tensor_t **A = Z + L; // A[0] is X, A[l + 1] the outputs of layer l
+
+    int err = 0;
+    A[0] = (tensor_t *)X;
+    for(size_t l = 0; l < L && err == 0; l++) {
+        size_t n = net->layers[l].W->ncols;
+        Z[l] = tensor_arena_allocate(arena, m, n, TENSOR_FLOAT64);
+        A[l + 1] = tensor_arena_allocate(arena, m, n, TENSOR_FLOAT64);
+        if(Z[l] == NULL || A[l + 1] == NULL) {
+            errno = ENOMEM;
+            err = -1;
+            break;
+        }
+        err = tensor_linear_fused(A[l], net->layers[l].W, net->layers[l].b,
+                                  net->layers[l].act, A[l + 1], Z[l]);
+    }
+
+    /* the gradient of the logits, G_L, replaces the logits */
+    double mean = 0.0;
+    if(err == 0) {
+        err = tensor_softmax_cross_entropy(A[L], labels, &mean, A[L]);
+    }
+    if(err == 0 && loss != NULL) *loss = mean * (double)m;
+
+    tensor_t *G = A[L];
+    for(size_t l = L; l-- > 0 && err == 0;) {
+        const struct network_layer *layer = &net->layers[l];
+
+        /* D_l = G_l .* act_l'(Z_l), Z_l is not needed anymore */
+        if(layer->act != TENSOR_IDENTITY) {
+            err = tensor_activate_derivative(layer->act, Z[l], Z[l]);
+            if(err == 0) err = tensor_mul(G, Z[l], G);
+            if(err != 0) break;
+        }
+
+        tensor_t At;
+        tensor_transpose_view(A[l], &At);
+        err = tensor_matmul(&At, G, grads->dW[l]);
+        if(err == 0) err = tensor_sum_cols(G, grads->db[l]);
+        if(err != 0 || l == 0) break;
+
+        tensor_t Wt;
+        tensor_transpose_view(layer->W, &Wt);
+        tensor_t *prev = tensor_arena_allocate(arena, m, layer->W->nrows,
+                                               TENSOR_FLOAT64);
+        if(prev == NULL) {
+            errno = ENOMEM;
+            err = -1;
+            break;
+        }
+        err = tensor_matmul(G, &Wt, prev);
+        G = prev;
+    }
+
+    free(Z);
+    return err;
+}
+
+/* network_update: Add alpha times the gradients in grads to the parameters
+ * of net, a step of gradient descent for a negative alpha.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if net or grads is
+ * NULL or their shapes do not match */
+int network_update(network_t *net, const network_grads_t *grads,
+                   double alpha)
+{
+    /* NULL checking */
+    if(net == NULL || grads == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(grads->nlayers != net->nlayers) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(size_t l = 0; l < net->nlayers; l++) {
+        int err = tensor_axpy(alpha, grads->dW[l], net->layers[l].W);
+        if(err == 0) err = tensor_axpy(alpha, grads->db[l], net->layers[l].b);
+        if(err != 0) return err;
+    }
+    return 0;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_NETWORK_C_TEST
+#include <assert.h>
+
+/* test_fill: pseudo random inputs in [-1, 1) and labels */
+static void test_fill(tensor_t *X, size_t *labels, size_t nclasses,
+                      unsigned seed)
+{
+    for(size_t i = 0; i < X->nrows; i++) {
+        for(size_t j = 0; j < X->ncols; j++) {
+            seed = seed * 1103515245u + 12345u;
+            TENSOR_AT(X, i, j) = (double)(seed >> 8) / (1 << 23) - 1.0;
+        }
+        seed = seed * 1103515245u + 12345u;
+        labels[i] = (seed >> 8) % nclasses;
+    }
+}
+
+/* test_loss: sum of the losses of the rows of X computed by the forward
+ * pass */
+static double test_loss(const network_t *net, const tensor_t *X,
+                        const size_t *labels, size_t nclasses)
+{
+    double mean;
+    tensor_t *out = allocate_tensor(X->nrows, nclasses);
+    assert(out != NULL);
+    assert(network_forward(net, X, out) == 0);
+    assert(tensor_softmax_cross_entropy(out, labels, &mean, NULL) == 0);
+    free_tensor(out);
+    return mean * (double)X->nrows;
+}
+
+/* test_check: compare the gradient of the parameter p with central
+ * differences */
+static void test_check(network_t *net, tensor_t *p, const tensor_t *dp,
+                       const tensor_t *X, const size_t *labels,
+                       size_t nclasses)
+{
+    const double h = 1e-6;
+    for(size_t i = 0; i < p->nrows; i++) {
+        for(size_t j = 0; j < p->ncols; j++) {
+            double v = TENSOR_AT(p, i, j);
+            TENSOR_AT(p, i, j) = v + h;
+            double up = test_loss(net, X, labels, nclasses);
+            TENSOR_AT(p, i, j) = v - h;
+            double down = test_loss(net, X, labels, nclasses);
+            TENSOR_AT(p, i, j) = v;
+            double fd = (up - down) / (2.0 * h);
+            double g = TENSOR_AT(dp, i, j);
+            assert(fabs(fd - g) <= 1e-6 * (1.0 + fabs(g)));
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    double loss, loss2;
+
+    rng_t *rng = allocate_rng(RNG_UNIFORM);
+    assert(rng != NULL);
+
+    size_t sizes[4] = {5, 7, 6, 3};
+    tensor_activation_t acts[3] = {TENSOR_TANH, TENSOR_GELU,
+                                   TENSOR_IDENTITY};
+    network_t *net = allocate_network(3, sizes, acts, *rng);
+    assert(net != NULL);
+    assert(net->nlayers == 3);
+    for(size_t l = 0; l < 3; l++) {
+        const tensor_t *W = net->layers[l].W;
+        double a = sqrt(6.0 / (double)(sizes[l] + sizes[l + 1]));
+        assert(W->nrows == sizes[l] && W->ncols == sizes[l + 1]);
+        assert(net->layers[l].b->ncols == sizes[l + 1]);
+        for(size_t i = 0; i < W->nrows; i++) {
+            for(size_t j = 0; j < W->ncols; j++) {
+                assert(fabs(TENSOR_AT(W, i, j)) <= a);
+            }
+        }
+    }
+    /* the biases start at zero, move them for the checks */
+    for(size_t l = 0; l < 3; l++) {
+        for(size_t j = 0; j < sizes[l + 1]; j++) {
+            TENSOR_AT(net->layers[l].b, 0, j) = 0.1 * (double)j - 0.2;
+        }
+    }
+
+    size_t m = 9;
+    size_t labels[9];
+    tensor_t *X = allocate_tensor(m, 5);
+    assert(X != NULL);
+    test_fill(X, labels, 3, 7);
+
+    tensor_arena_t *arena = allocate_tensor_arena(1 << 12);
+    network_grads_t *grads = allocate_network_grads(net);
+    assert(arena != NULL && grads != NULL);
+
+    /* the gradients against central differences of the forward pass */
+    err = network_backward(net, X, labels, arena, grads, &loss);
+    assert(err == 0);
+    assert(fabs(loss - test_loss(net, X, labels, 3)) <= 1e-12 * loss);
+    for(size_t l = 0; l < 3; l++) {
+        test_check(net, net->layers[l].W, grads->dW[l], X, labels, 3);
+        test_check(net, net->layers[l].b, grads->db[l], X, labels, 3);
+    }
+
+    /* the gradients of two parts of the batch add up to the gradient of
+     * the batch */
+    network_grads_t *part = allocate_network_grads(net);
+    network_grads_t *rest = allocate_network_grads(net);
+    assert(part != NULL && rest != NULL);
+    tensor_t top, bottom;
+    tensor_view_rows(X, 0, 4, &top);
+    tensor_view_rows(X, 4, m - 4, &bottom);
+    tensor_arena_reset(arena);
+    err = network_backward(net, &top, labels, arena, part, &loss2);
+    assert(err == 0);
+    double loss3;
+    err = network_backward(net, &bottom, labels + 4, arena, rest, &loss3);
+    assert(err == 0);
+    assert(fabs(loss2 + loss3 - loss) <= 1e-12 * loss);
+    for(size_t l = 0; l < 3; l++) {
+        const tensor_t *dW = grads->dW[l];
+        for(size_t i = 0; i < dW->nrows; i++) {
+            for(size_t j = 0; j < dW->ncols; j++) {
+                double sum = TENSOR_AT(part->dW[l], i, j)
+                             + TENSOR_AT(rest->dW[l], i, j);
+                assert(fabs(sum - TENSOR_AT(dW, i, j)) <= 1e-12);
+            }
+        }
+        for(size_t j = 0; j < grads->db[l]->ncols; j++) {
+            double sum = TENSOR_AT(part->db[l], 0, j)
+                         + TENSOR_AT(rest->db[l], 0, j);
+            assert(fabs(sum - TENSOR_AT(grads->db[l], 0, j)) <= 1e-12);
+        }
+    }
+
+    /* a step of gradient descent */
+    double w = TENSOR_AT(net->layers[1].W, 2, 3);
+    double b = TENSOR_AT(net->layers[2].b, 0, 1);
+    err = network_update(net, grads, -0.5);
+    assert(err == 0);
+    assert(TENSOR_AT(net->layers[1].W, 2, 3)
+           == w - 0.5 * TENSOR_AT(grads->dW[1], 2, 3));
+    assert(TENSOR_AT(net->layers[2].b, 0, 1)
+           == b - 0.5 * TENSOR_AT(grads->db[2], 0, 1));
+
+    /* a few steps reduce the loss */
+    for(int step = 0; step < 20; step++) {
+        tensor_arena_reset(arena);
+        err = network_backward(net, X, labels, arena, grads, &loss2);
+        assert(err == 0);
+        err = network_update(net, grads, -0.1 / (double)m);
+        assert(err == 0);
+    }
+    assert(test_loss(net, X, labels, 3) < loss);
+
+    /* the loss can be omitted */
+    tensor_arena_reset(arena);
+    err = network_backward(net, X, labels, arena, grads, NULL);
+    assert(err == 0);
+
+    /* invalid arguments */
+    size_t bad_sizes[3] = {5, 0, 3};
+    tensor_activation_t bad_acts[2] = {TENSOR_NACTIVATIONS, TENSOR_TANH};
+    assert(allocate_network(0, sizes, acts, *rng) == NULL);
+    assert(errno == EINVAL);
+    assert(allocate_network(2, bad_sizes, acts, *rng) == NULL);
+    assert(errno == EINVAL);
+    assert(allocate_network(2, sizes, bad_acts, *rng) == NULL);
+    assert(errno == EINVAL);
+    assert(allocate_network(2, NULL, acts, *rng) == NULL);
+    assert(errno == EINVAL);
+    assert(allocate_network_grads(NULL) == NULL);
+    assert(errno == EINVAL);
+
+    tensor_t *out = allocate_tensor(m, 3);
+    tensor_t *Y = allocate_tensor(m, 4);
+    assert(out != NULL && Y != NULL);
+    assert(network_forward(net, X, NULL) != 0 && errno == EINVAL);
+    assert(network_forward(net, Y, out) != 0 && errno == EINVAL);
+    assert(network_forward(net, X, Y) != 0 && errno == EINVAL);
+    assert(network_backward(net, X, NULL, arena, grads, &loss) != 0);
+    assert(errno == EINVAL);
+    assert(network_backward(net, Y, labels, arena, grads, &loss) != 0);
+    assert(errno == EINVAL);
+    assert(network_backward(net, X, labels, NULL, grads, &loss) != 0);
+    assert(errno == EINVAL);
+    labels[3] = 3;
+    assert(network_backward(net, X, labels, arena, grads, &loss) != 0);
+    assert(errno == EINVAL);
+    assert(network_update(NULL, grads, 1.0) != 0 && errno == EINVAL);
+
+    free_network(NULL);
+    free_network_grads(NULL);
+    free_tensor(out);
+    free_tensor(Y);
+    free_tensor(X);
+    free_network_grads(part);
+    free_network_grads(rest);
+    free_network_grads(grads);
+    free_tensor_arena(arena);
+    free_network(net);
+    free_rng(rng);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,58 @@
+/* network - Multilayer perceptrons and their gradients
+ * A network is a stack of dense layers, layer l computes
+ *
+ *   A_l = act_l(A_(l-1) * W_l + b_l)
+ *
+ * from the inputs A_0 = X. The outputs of the last layer are the logits of
+ * the classes, trained with tensor_softmax_cross_entropy of loss.h.
+ *
+ * The gradients are the gradients of the sum of the losses of the rows,
+ * not of their mean, so the gradients of the parts of a batch add up to
+ * the gradient of the batch.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_NETWORK_H
+#define SIMPLE_NN_NETWORK_H
+
+#include "tensor.h"
+#include "activation.h"
+#include "arena.h"
+#include "rng.h"
+
+struct network_layer {
+    tensor_t *W; // ninputs x noutputs weights
+    tensor_t *b; // 1 x noutputs bias
+    tensor_activation_t act;
+};
+
+struct network {
+    size_t nlayers;
+    struct network_layer *layers;
+};
+typedef struct network network_t;
+
+/* The gradients of the parameters of a network, dW[l] and db[l] have the
+ * shapes of the weights and the bias of layer l */
+struct network_grads {
+    size_t nlayers;
+    tensor_t **dW;
+    tensor_t **db;
+};
+typedef struct network_grads network_grads_t;
+
+network_t *allocate_network(size_t nlayers, const size_t *sizes,
+                            const tensor_activation_t *acts, rng_t rng);
+void free_network(network_t *net);
+network_grads_t *allocate_network_grads(const network_t *net);
+void free_network_grads(network_grads_t *grads);
+
+int network_forward(const network_t *net, const tensor_t *X, tensor_t *out);
+int network_backward(const network_t *net, const tensor_t *X,
+                     const size_t *labels, tensor_arena_t *arena,
+                     network_grads_t *grads, double *loss);
+int network_update(network_t *net, const network_grads_t *grads,
+                   double alpha);
+
+#endif
@@ -0,0 +1,627 @@
+/* ops - Elementwise arithmetic on tensors
+ * The operations work on tensors of any element type and strides. Rows of
+ * float64 elements with unit column stride are processed in place with
+ * SIMD kernels picked for the CPU, other rows go through double buffers.
+ * Large tensors are split across threads.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "tensor.h"
+#include "ops.h"
+#include "cpu.h"
+#include "parallel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OPS_X86 1
+#include <immintrin.h>
+#endif
+
+/* Elements per piece of a parallel loop, smaller tensors stay on the
+ * calling thread */
+#define OPS_GRAIN 32768
+/* Elements converted at once for rows that are not float64 */
+#define OPS_CHUNK 256
+
+enum ops_op {
+    OPS_ADD,
+    OPS_SUB,
+    OPS_MUL,
+    OPS_DIV,
+    OPS_SCALE, // c = alpha * a
+    OPS_AXPY, // c = c + alpha * a
+    OPS_MAP // c = fn(a)
+};
+
+/* ops_binary_t: c = a op b for n elements */
+typedef void (*ops_binary_t)(size_t n, const double *a, const double *b,
+                             double *c);
+/* ops_scalar_t: c = alpha * a or c = c + alpha * a for n elements */
+typedef void (*ops_scalar_t)(size_t n, double alpha, const double *a,
+                             double *c);
+
+struct ops_kernels {
+    ops_binary_t binary[4]; // indexed by OPS_ADD ... OPS_DIV
+    ops_scalar_t scale;
+    ops_scalar_t axpy;
+};
+
+/* Generic kernels */
+#define OPS_GENERIC_BINARY(name, op)                                    \
+    static void ops_##name##_generic(size_t n, const double *a,         \
+                                     const double *b, double *c)        \
+    {                                                                   \
+        for(size_t i = 0; i < n; i++) c[i] = a[i] op b[i];              \
+    }
+
+OPS_GENERIC_BINARY(add, +)
+OPS_GENERIC_BINARY(sub, -)
+OPS_GENERIC_BINARY(mul, *)
+OPS_GENERIC_BINARY(div, /)
+
+static void ops_scale_generic(size_t n, double alpha, const double *a,
+                              double *c)
+{
+    for(size_t i = 0; i < n; i++) c[i] = alpha * a[i];
+}
+
+static void ops_axpy_generic(size_t n, double alpha, const double *a,
+                             double *c)
+{
+    for(size_t i = 0; i < n; i++) c[i] = c[i] + alpha * a[i];
+}
+
+#ifdef OPS_X86
+/* ops_head: Number of elements before c is aligned to a vector of width
+ * doubles, so the vector loop can use aligned stores */
+static size_t ops_head(const double *c, size_t width, size_t n)
+{
+    size_t misalign = ((uintptr_t)c / sizeof(double)) % width;
+    size_t head = misalign > 0 ? width - misalign : 0;
+    return head < n ? head : n;
+}
+
+/* SIMD kernels of one level: pfx is the intrinsic prefix (_mm, _mm256,
+ * _mm512) and width the doubles per vector. The head and tail elements
+ * use the scalar expression. Multiply and add are never fused so every
+ * level gives the same results. */
+#define OPS_SIMD_BINARY(name, level, isa, width, pfx, op)               \
+    __attribute__((target(isa)))                                        \
+    static void ops_##name##_##level(size_t n, const double *a,         \
+                                     const double *b, double *c)        \
+    {                                                                   \
+        size_t i = ops_head(c, width, n);                               \
+        for(size_t j = 0; j < i; j++) c[j] = a[j] op b[j];              \
+        for(; i + width <= n; i += width) {                             \
+            pfx##_store_pd(c + i, pfx##_##name##_pd(pfx##_loadu_pd(a + i), \
+                                                    pfx##_loadu_pd(b + i))); \
+        }                                                               \
+        for(; i < n; i++) c[i] = a[i] op b[i];                          \
+    }
+
+#define OPS_SIMD_SCALAR(level, isa, width, pfx)                         \
+    __attribute__((target(isa)))                                        \
+    static void ops_scale_##level(size_t n, double alpha, const double *a, \
+                                  double *c)                            \
+    {                                                                   \
+        size_t i = ops_head(c, width, n);                               \
+        for(size_t j = 0; j < i; j++) c[j] = alpha * a[j];              \
+        for(; i + width <= n; i += width) {                             \
+            pfx##_store_pd(c + i, pfx##_mul_pd(pfx##_set1_pd(alpha),    \
+                                               pfx##_loadu_pd(a + i))); \
+        }                                                               \
+        for(; i < n; i++) c[i] = alpha * a[i];                          \
+    }                                                                   \
+                                                                        \
+    __attribute__((target(isa)))                                        \
+    static void ops_axpy_##level(size_t n, double alpha, const double *a, \
+                                 double *c)                             \
+    {                                                                   \
+        size_t i = ops_head(c, width, n);                               \
+        for(size_t j = 0; j < i; j++) c[j] = c[j] + alpha * a[j];       \
+        for(; i + width <= n; i += width) {                             \
+            pfx##_store_pd(c + i, pfx##_add_pd(                         \
+                pfx##_load_pd(c + i),                                   \
+                pfx##_mul_pd(pfx##_set1_pd(alpha), pfx##_loadu_pd(a + i)))); \
+        }                                                               \
+        for(; i < n; i++) c[i] = c[i] + alpha * a[i];                   \
+    }
+
+#define OPS_SIMD_KERNELS(level, isa, width, pfx)                        \
+    OPS_SIMD_BINARY(add, level, isa, width, pfx, +)                     \
+    OPS_SIMD_BINARY(sub, level, isa, width, pfx, -)                     \
+    OPS_SIMD_BINARY(mul, level, isa, width, pfx, *)                     \
+    OPS_SIMD_BINARY(div, level, isa, width, pfx, /)                     \
+    OPS_SIMD_SCALAR(level, isa, width, pfx)
+
+OPS_SIMD_KERNELS(sse2, "sse2", 2, _mm)
+OPS_SIMD_KERNELS(avx2, "avx2", 4, _mm256)
+OPS_SIMD_KERNELS(avx512, "avx512f", 8, _mm512)
+
+#define OPS_LEVEL_KERNELS(level)                                        \
+    {                                                                   \
+        {ops_add_##level, ops_sub_##level, ops_mul_##level,             \
+         ops_div_##level},                                              \
+        ops_scale_##level, ops_axpy_##level                             \
+    }
+
+/* Kernels of every cpu_level_t */
+static const struct ops_kernels ops_kernels[CPU_NLEVELS] = {
+    OPS_LEVEL_KERNELS(generic), OPS_LEVEL_KERNELS(sse2),
+    OPS_LEVEL_KERNELS(avx2), OPS_LEVEL_KERNELS(avx512)
+};
+#else
+static const struct ops_kernels ops_kernels[CPU_NLEVELS] = {
+    {{ops_add_generic, ops_sub_generic, ops_mul_generic, ops_div_generic},
+     ops_scale_generic, ops_axpy_generic},
+    {{ops_add_generic, ops_sub_generic, ops_mul_generic, ops_div_generic},
+     ops_scale_generic, ops_axpy_generic},
+    {{ops_add_generic, ops_sub_generic, ops_mul_generic, ops_div_generic},
+     ops_scale_generic, ops_axpy_generic},
+    {{ops_add_generic, ops_sub_generic, ops_mul_generic, ops_div_generic},
+     ops_scale_generic, ops_axpy_generic}
+};
+#endif
+
+/* One elementwise operation. The tensors are copies of the operands so
+ * contiguous ones can be reshaped into a single long row. */
+struct ops_task {
+    enum ops_op op;
+    const struct ops_kernels *kernels;
+    tensor_t a;
+    tensor_t b; // only used by the binary operations
+    tensor_t c;
+    int broadcast; // b is one row added to every row of a
+    double alpha;
+    tensor_map_fn_t fn; // function of OPS_MAP
+    void *ctx;
+};
+
+/* ops_direct: check whether the rows of t can be handed to the kernels */
+static int ops_direct(const tensor_t *t)
+{
+    return t->dtype == TENSOR_FLOAT64 && (t->col_stride == 1 || t->ncols == 1);
+}
+
+static double *ops_at(const tensor_t *t, size_t i, size_t j)
+{
+    return (double *)t->data + t->offset + i * t->ld + j * t->col_stride;
+}
+
+/* ops_load: convert n elements of the row i of t, from column j, to
+ * doubles */
+static void ops_load(const tensor_t *t, size_t i, size_t j, size_t n,
+                     double *buf)
+{
+    size_t elsize = tensor_dtype_size(t->dtype);
+    const char *src = (const char *)t->data
+                      + (t->offset + i * t->ld + j * t->col_stride) * elsize;
+    if(t->col_stride == 1) {
+        tensor_convert_array(src, t->dtype, buf, TENSOR_FLOAT64, n);
+        return;
+    }
+    for(size_t k = 0; k < n; k++) {
+        tensor_convert_array(src + k * t->col_stride * elsize, t->dtype,
+                             buf + k, TENSOR_FLOAT64, 1);
+    }
+}
+
+/* ops_store: convert n doubles to the row i of t, from column j */
+static void ops_store(const tensor_t *t, size_t i, size_t j, size_t n,
+                      const double *buf)
+{
+    size_t elsize = tensor_dtype_size(t->dtype);
+    char *dst = (char *)t->data
+                + (t->offset + i * t->ld + j * t->col_stride) * elsize;
+    if(t->col_stride == 1) {
+        tensor_convert_array(buf, TENSOR_FLOAT64, dst, t->dtype, n);
+        return;
+    }
+    for(size_t k = 0; k < n; k++) {
+        tensor_convert_array(buf + k, TENSOR_FLOAT64,
+                             dst + k * t->col_stride * elsize, t->dtype, 1);
+    }
+}
+
+/* ops_segment: apply the operation to n elements of the row i, from
+ * column j */
+static void ops_segment(const struct ops_task *task, size_t i, size_t j,
+                        size_t n)
+{
+    double abuf[OPS_CHUNK], bbuf[OPS_CHUNK], cbuf[OPS_CHUNK];
+    int binary = task->op < OPS_SCALE;
+    int direct_a = ops_direct(&task->a);
+    int direct_b = !binary || ops_direct(&task->b);
+    int direct_c = ops_direct(&task->c);
+    size_t bi = task->broadcast ? 0 : i;
+    size_t chunk = direct_a && direct_b && direct_c ? n : OPS_CHUNK;
+
+    for(size_t done = 0; done < n; done += chunk) {
+        size_t len = n - done < chunk ? n - done : chunk;
+        size_t col = j + done;
+
+        const double *a = abuf, *b = bbuf;
+        double *c = cbuf;
+        if(direct_a) a = ops_at(&task->a, i, col);
+        else ops_load(&task->a, i, col, len, abuf);
+        if(binary && direct_b) b = ops_at(&task->b, bi, col);
+        else if(binary) ops_load(&task->b, bi, col, len, bbuf);
+        if(direct_c) c = ops_at(&task->c, i, col);
+        else if(task->op == OPS_AXPY) ops_load(&task->c, i, col, len, cbuf);
+
+        switch(task->op) {
+        case OPS_SCALE:
+            task->kernels->scale(len, task->alpha, a, c);
+            break;
+        case OPS_AXPY:
+            task->kernels->axpy(len, task->alpha, a, c);
+            break;
+        case OPS_MAP:
+            task->fn(task->ctx, len, a, c);
+            break;
+        default:
+            task->kernels->binary[task->op](len, a, b, c);
+            break;
+        }
+
+        if(!direct_c) ops_store(&task->c, i, col, len, cbuf);
+    }
+}
+
+/* ops_range: parallel_for body over the row-major element indices */
+static void ops_range(void *ctx, size_t begin, size_t end)
+{
+    const struct ops_task *task = ctx;
+    size_t ncols = task->c.ncols;
+    while(begin < end) {
+        size_t i = begin / ncols, j = begin % ncols;
+        size_t n = ncols - j < end - begin ? ncols - j : end - begin;
+        ops_segment(task, i, j, n);
+        begin += n;
+    }
+}
+
+/* ops_run: apply op to every element of C. The shapes are checked by the
+ * caller. */
+static int ops_run(enum ops_op op, const tensor_t *A, const tensor_t *B,
+                   int broadcast, double alpha, tensor_t *C,
+                   tensor_map_fn_t fn, void *ctx)
+{
+    struct ops_task task;
+    task.op = op;
+    task.fn = fn;
+    task.ctx = ctx;
+    task.kernels = &ops_kernels[cpu_get_level()];
+    task.a = *A;
+    task.b = B != NULL ? *B : *A;
+    task.c = *C;
+    task.broadcast = broadcast;
+    task.alpha = alpha;
+
+    /* operands without gaps are one long row */
+    size_t total = C->nrows * C->ncols;
+    if(!broadcast && C->nrows > 1 && tensor_is_contiguous(*A)
+       && tensor_is_contiguous(task.b) && tensor_is_contiguous(*C)) {
+        tensor_reshape_view(A, 1, total, &task.a);
+        tensor_reshape_view(&task.b, 1, total, &task.b);
+        tensor_reshape_view(C, 1, total, &task.c);
+    }
+
+    return parallel_for(0, total, OPS_GRAIN, ops_range, &task);
+}
+
+/* ops_binary: check the operands of C = A op B */
+static int ops_binary(enum ops_op op, const tensor_t *A, const tensor_t *B,
+                      tensor_t *C)
+{
+    /* NULL checking */
+    if(A == NULL || B == NULL || C == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(A->nrows != B->nrows || A->ncols != B->ncols
+       || A->nrows != C->nrows || A->ncols != C->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ops_run(op, A, B, 0, 0.0, C, NULL, NULL);
+}
+
+/* tensor_add: Compute C = A + B elementwise.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if A, B or C is NULL
+ * or their shapes differ */
+int tensor_add(const tensor_t *A, const tensor_t *B, tensor_t *C)
+{
+    return ops_binary(OPS_ADD, A, B, C);
+}
+
+/* tensor_sub: Compute C = A - B elementwise, see tensor_add */
+int tensor_sub(const tensor_t *A, const tensor_t *B, tensor_t *C)
+{
+    return ops_binary(OPS_SUB, A, B, C);
+}
+
+/* tensor_mul: Compute the Hadamard product C = A * B, see tensor_add */
+int tensor_mul(const tensor_t *A, const tensor_t *B, tensor_t *C)
+{
+    return ops_binary(OPS_MUL, A, B, C);
+}
+
+/* tensor_div: Compute C = A / B elementwise, see tensor_add */
+int tensor_div(const tensor_t *A, const tensor_t *B, tensor_t *C)
+{
+    return ops_binary(OPS_DIV, A, B, C);
+}
+
+/* tensor_add_row: Add the 1 x ncols tensor row to every row of A and
+ * store the result in C, e.g. to add a bias.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if A, row or C is NULL
+ * or the shapes don't match */
+int tensor_add_row(const tensor_t *A, const tensor_t *row, tensor_t *C)
+{
+    /* NULL checking */
+    if(A == NULL || row == NULL || C == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(row->nrows != 1 || row->ncols != A->ncols || A->nrows != C->nrows
+       || A->ncols != C->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ops_run(OPS_ADD, A, row, 1, 0.0, C, NULL, NULL);
+}
+
+/* tensor_scale: Compute C = alpha * A.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if A or C is NULL or
+ * their shapes differ */
+int tensor_scale(const tensor_t *A, double alpha, tensor_t *C)
+{
+    /* NULL checking */
+    if(A == NULL || C == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(A->nrows != C->nrows || A->ncols != C->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ops_run(OPS_SCALE, A, NULL, 0, alpha, C, NULL, NULL);
+}
+
+/* tensor_axpy: Compute Y = Y + alpha * X, e.g. a gradient step with a
+ * negative learning rate alpha.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X or Y is NULL or
+ * their shapes differ */
+int tensor_axpy(double alpha, const tensor_t *X, tensor_t *Y)
+{
+    /* NULL checking */
+    if(X == NULL || Y == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(X->nrows != Y->nrows || X->ncols != Y->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ops_run(OPS_AXPY, X, NULL, 0, alpha, Y, NULL, NULL);
+}
+
+/* tensor_map: Compute Y = fn(X) elementwise. fn is called with ctx on
+ * runs of doubles, X and Y are converted and split across threads like the
+ * other operations so fn can be a SIMD kernel over plain arrays. fn must
+ * be safe to call from several threads at once.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X, Y or fn is NULL
+ * or the shapes of X and Y differ */
+int tensor_map(const tensor_t *X, tensor_t *Y, tensor_map_fn_t fn, void *ctx)
+{
+    /* NULL checking */
+    if(X == NULL || Y == NULL || fn == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(X->nrows != Y->nrows || X->ncols != Y->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ops_run(OPS_MAP, X, NULL, 0, 0.0, Y, fn, ctx);
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_OPS_C_TEST
+#include <assert.h>
+#include <math.h>
+
+static void test_fill(tensor_t *t, int seed)
+{
+    for(size_t i = 0; i < t->nrows; i++) {
+        for(size_t j = 0; j < t->ncols; j++) {
+            tensor_set_value(t, i, j, (double)((i * 7 + j * 3 + seed) % 17)
+                                      - 8.0 + 0.25 * seed);
+        }
+    }
+}
+
+static double test_get(const tensor_t *t, size_t i, size_t j)
+{
+    double value;
+    tensor_get_value(*t, i, j, &value);
+    return value;
+}
+
+/* test_ops: check every operation on A and B against scalar code */
+static void test_ops(const tensor_t *A, const tensor_t *B, tensor_t *C)
+{
+    int err = 0;
+    int (*ops[4])(const tensor_t *, const tensor_t *, tensor_t *) = {
+        tensor_add, tensor_sub, tensor_mul, tensor_div
+    };
+    for(int op = 0; op < 4; op++) {
+        err = ops[op](A, B, C);
+        assert(err == 0);
+        for(size_t i = 0; i < C->nrows; i++) {
+            for(size_t j = 0; j < C->ncols; j++) {
+                double a = test_get(A, i, j), b = test_get(B, i, j), r;
+                if(op == 0) r = a + b;
+                else if(op == 1) r = a - b;
+                else if(op == 2) r = a * b;
+                else r = a / b;
+                double expected;
+                tensor_t *one = allocate_typed_tensor(1, 1, C->dtype);
+                tensor_set_value(one, 0, 0, r);
+                tensor_get_value(*one, 0, 0, &expected);
+                free_tensor(one);
+                assert(test_get(C, i, j) == expected);
+            }
+        }
+    }
+}
+
+static void test_square(void *ctx, size_t n, const double *x, double *y)
+{
+    double *offset = ctx;
+    for(size_t i = 0; i < n; i++) y[i] = x[i] * x[i] + *offset;
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+
+    for(int level = 0; level <= (int)cpu_get_max_level(); level++) {
+        cpu_set_level((cpu_level_t)level);
+
+        /* padded rows, then an unaligned view of them */
+        tensor_t *A = allocate_tensor(37, 29);
+        tensor_t *B = allocate_tensor(37, 29);
+        tensor_t *C = allocate_tensor(37, 29);
+        test_fill(A, 1);
+        test_fill(B, 2);
+        test_ops(A, B, C);
+        tensor_t va, vb, vc;
+        tensor_view_cols(A, 1, 27, &va);
+        tensor_view_cols(B, 2, 27, &vb);
+        tensor_view_cols(C, 0, 27, &vc);
+        test_ops(&va, &vb, &vc);
+
+        /* contiguous tensors, in place */
+        tensor_t *D = allocate_tensor(64, 4);
+        tensor_t *E = allocate_tensor(64, 4);
+        test_fill(D, 3);
+        test_fill(E, 4);
+        double before = TENSOR_AT(D, 63, 3);
+        err = tensor_add(D, E, D);
+        assert(err == 0);
+        assert(TENSOR_AT(D, 63, 3) == before + TENSOR_AT(E, 63, 3));
+
+        /* float32 and a transposed view */
+        tensor_t *F = allocate_typed_tensor(29, 37, TENSOR_FLOAT32);
+        tensor_t *G = allocate_typed_tensor(37, 29, TENSOR_FLOAT16);
+        tensor_t ft;
+        test_fill(F, 5);
+        tensor_transpose_view(F, &ft);
+        test_ops(&ft, B, G);
+
+        /* bias, scale and axpy */
+        tensor_t *bias = allocate_tensor(1, 29);
+        test_fill(bias, 6);
+        err = tensor_add_row(A, bias, C);
+        assert(err == 0);
+        for(size_t i = 0; i < 37; i++) {
+            for(size_t j = 0; j < 29; j++) {
+                assert(TENSOR_AT(C, i, j)
+                       == TENSOR_AT(A, i, j) + TENSOR_AT(bias, 0, j));
+            }
+        }
+        err = tensor_scale(A, -0.5, C);
+        assert(err == 0);
+        assert(TENSOR_AT(C, 5, 7) == -0.5 * TENSOR_AT(A, 5, 7));
+        tensor_t *Y = allocate_tensor(37, 29);
+        test_fill(Y, 7);
+        err = tensor_axpy(0.125, A, Y);
+        assert(err == 0);
+        for(size_t i = 0; i < 37; i++) {
+            for(size_t j = 0; j < 29; j++) {
+                double y = (double)((i * 7 + j * 3 + 7) % 17) - 8.0 + 1.75;
+                assert(TENSOR_AT(Y, i, j) == y + 0.125 * TENSOR_AT(A, i, j));
+            }
+        }
+        err = tensor_axpy(2.0, A, G);
+        assert(err == 0);
+
+        /* a user function, in place on a float32 view */
+        double offset = 0.5;
+        err = tensor_map(&ft, &ft, test_square, &offset);
+        assert(err == 0);
+        double x = (double)((2 * 7 + 3 * 3 + 5) % 17) - 8.0 + 1.25;
+        assert(test_get(F, 2, 3) == x * x + 0.5);
+        err = tensor_map(A, C, NULL, NULL);
+        assert(err != 0 && errno == EINVAL);
+
+        /* shape mismatch */
+        err = tensor_add(A, D, C);
+        assert(err != 0 && errno == EINVAL);
+        err = tensor_add_row(A, A, C);
+        assert(err != 0 && errno == EINVAL);
+
+        free_tensor(A);
+        free_tensor(B);
+        free_tensor(C);
+        free_tensor(D);
+        free_tensor(E);
+        free_tensor(F);
+        free_tensor(G);
+        free_tensor(bias);
+        free_tensor(Y);
+    }
+    cpu_set_level(cpu_get_max_level());
+
+    /* a tensor split across threads gives the same result */
+    parallel_set_nthreads(4);
+    tensor_t *A = allocate_tensor(300, 301);
+    tensor_t *B = allocate_tensor(300, 301);
+    tensor_t *C = allocate_tensor(300, 301);
+    test_fill(A, 1);
+    test_fill(B, 2);
+    err = tensor_mul(A, B, C);
+    assert(err == 0);
+    for(size_t i = 0; i < 300; i++) {
+        for(size_t j = 0; j < 301; j++) {
+            assert(TENSOR_AT(C, i, j)
+                   == TENSOR_AT(A, i, j) * TENSOR_AT(B, i, j));
+        }
+    }
+    free_tensor(A);
+    free_tensor(B);
+    free_tensor(C);
+    return 0;
+}
+#endif
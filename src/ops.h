@@ -0,0 +1,36 @@
+/* ops - Elementwise arithmetic on tensors
+ * The operations work on tensors of any element type and strides. Rows of
+ * float64 elements with unit column stride are processed in place with
+ * SIMD kernels picked for the CPU, other rows go through double buffers.
+ * Large tensors are split across threads.
+ *
+ * The output C can be the same tensor as an input for the in-place form
+ * of an operation, e.g. tensor_add(A, B, A). Other overlaps are not
+ * supported.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_OPS_H
+#define SIMPLE_NN_OPS_H
+
+#include "tensor.h"
+
+int tensor_add(const tensor_t *A, const tensor_t *B, tensor_t *C);
+int tensor_sub(const tensor_t *A, const tensor_t *B, tensor_t *C);
+int tensor_mul(const tensor_t *A, const tensor_t *B, tensor_t *C);
+int tensor_div(const tensor_t *A, const tensor_t *B, tensor_t *C);
+
+int tensor_add_row(const tensor_t *A, const tensor_t *row, tensor_t *C);
+
+int tensor_scale(const tensor_t *A, double alpha, tensor_t *C);
+int tensor_axpy(double alpha, const tensor_t *X, tensor_t *Y);
+
+/* tensor_map_fn_t: store f(x[i]) in y[i] for n doubles, x and y may be the
+ * same array */
+typedef void (*tensor_map_fn_t)(void *ctx, size_t n, const double *x,
+                                double *y);
+
+int tensor_map(const tensor_t *X, tensor_t *Y, tensor_map_fn_t fn, void *ctx);
+
+#endif
@@ -0,0 +1,405 @@
+/* parallel - Split loops over ranges of indices across threads
+ * A pool of worker threads is started on the first parallel loop and
+ * reused by the next ones. A loop is cut into tasks of whole grains,
+ * handed out in contiguous runs to the deques of the threads that take
+ * part, the calling thread included. A thread runs the tasks of its deque
+ * from the front; once it is empty, it steals the back half of the deque
+ * of another thread, so threads that finish early take work from the
+ * slow ones. The call returns when every task is done.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "parallel.h"
+
+/* Upper bound on the threads of one parallel_for */
+#define PARALLEL_MAX_THREADS 256
+
+/* Tasks a loop is cut into per thread: enough for the threads to even out
+ * by stealing, few enough that the calls of fn stay cheap */
+#define PARALLEL_TASKS_PER_THREAD 8
+
+static pthread_once_t parallel_once = PTHREAD_ONCE_INIT;
+static size_t parallel_nthreads = 1;
+/* Non-zero on a thread that runs the tasks of a parallel_for */
+static __thread int parallel_inside = 0;
+
+/* The tasks [lo, hi) of a thread. Each deque has its own cache line so
+ * the threads don't slow each other down when they take tasks. */
+struct parallel_deque {
+    pthread_mutex_t lock;
+    size_t lo;
+    size_t hi;
+} __attribute__((aligned(64)));
+
+/* One parallel_for: task t is the indices [begin + t * size, begin + (t +
+ * 1) * size), clipped to end */
+struct parallel_job {
+    parallel_fn_t fn;
+    void *ctx;
+    size_t begin;
+    size_t end;
+    size_t size; // indices per task, a multiple of the grain
+    size_t nthreads; // threads taking part, the caller is thread 0
+    size_t running; // workers inside the job, guarded by the pool lock
+};
+
+/* The workers sleep on start until a job is published and the caller
+ * sleeps on done until the workers are out of it. Only one parallel_for
+ * runs on the pool at a time, loops that find it busy run serially. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    pthread_mutex_t busy; // held by the thread whose job runs
+    struct parallel_job *job; // or NULL
+    unsigned long generation; // incremented for every job
+    size_t nworkers;
+    int stopping;
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    struct parallel_deque deques[PARALLEL_MAX_THREADS];
+} parallel_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+};
+
+/* parallel_init: Use the SIMPLE_NN_THREADS environment variable, or one
+ * thread per online CPU */
+static void parallel_init(void)
+{
+    long n = 0;
+    const char *value = getenv("SIMPLE_NN_THREADS");
+    if(value != NULL) n = strtol(value, NULL, 10);
+    if(n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n <= 0) n = 1;
+    if(n > PARALLEL_MAX_THREADS) n = PARALLEL_MAX_THREADS;
+    __atomic_store_n(&parallel_nthreads, (size_t)n, __ATOMIC_RELAXED);
+    for(size_t i = 0; i < PARALLEL_MAX_THREADS; i++) {
+        pthread_mutex_init(&parallel_pool.deques[i].lock, NULL);
+    }
+}
+
+/* parallel_get_nthreads: Get the number of threads parallel_for uses.
+ * It returns the number of threads */
+size_t parallel_get_nthreads(void)
+{
+    pthread_once(&parallel_once, parallel_init);
+    return __atomic_load_n(&parallel_nthreads, __ATOMIC_RELAXED);
+}
+
+/* parallel_set_nthreads: Set the number of threads parallel_for uses,
+ * one makes every loop serial. Workers already started are kept and left
+ * idle when the number goes down.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if nthreads is zero
+ * or too large */
+int parallel_set_nthreads(size_t nthreads)
+{
+    pthread_once(&parallel_once, parallel_init);
+    if(nthreads == 0 || nthreads > PARALLEL_MAX_THREADS) {
+        errno = EINVAL;
+        return -1;
+    }
+    __atomic_store_n(&parallel_nthreads, nthreads, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* parallel_pop: take the front task of deque d.
+ * It returns non-zero value if there was one */
+static int parallel_pop(struct parallel_deque *d, size_t *task)
+{
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if(d->lo < d->hi) {
+        *task = d->lo++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/* parallel_steal: move the back half of the deque of another thread to
+ * the deque of thread self, starting the search after self.
+ * It returns non-zero value if tasks were stolen */
+static int parallel_steal(const struct parallel_job *job, size_t self)
+{
+    for(size_t i = 1; i < job->nthreads; i++) {
+        struct parallel_deque *victim;
+        victim = &parallel_pool.deques[(self + i) % job->nthreads];
+        size_t lo = 0, hi = 0;
+        pthread_mutex_lock(&victim->lock);
+        if(victim->lo < victim->hi) {
+            hi = victim->hi;
+            lo = victim->hi - (victim->hi - victim->lo + 1) / 2;
+            victim->hi = lo;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if(lo < hi) {
+            struct parallel_deque *own = &parallel_pool.deques[self];
+            pthread_mutex_lock(&own->lock);
+            own->lo = lo;
+            own->hi = hi;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* parallel_work: run tasks of job as thread self until none is left */
+static void parallel_work(const struct parallel_job *job, size_t self)
+{
+    struct parallel_deque *own = &parallel_pool.deques[self];
+    size_t task;
+    do {
+        while(parallel_pop(own, &task)) {
+            size_t begin = job->begin + task * job->size;
+            size_t end = job->end - begin > job->size ? begin + job->size
+                                                      : job->end;
+            job->fn(job->ctx, begin, end);
+        }
+    } while(parallel_steal(job, self));
+}
+
+/* parallel_worker: body of worker thread id, id >= 1 */
+static void *parallel_worker(void *arg)
+{
+    size_t id = (size_t)arg;
+    unsigned long seen = 0;
+    parallel_inside = 1;
+    pthread_mutex_lock(&parallel_pool.lock);
+    for(;;) {
+        while(!parallel_pool.stopping && parallel_pool.generation == seen) {
+            pthread_cond_wait(&parallel_pool.start, &parallel_pool.lock);
+        }
+        if(parallel_pool.stopping) break;
+        seen = parallel_pool.generation;
+        struct parallel_job *job = parallel_pool.job;
+        if(job == NULL || id >= job->nthreads) continue;
+
+        job->running++;
+        pthread_mutex_unlock(&parallel_pool.lock);
+        parallel_work(job, id);
+        pthread_mutex_lock(&parallel_pool.lock);
+        if(--job->running == 0) pthread_cond_signal(&parallel_pool.done);
+    }
+    pthread_mutex_unlock(&parallel_pool.lock);
+    return NULL;
+}
+
+/* parallel_stop: stop and join the workers at exit */
+static void parallel_stop(void)
+{
+    pthread_mutex_lock(&parallel_pool.lock);
+    parallel_pool.stopping = 1;
+    pthread_cond_broadcast(&parallel_pool.start);
+    pthread_mutex_unlock(&parallel_pool.lock);
+    for(size_t i = 1; i <= parallel_pool.nworkers; i++) {
+        pthread_join(parallel_pool.threads[i], NULL);
+    }
+}
+
+/* parallel_grow: start workers until there are nthreads - 1 of them, the
+ * caller holds the busy lock.
+ * It returns the number of threads a job can use */
+static size_t parallel_grow(size_t nthreads)
+{
+    while(parallel_pool.nworkers + 1 < nthreads) {
+        size_t id = parallel_pool.nworkers + 1;
+        if(pthread_create(&parallel_pool.threads[id], NULL, parallel_worker,
+                          (void *)id) != 0) {
+            break;
+        }
+        if(++parallel_pool.nworkers == 1) atexit(parallel_stop);
+    }
+    return parallel_pool.nworkers + 1 < nthreads ? parallel_pool.nworkers + 1
+                                                 : nthreads;
+}
+
+/* parallel_for: Call fn on pieces of the range [begin, end) in parallel.
+ * Every piece starts a whole number of grains after begin and every piece
+ * but the last has a multiple of grain indices, so a grain can be used to
+ * keep pieces large enough to pay for a task. A zero grain is taken as one.
+ * A range of a single grain, a parallel_for called from a piece and a
+ * parallel_for that finds the pool running a loop of another thread run
+ * serially on the calling thread.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if fn is NULL */
+int parallel_for(size_t begin, size_t end, size_t grain, parallel_fn_t fn,
+                 void *ctx)
+{
+    if(fn == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(end <= begin) return 0;
+    if(grain == 0) grain = 1;
+
+    size_t n = end - begin;
+    size_t ngrains = (n - 1) / grain + 1;
+    size_t nthreads = parallel_get_nthreads();
+    if(nthreads > ngrains) nthreads = ngrains;
+    if(nthreads <= 1 || parallel_inside
+       || pthread_mutex_trylock(&parallel_pool.busy) != 0) {
+        fn(ctx, begin, end);
+        return 0;
+    }
+    nthreads = parallel_grow(nthreads);
+    if(nthreads <= 1) {
+        pthread_mutex_unlock(&parallel_pool.busy);
+        fn(ctx, begin, end);
+        return 0;
+    }
+
+    /* tasks of whole grains, the threads start with even runs of them */
+    size_t pergrains = ngrains / (nthreads * PARALLEL_TASKS_PER_THREAD);
+    struct parallel_job job = {fn, ctx, begin, end, 0, nthreads, 0};
+    job.size = (pergrains > 0 ? pergrains : 1) * grain;
+    size_t ntasks = (n - 1) / job.size + 1;
+    for(size_t i = 0; i < nthreads; i++) {
+        struct parallel_deque *d = &parallel_pool.deques[i];
+        pthread_mutex_lock(&d->lock);
+        d->lo = ntasks * i / nthreads;
+        d->hi = ntasks * (i + 1) / nthreads;
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    pthread_mutex_lock(&parallel_pool.lock);
+    parallel_pool.job = &job;
+    parallel_pool.generation++;
+    pthread_cond_broadcast(&parallel_pool.start);
+    pthread_mutex_unlock(&parallel_pool.lock);
+
+    parallel_inside = 1;
+    parallel_work(&job, 0);
+    parallel_inside = 0;
+
+    /* workers that didn't pick the job up yet won't, the others finish */
+    pthread_mutex_lock(&parallel_pool.lock);
+    parallel_pool.job = NULL;
+    while(job.running > 0) {
+        pthread_cond_wait(&parallel_pool.done, &parallel_pool.lock);
+    }
+    pthread_mutex_unlock(&parallel_pool.lock);
+    pthread_mutex_unlock(&parallel_pool.busy);
+    return 0;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_PARALLEL_C_TEST
+#include <assert.h>
+#include <string.h>
+
+struct test_ctx {
+    unsigned char *seen;
+    size_t grain;
+    size_t pieces;
+    size_t nested;
+};
+
+/* test_mark: count the visits of every index, pieces start on a grain and
+ * only the last one can be shorter */
+static void test_mark(void *arg, size_t begin, size_t end)
+{
+    struct test_ctx *ctx = arg;
+    __atomic_add_fetch(&ctx->pieces, 1, __ATOMIC_RELAXED);
+    assert((begin - 3) % ctx->grain == 0);
+    assert(end == 1000 || (end - begin) % ctx->grain == 0);
+    for(size_t i = begin; i < end; i++) ctx->seen[i]++;
+}
+
+static void test_count(void *arg, size_t begin, size_t end)
+{
+    size_t *count = arg;
+    __atomic_add_fetch(count, end - begin, __ATOMIC_RELAXED);
+}
+
+/* test_caller: loops from a thread of the program */
+static void *test_caller(void *arg)
+{
+    for(size_t r = 0; r < 50; r++) {
+        assert(parallel_for(0, 4096, 16, test_count, arg) == 0);
+    }
+    return NULL;
+}
+
+static void test_nested(void *arg, size_t begin, size_t end)
+{
+    struct test_ctx *ctx = arg;
+    size_t count = 0;
+    parallel_for(0, 100, 1, test_count, &count);
+    assert(count == 100);
+    __atomic_add_fetch(&ctx->nested, end - begin, __ATOMIC_RELAXED);
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    assert(parallel_get_nthreads() >= 1);
+    err = parallel_set_nthreads(0);
+    assert(err != 0 && errno == EINVAL);
+    err = parallel_set_nthreads(4);
+    assert(err == 0 && parallel_get_nthreads() == 4);
+
+    /* every index is visited once, for any range and grain */
+    size_t n = 1000;
+    unsigned char *seen = malloc(n);
+    size_t grains[] = {1, 7, 250, 1000, 5000};
+    for(size_t g = 0; g < sizeof grains / sizeof grains[0]; g++) {
+        struct test_ctx ctx = {seen, grains[g], 0, 0};
+        memset(seen, 0, n);
+        err = parallel_for(3, n, grains[g], test_mark, &ctx);
+        assert(err == 0);
+        assert(seen[0] == 0 && seen[2] == 0);
+        for(size_t i = 3; i < n; i++) assert(seen[i] == 1);
+        size_t max = (n - 3 + grains[g] - 1) / grains[g];
+        assert(ctx.pieces >= 1 && ctx.pieces <= max);
+        if(max == 1) assert(ctx.pieces == 1);
+    }
+
+    /* the pool follows the number of threads */
+    size_t counts[] = {2, 8, 1, 3};
+    for(size_t c = 0; c < sizeof counts / sizeof counts[0]; c++) {
+        size_t count = 0;
+        parallel_set_nthreads(counts[c]);
+        for(size_t r = 0; r < 100; r++) {
+            err = parallel_for(0, 10000, 10, test_count, &count);
+            assert(err == 0);
+        }
+        assert(count == 100 * 10000);
+    }
+    parallel_set_nthreads(4);
+
+    /* loops of several threads at once share the pool */
+    pthread_t callers[3];
+    size_t totals[3] = {0, 0, 0};
+    for(size_t i = 0; i < 3; i++) {
+        err = pthread_create(&callers[i], NULL, test_caller, &totals[i]);
+        assert(err == 0);
+    }
+    for(size_t i = 0; i < 3; i++) {
+        pthread_join(callers[i], NULL);
+        assert(totals[i] == 50 * 4096);
+    }
+
+    /* empty ranges and nested loops */
+    struct test_ctx ctx = {seen, 1, 0, 0};
+    err = parallel_for(5, 5, 1, test_mark, &ctx);
+    assert(err == 0 && ctx.pieces == 0);
+    err = parallel_for(0, 64, 1, test_nested, &ctx);
+    assert(err == 0 && ctx.nested == 64);
+    err = parallel_for(0, 1, 1, NULL, NULL);
+    assert(err != 0 && errno == EINVAL);
+
+    free(seen);
+    return 0;
+}
+#endif
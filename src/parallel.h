@@ -0,0 +1,27 @@
+/* parallel - Split loops over ranges of indices across threads
+ * A range [begin, end) is cut into contiguous pieces of whole grains that
+ * run on a persistent pool of threads, the calling thread included, and
+ * are balanced between the threads by work stealing. The call returns when
+ * every piece is done. The grain is the size heuristic of a loop: a range
+ * of a single grain, such as a small tensor, runs serially without waking
+ * the pool, and a loop never uses more threads than it has grains. A
+ * parallel_for called from a piece runs serially on that thread.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_PARALLEL_H
+#define SIMPLE_NN_PARALLEL_H
+
+#include <stddef.h>
+
+/* parallel_fn_t: process the indices [begin, end) of the range */
+typedef void (*parallel_fn_t)(void *ctx, size_t begin, size_t end);
+
+int parallel_for(size_t begin, size_t end, size_t grain, parallel_fn_t fn,
+                 void *ctx);
+
+size_t parallel_get_nthreads(void);
+int parallel_set_nthreads(size_t nthreads);
+
+#endif
@@ -0,0 +1,426 @@
+/* pool - Size-class allocator that recycles tensor memory
+ * Freed blocks are kept on per-size-class free lists instead of going back
+ * to libc, so a long-running process that frees tensors in any order gets
+ * warm, already faulted-in memory on the next allocation. Each thread keeps
+ * a small cache per size class in front of the shared lists to avoid lock
+ * contention.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "tensor.h"
+#include "pool.h"
+
+/* Size classes are counted in units of TENSOR_ALIGNMENT bytes: 1, 2, 3, 4,
+ * then four classes per power of two (5, 6, 7, 8, 10, 12, 14, 16, 20, ...),
+ * so a block wastes at most 25% of its size. The largest class is 64 MiB,
+ * bigger blocks bypass the free lists. */
+#define TENSOR_POOL_NCLASSES 76
+#define TENSOR_POOL_LARGE TENSOR_POOL_NCLASSES
+
+/* Blocks up to this size are cached per thread, at most DEPTH per class */
+#define TENSOR_POOL_THREAD_MAX_SIZE (256 * 1024)
+#define TENSOR_POOL_THREAD_DEPTH 8
+
+/* Every block starts with this header, padded to TENSOR_ALIGNMENT bytes so
+ * the memory returned to the caller stays aligned */
+struct tensor_pool_header {
+    size_t sclass; // size class or TENSOR_POOL_LARGE
+    size_t size; // usable bytes after the header
+};
+
+/* A cached block reuses its usable part as the free list link */
+struct tensor_pool_node {
+    struct tensor_pool_node *next;
+};
+
+struct tensor_pool_list {
+    struct tensor_pool_node *head;
+    size_t count;
+};
+
+struct tensor_pool_cache {
+    struct tensor_pool_list lists[TENSOR_POOL_NCLASSES];
+};
+
+static pthread_once_t tensor_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tensor_pool_key;
+static pthread_mutex_t tensor_pool_locks[TENSOR_POOL_NCLASSES];
+static struct tensor_pool_list tensor_pool_lists[TENSOR_POOL_NCLASSES];
+static __thread struct tensor_pool_cache *tensor_pool_thread_cache;
+static tensor_pool_stats_t tensor_pool_stats;
+
+/* tensor_pool_class: get the size class of a block of size bytes */
+static size_t tensor_pool_class(size_t size)
+{
+    size_t units = (size + TENSOR_ALIGNMENT - 1) / TENSOR_ALIGNMENT;
+    if(units == 0) units = 1;
+    if(units <= 4) return units - 1;
+
+    size_t step = 1;
+    size_t group = 0;
+    while(units > 8 * step) {
+        step <<= 1;
+        group++;
+    }
+
+    size_t sclass = 4 + group * 4 + (units - 4 * step + step - 1) / step - 1;
+    return sclass < TENSOR_POOL_NCLASSES ? sclass : TENSOR_POOL_LARGE;
+}
+
+/* tensor_pool_class_size: get the usable bytes of the blocks of class
+ * sclass */
+static size_t tensor_pool_class_size(size_t sclass)
+{
+    if(sclass < 4) return (sclass + 1) * TENSOR_ALIGNMENT;
+
+    size_t group = (sclass - 4) / 4;
+    size_t step = (sclass - 4) % 4 + 1;
+    return ((4 + step) << group) * TENSOR_ALIGNMENT;
+}
+
+/* tensor_pool_push: put block on the free list */
+static void tensor_pool_push(struct tensor_pool_list *list, void *block)
+{
+    struct tensor_pool_node *node = block;
+    node->next = list->head;
+    list->head = node;
+    list->count++;
+}
+
+/* tensor_pool_pop: take a block from the free list, NULL if it is empty */
+static void *tensor_pool_pop(struct tensor_pool_list *list)
+{
+    struct tensor_pool_node *node = list->head;
+    if(node == NULL) return NULL;
+
+    list->head = node->next;
+    list->count--;
+    return node;
+}
+
+/* tensor_pool_flush: move the blocks of the thread cache to the shared
+ * free lists */
+static void tensor_pool_flush(struct tensor_pool_cache *cache)
+{
+    for(size_t c = 0; c < TENSOR_POOL_NCLASSES; c++) {
+        struct tensor_pool_list *list = &cache->lists[c];
+        if(list->head == NULL) continue;
+
+        pthread_mutex_lock(&tensor_pool_locks[c]);
+        void *block;
+        while((block = tensor_pool_pop(list)) != NULL) {
+            tensor_pool_push(&tensor_pool_lists[c], block);
+        }
+        pthread_mutex_unlock(&tensor_pool_locks[c]);
+    }
+}
+
+/* tensor_pool_thread_exit: give the cache of an exiting thread back to the
+ * shared free lists. It runs on the exiting thread, the pointer to the
+ * cache is cleared first so that a tensor freed or allocated by a later
+ * destructor of the thread doesn't use the freed cache. */
+static void tensor_pool_thread_exit(void *cache)
+{
+    tensor_pool_thread_cache = NULL;
+    tensor_pool_flush(cache);
+    free(cache);
+}
+
+static void tensor_pool_init(void)
+{
+    for(size_t c = 0; c < TENSOR_POOL_NCLASSES; c++) {
+        pthread_mutex_init(&tensor_pool_locks[c], NULL);
+    }
+    pthread_key_create(&tensor_pool_key, tensor_pool_thread_exit);
+}
+
+/* tensor_pool_get_cache: get the cache of the calling thread, creating it
+ * on first use. It returns NULL if the cache cannot be allocated, the
+ * shared free lists are used then. */
+static struct tensor_pool_cache *tensor_pool_get_cache(void)
+{
+    if(tensor_pool_thread_cache != NULL) return tensor_pool_thread_cache;
+
+    struct tensor_pool_cache *cache = calloc(1, sizeof *cache);
+    if(cache == NULL) return NULL;
+    if(pthread_setspecific(tensor_pool_key, cache) != 0) {
+        free(cache);
+        return NULL;
+    }
+
+    tensor_pool_thread_cache = cache;
+    return cache;
+}
+
+/* tensor_pool_count: update the statistics for a block of size bytes
+ * that is allocated (sign > 0) or freed (sign < 0) */
+static void tensor_pool_count(size_t size, int sign)
+{
+    if(sign < 0) {
+        __atomic_sub_fetch(&tensor_pool_stats.bytes_in_use, size,
+                           __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t in_use = __atomic_add_fetch(&tensor_pool_stats.bytes_in_use, size,
+                                       __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&tensor_pool_stats.peak_bytes,
+                                  __ATOMIC_RELAXED);
+    while(in_use > peak
+          && !__atomic_compare_exchange_n(&tensor_pool_stats.peak_bytes,
+                                          &peak, in_use, 1, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED)) {
+    }
+}
+
+/* tensor_pool_alloc: Allocate a block of at least size bytes aligned to
+ * TENSOR_ALIGNMENT. The content of the block is undefined. A block freed
+ * earlier with tensor_pool_free is reused when one of the same size class
+ * is available.
+ *
+ * It returns NULL and set errno to ENOMEM if the allocation fails.
+ * It returns pointer to the block if success. */
+void *tensor_pool_alloc(size_t size)
+{
+    pthread_once(&tensor_pool_once, tensor_pool_init);
+
+    size_t sclass = tensor_pool_class(size);
+    char *block = NULL;
+
+    if(sclass != TENSOR_POOL_LARGE) {
+        size = tensor_pool_class_size(sclass);
+
+        /* the thread cache first, then the shared free list */
+        struct tensor_pool_cache *cache = tensor_pool_get_cache();
+        if(cache != NULL) block = tensor_pool_pop(&cache->lists[sclass]);
+        if(block == NULL) {
+            pthread_mutex_lock(&tensor_pool_locks[sclass]);
+            block = tensor_pool_pop(&tensor_pool_lists[sclass]);
+            pthread_mutex_unlock(&tensor_pool_locks[sclass]);
+        }
+
+        if(block != NULL) {
+            __atomic_add_fetch(&tensor_pool_stats.hits, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&tensor_pool_stats.bytes_cached, size,
+                               __ATOMIC_RELAXED);
+            tensor_pool_count(size, 1);
+            return block;
+        }
+    }
+
+    void *mem = NULL;
+    if(posix_memalign(&mem, TENSOR_ALIGNMENT, TENSOR_ALIGNMENT + size) != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct tensor_pool_header *header = mem;
+    header->sclass = sclass;
+    header->size = size;
+    __atomic_add_fetch(&tensor_pool_stats.misses, 1, __ATOMIC_RELAXED);
+    tensor_pool_count(size, 1);
+    return (char *)mem + TENSOR_ALIGNMENT;
+}
+
+/* tensor_pool_free: Give back a block allocated by tensor_pool_alloc. The
+ * block is kept for reuse unless it is larger than the largest size class.
+ * It does nothing if ptr is NULL */
+void tensor_pool_free(void *ptr)
+{
+    if(ptr == NULL) return;
+
+    struct tensor_pool_header *header =
+        (struct tensor_pool_header *)((char *)ptr - TENSOR_ALIGNMENT);
+    size_t sclass = header->sclass;
+    size_t size = header->size;
+    tensor_pool_count(size, -1);
+
+    if(sclass == TENSOR_POOL_LARGE) {
+        free(header);
+        return;
+    }
+
+    __atomic_add_fetch(&tensor_pool_stats.bytes_cached, size,
+                       __ATOMIC_RELAXED);
+
+    /* small blocks stay in the thread cache while it has room */
+    if(size <= TENSOR_POOL_THREAD_MAX_SIZE) {
+        struct tensor_pool_cache *cache = tensor_pool_get_cache();
+        if(cache != NULL
+           && cache->lists[sclass].count < TENSOR_POOL_THREAD_DEPTH) {
+            tensor_pool_push(&cache->lists[sclass], ptr);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&tensor_pool_locks[sclass]);
+    tensor_pool_push(&tensor_pool_lists[sclass], ptr);
+    pthread_mutex_unlock(&tensor_pool_locks[sclass]);
+}
+
+/* tensor_pool_trim: Give the blocks cached by the calling thread and the
+ * shared free lists back to libc. Blocks cached by other threads are kept
+ * until those threads exit or trim. */
+void tensor_pool_trim(void)
+{
+    pthread_once(&tensor_pool_once, tensor_pool_init);
+
+    if(tensor_pool_thread_cache != NULL) {
+        tensor_pool_flush(tensor_pool_thread_cache);
+    }
+
+    for(size_t c = 0; c < TENSOR_POOL_NCLASSES; c++) {
+        size_t size = tensor_pool_class_size(c);
+
+        pthread_mutex_lock(&tensor_pool_locks[c]);
+        char *block;
+        while((block = tensor_pool_pop(&tensor_pool_lists[c])) != NULL) {
+            __atomic_sub_fetch(&tensor_pool_stats.bytes_cached, size,
+                               __ATOMIC_RELAXED);
+            free(block - TENSOR_ALIGNMENT);
+        }
+        pthread_mutex_unlock(&tensor_pool_locks[c]);
+    }
+}
+
+/* tensor_pool_get_stats: Write a snapshot of the pool statistics to stats.
+ * It does nothing if stats is NULL */
+void tensor_pool_get_stats(tensor_pool_stats_t *stats)
+{
+    if(stats == NULL) return;
+
+    stats->hits = __atomic_load_n(&tensor_pool_stats.hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&tensor_pool_stats.misses,
+                                    __ATOMIC_RELAXED);
+    stats->bytes_in_use = __atomic_load_n(&tensor_pool_stats.bytes_in_use,
+                                          __ATOMIC_RELAXED);
+    stats->peak_bytes = __atomic_load_n(&tensor_pool_stats.peak_bytes,
+                                        __ATOMIC_RELAXED);
+    stats->bytes_cached = __atomic_load_n(&tensor_pool_stats.bytes_cached,
+                                          __ATOMIC_RELAXED);
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_POOL_C_TEST
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+static void *test_worker(void *arg)
+{
+    size_t sizes[] = {100, 3000, 64 * 1024, 1024 * 1024};
+    void *blocks[4];
+
+    for(int round = 0; round < 100; round++) {
+        for(int i = 0; i < 4; i++) {
+            blocks[i] = tensor_pool_alloc(sizes[i]);
+            assert(blocks[i] != NULL);
+            memset(blocks[i], round, sizes[i]);
+        }
+        for(int i = 3; i >= 0; i--) {
+            tensor_pool_free(blocks[i]);
+        }
+    }
+    return NULL;
+}
+
+static pthread_key_t test_key;
+
+/* test_late_exit: destructor of test_key that puts itself back once, so
+ * its second call comes after the destructor of the pool cache, and then
+ * uses the pool */
+static void test_late_exit(void *value)
+{
+    if(value == (void *)1) {
+        pthread_setspecific(test_key, (void *)2);
+        return;
+    }
+    void *block = tensor_pool_alloc(100);
+    assert(block != NULL);
+    tensor_pool_free(block);
+}
+
+static void *test_late_worker(void *arg)
+{
+    tensor_pool_free(tensor_pool_alloc(100));
+    pthread_setspecific(test_key, (void *)1);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    tensor_pool_stats_t stats;
+
+    /* the size classes round up by at most 25% */
+    for(size_t size = 1; size < 100000; size += 7) {
+        size_t sclass = tensor_pool_class(size);
+        size_t class_size = tensor_pool_class_size(sclass);
+        assert(class_size >= size);
+        assert(sclass == 0 || tensor_pool_class_size(sclass - 1) < size);
+    }
+    assert(tensor_pool_class_size(TENSOR_POOL_NCLASSES - 1)
+           == 64 * 1024 * 1024);
+    assert(tensor_pool_class(64 * 1024 * 1024 + 1) == TENSOR_POOL_LARGE);
+
+    /* freed blocks are reused */
+    void *a = tensor_pool_alloc(1000);
+    assert(a != NULL);
+    assert((uintptr_t)a % TENSOR_ALIGNMENT == 0);
+    tensor_pool_free(a);
+    void *b = tensor_pool_alloc(1010);
+    assert(b == a);
+    tensor_pool_get_stats(&stats);
+    assert(stats.hits == 1);
+    assert(stats.misses == 1);
+    assert(stats.bytes_in_use >= 1010);
+
+    /* large blocks bypass the free lists */
+    void *large = tensor_pool_alloc(100 * 1024 * 1024);
+    assert(large != NULL);
+    tensor_pool_free(large);
+    tensor_pool_free(b);
+    tensor_pool_free(NULL);
+    tensor_pool_get_stats(&stats);
+    assert(stats.bytes_in_use == 0);
+    assert(stats.peak_bytes >= 100 * 1024 * 1024);
+
+    /* tensors are allocated from the pool */
+    tensor_t *t = allocate_tensor(10, 10);
+    void *first = t;
+    free_tensor(t);
+    t = allocate_tensor(10, 10);
+    assert((void *)t == first);
+    free_tensor(t);
+
+    /* threads recycle blocks and hand their cache back when they exit */
+    pthread_t threads[4];
+    for(int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, test_worker, NULL);
+    }
+    for(int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    tensor_pool_get_stats(&stats);
+    assert(stats.bytes_in_use == 0);
+    assert(stats.hits > stats.misses);
+
+    /* a destructor that runs after the one of the pool cache doesn't use
+     * the freed cache */
+    pthread_key_create(&test_key, test_late_exit);
+    pthread_create(&threads[0], NULL, test_late_worker, NULL);
+    pthread_join(threads[0], NULL);
+    tensor_pool_get_stats(&stats);
+    assert(stats.bytes_in_use == 0);
+
+    /* trim gives every cached block back */
+    tensor_pool_trim();
+    tensor_pool_get_stats(&stats);
+    assert(stats.bytes_cached == 0);
+}
+#endif
@@ -0,0 +1,31 @@
+/* pool - Size-class allocator that recycles tensor memory
+ * Freed blocks are kept on per-size-class free lists instead of going back
+ * to libc, so a long-running process that frees tensors in any order gets
+ * warm, already faulted-in memory on the next allocation. Each thread keeps
+ * a small cache per size class in front of the shared lists to avoid lock
+ * contention.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_POOL_H
+#define SIMPLE_NN_POOL_H
+
+#include <stddef.h>
+
+struct tensor_pool_stats {
+    size_t hits; // allocations served from a free list
+    size_t misses; // allocations that had to call libc
+    size_t bytes_in_use; // bytes of the blocks currently allocated
+    size_t peak_bytes; // highest value of bytes_in_use
+    size_t bytes_cached; // bytes of the blocks kept in the free lists
+};
+typedef struct tensor_pool_stats tensor_pool_stats_t;
+
+void *tensor_pool_alloc(size_t size);
+void tensor_pool_free(void *ptr);
+
+void tensor_pool_trim(void);
+void tensor_pool_get_stats(tensor_pool_stats_t *stats);
+
+#endif
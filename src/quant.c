@@ -0,0 +1,962 @@
+/* quant - Int8 quantized weights and inference of dense layers
+ * The product of a row a of the input and a column w of the weights is
+ * computed on the quantized values and corrected for the zero points:
+ *
+ *   sum (qa - za) (qw - zw) = sum qa qw - za sum qw - zw sum qa + k za zw
+ *
+ * where sum qa qw is the int32 dot product of the kernels, sum qw is stored
+ * with the weights and sum qa is counted when the row is quantized.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "tensor.h"
+#include "quant.h"
+#include "activation.h"
+#include "cpu.h"
+#include "parallel.h"
+#include "pool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUANT_X86 1
+#include <immintrin.h>
+#endif
+
+/* Columns of a panel and rows of a group of packed weights. The columns
+ * are padded to QUANT_MAX_NR, the widest block of the kernels. */
+#define QUANT_NR 16
+#define QUANT_KG 4
+#define QUANT_MAX_NR 32
+
+/* Rows of the input quantized at once, their 8-bit rows stay in L2 while
+ * they are multiplied with every panel */
+#define QUANT_MB 64
+
+/* The largest product of a 7-bit activation and an int8 weight is 127 *
+ * 128, the int32 accumulators can't overflow below this depth */
+#define QUANT_MAX_DEPTH (INT32_MAX / (127 * 128))
+
+/* Multiply-adds below which a piece of work is not worth a thread */
+#define QUANT_GRAIN (1 << 20)
+
+/* A kernel computes the mr x nr block acc = a * w of 32-bit dot products,
+ * a holds mr rows of 4 * kq unsigned bytes lda apart and w is nr /
+ * QUANT_NR consecutive panels of kq groups of QUANT_NR x QUANT_KG signed
+ * bytes */
+typedef void (*quant_kernel_fn_t)(size_t kq, const uint8_t *a, size_t lda,
+                                  const int8_t *w, int32_t *acc);
+
+struct quant_kernel {
+    quant_kernel_fn_t fn;
+    size_t mr; // rows of a computed at once
+    size_t nr; // columns computed at once, QUANT_NR or QUANT_MAX_NR
+};
+
+/* quant_load32: the 4 bytes at p as an int32 */
+static inline int32_t quant_load32(const uint8_t *p)
+{
+    int32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+/* Generic kernel: 4 rows */
+static void quant_kernel_generic(size_t kq, const uint8_t *a, size_t lda,
+                                 const int8_t *w, int32_t *acc)
+{
+    for(size_t i = 0; i < 4 * QUANT_NR; i++) acc[i] = 0;
+    for(size_t g = 0; g < kq; g++) {
+        const int8_t *wg = w + g * QUANT_NR * QUANT_KG;
+        for(size_t r = 0; r < 4; r++) {
+            const uint8_t *ar = a + r * lda + g * QUANT_KG;
+            int32_t *cr = acc + r * QUANT_NR;
+            for(size_t j = 0; j < QUANT_NR; j++) {
+                const int8_t *wj = wg + j * QUANT_KG;
+                cr[j] += ar[0] * wj[0] + ar[1] * wj[1] + ar[2] * wj[2]
+                         + ar[3] * wj[3];
+            }
+        }
+    }
+}
+
+#ifdef QUANT_X86
+/* AVX2: 4 rows of 2 x 8 columns. vpmaddubsw sums pairs of products into
+ * int16 and vpmaddwd sums the pairs into int32. */
+__attribute__((target("avx2")))
+static void quant_kernel_avx2(size_t kq, const uint8_t *a, size_t lda,
+                              const int8_t *w, int32_t *acc)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i c[4][2];
+    for(int r = 0; r < 4; r++) {
+        c[r][0] = _mm256_setzero_si256();
+        c[r][1] = _mm256_setzero_si256();
+    }
+    for(size_t g = 0; g < kq; g++) {
+        const int8_t *wg = w + g * QUANT_NR * QUANT_KG;
+        __m256i w0 = _mm256_loadu_si256((const __m256i *)wg);
+        __m256i w1 = _mm256_loadu_si256((const __m256i *)(wg + 32));
+        for(int r = 0; r < 4; r++) {
+            __m256i ab = _mm256_set1_epi32(quant_load32(a + r * lda
+                                                        + g * QUANT_KG));
+            __m256i p0 = _mm256_maddubs_epi16(ab, w0);
+            __m256i p1 = _mm256_maddubs_epi16(ab, w1);
+            c[r][0] = _mm256_add_epi32(c[r][0], _mm256_madd_epi16(p0, ones));
+            c[r][1] = _mm256_add_epi32(c[r][1], _mm256_madd_epi16(p1, ones));
+        }
+    }
+    for(int r = 0; r < 4; r++) {
+        _mm256_storeu_si256((__m256i *)(acc + r * QUANT_NR), c[r][0]);
+        _mm256_storeu_si256((__m256i *)(acc + r * QUANT_NR + 8), c[r][1]);
+    }
+}
+
+#ifdef CPU_HAVE_AVXVNNI
+/* AVX-VNNI: 4 rows of 2 x 8 columns, one vpdpbusd per 4 products */
+__attribute__((target("avx2,avxvnni")))
+static void quant_kernel_avxvnni(size_t kq, const uint8_t *a, size_t lda,
+                                 const int8_t *w, int32_t *acc)
+{
+    __m256i c[4][2];
+    for(int r = 0; r < 4; r++) {
+        c[r][0] = _mm256_setzero_si256();
+        c[r][1] = _mm256_setzero_si256();
+    }
+    for(size_t g = 0; g < kq; g++) {
+        const int8_t *wg = w + g * QUANT_NR * QUANT_KG;
+        __m256i w0 = _mm256_loadu_si256((const __m256i *)wg);
+        __m256i w1 = _mm256_loadu_si256((const __m256i *)(wg + 32));
+        for(int r = 0; r < 4; r++) {
+            __m256i ab = _mm256_set1_epi32(quant_load32(a + r * lda
+                                                        + g * QUANT_KG));
+            c[r][0] = _mm256_dpbusd_avx_epi32(c[r][0], ab, w0);
+            c[r][1] = _mm256_dpbusd_avx_epi32(c[r][1], ab, w1);
+        }
+    }
+    for(int r = 0; r < 4; r++) {
+        _mm256_storeu_si256((__m256i *)(acc + r * QUANT_NR), c[r][0]);
+        _mm256_storeu_si256((__m256i *)(acc + r * QUANT_NR + 8), c[r][1]);
+    }
+}
+#endif
+
+/* AVX-512: 8 rows of 2 x 16 columns, two panels share the broadcasts of
+ * the rows */
+__attribute__((target("avx512f,avx512bw")))
+static void quant_kernel_avx512(size_t kq, const uint8_t *a, size_t lda,
+                                const int8_t *w, int32_t *acc)
+{
+    const __m512i ones = _mm512_set1_epi16(1);
+    const int8_t *w1 = w + kq * QUANT_NR * QUANT_KG;
+    __m512i c[8][2];
+    for(int r = 0; r < 8; r++) {
+        c[r][0] = _mm512_setzero_si512();
+        c[r][1] = _mm512_setzero_si512();
+    }
+    for(size_t g = 0; g < kq; g++) {
+        __m512i w0g = _mm512_loadu_si512(w + g * QUANT_NR * QUANT_KG);
+        __m512i w1g = _mm512_loadu_si512(w1 + g * QUANT_NR * QUANT_KG);
+        for(int r = 0; r < 8; r++) {
+            __m512i ab = _mm512_set1_epi32(quant_load32(a + r * lda
+                                                        + g * QUANT_KG));
+            __m512i p0 = _mm512_maddubs_epi16(ab, w0g);
+            __m512i p1 = _mm512_maddubs_epi16(ab, w1g);
+            c[r][0] = _mm512_add_epi32(c[r][0], _mm512_madd_epi16(p0, ones));
+            c[r][1] = _mm512_add_epi32(c[r][1], _mm512_madd_epi16(p1, ones));
+        }
+    }
+    for(int r = 0; r < 8; r++) {
+        _mm512_storeu_si512(acc + r * QUANT_MAX_NR, c[r][0]);
+        _mm512_storeu_si512(acc + r * QUANT_MAX_NR + QUANT_NR, c[r][1]);
+    }
+}
+
+/* AVX-512 VNNI: 8 rows of 2 x 16 columns */
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void quant_kernel_avx512vnni(size_t kq, const uint8_t *a, size_t lda,
+                                    const int8_t *w, int32_t *acc)
+{
+    const int8_t *w1 = w + kq * QUANT_NR * QUANT_KG;
+    __m512i c[8][2];
+    for(int r = 0; r < 8; r++) {
+        c[r][0] = _mm512_setzero_si512();
+        c[r][1] = _mm512_setzero_si512();
+    }
+    for(size_t g = 0; g < kq; g++) {
+        __m512i w0g = _mm512_loadu_si512(w + g * QUANT_NR * QUANT_KG);
+        __m512i w1g = _mm512_loadu_si512(w1 + g * QUANT_NR * QUANT_KG);
+        for(int r = 0; r < 8; r++) {
+            __m512i ab = _mm512_set1_epi32(quant_load32(a + r * lda
+                                                        + g * QUANT_KG));
+            c[r][0] = _mm512_dpbusd_epi32(c[r][0], ab, w0g);
+            c[r][1] = _mm512_dpbusd_epi32(c[r][1], ab, w1g);
+        }
+    }
+    for(int r = 0; r < 8; r++) {
+        _mm512_storeu_si512(acc + r * QUANT_MAX_NR, c[r][0]);
+        _mm512_storeu_si512(acc + r * QUANT_MAX_NR + QUANT_NR, c[r][1]);
+    }
+}
+#endif
+
+/* Rows of the largest kernel, the quantized rows are padded to it */
+#define QUANT_MAX_MR 8
+
+/* quant_select_kernel: the kernel of the current CPU level and features */
+static struct quant_kernel quant_select_kernel(void)
+{
+    struct quant_kernel k = {quant_kernel_generic, 4, QUANT_NR};
+#ifdef QUANT_X86
+    const cpu_features_t *features = cpu_get_features();
+    switch(cpu_get_level()) {
+    case CPU_AVX512:
+        k.fn = features->avx512vnni ? quant_kernel_avx512vnni
+                                    : quant_kernel_avx512;
+        k.mr = 8;
+        k.nr = QUANT_MAX_NR;
+        break;
+    case CPU_AVX2:
+        k.fn = quant_kernel_avx2;
+#ifdef CPU_HAVE_AVXVNNI
+        if(features->avxvnni) k.fn = quant_kernel_avxvnni;
+#endif
+        break;
+    default:
+        break;
+    }
+#endif
+    return k;
+}
+
+/* quant_round: x rounded half away from zero and clamped to [lo, hi], NaN
+ * becomes zero */
+static long quant_round(double x, long lo, long hi)
+{
+    if(x != x) return 0;
+    if(x <= (double)lo) return lo;
+    if(x >= (double)hi) return hi;
+    return (long)(x < 0 ? x - 0.5 : x + 0.5);
+}
+
+/* quant_pad: n rounded up to a multiple of m */
+static size_t quant_pad(size_t n, size_t m)
+{
+    return (n + m - 1) / m * m;
+}
+
+/* quant_calibrate: scale and zero point that map [lo, hi], which contains
+ * zero, to the levels [qmin, qmax] */
+static void quant_calibrate(double lo, double hi, long qmin, long qmax,
+                            double *scale, int32_t *zero)
+{
+    if(!(hi > lo)) {
+        /* a constant zero column or row */
+        *scale = 0.0;
+        *zero = qmin < 0 ? 0 : (int32_t)qmin;
+        return;
+    }
+    *scale = (hi - lo) / (double)(qmax - qmin);
+    *zero = (int32_t)quant_round(qmin - lo / *scale, qmin, qmax);
+}
+
+/* quant_packed_index: position of the weight (k, j) in the panels of a
+ * tensor with kp padded rows */
+static size_t quant_packed_index(size_t kp, size_t k, size_t j)
+{
+    return (j / QUANT_NR) * kp * QUANT_NR + (k / QUANT_KG) * QUANT_NR
+           * QUANT_KG + (j % QUANT_NR) * QUANT_KG + k % QUANT_KG;
+}
+
+/* quant_from_tensor: Quantize the weights W (k x n) to int8 with a scale
+ * and a zero point per column. W can be any view of any element type. The
+ * range of a column is extended to contain zero, so zero is stored exactly,
+ * and NaN weights are stored as zero.
+ *
+ * It returns NULL and set errno to EINVAL if W is NULL or has more rows
+ * than the int32 accumulators allow (about 130000)
+ * It returns NULL and set errno to ENOMEM if the memory cannot be allocated
+ * It returns pointer to the new quantized tensor if operation success */
+quant_tensor_t *quant_from_tensor(const tensor_t *W)
+{
+    /* NULL checking */
+    if(W == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* shape checking */
+    if(W->nrows > QUANT_MAX_DEPTH) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t k = W->nrows, n = W->ncols;
+    size_t kp = quant_pad(k, QUANT_KG), np = quant_pad(n, QUANT_MAX_NR);
+    quant_tensor_t *q = malloc(sizeof *q);
+    double *lo = calloc(n, sizeof(double));
+    double *hi = calloc(n, sizeof(double));
+    if(q != NULL) {
+        q->nrows = k;
+        q->ncols = n;
+        q->scale = malloc(n * sizeof(double));
+        q->zero = malloc(n * sizeof(int32_t));
+        q->colsum = calloc(n, sizeof(int32_t));
+        q->packed = calloc(kp * np, sizeof(int8_t));
+    }
+    if(q == NULL || lo == NULL || hi == NULL || q->scale == NULL
+       || q->zero == NULL || q->colsum == NULL || q->packed == NULL) {
+        free_quant_tensor(q);
+        free(lo);
+        free(hi);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* the range of every column, row by row */
+    double v;
+    for(size_t i = 0; i < k; i++) {
+        for(size_t j = 0; j < n; j++) {
+            tensor_get_value(*W, i, j, &v);
+            if(v < lo[j]) lo[j] = v;
+            if(v > hi[j]) hi[j] = v;
+        }
+    }
+    for(size_t j = 0; j < n; j++) {
+        quant_calibrate(lo[j], hi[j], INT8_MIN, INT8_MAX, &q->scale[j],
+                        &q->zero[j]);
+    }
+
+    for(size_t i = 0; i < k; i++) {
+        for(size_t j = 0; j < n; j++) {
+            long w = q->zero[j];
+            tensor_get_value(*W, i, j, &v);
+            if(q->scale[j] > 0 && v == v) {
+                w = quant_round(v / q->scale[j] + q->zero[j], INT8_MIN,
+                                INT8_MAX);
+            }
+            q->packed[quant_packed_index(kp, i, j)] = (int8_t)w;
+            q->colsum[j] += (int32_t)w;
+        }
+    }
+    free(lo);
+    free(hi);
+    return q;
+}
+
+/* free_quant_tensor: Free quantized tensor q.
+ * It does nothing if q is NULL */
+void free_quant_tensor(quant_tensor_t *q)
+{
+    if(q == NULL) return;
+    free(q->scale);
+    free(q->zero);
+    free(q->colsum);
+    free(q->packed);
+    free(q);
+}
+
+/* quant_to_tensor: Store the dequantized weights of q in W, an allocated
+ * tensor of the same shape.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if q or W is NULL or
+ * the shapes do not match */
+int quant_to_tensor(const quant_tensor_t *q, tensor_t *W)
+{
+    /* NULL checking */
+    if(q == NULL || W == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(q->nrows != W->nrows || q->ncols != W->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t kp = quant_pad(q->nrows, QUANT_KG);
+    for(size_t i = 0; i < q->nrows; i++) {
+        for(size_t j = 0; j < q->ncols; j++) {
+            int32_t w = q->packed[quant_packed_index(kp, i, j)];
+            tensor_set_value(W, i, j, q->scale[j] * (w - q->zero[j]));
+        }
+    }
+    return 0;
+}
+
+/* quant_row: quantize the k doubles of x to 7-bit unsigned values in a,
+ * padded with zeros to kp bytes. It stores the scale, the zero point and
+ * the sum of the quantized values of the row. */
+static void quant_row(size_t k, size_t kp, const double *x, uint8_t *a,
+                      double *scale, int32_t *zero, int32_t *sum)
+{
+    double lo = 0.0, hi = 0.0;
+    for(size_t i = 0; i < k; i++) {
+        if(x[i] < lo) lo = x[i];
+        if(x[i] > hi) hi = x[i];
+    }
+    quant_calibrate(lo, hi, 0, 127, scale, zero);
+
+    int32_t s = 0;
+    if(*scale > 0) {
+        double inv = 1.0 / *scale, z = *zero;
+        for(size_t i = 0; i < k; i++) {
+            /* NaN is stored as zero, the zero point of the row */
+            a[i] = x[i] != x[i] ? (uint8_t)*zero
+                                : (uint8_t)quant_round(x[i] * inv + z, 0, 127);
+            s += a[i];
+        }
+    } else {
+        memset(a, 0, k);
+    }
+    memset(a + k, 0, kp - k);
+    *sum = s;
+}
+
+/* One quantized layer out = act(X * W + bias) split across threads over
+ * the rows of X */
+struct quant_task {
+    const tensor_t *X;
+    const quant_tensor_t *W;
+    const double *bias; // W->ncols doubles, or NULL
+    tensor_activation_fn_t act; // or NULL
+    struct quant_kernel kernel;
+    double *c; // TENSOR_FLOAT64 rows of out, ldc apart
+    size_t ldc;
+    int failed; // set when a scratch buffer cannot be allocated
+};
+
+/* quant_load_row: row i of X as contiguous doubles, in buf if needed */
+static const double *quant_load_row(const tensor_t *X, size_t i, double *buf)
+{
+    size_t elsize = tensor_dtype_size(X->dtype);
+    const char *row = (const char *)X->data + (X->offset + i * X->ld)
+                                              * elsize;
+    if(X->col_stride != 1 && X->ncols > 1) {
+        for(size_t j = 0; j < X->ncols; j++) {
+            tensor_get_value(*X, i, j, &buf[j]);
+        }
+        return buf;
+    }
+    if(X->dtype == TENSOR_FLOAT64) return (const double *)row;
+    tensor_convert_array(row, X->dtype, buf, TENSOR_FLOAT64, X->ncols);
+    return buf;
+}
+
+/* quant_block: quantize the mb rows of X from row i0 and compute their
+ * outputs, the scratch buffers hold QUANT_MB rows */
+static void quant_block(const struct quant_task *task, size_t i0, size_t mb,
+                        double *xbuf, uint8_t *a, double *sa, int32_t *za,
+                        int32_t *ra, int32_t *acc)
+{
+    const quant_tensor_t *W = task->W;
+    size_t k = W->nrows, n = W->ncols, kp = quant_pad(k, QUANT_KG);
+    size_t mr = task->kernel.mr, nr = task->kernel.nr;
+    size_t mbr = quant_pad(mb, mr);
+
+    for(size_t r = 0; r < mbr; r++) {
+        if(r < mb) {
+            const double *x = quant_load_row(task->X, i0 + r, xbuf);
+            quant_row(k, kp, x, a + r * kp, &sa[r], &za[r], &ra[r]);
+        } else {
+            memset(a + r * kp, 0, kp);
+        }
+    }
+
+    for(size_t j0 = 0; j0 < n; j0 += nr) {
+        const int8_t *panel = W->packed + j0 * kp;
+        size_t nc = n - j0 < nr ? n - j0 : nr;
+        for(size_t g = 0; g < mbr; g += mr) {
+            task->kernel.fn(kp / QUANT_KG, a + g * kp, kp, panel, acc);
+            for(size_t r = g; r < g + mr && r < mb; r++) {
+                double *c = task->c + (i0 + r) * task->ldc + j0;
+                const int32_t *cr = acc + (r - g) * nr;
+                for(size_t j = 0; j < nc; j++) {
+                    int64_t zw = W->zero[j0 + j];
+                    int64_t dot = (int64_t)cr[j]
+                                  - (int64_t)za[r] * W->colsum[j0 + j]
+                                  - zw * ra[r] + (int64_t)k * za[r] * zw;
+                    c[j] = sa[r] * W->scale[j0 + j] * (double)dot;
+                    if(task->bias != NULL) c[j] += task->bias[j0 + j];
+                }
+            }
+        }
+    }
+
+    if(task->act != NULL) {
+        for(size_t r = 0; r < mb; r++) {
+            double *c = task->c + (i0 + r) * task->ldc;
+            task->act(n, c, c);
+        }
+    }
+}
+
+/* quant_range: parallel_for body over the rows of X */
+static void quant_range(void *ctx, size_t begin, size_t end)
+{
+    struct quant_task *task = ctx;
+    size_t k = task->W->nrows, kp = quant_pad(k, QUANT_KG);
+    size_t mb = quant_pad(QUANT_MB, QUANT_MAX_MR);
+
+    /* doubles first, then int32 and bytes, so everything is aligned */
+    size_t size = (k + mb) * sizeof(double)
+                  + (2 * mb + QUANT_MAX_MR * QUANT_MAX_NR) * sizeof(int32_t)
+                  + mb * kp;
+    char *buf = tensor_pool_alloc(size);
+    if(buf == NULL) {
+        __atomic_store_n(&task->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    double *xbuf = (double *)buf;
+    double *sa = xbuf + k;
+    int32_t *za = (int32_t *)(sa + mb);
+    int32_t *ra = za + mb;
+    int32_t *acc = ra + mb;
+    uint8_t *a = (uint8_t *)(acc + QUANT_MAX_MR * QUANT_MAX_NR);
+
+    for(size_t i = begin; i < end; i += QUANT_MB) {
+        size_t rows = end - i < QUANT_MB ? end - i : QUANT_MB;
+        quant_block(task, i, rows, xbuf, a, sa, za, ra, acc);
+    }
+    tensor_pool_free(buf);
+}
+
+/* quant_element: address of the element (i, j) of t */
+static const char *quant_element(const tensor_t *t, size_t i, size_t j)
+{
+    return (const char *)t->data + (t->offset + i * t->ld + j * t->col_stride)
+                                   * tensor_dtype_size(t->dtype);
+}
+
+/* quant_overlaps: check whether the elements of tensors x and y can share
+ * memory */
+static int quant_overlaps(const tensor_t *x, const tensor_t *y)
+{
+    uintptr_t x0 = (uintptr_t)quant_element(x, 0, 0);
+    uintptr_t x1 = (uintptr_t)quant_element(x, x->nrows - 1, x->ncols - 1)
+                   + tensor_dtype_size(x->dtype) - 1;
+    uintptr_t y0 = (uintptr_t)quant_element(y, 0, 0);
+    uintptr_t y1 = (uintptr_t)quant_element(y, y->nrows - 1, y->ncols - 1)
+                   + tensor_dtype_size(y->dtype) - 1;
+    return x0 <= y1 && y0 <= x1;
+}
+
+/* quant_linear: compute the layer out = act(X * W + bias) with the int8
+ * weights W. X is m x k, W is k x n, bias is a 1 x n tensor or NULL and
+ * out must be an allocated m x n tensor that doesn't overlap X. Each row of
+ * X is quantized with its own scale and zero point before the product. X,
+ * bias and out can be any views of any element type; an out that is not
+ * a TENSOR_FLOAT64 tensor with unit column stride is computed in a
+ * temporary tensor and converted. Large products are split across threads
+ * over the rows of X.
+ *
+ * It returns zero if the operation succeed.
+ * It returns non-zero value and set errno to EINVAL if X, W or out is
+ * NULL, act is not valid, the shapes do not match or out overlaps X.
+ * It returns non-zero value and set errno to ENOMEM if the buffers cannot
+ * be allocated */
+int quant_linear(const tensor_t *X, const quant_tensor_t *W,
+                 const tensor_t *bias, tensor_activation_t act,
+                 tensor_t *out)
+{
+    /* NULL checking */
+    if(X == NULL || W == NULL || out == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((int)act < 0 || act >= TENSOR_NACTIVATIONS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(X->ncols != W->nrows || out->nrows != X->nrows
+       || out->ncols != W->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(bias != NULL && (bias->nrows != 1 || bias->ncols != W->ncols)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* alias checking */
+    if(quant_overlaps(out, X)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* the bias as contiguous doubles */
+    size_t n = W->ncols;
+    double *b = NULL;
+    if(bias != NULL) {
+        b = tensor_pool_alloc(n * sizeof(double));
+        if(b == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        for(size_t j = 0; j < n; j++) tensor_get_value(*bias, 0, j, &b[j]);
+    }
+
+    /* an output the blocks can't write is computed in double first */
+    tensor_t *out64 = out;
+    int err = 0;
+    if(out->dtype != TENSOR_FLOAT64
+       || (out->col_stride != 1 && out->ncols > 1)) {
+        out64 = allocate_tensor(out->nrows, out->ncols);
+        if(out64 == NULL) err = -1;
+    }
+
+    if(err == 0) {
+        struct quant_task task = {
+            X, W, b,
+            act == TENSOR_IDENTITY ? NULL : tensor_get_activation_fn(act),
+            quant_select_kernel(), (double *)out64->data + out64->offset,
+            out64->ld, 0
+        };
+        size_t work = (W->nrows > 0 ? W->nrows : 1) * n;
+        size_t grain = quant_pad(QUANT_GRAIN / work + 1, QUANT_MB);
+        err = parallel_for(0, X->nrows, grain, quant_range, &task);
+        if(err == 0 && task.failed) {
+            errno = ENOMEM;
+            err = -1;
+        }
+    }
+    if(err == 0 && out64 != out) err = tensor_convert(out64, out);
+
+    if(out64 != out && out64 != NULL) free_tensor(out64);
+    tensor_pool_free(b);
+    return err;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_QUANT_C_TEST
+#include <assert.h>
+#include <math.h>
+
+/* test_fill: pseudo random values in [lo, hi) */
+static void test_fill(tensor_t *t, double lo, double hi, unsigned seed)
+{
+    for(size_t i = 0; i < t->nrows; i++) {
+        for(size_t j = 0; j < t->ncols; j++) {
+            seed = seed * 1103515245u + 12345u;
+            double u = (double)(seed >> 8) / (1 << 24);
+            tensor_set_value(t, i, j, lo + (hi - lo) * u);
+        }
+    }
+}
+
+/* test_kernels: every kernel the CPU runs computes the same integers as
+ * the generic one, for bytes in the whole range of the operands */
+static void test_kernels(void)
+{
+    enum { KQ = 37, LDA = 4 * KQ + 4 };
+    uint8_t a[QUANT_MAX_MR * LDA];
+    int8_t w[KQ * QUANT_MAX_NR * QUANT_KG];
+    int32_t expected[QUANT_MAX_MR][QUANT_MAX_NR];
+    int32_t acc[QUANT_MAX_MR * QUANT_MAX_NR], block[4 * QUANT_NR];
+    unsigned seed = 7;
+
+    for(size_t i = 0; i < sizeof a; i++) {
+        seed = seed * 1103515245u + 12345u;
+        a[i] = (uint8_t)(i % 5 == 0 ? 127 : (seed >> 16) % 128);
+    }
+    for(size_t i = 0; i < sizeof w; i++) {
+        seed = seed * 1103515245u + 12345u;
+        w[i] = (int8_t)(i % 7 == 0 ? -128 : (int)((seed >> 16) % 256) - 128);
+    }
+    for(size_t r = 0; r < QUANT_MAX_MR; r += 4) {
+        for(size_t p = 0; p < QUANT_MAX_NR / QUANT_NR; p++) {
+            quant_kernel_generic(KQ, a + r * LDA, LDA,
+                                 w + p * KQ * QUANT_NR * QUANT_KG, block);
+            for(size_t i = 0; i < 4; i++) {
+                memcpy(&expected[r + i][p * QUANT_NR], block + i * QUANT_NR,
+                       sizeof(int32_t) * QUANT_NR);
+            }
+        }
+    }
+
+    struct quant_kernel kernels[5] = {{quant_kernel_generic, 4, QUANT_NR}};
+    size_t nkernels = 1;
+#ifdef QUANT_X86
+    const cpu_features_t *f = cpu_get_features();
+    struct quant_kernel avx2 = {quant_kernel_avx2, 4, QUANT_NR};
+    struct quant_kernel avx512 = {quant_kernel_avx512, 8, QUANT_MAX_NR};
+    struct quant_kernel vnni512 = {quant_kernel_avx512vnni, 8, QUANT_MAX_NR};
+    if(cpu_get_level() >= CPU_AVX2) kernels[nkernels++] = avx2;
+#ifdef CPU_HAVE_AVXVNNI
+    struct quant_kernel avxvnni = {quant_kernel_avxvnni, 4, QUANT_NR};
+    if(f->avxvnni) kernels[nkernels++] = avxvnni;
+#endif
+    if(cpu_get_level() >= CPU_AVX512) kernels[nkernels++] = avx512;
+    if(f->avx512vnni) kernels[nkernels++] = vnni512;
+#endif
+    for(size_t i = 0; i < nkernels; i++) {
+        struct quant_kernel k = kernels[i];
+        for(size_t r = 0; r < QUANT_MAX_MR; r += k.mr) {
+            for(size_t j = 0; j < QUANT_MAX_NR; j += k.nr) {
+                k.fn(KQ, a + r * LDA, LDA, w + j * KQ * QUANT_KG, acc);
+                for(size_t ri = 0; ri < k.mr; ri++) {
+                    assert(memcmp(acc + ri * k.nr, &expected[r + ri][j],
+                                  sizeof(int32_t) * k.nr) == 0);
+                }
+            }
+        }
+    }
+}
+
+/* test_reference: out = act(X * W + bias) from the same quantized values in
+ * double, and the exact product in double */
+static void test_reference(const tensor_t *X, const quant_tensor_t *q,
+                           const tensor_t *W, const tensor_t *bias,
+                           tensor_activation_t act, tensor_t *R,
+                           tensor_t *E)
+{
+    size_t k = X->ncols, kp = quant_pad(k, QUANT_KG);
+    double *x = malloc(k * sizeof(double));
+    uint8_t *a = malloc(kp);
+    for(size_t i = 0; i < X->nrows; i++) {
+        double sa;
+        int32_t za, ra;
+        for(size_t p = 0; p < k; p++) tensor_get_value(*X, i, p, &x[p]);
+        quant_row(k, kp, x, a, &sa, &za, &ra);
+        for(size_t j = 0; j < q->ncols; j++) {
+            double dot = 0.0, exact = 0.0, w, bj = 0.0;
+            for(size_t p = 0; p < k; p++) {
+                int32_t qw = q->packed[quant_packed_index(kp, p, j)];
+                dot += (double)(a[p] - za) * (qw - q->zero[j]);
+                tensor_get_value(*W, p, j, &w);
+                exact += x[p] * w;
+            }
+            if(bias != NULL) tensor_get_value(*bias, 0, j, &bj);
+            double r = sa * q->scale[j] * dot + bj, e = exact + bj;
+            tensor_activate_array(act, 1, &r, &r);
+            tensor_activate_array(act, 1, &e, &e);
+            tensor_set_value(R, i, j, r);
+            tensor_set_value(E, i, j, e);
+        }
+    }
+    free(a);
+    free(x);
+}
+
+/* test_linear: quant_linear of an m x k input and k x n weights against
+ * the references, on every level and with one and several threads */
+static void test_linear(size_t m, size_t n, size_t k, tensor_activation_t act)
+{
+    tensor_t *X = allocate_tensor(m, k);
+    tensor_t *W = allocate_tensor(k, n);
+    tensor_t *bias = allocate_tensor(1, n);
+    tensor_t *R = allocate_tensor(m, n), *E = allocate_tensor(m, n);
+    tensor_t *out = allocate_tensor(m, n), *first = allocate_tensor(m, n);
+    test_fill(X, -1.0, 3.0, (unsigned)(m * 31 + k));
+    test_fill(W, -0.5, 0.25, (unsigned)(n * 17 + k));
+    test_fill(bias, -1.0, 1.0, 3);
+    quant_tensor_t *q = quant_from_tensor(W);
+    assert(q != NULL);
+    test_reference(X, q, W, bias, act, R, E);
+
+    /* the quantization error of a dot product grows like sqrt(k) */
+    double tol = 0.02 * sqrt((double)k) + 1e-9;
+    size_t nthreads = parallel_get_nthreads();
+    for(int level = CPU_GENERIC; level <= (int)cpu_get_max_level(); level++) {
+        cpu_set_level((cpu_level_t)level);
+        for(size_t threads = 1; threads <= 4; threads += 3) {
+            parallel_set_nthreads(threads);
+            assert(quant_linear(X, q, bias, act, out) == 0);
+            if(level == CPU_GENERIC && threads == 1) tensor_convert(out, first);
+            for(size_t i = 0; i < m; i++) {
+                for(size_t j = 0; j < n; j++) {
+                    double y = TENSOR_AT(out, i, j), r = TENSOR_AT(R, i, j);
+                    assert(fabs(y - r) <= 1e-9 * (1.0 + fabs(r)));
+                    assert(fabs(y - TENSOR_AT(E, i, j)) <= tol);
+                    /* the same bits on every level and thread count */
+                    assert(y == TENSOR_AT(first, i, j));
+                }
+            }
+        }
+    }
+    cpu_set_level(cpu_get_max_level());
+    parallel_set_nthreads(nthreads);
+
+    free_quant_tensor(q);
+    free_tensor(first);
+    free_tensor(out);
+    free_tensor(E);
+    free_tensor(R);
+    free_tensor(bias);
+    free_tensor(W);
+    free_tensor(X);
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+
+    /* quantization of weights */
+    double values[] = {
+        -1.0, 0.0, 2.0, 0.5,
+        0.5, 0.0, 4.0, 0.5,
+        1.0, 0.0, 1.0, 0.5,
+    };
+    tensor_t *W = tensor_from_array(3, 4, values, TENSOR_FLOAT64);
+    tensor_t *D = allocate_tensor(3, 4);
+    quant_tensor_t *q = quant_from_tensor(W);
+    assert(q != NULL && q->nrows == 3 && q->ncols == 4);
+    assert(q->scale[0] == 2.0 / 255 && q->zero[0] == -1);
+    /* a zero column, and positive columns whose range starts at zero */
+    assert(q->scale[1] == 0.0 && q->zero[1] == 0);
+    assert(q->scale[2] == 4.0 / 255 && q->zero[2] == -128);
+    err = quant_to_tensor(q, D);
+    assert(err == 0);
+    for(size_t i = 0; i < 3; i++) {
+        for(size_t j = 0; j < 4; j++) {
+            double error = fabs(TENSOR_AT(D, i, j) - TENSOR_AT(W, i, j));
+            assert(error <= q->scale[j] + 1e-12);
+        }
+    }
+    /* zero is stored exactly */
+    assert(TENSOR_AT(D, 0, 1) == 0.0 && TENSOR_AT(D, 0, 2) != 0.0);
+    assert(fabs(TENSOR_AT(D, 1, 2) - 4.0) < 1e-12);
+    free_quant_tensor(q);
+
+    /* NaN weights and activations count as zero, also in a column and a
+     * row whose zero point is not zero */
+    double nan_values[12], zero_values[12];
+    for(size_t i = 0; i < 12; i++) nan_values[i] = zero_values[i] = values[i];
+    nan_values[2] = NAN;
+    zero_values[2] = 0.0;
+    tensor_t *Wn = tensor_from_array(3, 4, nan_values, TENSOR_FLOAT64);
+    tensor_t *Wz = tensor_from_array(3, 4, zero_values, TENSOR_FLOAT64);
+    quant_tensor_t *qn = quant_from_tensor(Wn);
+    quant_tensor_t *qz = quant_from_tensor(Wz);
+    assert(qn != NULL && qz != NULL && qn->zero[2] == -128);
+    err = quant_to_tensor(qn, D);
+    assert(err == 0 && TENSOR_AT(D, 0, 2) == 0.0);
+    tensor_t *Xn = allocate_tensor(6, 3), *Xz = allocate_tensor(6, 3);
+    tensor_t *On = allocate_tensor(6, 4), *Oz = allocate_tensor(6, 4);
+    test_fill(Xn, -2.0, -0.5, 3);
+    test_fill(Xz, -2.0, -0.5, 3);
+    TENSOR_AT(Xn, 4, 1) = NAN;
+    TENSOR_AT(Xz, 4, 1) = 0.0;
+    err = quant_linear(Xn, qn, NULL, TENSOR_IDENTITY, On);
+    assert(err == 0);
+    err = quant_linear(Xz, qz, NULL, TENSOR_IDENTITY, Oz);
+    assert(err == 0);
+    for(size_t i = 0; i < 6; i++) {
+        for(size_t j = 0; j < 4; j++) {
+            assert(TENSOR_AT(On, i, j) == TENSOR_AT(Oz, i, j));
+        }
+    }
+    free_tensor(Xn);
+    free_tensor(Xz);
+    free_tensor(On);
+    free_tensor(Oz);
+    free_quant_tensor(qn);
+    free_quant_tensor(qz);
+    free_tensor(Wn);
+    free_tensor(Wz);
+
+    /* a larger random tensor */
+    tensor_t *V = allocate_tensor(300, 70), *Vd = allocate_tensor(300, 70);
+    test_fill(V, -3.0, 1.0, 11);
+    q = quant_from_tensor(V);
+    assert(q != NULL && quant_to_tensor(q, Vd) == 0);
+    for(size_t i = 0; i < 300; i++) {
+        for(size_t j = 0; j < 70; j++) {
+            double error = fabs(TENSOR_AT(Vd, i, j) - TENSOR_AT(V, i, j));
+            assert(error <= q->scale[j] + 1e-12);
+        }
+    }
+    free_quant_tensor(q);
+    free_tensor(Vd);
+    free_tensor(V);
+
+    /* the kernels */
+    for(int level = CPU_GENERIC; level <= (int)cpu_get_max_level(); level++) {
+        cpu_set_level((cpu_level_t)level);
+        test_kernels();
+    }
+    cpu_set_level(cpu_get_max_level());
+
+    /* layers of every shape class: edges of the panels and row groups */
+    test_linear(1, 1, 1, TENSOR_IDENTITY);
+    test_linear(3, 5, 7, TENSOR_RELU);
+    test_linear(9, 16, 4, TENSOR_IDENTITY);
+    test_linear(70, 33, 130, TENSOR_SIGMOID);
+    test_linear(200, 100, 257, TENSOR_IDENTITY);
+
+    /* other element types and views */
+    tensor_t *X = allocate_typed_tensor(5, 3, TENSOR_FLOAT32);
+    tensor_t *Xt = allocate_tensor(3, 5), Xv;
+    tensor_t *out = allocate_typed_tensor(5, 4, TENSOR_FLOAT32);
+    tensor_t *out64 = allocate_tensor(5, 4);
+    test_fill(X, -2.0, 2.0, 5);
+    tensor_transpose_view(Xt, &Xv);
+    for(size_t i = 0; i < 5; i++) {
+        for(size_t j = 0; j < 3; j++) {
+            double v;
+            tensor_get_value(*X, i, j, &v);
+            tensor_set_value(&Xv, i, j, v);
+        }
+    }
+    q = quant_from_tensor(W);
+    err = quant_linear(X, q, NULL, TENSOR_TANH, out);
+    assert(err == 0);
+    err = quant_linear(&Xv, q, NULL, TENSOR_TANH, out64);
+    assert(err == 0);
+    for(size_t i = 0; i < 5; i++) {
+        for(size_t j = 0; j < 4; j++) {
+            double v;
+            tensor_get_value(*out, i, j, &v);
+            assert(v == (float)TENSOR_AT(out64, i, j));
+        }
+    }
+
+    /* it returns non-zero value if the shapes do not match */
+    err = quant_linear(X, q, NULL, TENSOR_RELU, D);
+    assert(err != 0 && errno == EINVAL);
+    err = quant_linear(X, q, W, TENSOR_RELU, out);
+    assert(err != 0 && errno == EINVAL);
+    err = quant_to_tensor(q, out);
+    assert(err != 0 && errno == EINVAL);
+
+    /* it returns non-zero value if act is not valid */
+    err = quant_linear(X, q, NULL, TENSOR_NACTIVATIONS, out);
+    assert(err != 0 && errno == EINVAL);
+
+    /* it returns non-zero value if out overlaps X */
+    tensor_t *S = allocate_tensor(4, 4);
+    quant_tensor_t *qs = quant_from_tensor(S);
+    err = quant_linear(S, qs, NULL, TENSOR_RELU, S);
+    assert(err != 0 && errno == EINVAL);
+
+    /* it returns non-zero value if one of the arguments is NULL */
+    assert(quant_from_tensor(NULL) == NULL && errno == EINVAL);
+    err = quant_linear(NULL, q, NULL, TENSOR_RELU, out);
+    assert(err != 0 && errno == EINVAL);
+    err = quant_linear(X, NULL, NULL, TENSOR_RELU, out);
+    assert(err != 0 && errno == EINVAL);
+    err = quant_to_tensor(NULL, D);
+    assert(err != 0 && errno == EINVAL);
+    free_quant_tensor(NULL);
+
+    free_quant_tensor(qs);
+    free_tensor(S);
+    free_quant_tensor(q);
+    free_tensor(out64);
+    free_tensor(out);
+    free_tensor(Xt);
+    free_tensor(X);
+    free_tensor(D);
+    free_tensor(W);
+    return 0;
+}
+#endif
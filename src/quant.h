@@ -0,0 +1,52 @@
+/* quant - Int8 quantized weights and inference of dense layers
+ * A quantized tensor stores the weights W of a layer as int8 with a scale
+ * and a zero point per output channel (column):
+ *
+ *   W(k, j) ~ scale[j] * (q(k, j) - zero[j])
+ *
+ * so a layer reads a quarter of the memory of the same weights in int8
+ * instead of double. The scale and zero point of a column are calibrated on
+ * its minimum and maximum so the 256 levels cover its range exactly.
+ *
+ * quant_linear quantizes each row of the input on the fly to 7-bit
+ * unsigned values with its own scale and zero point, multiplies it with
+ * the int8 weights into int32 accumulators and converts the result back to
+ * double with the bias and the activation of the layer. The products use
+ * vpdpbusd on CPUs with AVX-512 VNNI or AVX-VNNI and vpmaddubsw otherwise.
+ * The activations are kept in 7 bits so the int16 pairs of vpmaddubsw
+ * can't saturate: every kernel computes the exact same integers.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_QUANT_H
+#define SIMPLE_NN_QUANT_H
+
+#include <stdint.h>
+
+#include "tensor.h"
+#include "activation.h"
+
+/* The weights are packed in panels of 16 columns: the 4 weights of rows
+ * 4g to 4g + 3 of a column are stored next to each other, the 16 columns
+ * of a group of rows make 64 bytes. Rows are padded to a multiple of 4 and
+ * columns to a multiple of 32 with zeros. */
+struct quant_tensor {
+    size_t nrows;
+    size_t ncols;
+    double *scale; // ncols scales
+    int32_t *zero; // ncols zero points, in [-128, 127]
+    int32_t *colsum; // ncols sums of the quantized weights of a column
+    int8_t *packed; // quantized weights in panels
+};
+typedef struct quant_tensor quant_tensor_t;
+
+quant_tensor_t *quant_from_tensor(const tensor_t *W);
+void free_quant_tensor(quant_tensor_t *q);
+int quant_to_tensor(const quant_tensor_t *q, tensor_t *W);
+
+int quant_linear(const tensor_t *X, const quant_tensor_t *W,
+                 const tensor_t *bias, tensor_activation_t act,
+                 tensor_t *out);
+
+#endif
@@ -0,0 +1,1166 @@
+/* reduce - Sums, means, maxima and norms of tensors
+ * Every reduction comes in three forms: over the whole tensor, one result
+ * per row (the _rows functions) and one result per column (the _cols
+ * functions). Sums are pairwise: blocks of 256 elements are added
+ * in 16 interleaved lanes and the block sums are added as a binary tree,
+ * so the rounding error grows with log(n) instead of n. Column reductions
+ * walk the rows of the tensor in order and add whole rows of a block of
+ * columns at once, they never walk down a single column.
+ *
+ * The results don't depend on the CPU level or the number of threads.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+
+#include "tensor.h"
+#include "reduce.h"
+#include "pool.h"
+#include "cpu.h"
+#include "parallel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define REDUCE_X86 1
+#include <immintrin.h>
+#endif
+
+/* Interleaved partial sums of a block, the same on every CPU level */
+#define REDUCE_LANES 16
+/* Elements added in lanes before the sums are combined pairwise */
+#define REDUCE_BLOCK 256
+/* Elements of a row reduced by one task. Rows are cut at fixed columns so
+ * the results don't depend on the number of threads. */
+#define REDUCE_CHUNK 4096
+/* Columns and rows of one task of the column reductions. The leaves of
+ * the pairwise sum add REDUCE_ROW_BLOCK rows one after the other. */
+#define REDUCE_COLS 512
+#define REDUCE_SEG_ROWS 8192
+#define REDUCE_ROW_BLOCK 16
+/* Levels of the pairwise sum of REDUCE_SEG_ROWS rows */
+#define REDUCE_LEVELS 10
+/* Elements per piece of a parallel loop */
+#define REDUCE_GRAIN 32768
+
+enum reduce_op {
+    REDUCE_SUM,
+    REDUCE_SUMSQ, // sum of the squares
+    REDUCE_MAX,
+    REDUCE_ARGMAX
+};
+
+struct reduce_kernels {
+    /* add x, or the squares of x, to lanes; n is a multiple of
+     * REDUCE_LANES */
+    void (*lanes)(size_t n, const double *x, int square, double *lanes);
+    /* largest of n elements, NaN if one of them is NaN */
+    double (*max)(size_t n, const double *x);
+    /* acc[j] = acc[j] op x[j] for REDUCE_SUM, REDUCE_SUMSQ and
+     * REDUCE_MAX */
+    void (*accumulate)(size_t n, const double *x, enum reduce_op op,
+                       double *acc);
+};
+
+/* reduce_max2: the larger of a and b, NaN if one of them is NaN */
+static double reduce_max2(double a, double b)
+{
+    if(a != a || b != b) return a != a ? a : b;
+    return b > a ? b : a;
+}
+
+/* Generic kernels */
+static void reduce_lanes_generic(size_t n, const double *x, int square,
+                                 double *lanes)
+{
+    for(size_t i = 0; i < n; i += REDUCE_LANES) {
+        for(int l = 0; l < REDUCE_LANES; l++) {
+            double v = x[i + l];
+            lanes[l] += square ? v * v : v;
+        }
+    }
+}
+
+static double reduce_max_generic(size_t n, const double *x)
+{
+    double m = -INFINITY;
+    int nan = 0;
+    for(size_t i = 0; i < n; i++) {
+        nan |= x[i] != x[i];
+        m = x[i] > m ? x[i] : m;
+    }
+    return nan ? NAN : m;
+}
+
+static void reduce_accumulate_generic(size_t n, const double *x,
+                                      enum reduce_op op, double *acc)
+{
+    switch(op) {
+    case REDUCE_SUM:
+        for(size_t j = 0; j < n; j++) acc[j] = acc[j] + x[j];
+        break;
+    case REDUCE_SUMSQ:
+        for(size_t j = 0; j < n; j++) acc[j] = acc[j] + x[j] * x[j];
+        break;
+    default:
+        for(size_t j = 0; j < n; j++) acc[j] = reduce_max2(acc[j], x[j]);
+        break;
+    }
+}
+
+#ifdef REDUCE_X86
+/* SIMD kernels of one level over the primitives REDUCE_V (vector type),
+ * REDUCE_W (doubles per vector), REDUCE_LOAD, REDUCE_STORE, REDUCE_SET1,
+ * REDUCE_ADD, REDUCE_MUL, REDUCE_MAX and REDUCE_KEEPNAN(m, x), which makes
+ * the lanes of m NaN where x is NaN. REDUCE_MAX(x, m) returns m if either
+ * is NaN. */
+#define REDUCE_NV (REDUCE_LANES / REDUCE_W)
+
+#define REDUCE_DEFINE_KERNELS(level)                                    \
+    REDUCE_TARGET static void reduce_lanes_##level(size_t n,            \
+                                                   const double *x,     \
+                                                   int square,          \
+                                                   double *lanes)       \
+    {                                                                   \
+        REDUCE_V acc[REDUCE_NV];                                        \
+        for(int v = 0; v < REDUCE_NV; v++) {                            \
+            acc[v] = REDUCE_LOAD(lanes + v * REDUCE_W);                 \
+        }                                                               \
+        if(square) {                                                    \
+            for(size_t i = 0; i < n; i += REDUCE_LANES) {               \
+                for(int v = 0; v < REDUCE_NV; v++) {                    \
+                    REDUCE_V y = REDUCE_LOAD(x + i + v * REDUCE_W);     \
+                    acc[v] = REDUCE_ADD(acc[v], REDUCE_MUL(y, y));      \
+                }                                                       \
+            }                                                           \
+        } else {                                                        \
+            for(size_t i = 0; i < n; i += REDUCE_LANES) {               \
+                for(int v = 0; v < REDUCE_NV; v++) {                    \
+                    REDUCE_V y = REDUCE_LOAD(x + i + v * REDUCE_W);     \
+                    acc[v] = REDUCE_ADD(acc[v], y);                     \
+                }                                                       \
+            }                                                           \
+        }                                                               \
+        for(int v = 0; v < REDUCE_NV; v++) {                            \
+            REDUCE_STORE(lanes + v * REDUCE_W, acc[v]);                 \
+        }                                                               \
+    }                                                                   \
+                                                                        \
+    REDUCE_TARGET static double reduce_max_##level(size_t n,            \
+                                                   const double *x)     \
+    {                                                                   \
+        REDUCE_V m0 = REDUCE_SET1(-INFINITY), m1 = m0;                  \
+        double lanes[2 * REDUCE_W];                                     \
+        size_t i = 0;                                                   \
+        for(; i + 2 * REDUCE_W <= n; i += 2 * REDUCE_W) {               \
+            REDUCE_V y0 = REDUCE_LOAD(x + i);                           \
+            REDUCE_V y1 = REDUCE_LOAD(x + i + REDUCE_W);                \
+            m0 = REDUCE_KEEPNAN(REDUCE_MAX(y0, m0), y0);                \
+            m1 = REDUCE_KEEPNAN(REDUCE_MAX(y1, m1), y1);                \
+        }                                                               \
+        REDUCE_STORE(lanes, m0);                                        \
+        REDUCE_STORE(lanes + REDUCE_W, m1);                             \
+        double m = reduce_max_generic(n - i, x + i);                    \
+        for(int l = 0; l < 2 * REDUCE_W; l++) {                         \
+            m = reduce_max2(m, lanes[l]);                               \
+        }                                                               \
+        return m;                                                       \
+    }                                                                   \
+                                                                        \
+    REDUCE_TARGET static void reduce_accumulate_##level(size_t n,       \
+                                                        const double *x, \
+                                                        enum reduce_op op, \
+                                                        double *acc)    \
+    {                                                                   \
+        size_t j = 0;                                                   \
+        switch(op) {                                                    \
+        case REDUCE_SUM:                                                \
+            for(; j + REDUCE_W <= n; j += REDUCE_W) {                   \
+                REDUCE_STORE(acc + j, REDUCE_ADD(REDUCE_LOAD(acc + j),  \
+                                                 REDUCE_LOAD(x + j)));  \
+            }                                                           \
+            break;                                                      \
+        case REDUCE_SUMSQ:                                              \
+            for(; j + REDUCE_W <= n; j += REDUCE_W) {                   \
+                REDUCE_V y = REDUCE_LOAD(x + j);                        \
+                REDUCE_STORE(acc + j, REDUCE_ADD(REDUCE_LOAD(acc + j),  \
+                                                 REDUCE_MUL(y, y)));    \
+            }                                                           \
+            break;                                                      \
+        default:                                                        \
+            for(; j + REDUCE_W <= n; j += REDUCE_W) {                   \
+                REDUCE_V y = REDUCE_LOAD(x + j);                        \
+                REDUCE_V m = REDUCE_MAX(y, REDUCE_LOAD(acc + j));       \
+                REDUCE_STORE(acc + j, REDUCE_KEEPNAN(m, y));            \
+            }                                                           \
+            break;                                                      \
+        }                                                               \
+        reduce_accumulate_generic(n - j, x + j, op, acc + j);           \
+    }
+
+/* SSE2 level */
+#define REDUCE_TARGET __attribute__((target("sse2")))
+#define REDUCE_V __m128d
+#define REDUCE_W 2
+#define REDUCE_LOAD(p) _mm_loadu_pd(p)
+#define REDUCE_STORE(p, v) _mm_storeu_pd(p, v)
+#define REDUCE_SET1(a) _mm_set1_pd(a)
+#define REDUCE_ADD(a, b) _mm_add_pd(a, b)
+#define REDUCE_MUL(a, b) _mm_mul_pd(a, b)
+#define REDUCE_MAX(a, b) _mm_max_pd(a, b)
+#define REDUCE_KEEPNAN(m, x) _mm_or_pd(m, _mm_and_pd(_mm_cmpunord_pd(x, x), x))
+REDUCE_DEFINE_KERNELS(sse2)
+#undef REDUCE_TARGET
+#undef REDUCE_V
+#undef REDUCE_W
+#undef REDUCE_LOAD
+#undef REDUCE_STORE
+#undef REDUCE_SET1
+#undef REDUCE_ADD
+#undef REDUCE_MUL
+#undef REDUCE_MAX
+#undef REDUCE_KEEPNAN
+
+/* AVX2 level */
+#define REDUCE_TARGET __attribute__((target("avx2")))
+#define REDUCE_V __m256d
+#define REDUCE_W 4
+#define REDUCE_LOAD(p) _mm256_loadu_pd(p)
+#define REDUCE_STORE(p, v) _mm256_storeu_pd(p, v)
+#define REDUCE_SET1(a) _mm256_set1_pd(a)
+#define REDUCE_ADD(a, b) _mm256_add_pd(a, b)
+#define REDUCE_MUL(a, b) _mm256_mul_pd(a, b)
+#define REDUCE_MAX(a, b) _mm256_max_pd(a, b)
+#define REDUCE_KEEPNAN(m, x)                                            \
+    _mm256_blendv_pd(m, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q))
+REDUCE_DEFINE_KERNELS(avx2)
+#undef REDUCE_TARGET
+#undef REDUCE_V
+#undef REDUCE_W
+#undef REDUCE_LOAD
+#undef REDUCE_STORE
+#undef REDUCE_SET1
+#undef REDUCE_ADD
+#undef REDUCE_MUL
+#undef REDUCE_MAX
+#undef REDUCE_KEEPNAN
+
+/* AVX-512 level */
+#define REDUCE_TARGET __attribute__((target("avx512f")))
+#define REDUCE_V __m512d
+#define REDUCE_W 8
+#define REDUCE_LOAD(p) _mm512_loadu_pd(p)
+#define REDUCE_STORE(p, v) _mm512_storeu_pd(p, v)
+#define REDUCE_SET1(a) _mm512_set1_pd(a)
+#define REDUCE_ADD(a, b) _mm512_add_pd(a, b)
+#define REDUCE_MUL(a, b) _mm512_mul_pd(a, b)
+#define REDUCE_MAX(a, b) _mm512_max_pd(a, b)
+#define REDUCE_KEEPNAN(m, x)                                            \
+    _mm512_mask_mov_pd(m, _mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q), x)
+REDUCE_DEFINE_KERNELS(avx512)
+#undef REDUCE_TARGET
+#undef REDUCE_V
+#undef REDUCE_W
+#undef REDUCE_LOAD
+#undef REDUCE_STORE
+#undef REDUCE_SET1
+#undef REDUCE_ADD
+#undef REDUCE_MUL
+#undef REDUCE_MAX
+#undef REDUCE_KEEPNAN
+
+#define REDUCE_LEVEL_KERNELS(level)                                     \
+    {reduce_lanes_##level, reduce_max_##level, reduce_accumulate_##level}
+
+/* Kernels of every cpu_level_t */
+static const struct reduce_kernels reduce_kernels[CPU_NLEVELS] = {
+    REDUCE_LEVEL_KERNELS(generic), REDUCE_LEVEL_KERNELS(sse2),
+    REDUCE_LEVEL_KERNELS(avx2), REDUCE_LEVEL_KERNELS(avx512)
+};
+#else
+#define REDUCE_GENERIC_KERNELS                                          \
+    {reduce_lanes_generic, reduce_max_generic, reduce_accumulate_generic}
+static const struct reduce_kernels reduce_kernels[CPU_NLEVELS] = {
+    REDUCE_GENERIC_KERNELS, REDUCE_GENERIC_KERNELS, REDUCE_GENERIC_KERNELS,
+    REDUCE_GENERIC_KERNELS
+};
+#endif
+
+/* reduce_pairwise: sum of the n elements of x, or of their squares */
+static double reduce_pairwise(const struct reduce_kernels *k, size_t n,
+                              const double *x, int square)
+{
+    if(n > REDUCE_BLOCK) {
+        size_t half = n / 2 / REDUCE_LANES * REDUCE_LANES;
+        return reduce_pairwise(k, half, x, square)
+               + reduce_pairwise(k, n - half, x + half, square);
+    }
+
+    double lanes[REDUCE_LANES] = {0};
+    size_t body = n / REDUCE_LANES * REDUCE_LANES;
+    k->lanes(body, x, square, lanes);
+    for(size_t i = body; i < n; i++) {
+        lanes[i - body] += square ? x[i] * x[i] : x[i];
+    }
+
+    /* the lanes are added as a tree too */
+    for(int width = REDUCE_LANES / 2; width > 0; width /= 2) {
+        for(int l = 0; l < width; l++) lanes[l] += lanes[l + width];
+    }
+    return lanes[0];
+}
+
+/* reduce_find: index of the first element of x equal to m, or of the first
+ * NaN if m is NaN */
+static size_t reduce_find(size_t n, const double *x, double m)
+{
+    for(size_t i = 0; i < n; i++) {
+        if(m != m ? x[i] != x[i] : x[i] == m) return i;
+    }
+    return 0;
+}
+
+/* reduce_load: get n elements of the row i of t from column j as doubles.
+ * They are converted into buf unless they already are contiguous
+ * doubles. */
+static const double *reduce_load(const tensor_t *t, size_t i, size_t j,
+                                 size_t n, double *buf)
+{
+    size_t elsize = tensor_dtype_size(t->dtype);
+    const char *src = (const char *)t->data
+                      + (t->offset + i * t->ld + j * t->col_stride) * elsize;
+
+    if(t->col_stride == 1 || n == 1) {
+        if(t->dtype == TENSOR_FLOAT64) return (const double *)src;
+        tensor_convert_array(src, t->dtype, buf, TENSOR_FLOAT64, n);
+        return buf;
+    }
+    for(size_t k = 0; k < n; k++) {
+        tensor_convert_array(src + k * t->col_stride * elsize, t->dtype,
+                             buf + k, TENSOR_FLOAT64, 1);
+    }
+    return buf;
+}
+
+/* reduce_combine: combine the n partial results of op in values. Sums
+ * are added pairwise. For the maximum, the position of the first partial
+ * holding it is stored in best. */
+static double reduce_combine(const struct reduce_kernels *k,
+                             enum reduce_op op, size_t n,
+                             const double *values, size_t *best)
+{
+    if(op == REDUCE_SUM || op == REDUCE_SUMSQ) {
+        return reduce_pairwise(k, n, values, 0);
+    }
+
+    size_t b = 0;
+    for(size_t s = 1; s < n; s++) {
+        if(values[b] != values[b]) break;
+        if(values[s] > values[b] || values[s] != values[s]) b = s;
+    }
+    *best = b;
+    return values[b];
+}
+
+/* One reduction along the rows: every row is cut into nseg segments of
+ * REDUCE_CHUNK columns, whose partial results go to values and, for
+ * REDUCE_ARGMAX, the column of their maximum to index. */
+struct reduce_rows_task {
+    enum reduce_op op;
+    const struct reduce_kernels *kernels;
+    tensor_t x;
+    size_t nseg;
+    double *values;
+    size_t *index;
+};
+
+/* reduce_rows_range: parallel_for body over the segments */
+static void reduce_rows_range(void *ctx, size_t begin, size_t end)
+{
+    const struct reduce_rows_task *task = ctx;
+    const struct reduce_kernels *k = task->kernels;
+    double buf[REDUCE_CHUNK];
+
+    for(size_t item = begin; item < end; item++) {
+        size_t i = item / task->nseg;
+        size_t j = item % task->nseg * REDUCE_CHUNK;
+        size_t n = task->x.ncols - j;
+        if(n > REDUCE_CHUNK) n = REDUCE_CHUNK;
+        const double *x = reduce_load(&task->x, i, j, n, buf);
+
+        switch(task->op) {
+        case REDUCE_SUM:
+        case REDUCE_SUMSQ:
+            task->values[item] = reduce_pairwise(k, n, x,
+                                                 task->op == REDUCE_SUMSQ);
+            break;
+        case REDUCE_MAX:
+            task->values[item] = k->max(n, x);
+            break;
+        case REDUCE_ARGMAX:
+            task->values[item] = k->max(n, x);
+            task->index[item] = j + reduce_find(n, x, task->values[item]);
+            break;
+        }
+    }
+}
+
+/* reduce_rows_run: compute the partial results of op over the segments of
+ * the rows of X into a new task. The partials are freed with
+ * reduce_rows_free.
+ * It returns non-zero value and set errno to ENOMEM if the partials cannot
+ * be allocated */
+static int reduce_rows_run(enum reduce_op op, const tensor_t *X,
+                           struct reduce_rows_task *task)
+{
+    task->op = op;
+    task->kernels = &reduce_kernels[cpu_get_level()];
+    task->x = *X;
+    task->nseg = (X->ncols + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+    task->index = NULL;
+
+    size_t nitems = X->nrows * task->nseg;
+    task->values = tensor_pool_alloc(nitems * sizeof(double));
+    if(op == REDUCE_ARGMAX) {
+        task->index = tensor_pool_alloc(nitems * sizeof(size_t));
+    }
+    if(task->values == NULL || (op == REDUCE_ARGMAX && task->index == NULL)) {
+        tensor_pool_free(task->index);
+        tensor_pool_free(task->values);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t width = X->ncols < REDUCE_CHUNK ? X->ncols : REDUCE_CHUNK;
+    return parallel_for(0, nitems, (REDUCE_GRAIN + width - 1) / width,
+                        reduce_rows_range, task);
+}
+
+static void reduce_rows_free(struct reduce_rows_task *task)
+{
+    tensor_pool_free(task->index);
+    tensor_pool_free(task->values);
+}
+
+/* One reduction along the columns: the rows are cut into segments of
+ * REDUCE_SEG_ROWS rows and the columns into chunks of REDUCE_COLS
+ * columns. The result of each segment is a row of values, and of index
+ * for REDUCE_ARGMAX. */
+struct reduce_cols_task {
+    enum reduce_op op;
+    const struct reduce_kernels *kernels;
+    tensor_t x;
+    size_t nchunks;
+    double *values; // nseg x ncols
+    size_t *index; // nseg x ncols
+};
+
+/* reduce_cols_leaf: reduce the rows [r0, r0 + nr) of the nc columns from
+ * j0 into acc one row after the other */
+static void reduce_cols_leaf(const struct reduce_cols_task *task, size_t r0,
+                             size_t nr, size_t j0, size_t nc, double *acc,
+                             size_t *index)
+{
+    double buf[REDUCE_COLS];
+
+    for(size_t j = 0; j < nc; j++) {
+        acc[j] = task->op < REDUCE_MAX ? 0.0 : -INFINITY;
+        if(index != NULL) index[j] = r0;
+    }
+    for(size_t r = r0; r < r0 + nr; r++) {
+        const double *x = reduce_load(&task->x, r, j0, nc, buf);
+        if(index == NULL) {
+            task->kernels->accumulate(nc, x, task->op, acc);
+            continue;
+        }
+        for(size_t j = 0; j < nc; j++) {
+            if(acc[j] != acc[j]) continue;
+            if(x[j] > acc[j] || x[j] != x[j]) {
+                acc[j] = x[j];
+                index[j] = r;
+            }
+        }
+    }
+}
+
+/* reduce_cols_pairwise: sum the rows [r0, r0 + nr) of the nc columns from
+ * j0 into acc as a binary tree of leaves. scratch holds REDUCE_COLS
+ * doubles for each level below. */
+static void reduce_cols_pairwise(const struct reduce_cols_task *task,
+                                 size_t r0, size_t nr, size_t j0, size_t nc,
+                                 double *acc, double *scratch)
+{
+    if(nr <= REDUCE_ROW_BLOCK) {
+        reduce_cols_leaf(task, r0, nr, j0, nc, acc, NULL);
+        return;
+    }
+
+    size_t half = nr / 2;
+    reduce_cols_pairwise(task, r0, half, j0, nc, acc, scratch);
+    reduce_cols_pairwise(task, r0 + half, nr - half, j0, nc, scratch,
+                         scratch + REDUCE_COLS);
+    task->kernels->accumulate(nc, scratch, REDUCE_SUM, acc);
+}
+
+/* reduce_cols_range: parallel_for body over the pairs of a segment and a
+ * chunk */
+static void reduce_cols_range(void *ctx, size_t begin, size_t end)
+{
+    const struct reduce_cols_task *task = ctx;
+    double scratch[REDUCE_LEVELS * REDUCE_COLS];
+    size_t ncols = task->x.ncols;
+
+    for(size_t item = begin; item < end; item++) {
+        size_t seg = item / task->nchunks;
+        size_t r0 = seg * REDUCE_SEG_ROWS;
+        size_t j0 = item % task->nchunks * REDUCE_COLS;
+        size_t nr = task->x.nrows - r0;
+        size_t nc = ncols - j0;
+        if(nr > REDUCE_SEG_ROWS) nr = REDUCE_SEG_ROWS;
+        if(nc > REDUCE_COLS) nc = REDUCE_COLS;
+        double *acc = task->values + seg * ncols + j0;
+
+        if(task->op == REDUCE_SUM || task->op == REDUCE_SUMSQ) {
+            reduce_cols_pairwise(task, r0, nr, j0, nc, acc, scratch);
+        } else {
+            size_t *index = NULL;
+            if(task->index != NULL) index = task->index + seg * ncols + j0;
+            reduce_cols_leaf(task, r0, nr, j0, nc, acc, index);
+        }
+    }
+}
+
+/* reduce_cols_run: compute op over every column of X into out, and the
+ * row of the maximum into index for REDUCE_ARGMAX.
+ * It returns non-zero value and set errno to ENOMEM if the partials cannot
+ * be allocated */
+static int reduce_cols_run(enum reduce_op op, const tensor_t *X,
+                           double *out, size_t *index)
+{
+    struct reduce_cols_task task;
+    size_t ncols = X->ncols;
+    size_t nseg = (X->nrows + REDUCE_SEG_ROWS - 1) / REDUCE_SEG_ROWS;
+
+    task.op = op;
+    task.kernels = &reduce_kernels[cpu_get_level()];
+    task.x = *X;
+    task.nchunks = (ncols + REDUCE_COLS - 1) / REDUCE_COLS;
+    task.values = out;
+    task.index = index;
+
+    /* the segments after the first need their own rows of partials */
+    if(nseg > 1) {
+        task.values = tensor_pool_alloc(nseg * ncols * sizeof(double));
+        if(op == REDUCE_ARGMAX) {
+            task.index = tensor_pool_alloc(nseg * ncols * sizeof(size_t));
+        }
+        if(task.values == NULL || (op == REDUCE_ARGMAX && task.index == NULL)) {
+            tensor_pool_free(task.index);
+            tensor_pool_free(task.values);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    size_t width = X->nrows < REDUCE_SEG_ROWS ? X->nrows : REDUCE_SEG_ROWS;
+    width *= ncols < REDUCE_COLS ? ncols : REDUCE_COLS;
+    int err = parallel_for(0, nseg * task.nchunks,
+                           (REDUCE_GRAIN + width - 1) / width,
+                           reduce_cols_range, &task);
+    if(nseg == 1) return err;
+    if(err != 0) {
+        tensor_pool_free(task.index);
+        tensor_pool_free(task.values);
+        return err;
+    }
+
+    /* combine the rows of partials as a binary tree, the earlier segment
+     * is on the left of each node */
+    for(size_t step = 1; step < nseg; step *= 2) {
+        for(size_t s = 0; s + step < nseg; s += 2 * step) {
+            double *left = task.values + s * ncols;
+            const double *right = left + step * ncols;
+            if(op != REDUCE_ARGMAX) {
+                task.kernels->accumulate(ncols, right,
+                                         op == REDUCE_MAX ? op : REDUCE_SUM,
+                                         left);
+                continue;
+            }
+            size_t *lidx = task.index + s * ncols;
+            const size_t *ridx = lidx + step * ncols;
+            for(size_t j = 0; j < ncols; j++) {
+                if(left[j] != left[j]) continue;
+                if(right[j] > left[j] || right[j] != right[j]) {
+                    left[j] = right[j];
+                    lidx[j] = ridx[j];
+                }
+            }
+        }
+    }
+    for(size_t j = 0; j < ncols; j++) {
+        out[j] = task.values[j];
+        if(index != NULL) index[j] = task.index[j];
+    }
+
+    tensor_pool_free(task.index);
+    tensor_pool_free(task.values);
+    return 0;
+}
+
+/* reduce_is_transposed: check whether the columns of t are contiguous
+ * instead of its rows */
+static int reduce_is_transposed(const tensor_t *t)
+{
+    return t->col_stride != 1 && t->ld == 1 && t->nrows > 1 && t->ncols > 1;
+}
+
+static int reduce_cols(enum reduce_op op, const tensor_t *X, double *out,
+                       size_t *index);
+
+/* reduce_rows: compute op over every row of X into out, and the column of
+ * the maximum into index for REDUCE_ARGMAX */
+static int reduce_rows(enum reduce_op op, const tensor_t *X, double *out,
+                       size_t *index)
+{
+    struct reduce_rows_task task;
+
+    /* the rows of a transposed view are the columns of its storage */
+    if(reduce_is_transposed(X)) {
+        tensor_t T;
+        tensor_transpose_view(X, &T);
+        return reduce_cols(op, &T, out, index);
+    }
+
+    if(reduce_rows_run(op, X, &task) != 0) return -1;
+    for(size_t i = 0; i < X->nrows; i++) {
+        size_t at = i * task.nseg, best = 0;
+        out[i] = reduce_combine(task.kernels, op, task.nseg, task.values + at,
+                                &best);
+        if(index != NULL) index[i] = task.index[at + best];
+    }
+    reduce_rows_free(&task);
+    return 0;
+}
+
+static int reduce_cols(enum reduce_op op, const tensor_t *X, double *out,
+                       size_t *index)
+{
+    if(reduce_is_transposed(X)) {
+        tensor_t T;
+        tensor_transpose_view(X, &T);
+        return reduce_rows(op, &T, out, index);
+    }
+    return reduce_cols_run(op, X, out, index);
+}
+
+/* reduce_all: compute op over every element of X into out, and the
+ * position of the maximum into rowi and colj for REDUCE_ARGMAX */
+static int reduce_all(enum reduce_op op, const tensor_t *X, double *out,
+                      size_t *rowi, size_t *colj)
+{
+    struct reduce_rows_task task;
+    tensor_t x = *X, T;
+
+    /* a tensor without gaps is one long row; the storage order of a
+     * transposed one only matters to the position of the maximum */
+    if(X->nrows > 1 && tensor_is_contiguous(*X)) {
+        tensor_reshape_view(X, 1, X->nrows * X->ncols, &x);
+    } else if(op != REDUCE_ARGMAX && reduce_is_transposed(X)) {
+        tensor_transpose_view(X, &T);
+        if(tensor_is_contiguous(T)) {
+            tensor_reshape_view(&T, 1, T.nrows * T.ncols, &x);
+        }
+    }
+
+    if(reduce_rows_run(op, &x, &task) != 0) return -1;
+    size_t best = 0;
+    *out = reduce_combine(task.kernels, op, x.nrows * task.nseg, task.values,
+                          &best);
+
+    if(op == REDUCE_ARGMAX) {
+        size_t at = best / task.nseg * x.ncols + task.index[best];
+        *rowi = at / X->ncols;
+        *colj = at % X->ncols;
+    }
+    reduce_rows_free(&task);
+    return 0;
+}
+
+/* What is done to a reduction before it is returned */
+enum reduce_finish {
+    REDUCE_AS_IS,
+    REDUCE_MEAN, // divide by the number of elements
+    REDUCE_SQRT
+};
+
+static double reduce_finish(enum reduce_finish finish, double value,
+                            size_t count)
+{
+    switch(finish) {
+    case REDUCE_MEAN:
+        return value / (double)count;
+    case REDUCE_SQRT:
+        return sqrt(value);
+    default:
+        return value;
+    }
+}
+
+/* reduce_scalar: reduce every element of X into value */
+static int reduce_scalar(enum reduce_op op, enum reduce_finish finish,
+                         const tensor_t *X, double *value)
+{
+    /* NULL checking */
+    if(X == NULL || value == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(reduce_all(op, X, value, NULL, NULL) != 0) return -1;
+    *value = reduce_finish(finish, *value, X->nrows * X->ncols);
+    return 0;
+}
+
+/* reduce_axis: reduce every row of X into the nrows x 1 tensor Y, or
+ * every column of X into the 1 x ncols tensor Y if cols is non-zero */
+static int reduce_axis(enum reduce_op op, enum reduce_finish finish,
+                       int cols, const tensor_t *X, tensor_t *Y)
+{
+    /* NULL checking */
+    if(X == NULL || Y == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    size_t n = cols ? X->ncols : X->nrows;
+    size_t count = cols ? X->nrows : X->ncols;
+    if(cols ? Y->nrows != 1 || Y->ncols != n : Y->nrows != n || Y->ncols != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    double *out = tensor_pool_alloc(n * sizeof(double));
+    if(out == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int err = cols ? reduce_cols(op, X, out, NULL)
+                   : reduce_rows(op, X, out, NULL);
+    for(size_t i = 0; err == 0 && i < n; i++) {
+        double value = reduce_finish(finish, out[i], count);
+        tensor_set_value(Y, cols ? 0 : i, cols ? i : 0, value);
+    }
+    tensor_pool_free(out);
+    return err;
+}
+
+/* tensor_sum: Compute the sum of every element of X.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X or sum is NULL
+ * It returns non-zero value and set errno to ENOMEM if the partial sums
+ * cannot be allocated */
+int tensor_sum(const tensor_t *X, double *sum)
+{
+    return reduce_scalar(REDUCE_SUM, REDUCE_AS_IS, X, sum);
+}
+
+/* tensor_sum_rows: Compute the sum of every row of X into the nrows x 1
+ * tensor Y.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X or Y is NULL or
+ * Y has not the shape nrows x 1
+ * It returns non-zero value and set errno to ENOMEM if the partial sums
+ * cannot be allocated */
+int tensor_sum_rows(const tensor_t *X, tensor_t *Y)
+{
+    return reduce_axis(REDUCE_SUM, REDUCE_AS_IS, 0, X, Y);
+}
+
+/* tensor_sum_cols: Compute the sum of every column of X into the
+ * 1 x ncols tensor Y, e.g. the gradient of a bias over a batch.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X or Y is NULL or
+ * Y has not the shape 1 x ncols
+ * It returns non-zero value and set errno to ENOMEM if the partial sums
+ * cannot be allocated */
+int tensor_sum_cols(const tensor_t *X, tensor_t *Y)
+{
+    return reduce_axis(REDUCE_SUM, REDUCE_AS_IS, 1, X, Y);
+}
+
+/* tensor_mean: Compute the mean of every element of X, see tensor_sum */
+int tensor_mean(const tensor_t *X, double *mean)
+{
+    return reduce_scalar(REDUCE_SUM, REDUCE_MEAN, X, mean);
+}
+
+/* tensor_mean_rows: Compute the mean of every row of X, see
+ * tensor_sum_rows */
+int tensor_mean_rows(const tensor_t *X, tensor_t *Y)
+{
+    return reduce_axis(REDUCE_SUM, REDUCE_MEAN, 0, X, Y);
+}
+
+/* tensor_mean_cols: Compute the mean of every column of X, see
+ * tensor_sum_cols */
+int tensor_mean_cols(const tensor_t *X, tensor_t *Y)
+{
+    return reduce_axis(REDUCE_SUM, REDUCE_MEAN, 1, X, Y);
+}
+
+/* tensor_max: Find the largest element of X. The result is NaN if an
+ * element is NaN. See tensor_sum */
+int tensor_max(const tensor_t *X, double *max)
+{
+    return reduce_scalar(REDUCE_MAX, REDUCE_AS_IS, X, max);
+}
+
+/* tensor_max_rows: Find the largest element of every row of X, see
+ * tensor_max and tensor_sum_rows */
+int tensor_max_rows(const tensor_t *X, tensor_t *Y)
+{
+    return reduce_axis(REDUCE_MAX, REDUCE_AS_IS, 0, X, Y);
+}
+
+/* tensor_max_cols: Find the largest element of every column of X, see
+ * tensor_max and tensor_sum_cols */
+int tensor_max_cols(const tensor_t *X, tensor_t *Y)
+{
+    return reduce_axis(REDUCE_MAX, REDUCE_AS_IS, 1, X, Y);
+}
+
+/* tensor_argmax: Find the position of the largest element of X. The
+ * first one in row-major order is taken if there are ties, and the first
+ * NaN if an element is NaN.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X, rowi or colj is
+ * NULL
+ * It returns non-zero value and set errno to ENOMEM if the partial results
+ * cannot be allocated */
+int tensor_argmax(const tensor_t *X, size_t *rowi, size_t *colj)
+{
+    /* NULL checking */
+    if(X == NULL || rowi == NULL || colj == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    double max;
+    return reduce_all(REDUCE_ARGMAX, X, &max, rowi, colj);
+}
+
+/* reduce_argmax_axis: the position of the maximum of every row, or of
+ * every column if cols is non-zero */
+static int reduce_argmax_axis(int cols, const tensor_t *X, size_t *index)
+{
+    /* NULL checking */
+    if(X == NULL || index == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t n = cols ? X->ncols : X->nrows;
+    double *out = tensor_pool_alloc(n * sizeof(double));
+    if(out == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int err = cols ? reduce_cols(REDUCE_ARGMAX, X, out, index)
+                   : reduce_rows(REDUCE_ARGMAX, X, out, index);
+    tensor_pool_free(out);
+    return err;
+}
+
+/* tensor_argmax_rows: Store the column of the largest element of every
+ * row of X in the nrows elements of colj, e.g. the predicted classes of a
+ * batch. Ties are handled as in tensor_argmax.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X or colj is NULL
+ * It returns non-zero value and set errno to ENOMEM if the partial results
+ * cannot be allocated */
+int tensor_argmax_rows(const tensor_t *X, size_t *colj)
+{
+    return reduce_argmax_axis(0, X, colj);
+}
+
+/* tensor_argmax_cols: Store the row of the largest element of every
+ * column of X in the ncols elements of rowi, see tensor_argmax_rows */
+int tensor_argmax_cols(const tensor_t *X, size_t *rowi)
+{
+    return reduce_argmax_axis(1, X, rowi);
+}
+
+/* tensor_norm: Compute the Euclidean (Frobenius) norm of X, the square
+ * root of the sum of the squares of its elements. See tensor_sum */
+int tensor_norm(const tensor_t *X, double *norm)
+{
+    return reduce_scalar(REDUCE_SUMSQ, REDUCE_SQRT, X, norm);
+}
+
+/* tensor_norm_rows: Compute the Euclidean norm of every row of X, see
+ * tensor_sum_rows */
+int tensor_norm_rows(const tensor_t *X, tensor_t *Y)
+{
+    return reduce_axis(REDUCE_SUMSQ, REDUCE_SQRT, 0, X, Y);
+}
+
+/* tensor_norm_cols: Compute the Euclidean norm of every column of X, see
+ * tensor_sum_cols */
+int tensor_norm_cols(const tensor_t *X, tensor_t *Y)
+{
+    return reduce_axis(REDUCE_SUMSQ, REDUCE_SQRT, 1, X, Y);
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_REDUCE_C_TEST
+#include <assert.h>
+#include <string.h>
+
+/* test_fill: pseudo random values in [-1, 1) */
+static void test_fill(tensor_t *t, unsigned seed)
+{
+    for(size_t i = 0; i < t->nrows; i++) {
+        for(size_t j = 0; j < t->ncols; j++) {
+            seed = seed * 1103515245u + 12345u;
+            tensor_set_value(t, i, j, (double)(seed >> 8) / (1 << 23) - 1.0);
+        }
+    }
+}
+
+/* test_sums: sums of the rows and of the columns of X in long double */
+static void test_sums(const tensor_t *X, long double *rows,
+                      long double *cols)
+{
+    for(size_t j = 0; j < X->ncols; j++) cols[j] = 0.0L;
+    for(size_t i = 0; i < X->nrows; i++) {
+        rows[i] = 0.0L;
+        for(size_t j = 0; j < X->ncols; j++) {
+            double v;
+            tensor_get_value(*X, i, j, &v);
+            rows[i] += v;
+            cols[j] += v;
+        }
+    }
+}
+
+/* test_close: check a sum of n elements of magnitude below 1 */
+static void test_close(double value, long double reference, size_t n)
+{
+    assert(fabsl((long double)value - reference) <= 1e-15L * n);
+}
+
+/* test_shape: every reduction of X against long double references */
+static void test_shape(const tensor_t *X)
+{
+    size_t m = X->nrows, n = X->ncols;
+    long double *rows = malloc(m * sizeof(long double));
+    long double *cols = malloc(n * sizeof(long double));
+    tensor_t *R = allocate_tensor(m, 1);
+    tensor_t *C = allocate_tensor(1, n);
+    size_t *index = malloc((m > n ? m : n) * sizeof(size_t));
+    double value;
+    test_sums(X, rows, cols);
+
+    assert(tensor_sum_rows(X, R) == 0);
+    for(size_t i = 0; i < m; i++) test_close(TENSOR_AT(R, i, 0), rows[i], n);
+    assert(tensor_sum_cols(X, C) == 0);
+    for(size_t j = 0; j < n; j++) test_close(TENSOR_AT(C, 0, j), cols[j], m);
+    assert(tensor_mean_cols(X, C) == 0);
+    for(size_t j = 0; j < n; j++) {
+        test_close(TENSOR_AT(C, 0, j) * m, cols[j], m);
+    }
+    long double total = 0.0L;
+    for(size_t i = 0; i < m; i++) total += rows[i];
+    assert(tensor_sum(X, &value) == 0);
+    test_close(value, total, m * n);
+
+    /* maxima against a plain scan */
+    assert(tensor_max_rows(X, R) == 0);
+    assert(tensor_argmax_rows(X, index) == 0);
+    for(size_t i = 0; i < m; i++) {
+        double best = -INFINITY, v;
+        size_t at = 0;
+        for(size_t j = 0; j < n; j++) {
+            tensor_get_value(*X, i, j, &v);
+            if(v > best) {
+                best = v;
+                at = j;
+            }
+        }
+        assert(TENSOR_AT(R, i, 0) == best && index[i] == at);
+    }
+    assert(tensor_max_cols(X, C) == 0);
+    assert(tensor_argmax_cols(X, index) == 0);
+    for(size_t j = 0; j < n; j++) {
+        double v;
+        tensor_get_value(*X, index[j], j, &v);
+        assert(TENSOR_AT(C, 0, j) == v);
+        for(size_t i = 0; i < m; i++) {
+            tensor_get_value(*X, i, j, &v);
+            assert(v < TENSOR_AT(C, 0, j) || (v == TENSOR_AT(C, 0, j)
+                                               && i >= index[j]));
+        }
+    }
+
+    /* norms of the columns */
+    assert(tensor_norm_cols(X, C) == 0);
+    for(size_t j = 0; j < n; j++) {
+        long double sq = 0.0L;
+        for(size_t i = 0; i < m; i++) {
+            double v;
+            tensor_get_value(*X, i, j, &v);
+            sq += (long double)v * v;
+        }
+        test_close(TENSOR_AT(C, 0, j) * TENSOR_AT(C, 0, j), sq, m);
+    }
+
+    free(index);
+    free_tensor(C);
+    free_tensor(R);
+    free(cols);
+    free(rows);
+}
+
+/* test_bits: the reductions of X on the current level and threads */
+static void test_bits(const tensor_t *X, double *out)
+{
+    tensor_t *R = allocate_tensor(X->nrows, 1);
+    tensor_t *C = allocate_tensor(1, X->ncols);
+    assert(tensor_sum(X, out) == 0);
+    assert(tensor_norm(X, out + 1) == 0);
+    assert(tensor_sum_rows(X, R) == 0);
+    out[2] = TENSOR_AT(R, X->nrows - 1, 0);
+    assert(tensor_sum_cols(X, C) == 0);
+    out[3] = TENSOR_AT(C, 0, X->ncols - 1);
+    free_tensor(C);
+    free_tensor(R);
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    double value;
+    size_t rowi, colj;
+
+    /* small exact cases */
+    double values[] = {
+        1, 2, 3, 4, 5,
+        -1, 7, 7, 0, 2,
+        3, 3, -8, 1, 6,
+    };
+    tensor_t *X = tensor_from_array(3, 5, values, TENSOR_FLOAT64);
+    tensor_t *R = allocate_tensor(3, 1);
+    tensor_t *C = allocate_typed_tensor(1, 5, TENSOR_FLOAT32);
+    size_t index[5];
+    err = tensor_sum(X, &value);
+    assert(err == 0 && value == 35.0);
+    err = tensor_mean(X, &value);
+    assert(err == 0 && value == 35.0 / 15.0);
+    err = tensor_max(X, &value);
+    assert(err == 0 && value == 7.0);
+    err = tensor_argmax(X, &rowi, &colj);
+    assert(err == 0 && rowi == 1 && colj == 1);
+    err = tensor_norm(X, &value);
+    assert(err == 0 && value == sqrt(277.0));
+    err = tensor_sum_rows(X, R);
+    assert(err == 0);
+    assert(TENSOR_AT(R, 0, 0) == 15 && TENSOR_AT(R, 1, 0) == 15
+           && TENSOR_AT(R, 2, 0) == 5);
+    err = tensor_mean_cols(X, C);
+    assert(err == 0 && TENSOR_ELEMENT(C, float, 0, 1) == 4.0f);
+    err = tensor_max_cols(X, C);
+    assert(err == 0 && TENSOR_ELEMENT(C, float, 0, 2) == 7.0f);
+    err = tensor_argmax_rows(X, index);
+    assert(err == 0 && index[0] == 4 && index[1] == 1 && index[2] == 4);
+    err = tensor_argmax_cols(X, index);
+    assert(err == 0 && index[0] == 2 && index[2] == 1 && index[3] == 0);
+
+    /* NaN is the maximum, the first one wins */
+    TENSOR_AT(X, 1, 3) = NAN;
+    TENSOR_AT(X, 2, 0) = NAN;
+    err = tensor_max(X, &value);
+    assert(err == 0 && isnan(value));
+    err = tensor_argmax(X, &rowi, &colj);
+    assert(err == 0 && rowi == 1 && colj == 3);
+    err = tensor_argmax_cols(X, index);
+    assert(err == 0 && index[0] == 2 && index[3] == 1 && index[1] == 1);
+    err = tensor_max_rows(X, R);
+    assert(err == 0 && TENSOR_AT(R, 0, 0) == 5 && isnan(TENSOR_AT(R, 1, 0)));
+
+    /* it returns non-zero value if the shapes do not match */
+    err = tensor_sum_rows(X, C);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_norm_cols(X, R);
+    assert(err != 0 && errno == EINVAL);
+
+    /* it returns non-zero value if one of the arguments is NULL */
+    err = tensor_sum(NULL, &value);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_argmax(X, NULL, &colj);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_argmax_rows(X, NULL);
+    assert(err != 0 && errno == EINVAL);
+    free_tensor(C);
+    free_tensor(R);
+    free_tensor(X);
+
+    /* rows longer than a chunk, more rows than a segment, views and other
+     * element types */
+    size_t shapes[][2] = {{1, 1}, {3, 10000}, {20000, 7}, {37, 1100}};
+    for(size_t s = 0; s < 4; s++) {
+        tensor_t *A = allocate_tensor(shapes[s][0], shapes[s][1]);
+        tensor_t *F = allocate_typed_tensor(shapes[s][1], shapes[s][0],
+                                            TENSOR_FLOAT32);
+        tensor_t At, Ft;
+        test_fill(A, (unsigned)s);
+        test_shape(A);
+        tensor_transpose_view(A, &At);
+        test_shape(&At);
+        test_fill(F, (unsigned)s + 7);
+        test_shape(F);
+        tensor_transpose_view(F, &Ft);
+        test_shape(&Ft);
+        if(shapes[s][0] > 2) {
+            tensor_t rows;
+            tensor_view_rows(A, 1, shapes[s][0] - 2, &rows);
+            test_shape(&rows);
+        }
+        free_tensor(F);
+        free_tensor(A);
+    }
+
+    /* the pairwise sum is accurate over millions of elements */
+    size_t big = (size_t)1 << 22;
+    tensor_t *B = allocate_tensor(1, big);
+    tensor_fill(B, 0.1);
+    long double exact = (long double)0.1 * big;
+    err = tensor_sum(B, &value);
+    assert(err == 0);
+    assert(fabsl((long double)value - exact) / exact < 1e-15L);
+    free_tensor(B);
+
+    /* the results don't depend on the CPU level or the threads */
+    tensor_t *D = allocate_tensor(17000, 600);
+    double expected[4], got[4];
+    test_fill(D, 3);
+    test_bits(D, expected);
+    for(int level = CPU_GENERIC; level <= (int)cpu_get_max_level(); level++) {
+        cpu_set_level((cpu_level_t)level);
+        for(size_t threads = 1; threads <= 4; threads += 3) {
+            parallel_set_nthreads(threads);
+            test_bits(D, got);
+            assert(memcmp(expected, got, sizeof got) == 0);
+        }
+    }
+    cpu_set_level(cpu_get_max_level());
+    free_tensor(D);
+    return 0;
+}
+#endif
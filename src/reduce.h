@@ -0,0 +1,40 @@
+/* reduce - Sums, means, maxima and norms of tensors
+ * Every reduction comes in three forms: over the whole tensor, one result
+ * per row (the _rows functions) and one result per column (the _cols
+ * functions). Sums are pairwise: blocks of 256 elements are added
+ * in 16 interleaved lanes and the block sums are added as a binary tree,
+ * so the rounding error grows with log(n) instead of n. Column reductions
+ * walk the rows of the tensor in order and add whole rows of a block of
+ * columns at once, they never walk down a single column.
+ *
+ * The results don't depend on the CPU level or the number of threads.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_REDUCE_H
+#define SIMPLE_NN_REDUCE_H
+
+#include "tensor.h"
+
+int tensor_sum(const tensor_t *X, double *sum);
+int tensor_sum_rows(const tensor_t *X, tensor_t *Y);
+int tensor_sum_cols(const tensor_t *X, tensor_t *Y);
+
+int tensor_mean(const tensor_t *X, double *mean);
+int tensor_mean_rows(const tensor_t *X, tensor_t *Y);
+int tensor_mean_cols(const tensor_t *X, tensor_t *Y);
+
+int tensor_max(const tensor_t *X, double *max);
+int tensor_max_rows(const tensor_t *X, tensor_t *Y);
+int tensor_max_cols(const tensor_t *X, tensor_t *Y);
+
+int tensor_argmax(const tensor_t *X, size_t *rowi, size_t *colj);
+int tensor_argmax_rows(const tensor_t *X, size_t *colj);
+int tensor_argmax_cols(const tensor_t *X, size_t *rowi);
+
+int tensor_norm(const tensor_t *X, double *norm);
+int tensor_norm_rows(const tensor_t *X, tensor_t *Y);
+int tensor_norm_cols(const tensor_t *X, tensor_t *Y);
+
+#endif
@@ -0,0 +1,809 @@
+/* sgd - Stochastic gradient descent of sparse linear models
+ * The workers are the indices of a parallel_for with a grain of one. In
+ * the lock-free modes worker w owns the rows order[lo, hi) of a fixed
+ * split of the data, shuffles them at the start of every epoch and then
+ * runs plain SGD on them while the other workers write to the same
+ * weights. SGD_ATOMIC reads the weights with relaxed atomic loads and adds
+ * to them with a relaxed compare-and-swap loop, so updates that collide
+ * are applied one after the other; SGD_RACY uses plain loads and stores,
+ * so a colliding update can be overwritten, which is the cheapest option
+ * when the rows are sparse enough that collisions are rare. Neither mode
+ * orders the memory of the workers, the weights are only consistent once
+ * the call returns.
+ *
+ * In SGD_SYNC every worker adds the gradients of its part of a minibatch
+ * into a dense buffer of its own and lists the columns it touches. The
+ * lists are merged into one without duplicates, which a second parallel_for
+ * splits across the threads: for each of its columns the buffers are added
+ * up in the order of the workers, the weight is updated and the buffers are
+ * cleared for the next minibatch. The update reads the buffers of every
+ * worker for every column of the minibatch, so it costs the non-zeros of
+ * the minibatch times the number of workers instead of the columns of X
+ * times the number of workers.
+ *
+ * The counters of every worker live in its own cache line and are added
+ * up at the end, the workers never write to a shared counter.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "tensor.h"
+#include "sparse.h"
+#include "reduce.h"
+#include "pool.h"
+#include "parallel.h"
+#include "sgd.h"
+
+/* Rows evaluated by one piece of sgd_evaluate */
+#define SGD_EVALUATE_GRAIN 1024
+
+/* Columns of the weights updated by one piece of a minibatch update */
+#define SGD_UPDATE_GRAIN 1024
+
+struct sgd_worker {
+    double *grad; // dense gradient of SGD_SYNC, NULL otherwise
+    size_t *touched; // columns of grad made non-zero by the minibatch
+    size_t ntouched;
+    double loss; // sum of the losses of the current epoch
+    size_t nsamples;
+    size_t nupdates;
+    uint32_t seed; // state of the shuffle
+} __attribute__((aligned(64)));
+
+struct sgd_task {
+    const sparse_tensor_t *X;
+    const double *labels;
+    double *w; // first weight
+    size_t stride; // distance between two weights
+    const sgd_options_t *opts;
+    size_t nworkers;
+    struct sgd_worker *workers;
+    size_t *order; // rows in the order they are visited
+    size_t begin; // rows order[begin, end) of the minibatch of SGD_SYNC
+    size_t end;
+    double alpha; // factor of the update of SGD_SYNC
+    size_t *columns; // columns touched by the minibatch, each once
+    size_t ncolumns;
+    unsigned char *listed; // non-zero for the columns in columns
+    double *losses; // losses of the rows, for sgd_evaluate
+    double *errors; // misclassified rows, for sgd_evaluate
+    sgd_model_t model;
+};
+
+/* sgd_load: read the weight at p */
+static double sgd_load(sgd_mode_t mode, const double *p)
+{
+    double value;
+    if(mode == SGD_ATOMIC) {
+        __atomic_load(p, &value, __ATOMIC_RELAXED);
+    } else {
+        value = *p;
+    }
+    return value;
+}
+
+/* sgd_add: add delta to the weight at p */
+static void sgd_add(sgd_mode_t mode, double *p, double delta)
+{
+    if(mode == SGD_ATOMIC) {
+        double old, sum;
+        __atomic_load(p, &old, __ATOMIC_RELAXED);
+        do {
+            sum = old + delta;
+        } while(!__atomic_compare_exchange(p, &old, &sum, 1,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED));
+    } else {
+        *p += delta;
+    }
+}
+
+/* sgd_dot: dot product of row i of X with the weights */
+static double sgd_dot(const struct sgd_task *task, sgd_mode_t mode, size_t i)
+{
+    const sparse_tensor_t *X = task->X;
+    double z = 0.0;
+    for(size_t k = X->row_ptr[i]; k < X->row_ptr[i + 1]; k++) {
+        z += X->values[k] * sgd_load(mode, task->w
+                                           + X->col_idx[k] * task->stride);
+    }
+    return z;
+}
+
+/* sgd_gradient: loss of a row of label y with dot product z, the
+ * derivative of the loss with respect to z goes to g */
+static double sgd_gradient(sgd_model_t model, double y, double z, double *g)
+{
+    double t = y != 0.0 ? 1.0 : -1.0;
+    double margin = t * z;
+    if(model == SGD_PERCEPTRON) {
+        *g = margin <= 0.0 ? -t : 0.0;
+        return margin < 0.0 ? -margin : 0.0;
+    }
+
+    /* log(1 + exp(-margin)) and its derivative without overflow */
+    double e = exp(-fabs(margin));
+    if(margin >= 0.0) {
+        *g = -t * e / (1.0 + e);
+        return log1p(e);
+    }
+    *g = -t / (1.0 + e);
+    return -margin + log1p(e);
+}
+
+/* sgd_shuffle: shuffle the n rows of order */
+static void sgd_shuffle(size_t *order, size_t n, uint32_t *seed)
+{
+    for(size_t i = n; i > 1; i--) {
+        *seed = *seed * 1103515245u + 12345u;
+        size_t j = (size_t)(((uint64_t)*seed * i) >> 32);
+        size_t tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/* sgd_hogwild_range: one epoch of the workers [begin, end), updating the
+ * shared weights after every row */
+static void sgd_hogwild_range(void *arg, size_t begin, size_t end)
+{
+    struct sgd_task *task = arg;
+    const sparse_tensor_t *X = task->X;
+    sgd_mode_t mode = task->opts->mode;
+    double rate = task->opts->learning_rate;
+    for(size_t w = begin; w < end; w++) {
+        struct sgd_worker *worker = &task->workers[w];
+        size_t lo = X->nrows * w / task->nworkers;
+        size_t hi = X->nrows * (w + 1) / task->nworkers;
+        sgd_shuffle(task->order + lo, hi - lo, &worker->seed);
+
+        double loss = 0.0;
+        size_t nupdates = 0;
+        for(size_t r = lo; r < hi; r++) {
+            size_t i = task->order[r];
+            double g;
+            double z = sgd_dot(task, mode, i);
+            loss += sgd_gradient(task->opts->model, task->labels[i], z, &g);
+            if(g == 0.0) continue;
+
+            double step = -rate * g;
+            for(size_t k = X->row_ptr[i]; k < X->row_ptr[i + 1]; k++) {
+                sgd_add(mode, task->w + X->col_idx[k] * task->stride,
+                        step * X->values[k]);
+            }
+            nupdates++;
+        }
+        worker->loss = loss;
+        worker->nsamples += hi - lo;
+        worker->nupdates += nupdates;
+    }
+}
+
+/* sgd_sync_range: gradients of the parts of the minibatch of the workers
+ * [begin, end) */
+static void sgd_sync_range(void *arg, size_t begin, size_t end)
+{
+    struct sgd_task *task = arg;
+    const sparse_tensor_t *X = task->X;
+    size_t n = task->end - task->begin;
+    for(size_t w = begin; w < end; w++) {
+        struct sgd_worker *worker = &task->workers[w];
+        size_t lo = task->begin + n * w / task->nworkers;
+        size_t hi = task->begin + n * (w + 1) / task->nworkers;
+        double loss = 0.0;
+        size_t nupdates = 0;
+        for(size_t r = lo; r < hi; r++) {
+            size_t i = task->order[r];
+            double g;
+            double z = sgd_dot(task, SGD_SYNC, i);
+            loss += sgd_gradient(task->opts->model, task->labels[i], z, &g);
+            if(g == 0.0) continue;
+
+            for(size_t k = X->row_ptr[i]; k < X->row_ptr[i + 1]; k++) {
+                size_t j = X->col_idx[k];
+                if(worker->grad[j] == 0.0) {
+                    worker->touched[worker->ntouched++] = j;
+                }
+                worker->grad[j] += g * X->values[k];
+            }
+            nupdates++;
+        }
+        worker->loss += loss;
+        worker->nsamples += hi - lo;
+        worker->nupdates += nupdates;
+    }
+}
+
+/* sgd_sync_merge: merge the columns touched by the workers into
+ * task->columns. A worker lists a column again when its gradient cancels
+ * to zero and then changes, the column is kept once. */
+static void sgd_sync_merge(struct sgd_task *task)
+{
+    task->ncolumns = 0;
+    for(size_t w = 0; w < task->nworkers; w++) {
+        struct sgd_worker *worker = &task->workers[w];
+        for(size_t t = 0; t < worker->ntouched; t++) {
+            size_t j = worker->touched[t];
+            if(task->listed[j]) continue;
+            task->listed[j] = 1;
+            task->columns[task->ncolumns++] = j;
+        }
+        worker->ntouched = 0;
+    }
+}
+
+/* sgd_sync_update_range: add up the gradients of the workers for the
+ * columns [begin, end) of task->columns, update the weights and clear the
+ * gradients */
+static void sgd_sync_update_range(void *arg, size_t begin, size_t end)
+{
+    struct sgd_task *task = arg;
+    for(size_t c = begin; c < end; c++) {
+        size_t j = task->columns[c];
+        double sum = 0.0;
+        for(size_t w = 0; w < task->nworkers; w++) {
+            sum += task->workers[w].grad[j];
+            task->workers[w].grad[j] = 0.0;
+        }
+        if(sum != 0.0) task->w[j * task->stride] += task->alpha * sum;
+        task->listed[j] = 0;
+    }
+}
+
+/* sgd_check: check X, y and W and read the labels into a new array, W can
+ * be NULL */
+static double *sgd_check(const sparse_tensor_t *X, const tensor_t *y,
+                         const tensor_t *W)
+{
+    /* NULL checking */
+    if(X == NULL || y == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* shape checking */
+    if(X->nrows == 0 || y->nrows != X->nrows || y->ncols != 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if(W != NULL && (W->dtype != TENSOR_FLOAT64
+                     || W->nrows * W->ncols != X->ncols
+                     || (W->nrows != 1 && W->ncols != 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    double *labels = malloc(X->nrows * sizeof *labels);
+    if(labels == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    for(size_t i = 0; i < X->nrows; i++) {
+        tensor_get_value(*y, i, 0, &labels[i]);
+        if(labels[i] != 0.0 && labels[i] != 1.0) {
+            free(labels);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    return labels;
+}
+
+/* sgd_weights: first weight of W and the distance between two weights */
+static double *sgd_weights(const tensor_t *W, size_t *stride)
+{
+    *stride = W->nrows == 1 ? W->col_stride : W->ld;
+    return (double *)W->data + W->offset;
+}
+
+/* sgd_now: monotonic time in seconds */
+static double sgd_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* sgd_train: Train the weights W of a linear model on the rows of X with
+ * the labels y, 0 or 1, by opts->nepochs passes of stochastic gradient
+ * descent. W is a 1 x ncols or ncols x 1 TENSOR_FLOAT64 tensor with a
+ * weight for every column of X and holds the initial weights; add a column
+ * of ones to X for a bias. The rows are visited in an order shuffled with
+ * opts->seed. The counters of the training are stored in stats, which can
+ * be NULL.
+ *
+ * In the lock-free modes the result depends on the timing of the threads
+ * unless there is a single worker. SGD_SYNC takes a step against the mean
+ * gradient of every minibatch of opts->batch_size rows and gives the same
+ * result for any number of threads.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X, y, W or opts is
+ * NULL, X has no rows, the shapes do not match, W is not a TENSOR_FLOAT64
+ * vector, a label is not 0 or 1, the model or the mode is not valid or the
+ * batch size of SGD_SYNC is zero
+ * It returns non-zero value and set errno to ENOMEM if the buffers cannot
+ * be allocated */
+int sgd_train(const sparse_tensor_t *X, const tensor_t *y, tensor_t *W,
+              const sgd_options_t *opts, sgd_stats_t *stats)
+{
+    /* NULL checking */
+    if(W == NULL || opts == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if((int)opts->model < 0 || opts->model > SGD_PERCEPTRON
+       || (int)opts->mode < 0 || opts->mode > SGD_RACY
+       || (opts->mode == SGD_SYNC && opts->batch_size == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    double *labels = sgd_check(X, y, W);
+    if(labels == NULL) return -1;
+
+    size_t nworkers = opts->nworkers;
+    if(nworkers == 0) nworkers = parallel_get_nthreads();
+    struct sgd_task task = {X, labels, NULL, 0, opts, nworkers, NULL, NULL,
+                            0, 0, 0.0, NULL, 0, NULL, NULL, NULL,
+                            opts->model};
+    task.w = sgd_weights(W, &task.stride);
+    task.order = malloc(X->nrows * sizeof *task.order);
+    task.workers = tensor_pool_alloc(nworkers * sizeof *task.workers);
+    int err = task.order == NULL || task.workers == NULL;
+    for(size_t w = 0; !err && w < nworkers; w++) {
+        struct sgd_worker *worker = &task.workers[w];
+        worker->grad = NULL;
+        worker->touched = NULL;
+        worker->ntouched = 0;
+        worker->loss = 0.0;
+        worker->nsamples = 0;
+        worker->nupdates = 0;
+        worker->seed = opts->seed + (uint32_t)w * 2654435761u;
+    }
+
+    /* a worker lists a column at most once per non-zero of its rows of a
+     * minibatch */
+    size_t maxrow = 0, ntouched = X->nnz > 0 ? X->nnz : 1;
+    for(size_t i = 0; i < X->nrows; i++) {
+        size_t nnz = X->row_ptr[i + 1] - X->row_ptr[i];
+        if(nnz > maxrow) maxrow = nnz;
+    }
+    if(maxrow > 0 && opts->batch_size <= ntouched / maxrow) {
+        ntouched = opts->batch_size * maxrow;
+    }
+    for(size_t w = 0; !err && opts->mode == SGD_SYNC && w < nworkers; w++) {
+        struct sgd_worker *worker = &task.workers[w];
+        worker->grad = calloc(X->ncols, sizeof(double));
+        worker->touched = malloc(ntouched * sizeof(size_t));
+        if(worker->grad == NULL || worker->touched == NULL) err = 1;
+    }
+    if(!err && opts->mode == SGD_SYNC) {
+        task.columns = malloc(X->ncols * sizeof(size_t));
+        task.listed = calloc(X->ncols, 1);
+        if(task.columns == NULL || task.listed == NULL) err = 1;
+    }
+    if(err) {
+        for(size_t w = 0; task.order != NULL && task.workers != NULL
+                          && w < nworkers; w++) {
+            free(task.workers[w].grad);
+            free(task.workers[w].touched);
+        }
+        free(task.columns);
+        free(task.listed);
+        tensor_pool_free(task.workers);
+        free(task.order);
+        free(labels);
+        errno = ENOMEM;
+        return -1;
+    }
+    for(size_t i = 0; i < X->nrows; i++) task.order[i] = i;
+
+    double start = sgd_now();
+    uint32_t seed = opts->seed;
+    for(size_t epoch = 0; epoch < opts->nepochs; epoch++) {
+        if(opts->mode != SGD_SYNC) {
+            parallel_for(0, nworkers, 1, sgd_hogwild_range, &task);
+            continue;
+        }
+
+        sgd_shuffle(task.order, X->nrows, &seed);
+        for(size_t w = 0; w < nworkers; w++) task.workers[w].loss = 0.0;
+        for(task.begin = 0; task.begin < X->nrows; task.begin = task.end) {
+            task.end = task.begin + opts->batch_size;
+            if(task.end > X->nrows) task.end = X->nrows;
+            task.alpha = -opts->learning_rate
+                         / (double)(task.end - task.begin);
+            parallel_for(0, nworkers, 1, sgd_sync_range, &task);
+            sgd_sync_merge(&task);
+            parallel_for(0, task.ncolumns, SGD_UPDATE_GRAIN,
+                         sgd_sync_update_range, &task);
+        }
+    }
+    double seconds = sgd_now() - start;
+
+    if(stats != NULL) {
+        memset(stats, 0, sizeof *stats);
+        for(size_t w = 0; w < nworkers; w++) {
+            stats->nsamples += task.workers[w].nsamples;
+            stats->nupdates += task.workers[w].nupdates;
+            stats->loss += task.workers[w].loss;
+        }
+        if(opts->nepochs > 0) stats->loss /= (double)X->nrows;
+        stats->seconds = seconds;
+        if(seconds > 0.0) {
+            stats->samples_per_second = (double)stats->nsamples / seconds;
+        }
+    }
+
+    for(size_t w = 0; w < nworkers; w++) {
+        free(task.workers[w].grad);
+        free(task.workers[w].touched);
+    }
+    free(task.columns);
+    free(task.listed);
+    tensor_pool_free(task.workers);
+    free(task.order);
+    free(labels);
+    return 0;
+}
+
+/* sgd_evaluate_range: losses and errors of the rows [begin, end) */
+static void sgd_evaluate_range(void *arg, size_t begin, size_t end)
+{
+    struct sgd_task *task = arg;
+    for(size_t i = begin; i < end; i++) {
+        double g;
+        double z = sgd_dot(task, SGD_SYNC, i);
+        double t = task->labels[i] != 0.0 ? 1.0 : -1.0;
+        task->losses[i] = sgd_gradient(task->model, task->labels[i], z, &g);
+        task->errors[i] = t * z <= 0.0;
+    }
+}
+
+/* sgd_evaluate: Compute the mean loss of the model of weights W on the rows
+ * of X with the labels y and the fraction of the rows it misclassifies, a
+ * row is misclassified if its dot product with W is zero or has the wrong
+ * sign. See sgd_train for the shapes. Either loss or error_rate can be
+ * NULL.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X, y or W is NULL,
+ * both loss and error_rate are NULL, the shapes do not match, a label is
+ * not 0 or 1 or the model is not valid
+ * It returns non-zero value and set errno to ENOMEM if the buffers cannot
+ * be allocated */
+int sgd_evaluate(const sparse_tensor_t *X, const tensor_t *y,
+                 const tensor_t *W, sgd_model_t model, double *loss,
+                 double *error_rate)
+{
+    /* NULL checking */
+    if(W == NULL || (loss == NULL && error_rate == NULL)
+       || (int)model < 0 || model > SGD_PERCEPTRON) {
+        errno = EINVAL;
+        return -1;
+    }
+    double *labels = sgd_check(X, y, W);
+    if(labels == NULL) return -1;
+
+    /* the sums go through tensor_sum, in the same order for any number of
+     * threads */
+    size_t ld = tensor_leading_dimension(X->nrows, TENSOR_FLOAT64);
+    double *buf = tensor_pool_alloc(2 * ld * sizeof(double));
+    if(buf == NULL) {
+        free(labels);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct sgd_task task = {X, labels, NULL, 0, NULL, 0, NULL, NULL, 0, 0,
+                            0.0, NULL, 0, NULL, buf, buf + ld, model};
+    task.w = sgd_weights(W, &task.stride);
+    parallel_for(0, X->nrows, SGD_EVALUATE_GRAIN, sgd_evaluate_range, &task);
+
+    tensor_t t;
+    double sum;
+    tensor_init(&t, 1, X->nrows, TENSOR_FLOAT64, task.losses);
+    tensor_sum(&t, &sum);
+    if(loss != NULL) *loss = sum / (double)X->nrows;
+    tensor_init(&t, 1, X->nrows, TENSOR_FLOAT64, task.errors);
+    tensor_sum(&t, &sum);
+    if(error_rate != NULL) *error_rate = sum / (double)X->nrows;
+
+    tensor_pool_free(buf);
+    free(labels);
+    return 0;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_SGD_C_TEST
+#include <assert.h>
+
+/* test_data: sparse rows with a bias column of ones and about 14 other
+ * non-zeros in [0, 1), labelled by the sign of their product with a
+ * random hidden model */
+static sparse_tensor_t *test_data(size_t m, size_t n, tensor_t **y)
+{
+    unsigned seed = 11;
+    double *hidden = malloc(n * sizeof *hidden);
+    sparse_tensor_t *X = allocate_sparse_tensor(m, n, m * n);
+    *y = allocate_tensor(m, 1);
+    assert(hidden != NULL && X != NULL && *y != NULL);
+    for(size_t j = 0; j < n; j++) {
+        seed = seed * 1103515245u + 12345u;
+        hidden[j] = (double)(seed >> 8) / (1 << 23) - 1.0;
+    }
+    for(size_t i = 0; i < m; i++) {
+        double z = 0.0;
+        for(size_t j = 0; j < n;) {
+            seed = seed * 1103515245u + 12345u;
+            double v = j == 0 ? 1.0 : (double)(seed >> 8) / (1 << 24);
+            X->col_idx[X->nnz] = j;
+            X->values[X->nnz] = v;
+            X->nnz++;
+            z += v * hidden[j];
+            j += 1 + (seed >> 16) % 40;
+        }
+        X->row_ptr[i + 1] = X->nnz;
+        TENSOR_AT(*y, i, 0) = z > 0.0;
+    }
+    free(hidden);
+    return X;
+}
+
+/* test_cancel_data: groups of four rows with the same two columns, two
+ * labelled 1 and two labelled 0, so the perceptron gradients of a group
+ * cancel to zero at the zero model, and a column 0 stored as an explicit
+ * zero in every row */
+static sparse_tensor_t *test_cancel_data(size_t ngroups, tensor_t **y)
+{
+    sparse_tensor_t *X = allocate_sparse_tensor(4 * ngroups,
+                                                1 + 2 * ngroups,
+                                                12 * ngroups);
+    *y = allocate_tensor(4 * ngroups, 1);
+    assert(X != NULL && *y != NULL);
+    for(size_t i = 0; i < 4 * ngroups; i++) {
+        size_t cols[3] = {0, 1 + 2 * (i / 4), 2 + 2 * (i / 4)};
+        double values[3] = {0.0, 1.0, 0.5};
+        for(size_t k = 0; k < 3; k++) {
+            X->col_idx[X->nnz] = cols[k];
+            X->values[X->nnz] = values[k];
+            X->nnz++;
+        }
+        X->row_ptr[i + 1] = X->nnz;
+        TENSOR_AT(*y, i, 0) = i % 2;
+    }
+    return X;
+}
+
+/* test_sync_reference: SGD_SYNC with dense gradients that are added up
+ * and applied for every column of X */
+static void test_sync_reference(const sparse_tensor_t *X, const tensor_t *y,
+                                const sgd_options_t *opts, double *w)
+{
+    size_t m = X->nrows, n = X->ncols, nworkers = opts->nworkers;
+    size_t *order = malloc(m * sizeof *order);
+    double *grad = calloc(nworkers * n, sizeof *grad);
+    assert(order != NULL && grad != NULL);
+    for(size_t i = 0; i < m; i++) order[i] = i;
+    for(size_t j = 0; j < n; j++) w[j] = 0.0;
+
+    uint32_t seed = opts->seed;
+    for(size_t epoch = 0; epoch < opts->nepochs; epoch++) {
+        sgd_shuffle(order, m, &seed);
+        for(size_t begin = 0, end; begin < m; begin = end) {
+            end = begin + opts->batch_size < m ? begin + opts->batch_size
+                                               : m;
+            for(size_t v = 0; v < nworkers; v++) {
+                size_t lo = begin + (end - begin) * v / nworkers;
+                size_t hi = begin + (end - begin) * (v + 1) / nworkers;
+                for(size_t r = lo; r < hi; r++) {
+                    size_t i = order[r];
+                    double z = 0.0, g;
+                    for(size_t k = X->row_ptr[i]; k < X->row_ptr[i + 1]; k++) {
+                        z += X->values[k] * w[X->col_idx[k]];
+                    }
+                    sgd_gradient(opts->model, TENSOR_AT(y, i, 0), z, &g);
+                    for(size_t k = X->row_ptr[i]; k < X->row_ptr[i + 1]; k++) {
+                        grad[v * n + X->col_idx[k]] += g * X->values[k];
+                    }
+                }
+            }
+            double alpha = -opts->learning_rate / (double)(end - begin);
+            for(size_t j = 0; j < n; j++) {
+                double sum = 0.0;
+                for(size_t v = 0; v < nworkers; v++) {
+                    sum += grad[v * n + j];
+                    grad[v * n + j] = 0.0;
+                }
+                w[j] += alpha * sum;
+            }
+        }
+    }
+    free(grad);
+    free(order);
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    double loss, error_rate;
+    const size_t m = 1200, n = 300;
+
+    tensor_t *y;
+    sparse_tensor_t *X = test_data(m, n, &y);
+    tensor_t *W = allocate_tensor(1, n);
+    tensor_t *V = allocate_tensor(n, 1);
+    assert(W != NULL && V != NULL);
+
+    /* the zero model: log(2) and every row misclassified */
+    err = sgd_evaluate(X, y, W, SGD_LOGISTIC, &loss, &error_rate);
+    assert(err == 0);
+    assert(fabs(loss - log(2.0)) < 1e-15 && error_rate == 1.0);
+
+    /* every mode of both models learns the data with any number of
+     * threads */
+    sgd_options_t opts = SGD_OPTIONS_DEFAULT;
+    sgd_stats_t stats;
+    size_t nthreads = parallel_get_nthreads();
+    size_t threads[2] = {1, 4};
+    for(size_t t = 0; t < 2; t++) {
+        parallel_set_nthreads(threads[t]);
+        for(int model = SGD_LOGISTIC; model <= SGD_PERCEPTRON; model++) {
+            for(int mode = SGD_SYNC; mode <= SGD_RACY; mode++) {
+                opts.model = (sgd_model_t)model;
+                opts.mode = (sgd_mode_t)mode;
+                opts.nepochs = 20;
+                opts.nworkers = 0;
+                opts.batch_size = 8;
+                opts.learning_rate = 0.5;
+                tensor_fill(W, 0.0);
+                err = sgd_train(X, y, W, &opts, &stats);
+                assert(err == 0);
+                assert(stats.nsamples == m * opts.nepochs);
+                assert(stats.nupdates <= stats.nsamples);
+                assert(stats.nupdates > 0);
+                assert(stats.seconds >= 0.0);
+                assert(stats.loss >= 0.0);
+                err = sgd_evaluate(X, y, W, opts.model, &loss, &error_rate);
+                assert(err == 0);
+                assert(error_rate < 0.1);
+            }
+        }
+    }
+
+    /* a single worker doesn't depend on the mode or the threads, a
+     * minibatch of one row is the same SGD */
+    double expected[300];
+    opts.model = SGD_LOGISTIC;
+    opts.nworkers = 1;
+    opts.nepochs = 3;
+    opts.batch_size = 1;
+    for(size_t t = 0; t < 2; t++) {
+        parallel_set_nthreads(threads[t]);
+        for(int mode = SGD_SYNC; mode <= SGD_RACY; mode++) {
+            opts.mode = (sgd_mode_t)mode;
+            tensor_fill(W, 0.0);
+            err = sgd_train(X, y, W, &opts, &stats);
+            assert(err == 0);
+            for(size_t j = 0; j < n; j++) {
+                if(t == 0 && mode == SGD_SYNC) {
+                    expected[j] = TENSOR_AT(W, 0, j);
+                }
+                assert(fabs(TENSOR_AT(W, 0, j) - expected[j]) <= 1e-9);
+            }
+        }
+    }
+
+    /* SGD_SYNC gives the same weights for any number of threads, the
+     * weights can be a column */
+    opts.mode = SGD_SYNC;
+    opts.nworkers = 3;
+    opts.batch_size = 50;
+    for(size_t t = 0; t < 2; t++) {
+        parallel_set_nthreads(threads[t]);
+        tensor_fill(V, 0.0);
+        err = sgd_train(X, y, V, &opts, &stats);
+        assert(err == 0);
+        assert(stats.nsamples == 3 * m);
+        for(size_t j = 0; j < n; j++) {
+            if(t == 0) expected[j] = TENSOR_AT(V, j, 0);
+            assert(TENSOR_AT(V, j, 0) == expected[j]);
+        }
+    }
+
+    /* the columns listed by the workers give the weights of the dense
+     * update, also when gradients cancel to zero and a column is listed
+     * again, for explicit zeros and for minibatches that fill the lists */
+    tensor_t *cy;
+    sparse_tensor_t *C = test_cancel_data(50, &cy);
+    tensor_t *CW = allocate_tensor(1, C->ncols);
+    double *reference = malloc(C->ncols * sizeof *reference);
+    assert(CW != NULL && reference != NULL);
+    size_t configs[3][2] = {{1, 4}, {2, 200}, {3, 8}};
+    opts.model = SGD_PERCEPTRON;
+    opts.nepochs = 3;
+    opts.learning_rate = 0.5;
+    for(size_t c = 0; c < 3; c++) {
+        opts.nworkers = configs[c][0];
+        opts.batch_size = configs[c][1];
+        test_sync_reference(C, cy, &opts, reference);
+        for(size_t t = 0; t < 2; t++) {
+            parallel_set_nthreads(threads[t]);
+            tensor_fill(CW, 0.0);
+            err = sgd_train(C, cy, CW, &opts, NULL);
+            assert(err == 0);
+            for(size_t j = 0; j < C->ncols; j++) {
+                assert(TENSOR_AT(CW, 0, j) == reference[j]);
+            }
+        }
+    }
+    free(reference);
+    free_tensor(CW);
+    free_tensor(cy);
+    free_sparse_tensor(C);
+    opts.model = SGD_LOGISTIC;
+    opts.nworkers = 3;
+    opts.batch_size = 50;
+    parallel_set_nthreads(nthreads);
+
+    /* without epochs nothing changes */
+    opts.nepochs = 0;
+    err = sgd_train(X, y, V, &opts, NULL);
+    assert(err == 0);
+    for(size_t j = 0; j < n; j++) assert(TENSOR_AT(V, j, 0) == expected[j]);
+
+    /* invalid arguments */
+    opts.nepochs = 1;
+    tensor_t *bad = allocate_tensor(1, n - 1);
+    tensor_t *f32 = allocate_typed_tensor(1, n, TENSOR_FLOAT32);
+    tensor_t *z = allocate_tensor(m, 1);
+    assert(bad != NULL && f32 != NULL && z != NULL);
+    assert(sgd_train(NULL, y, W, &opts, NULL) != 0 && errno == EINVAL);
+    assert(sgd_train(X, NULL, W, &opts, NULL) != 0 && errno == EINVAL);
+    assert(sgd_train(X, y, NULL, &opts, NULL) != 0 && errno == EINVAL);
+    assert(sgd_train(X, y, W, NULL, NULL) != 0 && errno == EINVAL);
+    assert(sgd_train(X, y, bad, &opts, NULL) != 0 && errno == EINVAL);
+    assert(sgd_train(X, y, f32, &opts, NULL) != 0 && errno == EINVAL);
+    opts.batch_size = 0;
+    assert(sgd_train(X, y, W, &opts, NULL) != 0 && errno == EINVAL);
+    opts.batch_size = 1;
+    opts.mode = (sgd_mode_t)3;
+    assert(sgd_train(X, y, W, &opts, NULL) != 0 && errno == EINVAL);
+    opts.mode = (sgd_mode_t)-1;
+    assert(sgd_train(X, y, W, &opts, NULL) != 0 && errno == EINVAL);
+    opts.mode = SGD_SYNC;
+    opts.model = (sgd_model_t)-1;
+    assert(sgd_train(X, y, W, &opts, NULL) != 0 && errno == EINVAL);
+    opts.model = SGD_LOGISTIC;
+    opts.mode = SGD_ATOMIC;
+    tensor_fill(z, 2.0);
+    assert(sgd_train(X, z, W, &opts, NULL) != 0 && errno == EINVAL);
+    assert(sgd_evaluate(X, z, W, SGD_LOGISTIC, &loss, NULL) != 0);
+    assert(errno == EINVAL);
+    assert(sgd_evaluate(X, y, W, SGD_LOGISTIC, NULL, NULL) != 0);
+    assert(errno == EINVAL);
+    assert(sgd_evaluate(X, y, bad, SGD_LOGISTIC, &loss, NULL) != 0);
+    assert(errno == EINVAL);
+    assert(sgd_evaluate(X, y, W, (sgd_model_t)2, &loss, NULL) != 0);
+    assert(errno == EINVAL);
+    assert(sgd_evaluate(X, y, W, (sgd_model_t)-1, &loss, NULL) != 0);
+    assert(errno == EINVAL);
+
+    free_tensor(bad);
+    free_tensor(f32);
+    free_tensor(z);
+    free_tensor(V);
+    free_tensor(W);
+    free_tensor(y);
+    free_sparse_tensor(X);
+    return 0;
+}
+
+#endif
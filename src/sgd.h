@@ -0,0 +1,67 @@
+/* sgd - Stochastic gradient descent of sparse linear models
+ * Logistic regression and the perceptron on the rows of a sparse tensor
+ * only touch the weights of the non-zero columns of a row, so the updates
+ * of two rows rarely collide. sgd_train can run the workers lock-free:
+ * every worker takes one row at a time from its part of the data and
+ * updates the shared weights directly, Hogwild style, either with relaxed
+ * atomic additions that never lose an update or with plain loads and
+ * stores that may. The synchronous mode computes the gradient of every
+ * minibatch from fixed weights, adds up the gradients of the workers and
+ * then updates the weights, so its result doesn't depend on the threads.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_SGD_H
+#define SIMPLE_NN_SGD_H
+
+#include <stdint.h>
+
+#include "tensor.h"
+#include "sparse.h"
+
+enum sgd_model {
+    SGD_LOGISTIC, // log(1 + exp(-t z))
+    SGD_PERCEPTRON // max(0, -t z)
+};
+typedef enum sgd_model sgd_model_t;
+
+enum sgd_mode {
+    SGD_SYNC, // reduced minibatch gradients
+    SGD_ATOMIC, // lock-free, relaxed atomic additions
+    SGD_RACY // lock-free, plain loads and stores
+};
+typedef enum sgd_mode sgd_mode_t;
+
+/* The label of a row is 0 or 1, the target t is -1 or 1 and z is the dot
+ * product of the row with the weights */
+struct sgd_options {
+    sgd_model_t model;
+    sgd_mode_t mode;
+    double learning_rate;
+    size_t nepochs; // passes over the data
+    size_t nworkers; // 0 for one worker per thread of the pool
+    size_t batch_size; // rows of a minibatch of SGD_SYNC
+    uint32_t seed; // seed of the order of the rows
+};
+typedef struct sgd_options sgd_options_t;
+
+#define SGD_OPTIONS_DEFAULT {SGD_LOGISTIC, SGD_ATOMIC, 0.1, 1, 0, 256, 1}
+
+/* Counters of a call of sgd_train */
+struct sgd_stats {
+    size_t nsamples; // rows processed
+    size_t nupdates; // rows that changed the weights
+    double seconds; // wall time of the training
+    double samples_per_second;
+    double loss; // mean loss of the last epoch, each row before its update
+};
+typedef struct sgd_stats sgd_stats_t;
+
+int sgd_train(const sparse_tensor_t *X, const tensor_t *y, tensor_t *W,
+              const sgd_options_t *opts, sgd_stats_t *stats);
+int sgd_evaluate(const sparse_tensor_t *X, const tensor_t *y,
+                 const tensor_t *W, sgd_model_t model, double *loss,
+                 double *error_rate);
+
+#endif
@@ -0,0 +1,502 @@
+/* sparse - Sparse tensors in compressed sparse row (CSR) layout
+ * One-hot and bag-of-words features are mostly zeros. A sparse tensor only
+ * stores the non-zero elements, row by row, so memory and the cost of a
+ * product with a dense weight tensor scale with the number of non-zeros
+ * instead of nrows * ncols.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tensor.h"
+#include "csv.h"
+#include "sparse.h"
+
+/* allocate_sparse_tensor: Allocate new sparse tensor of nrows rows and
+ * ncols columns with room for capacity non-zeros. Every row is empty.
+ *
+ * It returns NULL and set errno to EINVAL if nrows or ncols is zero
+ * It returns NULL and set errno to ENOMEM if the allocation fails
+ * It returns pointer to new allocated sparse_tensor_t if success */
+sparse_tensor_t *allocate_sparse_tensor(size_t nrows, size_t ncols,
+                                        size_t capacity)
+{
+    if(nrows == 0 || ncols == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    sparse_tensor_t *s = malloc(sizeof *s);
+    if(s == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if(capacity == 0) capacity = 1;
+    s->nrows = nrows;
+    s->ncols = ncols;
+    s->nnz = 0;
+    s->capacity = capacity;
+    s->row_ptr = calloc(nrows + 1, sizeof(size_t));
+    s->col_idx = malloc(capacity * sizeof(size_t));
+    s->values = malloc(capacity * sizeof(double));
+    if(s->row_ptr == NULL || s->col_idx == NULL || s->values == NULL) {
+        free_sparse_tensor(s);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return s;
+}
+
+/* free_sparse_tensor: Free sparse tensor s.
+ * It does nothing if s is NULL */
+void free_sparse_tensor(sparse_tensor_t *s)
+{
+    if(s == NULL) return;
+    free(s->row_ptr);
+    free(s->col_idx);
+    free(s->values);
+    free(s);
+}
+
+/* sparse_reserve: Make room for capacity non-zeros in s */
+static int sparse_reserve(sparse_tensor_t *s, size_t capacity)
+{
+    if(capacity <= s->capacity) return 0;
+    if(capacity < s->capacity * 2) capacity = s->capacity * 2;
+
+    size_t *col_idx = realloc(s->col_idx, capacity * sizeof(size_t));
+    if(col_idx == NULL) return -1;
+    s->col_idx = col_idx;
+    double *values = realloc(s->values, capacity * sizeof(double));
+    if(values == NULL) return -1;
+    s->values = values;
+    s->capacity = capacity;
+    return 0;
+}
+
+/* sparse_from_dense: Allocate new sparse tensor holding the non-zero
+ * elements of tensor t, which can be a view of any element type. NaN is
+ * kept as a non-zero.
+ *
+ * It returns NULL and set errno to EINVAL if t is NULL or empty
+ * It returns NULL and set errno to ENOMEM if the allocation fails
+ * It returns pointer to new allocated sparse_tensor_t if success */
+sparse_tensor_t *sparse_from_dense(const tensor_t *t)
+{
+    /* NULL checking */
+    if(t == NULL || t->nrows == 0 || t->ncols == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* every row is converted to double, once to count and once to copy */
+    tensor_t *row = allocate_tensor(1, t->ncols);
+    if(row == NULL) return NULL;
+    const double *values = row->data;
+
+    size_t nnz = 0;
+    for(size_t i = 0; i < t->nrows; i++) {
+        tensor_t view;
+        tensor_view_rows(t, i, 1, &view);
+        tensor_convert(&view, row);
+        for(size_t j = 0; j < t->ncols; j++) nnz += values[j] != 0.0;
+    }
+
+    sparse_tensor_t *s = allocate_sparse_tensor(t->nrows, t->ncols, nnz);
+    if(s == NULL) {
+        free_tensor(row);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < t->nrows; i++) {
+        tensor_t view;
+        tensor_view_rows(t, i, 1, &view);
+        tensor_convert(&view, row);
+        for(size_t j = 0; j < t->ncols; j++) {
+            if(values[j] == 0.0) continue;
+            s->col_idx[s->nnz] = j;
+            s->values[s->nnz] = values[j];
+            s->nnz++;
+        }
+        s->row_ptr[i + 1] = s->nnz;
+    }
+
+    free_tensor(row);
+    return s;
+}
+
+/* sparse_to_dense: Store the elements of sparse tensor s, zeros included,
+ * in tensor dst.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if s or dst is NULL or
+ * the shapes differ */
+int sparse_to_dense(const sparse_tensor_t *s, tensor_t *dst)
+{
+    /* NULL checking */
+    if(s == NULL || dst == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(s->nrows != dst->nrows || s->ncols != dst->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    tensor_fill(dst, 0.0);
+    for(size_t i = 0; i < s->nrows; i++) {
+        for(size_t k = s->row_ptr[i]; k < s->row_ptr[i + 1]; k++) {
+            tensor_set_value(dst, i, s->col_idx[k], s->values[k]);
+        }
+    }
+    return 0;
+}
+
+/* sparse_parse_csv: Parse the rows of the mapped file into a new sparse
+ * tensor, growing the element arrays by doubling */
+static int sparse_parse_csv(const char *buf, size_t len,
+                            const csv_options_t *opts, sparse_tensor_t **X,
+                            tensor_t **y)
+{
+    const char *begin = buf, *end = buf + len;
+    if(opts->has_header) {
+        const char *newline = memchr(begin, '\n', len);
+        begin = newline != NULL ? newline + 1 : end;
+    }
+
+    long label = opts->label_column;
+    size_t size = (size_t)(end - begin);
+    size_t nfields = csv_count_cols(begin, size, opts->delimiter);
+    size_t nrows = csv_count_rows(begin, size);
+    if(nfields == 0 || label >= (long)nfields
+       || (label >= 0 && nfields == 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t ncols = nfields - (label >= 0);
+    sparse_tensor_t *s = allocate_sparse_tensor(nrows, ncols, nrows * 4);
+    tensor_t *ys = label >= 0 ? allocate_typed_tensor(nrows, 1,
+                                                      TENSOR_FLOAT64)
+                              : NULL;
+    double *values = malloc(nfields * sizeof(double));
+    int err = 0;
+    if(s == NULL || (label >= 0 && ys == NULL) || values == NULL) {
+        err = ENOMEM;
+    }
+
+    csv_scanner_t scanner;
+    csv_scanner_init(&scanner, begin, size, opts->delimiter);
+    for(size_t i = 0; !err && i < nrows; i++) {
+        size_t n;
+        if(csv_next_row(&scanner, values, nfields, &n) <= 0
+           || n != nfields) {
+            err = EINVAL;
+            break;
+        }
+        for(size_t j = 0; j < nfields; j++) {
+            if((long)j == label) {
+                TENSOR_AT(ys, i, 0) = values[j];
+                continue;
+            }
+            if(values[j] == 0.0) continue;
+            if(sparse_reserve(s, s->nnz + 1) != 0) {
+                err = ENOMEM;
+                break;
+            }
+            s->col_idx[s->nnz] = j - (label >= 0 && (long)j > label);
+            s->values[s->nnz] = values[j];
+            s->nnz++;
+        }
+        s->row_ptr[i + 1] = s->nnz;
+    }
+    free(values);
+
+    if(err) {
+        free_sparse_tensor(s);
+        free_tensor(ys);
+        errno = err;
+        return -1;
+    }
+    *X = s;
+    if(y != NULL) *y = ys;
+    return 0;
+}
+
+/* sparse_load_csv: Load the CSV/TSV file at path into a new sparse tensor
+ * X and, if opts->label_column is not negative, a new float64 column
+ * tensor y, like csv_load. Only the non-zero fields are stored so the
+ * dense matrix is never built. The dtype and nthreads options are
+ * ignored.
+ *
+ * It returns zero on success
+ * It returns non-zero value and set errno to EINVAL if the arguments are
+ * invalid or the file is empty or malformed
+ * It returns non-zero value and set errno to ENOMEM if the allocation
+ * fails
+ * It returns non-zero value and keep errno of open(2) or mmap(2) if the
+ * file cannot be mapped */
+int sparse_load_csv(const char *path, const csv_options_t *opts,
+                    sparse_tensor_t **X, tensor_t **y)
+{
+    /* NULL checking */
+    if(path == NULL || opts == NULL || X == NULL
+       || (opts->label_column >= 0 && y == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return -1;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    size_t length = (size_t)st.st_size;
+    if(length == 0) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved = errno;
+    close(fd);
+    if(base == MAP_FAILED) {
+        errno = saved;
+        return -1;
+    }
+
+    int err = sparse_parse_csv(base, length, opts, X, y);
+    saved = errno;
+    munmap(base, length);
+    errno = saved;
+    return err;
+}
+
+/* sparse_row_product: Compute the n elements c = sum of values[k] times
+ * the row col_idx[k] of w, for the count non-zeros of one row. Four rows
+ * of w are combined per pass so c is loaded and stored once for every
+ * four non-zeros. */
+static void sparse_row_product(const size_t *col_idx, const double *values,
+                               size_t count, const double *w, size_t ldw,
+                               size_t n, double *c)
+{
+    memset(c, 0, n * sizeof(double));
+
+    size_t k = 0;
+    for(; k + 4 <= count; k += 4) {
+        const double *w0 = w + col_idx[k] * ldw;
+        const double *w1 = w + col_idx[k + 1] * ldw;
+        const double *w2 = w + col_idx[k + 2] * ldw;
+        const double *w3 = w + col_idx[k + 3] * ldw;
+        double v0 = values[k], v1 = values[k + 1];
+        double v2 = values[k + 2], v3 = values[k + 3];
+        for(size_t j = 0; j < n; j++) {
+            c[j] += v0 * w0[j] + v1 * w1[j] + v2 * w2[j] + v3 * w3[j];
+        }
+    }
+    for(; k < count; k++) {
+        const double *w0 = w + col_idx[k] * ldw;
+        double v0 = values[k];
+        for(size_t j = 0; j < n; j++) c[j] += v0 * w0[j];
+    }
+}
+
+/* sparse_matmul: Compute C = A * W for a sparse tensor A and dense
+ * tensors W and C of any element type and strides. The work is
+ * proportional to the non-zeros of A times the columns of W: the rows of
+ * W selected by the non-zeros of each row of A are scaled and summed.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if an argument is
+ * NULL, the shapes don't match or C shares its data with W
+ * It returns non-zero value and set errno to ENOMEM if a temporary tensor
+ * cannot be allocated */
+int sparse_matmul(const sparse_tensor_t *A, const tensor_t *W, tensor_t *C)
+{
+    /* NULL checking */
+    if(A == NULL || W == NULL || C == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(A->ncols != W->nrows || C->nrows != A->nrows
+       || C->ncols != W->ncols || C->data == W->data) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* the kernel reads W as rows of contiguous doubles */
+    const tensor_t *w = W;
+    tensor_t *converted = NULL;
+    if(W->dtype != TENSOR_FLOAT64 || W->col_stride != 1) {
+        converted = allocate_tensor(W->nrows, W->ncols);
+        if(converted == NULL) return -1;
+        tensor_convert(W, converted);
+        w = converted;
+    }
+
+    /* rows of C that are not contiguous doubles go through a buffer */
+    size_t n = C->ncols;
+    int direct = C->dtype == TENSOR_FLOAT64 && C->col_stride == 1;
+    double *buffer = NULL;
+    if(!direct) {
+        buffer = malloc(n * sizeof(double));
+        if(buffer == NULL) {
+            free_tensor(converted);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    const double *wdata = (const double *)w->data + w->offset;
+    for(size_t i = 0; i < A->nrows; i++) {
+        size_t k = A->row_ptr[i];
+        double *c = direct ? (double *)C->data + C->offset + i * C->ld
+                           : buffer;
+        sparse_row_product(A->col_idx + k, A->values + k,
+                           A->row_ptr[i + 1] - k, wdata, w->ld, n, c);
+        if(!direct) tensor_set_row(C, i, buffer);
+    }
+
+    free(buffer);
+    free_tensor(converted);
+    return 0;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_SPARSE_C_TEST
+#include <assert.h>
+#include <stdio.h>
+
+#include "matmul.h"
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+
+    /* a mostly zero tensor with small integers so products are exact */
+    size_t m = 37, k = 53, n = 19;
+    tensor_t *dense = allocate_tensor(m, k);
+    tensor_fill(dense, 0.0);
+    for(size_t i = 0; i < m; i++) {
+        for(size_t j = 0; j < k; j++) {
+            if((i * 7 + j * 13) % 11 == 0) {
+                TENSOR_AT(dense, i, j) = (double)((i + j) % 5) - 2.0;
+            }
+        }
+    }
+
+    sparse_tensor_t *s = sparse_from_dense(dense);
+    assert(s != NULL && s->nrows == m && s->ncols == k);
+    size_t nnz = 0;
+    for(size_t i = 0; i < m; i++) {
+        for(size_t j = 0; j < k; j++) nnz += TENSOR_AT(dense, i, j) != 0.0;
+    }
+    assert(s->nnz == nnz && s->row_ptr[m] == nnz);
+    for(size_t i = 0; i < m; i++) {
+        for(size_t p = s->row_ptr[i]; p + 1 < s->row_ptr[i + 1]; p++) {
+            assert(s->col_idx[p] < s->col_idx[p + 1]);
+        }
+    }
+
+    /* back to dense */
+    tensor_t *back = allocate_typed_tensor(m, k, TENSOR_FLOAT32);
+    err = sparse_to_dense(s, back);
+    assert(err == 0);
+    for(size_t i = 0; i < m; i++) {
+        for(size_t j = 0; j < k; j++) {
+            double value;
+            tensor_get_value(*back, i, j, &value);
+            assert(value == TENSOR_AT(dense, i, j));
+        }
+    }
+
+    /* the sparse product matches the dense one */
+    tensor_t *W = allocate_tensor(k, n);
+    for(size_t i = 0; i < k; i++) {
+        for(size_t j = 0; j < n; j++) {
+            TENSOR_AT(W, i, j) = (double)((i * 3 + j) % 7) - 3.0;
+        }
+    }
+    tensor_t *expected = allocate_tensor(m, n);
+    tensor_t *C = allocate_tensor(m, n);
+    err = tensor_matmul(dense, W, expected);
+    assert(err == 0);
+    err = sparse_matmul(s, W, C);
+    assert(err == 0);
+    for(size_t i = 0; i < m; i++) {
+        for(size_t j = 0; j < n; j++) {
+            assert(TENSOR_AT(C, i, j) == TENSOR_AT(expected, i, j));
+        }
+    }
+
+    /* a float32 weight and a transposed output */
+    tensor_t *W32 = allocate_typed_tensor(k, n, TENSOR_FLOAT32);
+    tensor_convert(W, W32);
+    tensor_t *CT = allocate_tensor(n, m);
+    tensor_t view;
+    tensor_transpose_view(CT, &view);
+    err = sparse_matmul(s, W32, &view);
+    assert(err == 0);
+    for(size_t i = 0; i < m; i++) {
+        for(size_t j = 0; j < n; j++) {
+            assert(TENSOR_AT(CT, j, i) == TENSOR_AT(expected, i, j));
+        }
+    }
+
+    /* shape mismatch */
+    err = sparse_matmul(s, C, C);
+    assert(err != 0 && errno == EINVAL);
+
+    /* CSV with a label column, the zeros are not stored */
+    char path[] = "/tmp/simple-nn-sparse-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    const char *text = "w0,w1,w2,label\n0,1,0,1\n0,0,0,0\n2.5,0,0,1\n";
+    assert(write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+    close(fd);
+    csv_options_t opts = CSV_OPTIONS_DEFAULT;
+    opts.has_header = 1;
+    opts.label_column = 3;
+    sparse_tensor_t *X;
+    tensor_t *y;
+    err = sparse_load_csv(path, &opts, &X, &y);
+    assert(err == 0);
+    assert(X->nrows == 3 && X->ncols == 3 && X->nnz == 2);
+    assert(X->row_ptr[1] == 1 && X->row_ptr[2] == 1 && X->row_ptr[3] == 2);
+    assert(X->col_idx[0] == 1 && X->values[0] == 1.0);
+    assert(X->col_idx[1] == 0 && X->values[1] == 2.5);
+    assert(TENSOR_AT(y, 0, 0) == 1.0 && TENSOR_AT(y, 1, 0) == 0.0);
+    free_sparse_tensor(X);
+    free_tensor(y);
+    unlink(path);
+
+    free_sparse_tensor(s);
+    free_tensor(dense);
+    free_tensor(back);
+    free_tensor(W);
+    free_tensor(W32);
+    free_tensor(expected);
+    free_tensor(C);
+    free_tensor(CT);
+    return 0;
+}
+#endif
@@ -0,0 +1,40 @@
+/* sparse - Sparse tensors in compressed sparse row (CSR) layout
+ * One-hot and bag-of-words features are mostly zeros. A sparse tensor only
+ * stores the non-zero elements, row by row, so memory and the cost of a
+ * product with a dense weight tensor scale with the number of non-zeros
+ * instead of nrows * ncols.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_SPARSE_H
+#define SIMPLE_NN_SPARSE_H
+
+#include "tensor.h"
+#include "csv.h"
+
+/* The non-zeros of row i are values[k] at column col_idx[k] for k in
+ * [row_ptr[i], row_ptr[i + 1]), sorted by column. */
+struct sparse_tensor {
+    size_t nrows;
+    size_t ncols;
+    size_t nnz; // number of stored elements
+    size_t capacity; // room for elements in col_idx and values
+    size_t *row_ptr; // nrows + 1 offsets into col_idx and values
+    size_t *col_idx;
+    double *values;
+};
+typedef struct sparse_tensor sparse_tensor_t;
+
+sparse_tensor_t *allocate_sparse_tensor(size_t nrows, size_t ncols,
+                                        size_t capacity);
+void free_sparse_tensor(sparse_tensor_t *s);
+
+sparse_tensor_t *sparse_from_dense(const tensor_t *t);
+int sparse_to_dense(const sparse_tensor_t *s, tensor_t *dst);
+int sparse_load_csv(const char *path, const csv_options_t *opts,
+                    sparse_tensor_t **X, tensor_t **y);
+
+int sparse_matmul(const sparse_tensor_t *A, const tensor_t *W, tensor_t *C);
+
+#endif
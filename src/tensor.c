@@ -8,43 +8,163 @@
  * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
  * Use of this source code is governed by a BSD-style license that
  * can be found in the LICENSE file. */
+#define _POSIX_C_SOURCE 200112L
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <errno.h>
 
 #include "tensor.h"
 #include "rng.h"
+#include "pool.h"
+#include "cpu.h"
 
-/* allocate_tensor: allocate new zero-initialized tensor on heap.
- * It returns NULL if alocation fails or nrows/ncols is zero
- * It returns pointer to new allocated tensor_t if operation success */
-tensor_t *allocate_tensor(size_t nrows, size_t ncols)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TENSOR_X86 1
+#include <immintrin.h>
+#endif
+
+/* Number of elements converted at once through a temporary buffer */
+#define TENSOR_CONVERT_CHUNK 256
+
+/* tensor_dtype_size: get the size in bytes of one element of type dtype */
+size_t tensor_dtype_size(tensor_dtype_t dtype)
 {
-    /* check the value of nrows and ncols */
-    if(nrows == 0 || ncols == 0) {
+    switch(dtype) {
+    case TENSOR_FLOAT64:
+        return sizeof(double);
+    case TENSOR_FLOAT32:
+        return sizeof(float);
+    case TENSOR_FLOAT16:
+    case TENSOR_BFLOAT16:
+        return sizeof(uint16_t);
+    case TENSOR_INT8:
+        return sizeof(int8_t);
+    }
+    return 0;
+}
+
+/* tensor_leading_dimension: compute the leading dimension of a tensor with
+ * ncols columns of type dtype. Rows of at least one cache line are padded
+ * to a multiple of TENSOR_ALIGNMENT bytes; narrower rows (e.g. column
+ * vectors) are kept packed since padding them would multiply their size.
+ * When the row size is a multiple of 4096 bytes one more cache line is
+ * added, otherwise the same column of consecutive rows maps to the same
+ * cache set.
+ * It returns zero if dtype is unknown */
+size_t tensor_leading_dimension(size_t ncols, tensor_dtype_t dtype)
+{
+    size_t elsize = tensor_dtype_size(dtype);
+    if(elsize == 0) return 0;
+
+    size_t line = TENSOR_ALIGNMENT / elsize;
+    if(ncols < line) return ncols;
+
+    size_t ld = (ncols + line - 1) / line * line;
+    if((ld * elsize) % 4096 == 0) ld += line;
+    return ld;
+}
+
+/* tensor_init: Initialize the tensor header t for nrows x ncols elements of
+ * type dtype stored in data with the layout of allocate_typed_tensor: data
+ * holds nrows * tensor_leading_dimension(ncols, dtype) elements and should
+ * be aligned to TENSOR_ALIGNMENT bytes. t does not own data. The row
+ * padding is zero-filled, the elements are left untouched.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if t or data is NULL,
+ * nrows/ncols is zero or dtype is unknown */
+int tensor_init(tensor_t *t, size_t nrows, size_t ncols, tensor_dtype_t dtype,
+                void *data)
+{
+    size_t elsize = tensor_dtype_size(dtype);
+
+    /* check the arguments */
+    if(t == NULL || data == NULL || nrows == 0 || ncols == 0 || elsize == 0) {
         errno = EINVAL;
-        return NULL;
+        return -1;
     }
 
-    tensor_t *tensor = malloc(sizeof *tensor);
-    if(tensor == NULL) {
-        errno = ENOMEM;
+    size_t ld = tensor_leading_dimension(ncols, dtype);
+    t->nrows = nrows;
+    t->ncols = ncols;
+    t->ld = ld;
+    t->col_stride = 1;
+    t->offset = 0;
+    t->owns_data = 0;
+    t->arena = NULL;
+    t->dtype = dtype;
+    t->data = data;
+
+    /* zero the padding so vector loads past ncols read zeros */
+    if(ld != ncols) {
+        for(size_t i = 0; i < nrows; i++) {
+            memset((char *)data + ((i * ld) + ncols) * elsize, 0,
+                   (ld - ncols) * elsize);
+        }
+    }
+
+    return 0;
+}
+
+/* tensor_allocate_uninitialized: allocate new tensor from the tensor pool
+ * with aligned and padded data. The header and the data share one block.
+ * Only the row padding is zero-initialized.
+ * It returns NULL and set errno if nrows/ncols is zero, dtype is unknown or
+ * allocation fails
+ * It returns pointer to new allocated tensor_t if operation success */
+static tensor_t *tensor_allocate_uninitialized(size_t nrows, size_t ncols,
+                                               tensor_dtype_t dtype)
+{
+    size_t elsize = tensor_dtype_size(dtype);
+
+    /* check the value of nrows, ncols and dtype */
+    if(nrows == 0 || ncols == 0 || elsize == 0) {
+        errno = EINVAL;
         return NULL;
     }
 
-    double *data = calloc(nrows * ncols, sizeof *data);
-    if(data == NULL) {
+    size_t header_size = (sizeof(tensor_t) + TENSOR_ALIGNMENT - 1)
+                         / TENSOR_ALIGNMENT * TENSOR_ALIGNMENT;
+    size_t ld = tensor_leading_dimension(ncols, dtype);
+    char *block = tensor_pool_alloc(header_size + nrows * ld * elsize);
+    if(block == NULL) {
         errno = ENOMEM;
         return NULL;
     }
 
-    tensor->nrows = nrows;
-    tensor->ncols = ncols;
-    tensor->data = data;
+    tensor_t *tensor = (tensor_t *)block;
+    tensor_init(tensor, nrows, ncols, dtype, block + header_size);
+    tensor->owns_data = 1;
     return tensor;
 }
 
-/* allocate_random_tensor: Allocate random-number-initialized tensor
- * on the heap.
+/* allocate_typed_tensor: allocate new zero-initialized tensor on heap whose
+ * elements have type dtype.
+ * The data is aligned to TENSOR_ALIGNMENT bytes and each row is padded,
+ * see struct tensor.
+ * It returns NULL if alocation fails, nrows/ncols is zero or dtype is
+ * unknown
+ * It returns pointer to new allocated tensor_t if operation success */
+tensor_t *allocate_typed_tensor(size_t nrows, size_t ncols,
+                                tensor_dtype_t dtype)
+{
+    tensor_t *tensor = tensor_allocate_uninitialized(nrows, ncols, dtype);
+    if(tensor == NULL) return NULL;
+
+    memset(tensor->data, 0, nrows * tensor->ld * tensor_dtype_size(dtype));
+    return tensor;
+}
+
+/* allocate_tensor: allocate new zero-initialized TENSOR_FLOAT64 tensor on
+ * heap. See allocate_typed_tensor. */
+tensor_t *allocate_tensor(size_t nrows, size_t ncols)
+{
+    return allocate_typed_tensor(nrows, ncols, TENSOR_FLOAT64);
+}
+
+/* allocate_random_tensor: Allocate random-number-initialized TENSOR_FLOAT64
+ * tensor on the heap.
  * The distribution of where the random number generated from is specified
  * by random number generator rng.
  *
@@ -55,56 +175,39 @@ tensor_t *allocate_tensor(size_t nrows, size_t ncols)
  * handling */
 tensor_t *allocate_random_tensor(size_t nrows, size_t ncols, const rng_t rng)
 {
-    /* check the value of nrows and ncols */
-    if(nrows == 0 || ncols == 0) {
-        errno = EINVAL;
-        return NULL;
-    }
-
-    tensor_t *tensor = malloc(sizeof *tensor);
-    if(tensor == NULL) {
-        errno = ENOMEM;
-        return NULL;
-    }
-
-    double *data = malloc((nrows * ncols) * sizeof *data);
-    if(data == NULL) {
-        errno = ENOMEM;
-        return NULL;
-    }
-
-    tensor->nrows = nrows;
-    tensor->ncols = ncols;
-    tensor->data = data;
+    tensor_t *tensor = tensor_allocate_uninitialized(nrows, ncols,
+                                                     TENSOR_FLOAT64);
+    if(tensor == NULL) return NULL;
 
     /* populate the data */
-    for(int i = 0; i < nrows; i++) {
-        for(int j = 0; j < ncols; i++) {
+    double *data = tensor->data;
+    for(size_t i = 0; i < nrows; i++) {
+        for(size_t j = 0; j < ncols; j++) {
             int err = 0;
 
             double rand_value;
             err = rng_get_random_value(rng, &rand_value);
             if(err != 0) {
-                errno = errno;
+                free_tensor(tensor);
                 return NULL;
             }
 
-            err = tensor_set_value(tensor, i, j, rand_value);
-            if(err != 0) {
-                errno = errno;
-                return NULL;
-            }
+            data[(i * tensor->ld) + j] = rand_value;
         }
     }
 
     return tensor;
 }
 
-/* free_tensor: free tensor t from the heap */
+/* free_tensor: give tensor t allocated by allocate_tensor,
+ * allocate_typed_tensor or allocate_random_tensor back to the tensor pool.
+ * Tensors allocated from an arena are released by tensor_arena_reset or
+ * free_tensor_arena.
+ * It does nothing if t is NULL or does not own its data */
 void free_tensor(tensor_t *t)
 {
-    free(t->data);
-    free(t);
+    if(t == NULL || t->arena != NULL || !t->owns_data) return;
+    tensor_pool_free(t);
 }
 
 /* tensor_get_nrows: get the number of rows of the tensor t */
@@ -119,6 +222,12 @@ size_t tensor_get_ncols(const tensor_t t)
     return t.ncols;
 }
 
+/* tensor_get_dtype: get the element type of the tensor t */
+tensor_dtype_t tensor_get_dtype(const tensor_t t)
+{
+    return t.dtype;
+}
+
 /* tensor_get_value: get the value of tensor cell from tensor t specified by row
  * index rowi dan column index colj.
  * It returns 0 and write the value to the output if the input is valid
@@ -132,7 +241,9 @@ int tensor_get_value(const tensor_t t, size_t rowi, size_t colj, double *output)
     }
 
     /* writes the value to the output */
-    *output = *(t.data + ((rowi * t.ncols) + colj));
+    size_t index = t.offset + (rowi * t.ld) + (colj * t.col_stride);
+    tensor_convert_array((char *)t.data + index * tensor_dtype_size(t.dtype),
+                         t.dtype, output, TENSOR_FLOAT64, 1);
     return 0;
 }
 
@@ -157,7 +268,637 @@ int tensor_set_value(tensor_t *const t, size_t rowi, size_t colj, double value)
     }
 
     /* write the data */
-    *(t->data + ((rowi * t->ncols) + colj)) = value;
+    size_t index = t->offset + (rowi * t->ld) + (colj * t->col_stride);
+    tensor_convert_array(&value, TENSOR_FLOAT64,
+                         (char *)t->data + index * tensor_dtype_size(t->dtype),
+                         t->dtype, 1);
+    return 0;
+}
+
+/* tensor_from_array: Allocate new tensor of type dtype on heap and fill it
+ * with nrows * ncols elements of type dtype read from values in row-major
+ * order. The rows are copied with memcpy.
+ *
+ * It returns NULL and set errno to EINVAL if values is NULL, nrows/ncols
+ * is zero or dtype is unknown.
+ * It returns NULL and set errno to ENOMEM if allocation fails.
+ * It returns pointer to new allocated tensor_t if operation succeed */
+tensor_t *tensor_from_array(size_t nrows, size_t ncols, const void *values,
+                            tensor_dtype_t dtype)
+{
+    /* NULL checking */
+    if(values == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    tensor_t *tensor = tensor_allocate_uninitialized(nrows, ncols, dtype);
+    if(tensor == NULL) return NULL;
+
+    size_t elsize = tensor_dtype_size(dtype);
+    if(tensor->ld == ncols) {
+        memcpy(tensor->data, values, nrows * ncols * elsize);
+        return tensor;
+    }
+
+    for(size_t i = 0; i < nrows; i++) {
+        memcpy((char *)tensor->data + (i * tensor->ld) * elsize,
+               (const char *)values + (i * ncols) * elsize, ncols * elsize);
+    }
+    return tensor;
+}
+
+/* tensor_fill: Set every element of tensor t to value, converted to the
+ * element type of t once.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if t is NULL */
+int tensor_fill(tensor_t *t, double value)
+{
+    /* NULL checking */
+    if(t == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned char element[sizeof(double)];
+    size_t elsize = tensor_dtype_size(t->dtype);
+    tensor_convert_array(&value, TENSOR_FLOAT64, element, t->dtype, 1);
+
+    for(size_t i = 0; i < t->nrows; i++) {
+        char *row = (char *)t->data + (t->offset + (i * t->ld)) * elsize;
+        size_t stride = t->col_stride;
+
+        switch(elsize) {
+        case sizeof(double): {
+            double x;
+            memcpy(&x, element, sizeof x);
+            for(size_t j = 0; j < t->ncols; j++) {
+                ((double *)row)[j * stride] = x;
+            }
+            break;
+        }
+        case sizeof(float): {
+            float x;
+            memcpy(&x, element, sizeof x);
+            for(size_t j = 0; j < t->ncols; j++) {
+                ((float *)row)[j * stride] = x;
+            }
+            break;
+        }
+        case sizeof(uint16_t): {
+            uint16_t x;
+            memcpy(&x, element, sizeof x);
+            for(size_t j = 0; j < t->ncols; j++) {
+                ((uint16_t *)row)[j * stride] = x;
+            }
+            break;
+        }
+        default:
+            for(size_t j = 0; j < t->ncols; j++) {
+                row[j * stride] = (char)element[0];
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* tensor_set_row: Set the elements of the row rowi of tensor t to the ncols
+ * doubles read from values, converted to the element type of t.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if t or values is NULL
+ * or the row doesn't exists */
+int tensor_set_row(tensor_t *t, size_t rowi, const double *values)
+{
+    /* NULL checking */
+    if(t == NULL || values == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* bound checking */
+    if(rowi >= t->nrows) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t elsize = tensor_dtype_size(t->dtype);
+    char *row = (char *)t->data + (t->offset + (rowi * t->ld)) * elsize;
+    if(t->col_stride == 1) {
+        tensor_convert_array(values, TENSOR_FLOAT64, row, t->dtype, t->ncols);
+        return 0;
+    }
+
+    for(size_t j = 0; j < t->ncols; j++) {
+        tensor_convert_array(values + j, TENSOR_FLOAT64,
+                             row + (j * t->col_stride) * elsize, t->dtype, 1);
+    }
+    return 0;
+}
+
+/* tensor_copy_rows: Copy nrows rows of tensor src starting from the row
+ * src_rowi to the rows of tensor dst starting from the row dst_rowi. The
+ * elements are converted if the element types differ. Rows with unit
+ * column stride are copied with memmove, so src and dst may be the same
+ * tensor; otherwise they must not overlap.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if src or dst is NULL,
+ * the number of columns differs or the rows do not exist */
+int tensor_copy_rows(const tensor_t *src, size_t src_rowi, size_t nrows,
+                     tensor_t *dst, size_t dst_rowi)
+{
+    /* NULL checking */
+    if(src == NULL || dst == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* bound checking */
+    if(src->ncols != dst->ncols || src_rowi > src->nrows
+       || nrows > src->nrows - src_rowi || dst_rowi > dst->nrows
+       || nrows > dst->nrows - dst_rowi) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    tensor_t from, to;
+    if(nrows == 0) return 0;
+    tensor_view_rows(src, src_rowi, nrows, &from);
+    tensor_view_rows(dst, dst_rowi, nrows, &to);
+
+    /* one block if both sides have no gaps between the rows */
+    size_t elsize = tensor_dtype_size(src->dtype);
+    if(src->dtype == dst->dtype && tensor_is_contiguous(from)
+       && tensor_is_contiguous(to)) {
+        memmove((char *)to.data + to.offset * elsize,
+                (const char *)from.data + from.offset * elsize,
+                nrows * from.ncols * elsize);
+        return 0;
+    }
+
+    /* rows overlapping in place are copied back to front */
+    if(dst_rowi > src_rowi) {
+        for(size_t i = nrows; i-- > 0;) {
+            tensor_t src_row, dst_row;
+            tensor_view_rows(&from, i, 1, &src_row);
+            tensor_view_rows(&to, i, 1, &dst_row);
+            tensor_convert(&src_row, &dst_row);
+        }
+        return 0;
+    }
+
+    return tensor_convert(&from, &to);
+}
+
+/* tensor_is_contiguous: check whether the elements of tensor t are stored
+ * row after row without gaps.
+ * It returns non-zero value if t is contiguous otherwise it returns zero */
+int tensor_is_contiguous(const tensor_t t)
+{
+    if(t.nrows > 1 && t.ld != t.ncols) return 0;
+    if(t.ncols > 1 && t.col_stride != 1) return 0;
+    return 1;
+}
+
+/* tensor_view_rows: Create a view of nrows rows of tensor t starting from
+ * the row index rowi. The view shares the data of t, no element is copied.
+ * The view is written to the caller-provided view; it does not own the
+ * data and must not be passed to free_tensor. It is valid as long as the
+ * data of t is not freed.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if t or view is NULL,
+ * nrows is zero or the rows do not exist in t */
+int tensor_view_rows(const tensor_t *t, size_t rowi, size_t nrows,
+                     tensor_t *view)
+{
+    /* NULL checking */
+    if(t == NULL || view == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* bound checking */
+    if(nrows == 0 || rowi >= t->nrows || nrows > t->nrows - rowi) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *view = *t;
+    view->nrows = nrows;
+    view->offset = t->offset + (rowi * t->ld);
+    view->owns_data = 0;
+    return 0;
+}
+
+/* tensor_view_cols: Create a view of ncols columns of tensor t starting from
+ * the column index colj. See tensor_view_rows for the lifetime of the view.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if t or view is NULL,
+ * ncols is zero or the columns do not exist in t */
+int tensor_view_cols(const tensor_t *t, size_t colj, size_t ncols,
+                     tensor_t *view)
+{
+    /* NULL checking */
+    if(t == NULL || view == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* bound checking */
+    if(ncols == 0 || colj >= t->ncols || ncols > t->ncols - colj) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *view = *t;
+    view->ncols = ncols;
+    view->offset = t->offset + (colj * t->col_stride);
+    view->owns_data = 0;
+    return 0;
+}
+
+/* tensor_transpose_view: Create the transpose of tensor t as a view by
+ * swapping its shape and strides. See tensor_view_rows for the lifetime of
+ * the view.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if t or view is NULL */
+int tensor_transpose_view(const tensor_t *t, tensor_t *view)
+{
+    /* NULL checking */
+    if(t == NULL || view == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *view = *t;
+    view->nrows = t->ncols;
+    view->ncols = t->nrows;
+    view->ld = t->col_stride;
+    view->col_stride = t->ld;
+    view->owns_data = 0;
+    return 0;
+}
+
+/* tensor_reshape_view: Create a view of tensor t with nrows rows and ncols
+ * columns. The elements keep their row-major order, so t must be
+ * contiguous. See tensor_view_rows for the lifetime of the view.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if t or view is NULL,
+ * t is not contiguous or the number of elements does not match */
+int tensor_reshape_view(const tensor_t *t, size_t nrows, size_t ncols,
+                        tensor_t *view)
+{
+    /* NULL checking */
+    if(t == NULL || view == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* the shape must keep the number of elements */
+    if(nrows == 0 || ncols == 0 || nrows * ncols != t->nrows * t->ncols
+       || !tensor_is_contiguous(*t)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *view = *t;
+    view->nrows = nrows;
+    view->ncols = ncols;
+    view->ld = ncols;
+    view->col_stride = 1;
+    view->owns_data = 0;
+    return 0;
+}
+
+/* tensor_float_to_half: convert value to IEEE 754 binary16 rounding to
+ * nearest even. Values too large for binary16 become infinity, NaN stays a
+ * (quiet) NaN */
+uint16_t tensor_float_to_half(float value)
+{
+    uint32_t x;
+    memcpy(&x, &value, sizeof x);
+    uint32_t sign = x & 0x80000000u;
+    x ^= sign;
+
+    uint16_t h;
+    if(x >= 0x47800000u) {
+        /* overflow, infinity or NaN */
+        h = x > 0x7f800000u ? 0x7e00 : 0x7c00;
+    } else if(x < 0x38800000u) {
+        /* subnormal or zero result: adding 0.5 aligns the binary16
+         * mantissa to the bottom of the binary32 one and lets the FPU
+         * do the rounding */
+        uint32_t magic_bits = 0x3f000000u;
+        float f, magic;
+        memcpy(&f, &x, sizeof f);
+        memcpy(&magic, &magic_bits, sizeof magic);
+        f += magic;
+        memcpy(&x, &f, sizeof x);
+        h = (uint16_t)(x - magic_bits);
+    } else {
+        /* normal result: rebias the exponent and round the mantissa */
+        uint32_t odd = (x >> 13) & 1;
+        x += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+        h = (uint16_t)(x >> 13);
+    }
+
+    return h | (uint16_t)(sign >> 16);
+}
+
+/* tensor_half_to_float: convert IEEE 754 binary16 value to float, the
+ * conversion is exact */
+float tensor_half_to_float(uint16_t value)
+{
+    uint32_t x = (uint32_t)(value & 0x7fff) << 13;
+    uint32_t exponent = x & 0x0f800000u;
+    float f;
+
+    x += (uint32_t)(127 - 15) << 23;
+    if(exponent == 0x0f800000u) {
+        /* infinity or NaN */
+        x += (uint32_t)(128 - 16) << 23;
+        memcpy(&f, &x, sizeof f);
+    } else if(exponent == 0) {
+        /* zero or subnormal: renormalize through the FPU */
+        x += 1u << 23;
+        memcpy(&f, &x, sizeof f);
+        f -= 6.103515625e-05f; // 2^-14
+    } else {
+        memcpy(&f, &x, sizeof f);
+    }
+
+    memcpy(&x, &f, sizeof x);
+    x |= (uint32_t)(value & 0x8000) << 16;
+    memcpy(&f, &x, sizeof f);
+    return f;
+}
+
+/* tensor_float_to_bfloat16: convert value to bfloat16 rounding to nearest
+ * even. NaN stays a (quiet) NaN */
+uint16_t tensor_float_to_bfloat16(float value)
+{
+    uint32_t x;
+    memcpy(&x, &value, sizeof x);
+    if((x & 0x7fffffffu) > 0x7f800000u) {
+        return (uint16_t)((x >> 16) | 0x40);
+    }
+    x += 0x7fffu + ((x >> 16) & 1);
+    return (uint16_t)(x >> 16);
+}
+
+/* tensor_bfloat16_to_float: convert bfloat16 value to float, the
+ * conversion is exact */
+float tensor_bfloat16_to_float(uint16_t value)
+{
+    uint32_t x = (uint32_t)value << 16;
+    float f;
+    memcpy(&f, &x, sizeof f);
+    return f;
+}
+
+/* tensor_double_to_int8: round value half away from zero and saturate it to
+ * the int8 range. NaN becomes zero */
+static int8_t tensor_double_to_int8(double value)
+{
+    if(value != value) return 0;
+    if(value <= -128.0) return INT8_MIN;
+    if(value >= 127.0) return INT8_MAX;
+    return (int8_t)(value < 0 ? value - 0.5 : value + 0.5);
+}
+
+#ifdef TENSOR_X86
+/* tensor_half_to_float_f16c: convert n binary16 values with F16C */
+__attribute__((target("avx,f16c")))
+static void tensor_half_to_float_f16c(const uint16_t *src, float *dst,
+                                      size_t n)
+{
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+    }
+    for(; i < n; i++) {
+        dst[i] = tensor_half_to_float(src[i]);
+    }
+}
+
+/* tensor_float_to_half_f16c: convert n floats to binary16 with F16C */
+__attribute__((target("avx,f16c")))
+static void tensor_float_to_half_f16c(const float *src, uint16_t *dst,
+                                      size_t n)
+{
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i),
+                                    _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)(dst + i), h);
+    }
+    for(; i < n; i++) {
+        dst[i] = tensor_float_to_half(src[i]);
+    }
+}
+
+/* tensor_float_to_bfloat16_avx512: convert n floats to bfloat16 with
+ * AVX512-BF16. The instruction flushes subnormal inputs to zero. */
+__attribute__((target("avx512f,avx512bf16")))
+static void tensor_float_to_bfloat16_avx512(const float *src, uint16_t *dst,
+                                            size_t n)
+{
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256bh b = _mm512_cvtneps_pbh(_mm512_loadu_ps(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), (__m256i)b);
+    }
+    for(; i < n; i++) {
+        dst[i] = tensor_float_to_bfloat16(src[i]);
+    }
+}
+#endif
+
+/* tensor_load_float: convert n elements of type dtype (other than
+ * TENSOR_FLOAT64) from src to floats */
+static void tensor_load_float(const void *src, tensor_dtype_t dtype,
+                              float *dst, size_t n)
+{
+    const uint16_t *src16 = src;
+    const int8_t *src8 = src;
+
+    switch(dtype) {
+    case TENSOR_FLOAT32:
+        memcpy(dst, src, n * sizeof(float));
+        break;
+    case TENSOR_FLOAT16:
+#ifdef TENSOR_X86
+        if(cpu_get_features()->f16c) {
+            tensor_half_to_float_f16c(src16, dst, n);
+            break;
+        }
+#endif
+        for(size_t i = 0; i < n; i++) {
+            dst[i] = tensor_half_to_float(src16[i]);
+        }
+        break;
+    case TENSOR_BFLOAT16:
+        for(size_t i = 0; i < n; i++) {
+            dst[i] = tensor_bfloat16_to_float(src16[i]);
+        }
+        break;
+    case TENSOR_INT8:
+        for(size_t i = 0; i < n; i++) {
+            dst[i] = src8[i];
+        }
+        break;
+    case TENSOR_FLOAT64:
+        break;
+    }
+}
+
+/* tensor_store_float: convert n floats from src to elements of type dtype
+ * (other than TENSOR_FLOAT64) */
+static void tensor_store_float(const float *src, void *dst,
+                               tensor_dtype_t dtype, size_t n)
+{
+    uint16_t *dst16 = dst;
+    int8_t *dst8 = dst;
+
+    switch(dtype) {
+    case TENSOR_FLOAT32:
+        memcpy(dst, src, n * sizeof(float));
+        break;
+    case TENSOR_FLOAT16:
+#ifdef TENSOR_X86
+        if(cpu_get_features()->f16c) {
+            tensor_float_to_half_f16c(src, dst16, n);
+            break;
+        }
+#endif
+        for(size_t i = 0; i < n; i++) {
+            dst16[i] = tensor_float_to_half(src[i]);
+        }
+        break;
+    case TENSOR_BFLOAT16:
+#ifdef TENSOR_X86
+        if(cpu_get_features()->avx512bf16) {
+            tensor_float_to_bfloat16_avx512(src, dst16, n);
+            break;
+        }
+#endif
+        for(size_t i = 0; i < n; i++) {
+            dst16[i] = tensor_float_to_bfloat16(src[i]);
+        }
+        break;
+    case TENSOR_INT8:
+        for(size_t i = 0; i < n; i++) {
+            dst8[i] = tensor_double_to_int8(src[i]);
+        }
+        break;
+    case TENSOR_FLOAT64:
+        break;
+    }
+}
+
+/* tensor_convert_array: convert n contiguous elements of type src_dtype
+ * from src to elements of type dst_dtype in dst. The conversions between
+ * float types round to nearest even, F16C and AVX512-BF16 are used when the
+ * CPU supports them. The conversion to int8 rounds half away from zero and
+ * saturates. src and dst must not overlap unless the types are the same. */
+void tensor_convert_array(const void *src, tensor_dtype_t src_dtype,
+                          void *dst, tensor_dtype_t dst_dtype, size_t n)
+{
+    const char *s = src;
+    char *d = dst;
+    size_t src_size = tensor_dtype_size(src_dtype);
+    size_t dst_size = tensor_dtype_size(dst_dtype);
+    float chunk[TENSOR_CONVERT_CHUNK];
+
+    if(src_dtype == dst_dtype) {
+        memmove(dst, src, n * src_size);
+        return;
+    }
+
+    /* double to int8 is rounded directly, any other conversion from or to
+     * double goes through float chunks without losing precision */
+    if(src_dtype == TENSOR_FLOAT64 && dst_dtype == TENSOR_INT8) {
+        const double *s64 = src;
+        for(size_t i = 0; i < n; i++) {
+            ((int8_t *)dst)[i] = tensor_double_to_int8(s64[i]);
+        }
+        return;
+    }
+
+    for(size_t i = 0; i < n; i += TENSOR_CONVERT_CHUNK) {
+        size_t len = n - i < TENSOR_CONVERT_CHUNK ? n - i
+                                                  : TENSOR_CONVERT_CHUNK;
+        const char *si = s + i * src_size;
+        char *di = d + i * dst_size;
+
+        if(src_dtype == TENSOR_FLOAT64) {
+            for(size_t j = 0; j < len; j++) {
+                chunk[j] = (float)((const double *)si)[j];
+            }
+        } else {
+            tensor_load_float(si, src_dtype, chunk, len);
+        }
+
+        if(dst_dtype == TENSOR_FLOAT64) {
+            for(size_t j = 0; j < len; j++) {
+                ((double *)di)[j] = chunk[j];
+            }
+        } else {
+            tensor_store_float(chunk, di, dst_dtype, len);
+        }
+    }
+}
+
+/* tensor_convert: convert the elements of tensor src to the element type of
+ * tensor dst and write them to dst. See tensor_convert_array for the
+ * rounding. src and dst must not overlap unless they are the same tensor.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if src or dst is NULL
+ * or the shapes do not match */
+int tensor_convert(const tensor_t *src, tensor_t *dst)
+{
+    /* NULL checking */
+    if(src == NULL || dst == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(src->nrows != dst->nrows || src->ncols != dst->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t src_size = tensor_dtype_size(src->dtype);
+    size_t dst_size = tensor_dtype_size(dst->dtype);
+    for(size_t i = 0; i < src->nrows; i++) {
+        const char *s = (const char *)src->data
+                        + (src->offset + (i * src->ld)) * src_size;
+        char *d = (char *)dst->data + (dst->offset + (i * dst->ld)) * dst_size;
+
+        if(src->col_stride == 1 && dst->col_stride == 1) {
+            tensor_convert_array(s, src->dtype, d, dst->dtype, src->ncols);
+            continue;
+        }
+
+        for(size_t j = 0; j < src->ncols; j++) {
+            tensor_convert_array(s + (j * src->col_stride) * src_size,
+                                 src->dtype,
+                                 d + (j * dst->col_stride) * dst_size,
+                                 dst->dtype, 1);
+        }
+    }
+
     return 0;
 }
 
@@ -217,8 +958,236 @@ int main(int argc, char **argv)
     assert(err != 0);
     assert(errno == EINVAL);
 
+    /* the data is aligned and the rows are padded */
+    tensor_t *wide = allocate_tensor(3, 10);
+    assert(wide != NULL);
+    assert((uintptr_t)wide->data % TENSOR_ALIGNMENT == 0);
+    assert(wide->ld == 16);
+    assert(((double *)wide->data)[wide->ld - 1] == zero);
+    assert(!tensor_is_contiguous(*wide));
+    free_tensor(wide);
+
+    /* row sizes that are a multiple of a page get one more cache line */
+    tensor_t *pow2 = allocate_tensor(2, 512);
+    assert(pow2 != NULL);
+    assert(pow2->ld == 520);
+    free_tensor(pow2);
+
+    /* random tensors use the same layout */
+    rng_t *rng = allocate_rng(RNG_UNIFORM);
+    tensor_t *random = allocate_random_tensor(2, 9, *rng);
+    assert(random != NULL);
+    assert(random->ld == 16);
+    assert(((double *)random->data)[random->ld - 1] == zero);
+    for(int i = 0; i < 2; i++) {
+        for(int j = 0; j < 9; j++) {
+            err = tensor_get_value(*random, i, j, &output);
+            assert(err == 0);
+            assert(output >= 0.0 && output < 1.0);
+        }
+    }
+    free_tensor(random);
+    free_rng(rng);
+
+    /* test element types */
+    tensor_t *typed = allocate_typed_tensor(3, 40, TENSOR_FLOAT16);
+    assert(typed != NULL);
+    assert(tensor_get_dtype(*typed) == TENSOR_FLOAT16);
+    assert(typed->ld == 64);
+    err = tensor_set_value(typed, 2, 39, 1.5);
+    assert(err == 0);
+    err = tensor_get_value(*typed, 2, 39, &output);
+    assert(err == 0 && output == 1.5);
+    assert(((uint16_t *)typed->data)[2 * 64 + 39] == 0x3e00);
+    free_tensor(typed);
+
+    typed = allocate_typed_tensor(2, 2, TENSOR_INT8);
+    err = tensor_set_value(typed, 0, 0, 300.0);
+    assert(err == 0);
+    err = tensor_set_value(typed, 0, 1, -2.5);
+    assert(err == 0);
+    err = tensor_get_value(*typed, 0, 0, &output);
+    assert(err == 0 && output == 127.0);
+    err = tensor_get_value(*typed, 0, 1, &output);
+    assert(err == 0 && output == -3.0);
+    free_tensor(typed);
+
+    typed = allocate_typed_tensor(2, 2, (tensor_dtype_t)42);
+    assert(typed == NULL);
+    assert(errno == EINVAL);
+
+    /* scalar conversions */
+    assert(tensor_float_to_half(1.0f) == 0x3c00);
+    assert(tensor_float_to_half(-2.0f) == 0xc000);
+    assert(tensor_float_to_half(65504.0f) == 0x7bff);
+    assert(tensor_float_to_half(65520.0f) == 0x7c00);
+    assert(tensor_float_to_half(5.9604645e-08f) == 0x0001);
+    assert(tensor_float_to_half(1.0f + 1.0f / 4096.0f) == 0x3c00);
+    assert(tensor_half_to_float(0x0001) == 5.9604645e-08f);
+    assert(tensor_half_to_float(0x7bff) == 65504.0f);
+    assert(tensor_half_to_float(0xc000) == -2.0f);
+    assert(tensor_float_to_bfloat16(1.0f) == 0x3f80);
+    assert(tensor_float_to_bfloat16(1.0f + 1.0f / 256.0f) == 0x3f80);
+    assert(tensor_float_to_bfloat16(1.0f + 3.0f / 256.0f) == 0x3f82);
+    assert(tensor_bfloat16_to_float(0xbf80) == -1.0f);
+
+    /* the array conversions agree with the scalar ones */
+    float values[1000];
+    uint16_t halves[1000];
+    float back[1000];
+    for(int i = 0; i < 1000; i++) {
+        values[i] = (float)(i - 500) * 0.37f;
+    }
+    tensor_convert_array(values, TENSOR_FLOAT32, halves, TENSOR_FLOAT16, 1000);
+    tensor_convert_array(halves, TENSOR_FLOAT16, back, TENSOR_FLOAT32, 1000);
+    for(int i = 0; i < 1000; i++) {
+        assert(halves[i] == tensor_float_to_half(values[i]));
+        assert(back[i] == tensor_half_to_float(halves[i]));
+    }
+    tensor_convert_array(values, TENSOR_FLOAT32, halves, TENSOR_BFLOAT16,
+                         1000);
+    tensor_convert_array(halves, TENSOR_BFLOAT16, back, TENSOR_FLOAT32, 1000);
+    for(int i = 0; i < 1000; i++) {
+        assert(halves[i] == tensor_float_to_bfloat16(values[i]));
+        assert(back[i] == tensor_bfloat16_to_float(halves[i]));
+    }
+
+    /* tensor conversion through a transposed view */
+    tensor_t *f64 = allocate_tensor(3, 2);
+    tensor_t *f32 = allocate_typed_tensor(2, 3, TENSOR_FLOAT32);
+    tensor_t f32t;
+    for(int i = 0; i < 3; i++) {
+        for(int j = 0; j < 2; j++) {
+            tensor_set_value(f64, i, j, i * 2 + j + 0.25);
+        }
+    }
+    tensor_transpose_view(f32, &f32t);
+    err = tensor_convert(f64, &f32t);
+    assert(err == 0);
+    err = tensor_get_value(*f32, 1, 2, &output);
+    assert(err == 0 && output == 5.25);
+    err = tensor_convert(f64, f32);
+    assert(err != 0 && errno == EINVAL);
+    free_tensor(f32);
+    free_tensor(f64);
+
+    /* bulk fill and copy */
+    double dataset[] = {
+        0, 0, 1,
+        1, 1, 1,
+        1, 0, 1,
+        0, 1, 1,
+    };
+    tensor_t *X = tensor_from_array(4, 3, dataset, TENSOR_FLOAT64);
+    assert(X != NULL);
+    assert(TENSOR_AT(X, 3, 1) == 1.0);
+    assert(TENSOR_AT(X, 2, 1) == 0.0);
+    TENSOR_AT(X, 2, 1) = 5.0;
+    err = tensor_get_value(*X, 2, 1, &output);
+    assert(err == 0 && output == 5.0);
+    assert(tensor_from_array(4, 3, NULL, TENSOR_FLOAT64) == NULL);
+    assert(errno == EINVAL);
+
+    float wide_values[2 * 20];
+    for(int i = 0; i < 2 * 20; i++) wide_values[i] = i;
+    tensor_t *Xf = tensor_from_array(2, 20, wide_values, TENSOR_FLOAT32);
+    assert(Xf != NULL && Xf->ld == 32);
+    assert(TENSOR_ELEMENT(Xf, float, 1, 19) == 39.0f);
+
+    err = tensor_fill(Xf, 0.5);
+    assert(err == 0);
+    assert(TENSOR_ELEMENT(Xf, float, 1, 7) == 0.5f);
+    assert(((float *)Xf->data)[20] == 0.0f);
+
+    double row[20];
+    for(int j = 0; j < 20; j++) row[j] = -j;
+    err = tensor_set_row(Xf, 1, row);
+    assert(err == 0);
+    assert(TENSOR_ELEMENT(Xf, float, 1, 19) == -19.0f);
+    assert(TENSOR_ELEMENT(Xf, float, 0, 19) == 0.5f);
+    err = tensor_set_row(Xf, 2, row);
+    assert(err != 0 && errno == EINVAL);
+
+    /* copy rows between element types and within one tensor */
+    tensor_t *Xh = allocate_typed_tensor(3, 20, TENSOR_FLOAT16);
+    err = tensor_copy_rows(Xf, 0, 2, Xh, 1);
+    assert(err == 0);
+    err = tensor_get_value(*Xh, 2, 3, &output);
+    assert(err == 0 && output == -3.0);
+    err = tensor_copy_rows(Xh, 1, 2, Xh, 0);
+    assert(err == 0);
+    err = tensor_get_value(*Xh, 1, 3, &output);
+    assert(err == 0 && output == -3.0);
+    err = tensor_copy_rows(X, 1, 3, X, 0);
+    assert(err == 0);
+    assert(TENSOR_AT(X, 0, 0) == 1.0 && TENSOR_AT(X, 2, 0) == 0.0);
+    err = tensor_copy_rows(Xf, 1, 2, Xh, 0);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_copy_rows(X, 0, 1, Xh, 0);
+    assert(err != 0 && errno == EINVAL);
+    free_tensor(Xh);
+    free_tensor(Xf);
+    free_tensor(X);
+
+    /* test views */
+    tensor_t *parent = allocate_tensor(4, 3);
+    for(int i = 0; i < 4; i++) {
+        for(int j = 0; j < 3; j++) {
+            tensor_set_value(parent, i, j, i * 10 + j);
+        }
+    }
+    assert(tensor_is_contiguous(*parent));
+
+    /* row view shares the data with the parent */
+    tensor_t rows;
+    err = tensor_view_rows(parent, 1, 2, &rows);
+    assert(err == 0);
+    assert(tensor_get_nrows(rows) == 2 && tensor_get_ncols(rows) == 3);
+    assert(tensor_is_contiguous(rows));
+    err = tensor_get_value(rows, 1, 2, &output);
+    assert(err == 0 && output == 22);
+    err = tensor_set_value(&rows, 0, 0, -1.0);
+    assert(err == 0);
+    err = tensor_get_value(*parent, 1, 0, &output);
+    assert(err == 0 && output == -1.0);
+    err = tensor_get_value(rows, 2, 0, &output);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_view_rows(parent, 3, 2, &rows);
+    assert(err != 0 && errno == EINVAL);
+
+    /* column view of the row view */
+    tensor_t cols;
+    err = tensor_view_cols(&rows, 1, 2, &cols);
+    assert(err == 0);
+    assert(!tensor_is_contiguous(cols));
+    err = tensor_get_value(cols, 1, 1, &output);
+    assert(err == 0 && output == 22);
+    err = tensor_view_cols(&rows, 1, 3, &cols);
+    assert(err != 0 && errno == EINVAL);
+
+    /* transpose view */
+    tensor_t trans;
+    err = tensor_transpose_view(parent, &trans);
+    assert(err == 0);
+    assert(tensor_get_nrows(trans) == 3 && tensor_get_ncols(trans) == 4);
+    err = tensor_get_value(trans, 2, 3, &output);
+    assert(err == 0 && output == 32);
+
+    /* reshape view */
+    tensor_t reshaped;
+    err = tensor_reshape_view(parent, 2, 6, &reshaped);
+    assert(err == 0);
+    err = tensor_get_value(reshaped, 1, 0, &output);
+    assert(err == 0 && output == 20);
+    err = tensor_reshape_view(parent, 5, 2, &reshaped);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_reshape_view(&trans, 2, 6, &reshaped);
+    assert(err != 0 && errno == EINVAL);
+    free_tensor(parent);
+
     /* test free; checked by valgrind */
     free_tensor(tensor);
+    free_tensor(NULL);
 }
 #endif
 
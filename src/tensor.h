@@ -11,24 +11,111 @@
 #ifndef SIMPLE_NN_TENSOR_H
 #define SIMPLE_NN_TENSOR_H
 
+#include <stdint.h>
+#include <assert.h>
+
 #include "rng.h"
 
+struct tensor_arena;
+
+/* Element types of the tensor data. Every element type converts exactly to
+ * double, so tensor_get_value is exact for all of them; tensor_set_value
+ * rounds to nearest even (int8 rounds half away from zero and saturates) */
+enum tensor_dtype {
+    TENSOR_FLOAT64,
+    TENSOR_FLOAT32,
+    TENSOR_FLOAT16, // IEEE 754 binary16
+    TENSOR_BFLOAT16, // upper half of an IEEE 754 binary32
+    TENSOR_INT8
+};
+typedef enum tensor_dtype tensor_dtype_t;
+
+/* The data of allocated tensors starts on a TENSOR_ALIGNMENT boundary */
+#define TENSOR_ALIGNMENT 64
+
+/* The element (i, j) is stored at data[offset + i*ld + j*col_stride].
+ * A tensor returned by allocate_tensor has col_stride 1 and its leading
+ * dimension ld pads each row to a multiple of TENSOR_ALIGNMENT bytes, so
+ * every row starts on an aligned boundary. The padding is zero-filled.
+ * The strides, ld and offset are counted in elements of type dtype.
+ * A view shares the data of its parent and can have any strides, it never
+ * owns the data. */
 struct tensor {
     size_t nrows;
     size_t ncols;
-    double *data;
+    size_t ld; // leading dimension: distance in elements between two rows
+    size_t col_stride; // distance in elements between two consecutive columns
+    size_t offset; // position of the first element in data
+    int owns_data; // non-zero if free_tensor should release the tensor
+    struct tensor_arena *arena; // arena holding the tensor, NULL if none
+    tensor_dtype_t dtype;
+    void *data;
 };
 typedef struct tensor tensor_t;
 
 tensor_t *allocate_tensor(size_t nrows, size_t ncols);
+tensor_t *allocate_typed_tensor(size_t nrows, size_t ncols,
+                                tensor_dtype_t dtype);
 tensor_t *allocate_random_tensor(size_t nrows, size_t ncols, rng_t rng);
 
 void free_tensor(tensor_t *tensor);
 
+size_t tensor_leading_dimension(size_t ncols, tensor_dtype_t dtype);
+int tensor_init(tensor_t *t, size_t nrows, size_t ncols, tensor_dtype_t dtype,
+                void *data);
+
 size_t tensor_get_nrows(const tensor_t tensor);
 size_t tensor_get_ncols(const tensor_t tensor);
+tensor_dtype_t tensor_get_dtype(const tensor_t tensor);
+
+size_t tensor_dtype_size(tensor_dtype_t dtype);
 
 int tensor_set_value(tensor_t *const t, size_t rowi, size_t colj, double value);
 int tensor_get_value(const tensor_t t, size_t rowi, size_t colj, double *output);
 
+/* Unchecked element access. TENSOR_ELEMENT(t, type, i, j) is the element
+ * (i, j) of tensor pointer t as an lvalue of C type type, which must match
+ * the dtype of t; TENSOR_AT(t, i, j) is the shorthand for TENSOR_FLOAT64
+ * tensors. The arguments are evaluated more than once. The bounds and the
+ * element size are only checked by assert, so a build with NDEBUG does no
+ * checking at all. */
+#ifdef NDEBUG
+#define TENSOR_CHECK(t, type, i, j) ((void)0)
+#else
+#define TENSOR_CHECK(t, type, i, j)                                         \
+    assert((size_t)(i) < (t)->nrows && (size_t)(j) < (t)->ncols             \
+           && sizeof(type) == tensor_dtype_size((t)->dtype))
+#endif
+#define TENSOR_ELEMENT(t, type, i, j)                                       \
+    (*(TENSOR_CHECK(t, type, i, j),                                         \
+       &((type *)(t)->data)[(t)->offset + (size_t)(i) * (t)->ld             \
+                            + (size_t)(j) * (t)->col_stride]))
+#define TENSOR_AT(t, i, j) TENSOR_ELEMENT(t, double, i, j)
+
+tensor_t *tensor_from_array(size_t nrows, size_t ncols, const void *values,
+                            tensor_dtype_t dtype);
+int tensor_fill(tensor_t *t, double value);
+int tensor_set_row(tensor_t *t, size_t rowi, const double *values);
+int tensor_copy_rows(const tensor_t *src, size_t src_rowi, size_t nrows,
+                     tensor_t *dst, size_t dst_rowi);
+
+int tensor_is_contiguous(const tensor_t t);
+
+uint16_t tensor_float_to_half(float value);
+float tensor_half_to_float(uint16_t value);
+uint16_t tensor_float_to_bfloat16(float value);
+float tensor_bfloat16_to_float(uint16_t value);
+
+void tensor_convert_array(const void *src, tensor_dtype_t src_dtype,
+                          void *dst, tensor_dtype_t dst_dtype, size_t n);
+int tensor_convert(const tensor_t *src, tensor_t *dst);
+
+int tensor_view_rows(const tensor_t *t, size_t rowi, size_t nrows,
+                     tensor_t *view);
+int tensor_view_cols(const tensor_t *t, size_t colj, size_t ncols,
+                     tensor_t *view);
+int tensor_transpose_view(const tensor_t *t, tensor_t *view);
+int tensor_reshape_view(const tensor_t *t, size_t nrows, size_t ncols,
+                        tensor_t *view);
+
 #endif
@@ -0,0 +1,486 @@
+/* tensor_file - Binary tensor files that are opened with mmap(2)
+ * A tensor file is a 64-byte header followed by the raw row-major elements
+ * with the same padded layout allocate_typed_tensor uses, so opening a file
+ * maps the data directly into a tensor without parsing or copying it and
+ * several processes opening the same file share the page cache.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tensor.h"
+#include "tensor_file.h"
+
+#define TENSOR_FILE_MAGIC "SNNTENSR"
+
+/* On-disk header, see tensor_file.h. Every field is naturally aligned so
+ * the struct has no padding and is exactly 64 bytes. */
+struct tensor_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint64_t nrows;
+    uint64_t ncols;
+    uint64_t ld;
+    uint64_t data_offset;
+    uint32_t alignment;
+    uint32_t header_checksum;
+    uint64_t data_checksum;
+};
+
+/* A tensor opened with tensor_mmap_open. The tensor is the first member so
+ * the tensor pointer handed to the caller is also the mapping pointer. */
+struct tensor_mapping {
+    tensor_t tensor;
+    void *base;
+    size_t length;
+    uint64_t data_checksum;
+};
+
+/* Checksum: four interleaved 64-bit multiply-rotate lanes over 32-byte
+ * stripes, the tail bytes and a final avalanche. It runs at memory speed
+ * and catches truncated or corrupted files, it is not a cryptographic
+ * hash. */
+#define TENSOR_FILE_PRIME1 0x9e3779b185ebca87ULL
+#define TENSOR_FILE_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define TENSOR_FILE_PRIME3 0x165667b19e3779f9ULL
+
+struct tensor_file_hash {
+    uint64_t lanes[4];
+    unsigned char stripe[32];
+    size_t buffered;
+    uint64_t total;
+};
+
+static uint64_t tensor_file_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static void tensor_file_hash_init(struct tensor_file_hash *hash)
+{
+    hash->lanes[0] = TENSOR_FILE_PRIME1 + TENSOR_FILE_PRIME2;
+    hash->lanes[1] = TENSOR_FILE_PRIME2;
+    hash->lanes[2] = 0;
+    hash->lanes[3] = 0 - TENSOR_FILE_PRIME1;
+    hash->buffered = 0;
+    hash->total = 0;
+}
+
+static void tensor_file_hash_stripe(struct tensor_file_hash *hash,
+                                    const unsigned char *stripe)
+{
+    for(int lane = 0; lane < 4; lane++) {
+        uint64_t word;
+        memcpy(&word, stripe + lane * 8, sizeof word);
+        hash->lanes[lane] = tensor_file_rotl(hash->lanes[lane]
+                                             + word * TENSOR_FILE_PRIME2, 31)
+                            * TENSOR_FILE_PRIME1;
+    }
+}
+
+static void tensor_file_hash_update(struct tensor_file_hash *hash,
+                                    const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    hash->total += size;
+
+    /* complete the buffered stripe first */
+    if(hash->buffered > 0) {
+        size_t n = 32 - hash->buffered < size ? 32 - hash->buffered : size;
+        memcpy(hash->stripe + hash->buffered, p, n);
+        hash->buffered += n;
+        p += n;
+        size -= n;
+        if(hash->buffered < 32) return;
+        tensor_file_hash_stripe(hash, hash->stripe);
+        hash->buffered = 0;
+    }
+
+    for(; size >= 32; p += 32, size -= 32) {
+        tensor_file_hash_stripe(hash, p);
+    }
+
+    memcpy(hash->stripe, p, size);
+    hash->buffered = size;
+}
+
+static uint64_t tensor_file_hash_final(const struct tensor_file_hash *hash)
+{
+    uint64_t h = tensor_file_rotl(hash->lanes[0], 1)
+                 + tensor_file_rotl(hash->lanes[1], 7)
+                 + tensor_file_rotl(hash->lanes[2], 12)
+                 + tensor_file_rotl(hash->lanes[3], 18) + hash->total;
+
+    for(size_t i = 0; i < hash->buffered; i++) {
+        h ^= hash->stripe[i] * TENSOR_FILE_PRIME1;
+        h = tensor_file_rotl(h, 11) * TENSOR_FILE_PRIME2;
+    }
+
+    h ^= h >> 33;
+    h *= TENSOR_FILE_PRIME2;
+    h ^= h >> 29;
+    h *= TENSOR_FILE_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* tensor_file_checksum: compute the checksum of size bytes of data, as
+ * stored in the data checksum field of a tensor file */
+uint64_t tensor_file_checksum(const void *data, size_t size)
+{
+    struct tensor_file_hash hash;
+    tensor_file_hash_init(&hash);
+    tensor_file_hash_update(&hash, data, size);
+    return tensor_file_hash_final(&hash);
+}
+
+/* tensor_file_header_checksum: compute the checksum of header with its
+ * header_checksum field set to zero */
+static uint32_t tensor_file_header_checksum(struct tensor_file_header header)
+{
+    header.header_checksum = 0;
+    return (uint32_t)tensor_file_checksum(&header, sizeof header);
+}
+
+/* tensor_save: Write tensor t to a new tensor file at path, replacing the
+ * file if it exists. Any view can be saved; the file always holds the
+ * padded layout of allocate_typed_tensor.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if t or path is NULL
+ * It returns non-zero value and keep the errno of the failing call if the
+ * file cannot be written; the partial file is removed */
+int tensor_save(const tensor_t *t, const char *path)
+{
+    /* NULL checking */
+    if(t == NULL || path == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t elsize = tensor_dtype_size(t->dtype);
+    size_t ld = tensor_leading_dimension(t->ncols, t->dtype);
+    unsigned char *row = calloc(ld, elsize);
+    if(row == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if(file == NULL) {
+        free(row);
+        return -1;
+    }
+
+    struct tensor_file_header header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, TENSOR_FILE_MAGIC, sizeof header.magic);
+    header.version = TENSOR_FILE_VERSION;
+    header.dtype = t->dtype;
+    header.nrows = t->nrows;
+    header.ncols = t->ncols;
+    header.ld = ld;
+    header.data_offset = TENSOR_ALIGNMENT;
+    header.alignment = TENSOR_ALIGNMENT;
+
+    /* the header is exactly TENSOR_ALIGNMENT bytes, the data follows it
+     * directly. It is written again once the data checksum is known. */
+    int ok = fwrite(&header, sizeof header, 1, file) == 1;
+
+    struct tensor_file_hash hash;
+    tensor_file_hash_init(&hash);
+    for(size_t i = 0; ok && i < t->nrows; i++) {
+        const char *src = (const char *)t->data
+                          + (t->offset + (i * t->ld)) * elsize;
+        if(t->col_stride == 1) {
+            memcpy(row, src, t->ncols * elsize);
+        } else {
+            for(size_t j = 0; j < t->ncols; j++) {
+                memcpy(row + j * elsize, src + (j * t->col_stride) * elsize,
+                       elsize);
+            }
+        }
+
+        tensor_file_hash_update(&hash, row, ld * elsize);
+        ok = fwrite(row, elsize, ld, file) == ld;
+    }
+
+    if(ok) {
+        header.data_checksum = tensor_file_hash_final(&hash);
+        header.header_checksum = tensor_file_header_checksum(header);
+        ok = fseek(file, 0, SEEK_SET) == 0
+             && fwrite(&header, sizeof header, 1, file) == 1;
+    }
+
+    free(row);
+    if(fclose(file) != 0) ok = 0;
+    if(!ok) {
+        int saved = errno;
+        remove(path);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+/* tensor_file_check_header: check that header describes a valid tensor
+ * file of file_size bytes */
+static int tensor_file_check_header(const struct tensor_file_header *header,
+                                    size_t file_size)
+{
+    if(memcmp(header->magic, TENSOR_FILE_MAGIC, sizeof header->magic) != 0
+       || header->version != TENSOR_FILE_VERSION
+       || header->header_checksum != tensor_file_header_checksum(*header)) {
+        return -1;
+    }
+
+    size_t elsize = tensor_dtype_size((tensor_dtype_t)header->dtype);
+    if(elsize == 0 || header->nrows == 0 || header->ncols == 0
+       || header->ld < header->ncols || header->alignment == 0
+       || header->alignment % TENSOR_ALIGNMENT != 0
+       || header->data_offset % header->alignment != 0
+       || header->data_offset < sizeof *header
+       || header->data_offset > file_size) {
+        return -1;
+    }
+
+    /* the data must fit in the file */
+    uint64_t available = (file_size - header->data_offset) / elsize;
+    if(header->ld > available || header->nrows > available / header->ld) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* tensor_mmap_open: Open the tensor file at path as a read-only tensor
+ * whose data is mapped directly from the file. Nothing is parsed or copied
+ * besides the header; the data checksum is only checked by
+ * tensor_mmap_verify. Writing to the tensor crashes the process.
+ * The tensor must be released with tensor_mmap_close, free_tensor does
+ * nothing on it.
+ *
+ * It returns NULL and set errno to EINVAL if path is NULL or the file is
+ * not a valid tensor file.
+ * It returns NULL and keep the errno of open(2)/mmap(2) if the file cannot
+ * be mapped.
+ * It returns pointer to the mapped tensor if success. */
+tensor_t *tensor_mmap_open(const char *path)
+{
+    /* NULL checking */
+    if(path == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+
+    size_t length = (size_t)st.st_size;
+    if(length < sizeof(struct tensor_file_header)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    int saved = errno;
+    close(fd);
+    if(base == MAP_FAILED) {
+        errno = saved;
+        return NULL;
+    }
+
+    struct tensor_file_header header;
+    memcpy(&header, base, sizeof header);
+    if(tensor_file_check_header(&header, length) != 0) {
+        munmap(base, length);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct tensor_mapping *mapping = malloc(sizeof *mapping);
+    if(mapping == NULL) {
+        munmap(base, length);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* the padding is already zero in the file, tensor_init would write it */
+    tensor_t *tensor = &mapping->tensor;
+    tensor->nrows = header.nrows;
+    tensor->ncols = header.ncols;
+    tensor->ld = header.ld;
+    tensor->col_stride = 1;
+    tensor->offset = 0;
+    tensor->owns_data = 0;
+    tensor->arena = NULL;
+    tensor->dtype = (tensor_dtype_t)header.dtype;
+    tensor->data = (char *)base + header.data_offset;
+
+    mapping->base = base;
+    mapping->length = length;
+    mapping->data_checksum = header.data_checksum;
+    return tensor;
+}
+
+/* tensor_mmap_verify: Check the data of tensor t, opened by
+ * tensor_mmap_open, against the checksum stored in its file. This reads
+ * the whole data.
+ *
+ * It returns zero if the data matches the checksum
+ * It returns non-zero value and set errno to EINVAL if t is NULL
+ * It returns non-zero value and set errno to EIO if the data is corrupted */
+int tensor_mmap_verify(const tensor_t *t)
+{
+    /* NULL checking */
+    if(t == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const struct tensor_mapping *mapping = (const struct tensor_mapping *)t;
+    size_t size = t->nrows * t->ld * tensor_dtype_size(t->dtype);
+    if(tensor_file_checksum(t->data, size) != mapping->data_checksum) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* tensor_mmap_close: Unmap tensor t opened by tensor_mmap_open. Views of t
+ * must not be used afterwards.
+ * It does nothing if t is NULL */
+void tensor_mmap_close(tensor_t *t)
+{
+    if(t == NULL) return;
+
+    struct tensor_mapping *mapping = (struct tensor_mapping *)t;
+    munmap(mapping->base, mapping->length);
+    free(mapping);
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_TENSOR_FILE_C_TEST
+#include <assert.h>
+#include <stdint.h>
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    char path[] = "/tmp/simple-nn-tensor-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    /* the header has no padding */
+    assert(sizeof(struct tensor_file_header) == 64);
+
+    /* the incremental checksum matches the one-shot one */
+    unsigned char bytes[100];
+    for(int i = 0; i < 100; i++) bytes[i] = (unsigned char)(i * 31);
+    struct tensor_file_hash hash;
+    tensor_file_hash_init(&hash);
+    tensor_file_hash_update(&hash, bytes, 7);
+    tensor_file_hash_update(&hash, bytes + 7, 40);
+    tensor_file_hash_update(&hash, bytes + 47, 53);
+    assert(tensor_file_hash_final(&hash)
+           == tensor_file_checksum(bytes, sizeof bytes));
+    assert(tensor_file_checksum(bytes, 99)
+           != tensor_file_checksum(bytes, 100));
+
+    /* save and map a padded tensor */
+    tensor_t *t = allocate_tensor(5, 11);
+    for(size_t i = 0; i < 5; i++) {
+        for(size_t j = 0; j < 11; j++) {
+            TENSOR_AT(t, i, j) = i * 100.0 + j;
+        }
+    }
+    err = tensor_save(t, path);
+    assert(err == 0);
+
+    tensor_t *m = tensor_mmap_open(path);
+    assert(m != NULL);
+    assert(m->nrows == 5 && m->ncols == 11 && m->ld == t->ld);
+    assert(m->dtype == TENSOR_FLOAT64);
+    assert((uintptr_t)m->data % TENSOR_ALIGNMENT == 0);
+    assert(memcmp(m->data, t->data, 5 * t->ld * sizeof(double)) == 0);
+    assert(TENSOR_AT(m, 4, 10) == 410.0);
+    err = tensor_mmap_verify(m);
+    assert(err == 0);
+    free_tensor(m);
+    tensor_mmap_close(m);
+
+    /* a strided view of another element type */
+    tensor_t *h = allocate_typed_tensor(3, 2, TENSOR_FLOAT16);
+    tensor_t view;
+    tensor_set_value(h, 2, 1, 1.5);
+    tensor_transpose_view(h, &view);
+    err = tensor_save(&view, path);
+    assert(err == 0);
+    m = tensor_mmap_open(path);
+    assert(m != NULL);
+    assert(m->nrows == 2 && m->ncols == 3 && m->dtype == TENSOR_FLOAT16);
+    double output;
+    tensor_get_value(*m, 1, 2, &output);
+    assert(output == 1.5);
+    tensor_mmap_close(m);
+    free_tensor(h);
+
+    /* corrupted data is found by verify */
+    err = tensor_save(t, path);
+    assert(err == 0);
+    FILE *file = fopen(path, "r+b");
+    fseek(file, TENSOR_ALIGNMENT + 8, SEEK_SET);
+    fputc(0x7f, file);
+    fclose(file);
+    m = tensor_mmap_open(path);
+    assert(m != NULL);
+    err = tensor_mmap_verify(m);
+    assert(err != 0 && errno == EIO);
+    tensor_mmap_close(m);
+
+    /* a corrupted header is rejected when the file is opened */
+    file = fopen(path, "r+b");
+    fseek(file, 16, SEEK_SET);
+    fputc(0x7f, file);
+    fclose(file);
+    m = tensor_mmap_open(path);
+    assert(m == NULL && errno == EINVAL);
+
+    /* a truncated file is rejected */
+    err = tensor_save(t, path);
+    assert(err == 0);
+    err = truncate(path, TENSOR_ALIGNMENT + 8);
+    assert(err == 0);
+    m = tensor_mmap_open(path);
+    assert(m == NULL && errno == EINVAL);
+
+    /* invalid arguments */
+    assert(tensor_save(NULL, path) != 0 && errno == EINVAL);
+    assert(tensor_mmap_open(NULL) == NULL && errno == EINVAL);
+    assert(tensor_mmap_open("/nonexistent/tensor") == NULL);
+    assert(errno == ENOENT);
+
+    free_tensor(t);
+    remove(path);
+}
+#endif
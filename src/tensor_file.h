@@ -0,0 +1,40 @@
+/* tensor_file - Binary tensor files that are opened with mmap(2)
+ * A tensor file is a 64-byte header followed by the raw row-major elements
+ * with the same padded layout allocate_typed_tensor uses, so opening a file
+ * maps the data directly into a tensor without parsing or copying it and
+ * several processes opening the same file share the page cache.
+ *
+ * Layout, in the byte order of the machine that wrote it:
+ *   offset  size  field
+ *        0     8  magic "SNNTENSR"
+ *        8     4  version (TENSOR_FILE_VERSION)
+ *       12     4  dtype (tensor_dtype_t)
+ *       16     8  nrows
+ *       24     8  ncols
+ *       32     8  ld, the leading dimension in elements
+ *       40     8  data_offset, the position of the first element
+ *       48     4  alignment of data_offset (TENSOR_ALIGNMENT)
+ *       52     4  header checksum, computed with this field set to zero
+ *       56     8  data checksum, see tensor_file_checksum
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_TENSOR_FILE_H
+#define SIMPLE_NN_TENSOR_FILE_H
+
+#include <stdint.h>
+
+#include "tensor.h"
+
+#define TENSOR_FILE_VERSION 1
+
+uint64_t tensor_file_checksum(const void *data, size_t size);
+
+int tensor_save(const tensor_t *t, const char *path);
+
+tensor_t *tensor_mmap_open(const char *path);
+int tensor_mmap_verify(const tensor_t *t);
+void tensor_mmap_close(tensor_t *t);
+
+#endif
@@ -0,0 +1,475 @@
+/* trainer - Data-parallel minibatch training of networks
+ * The workers of a step are the indices of a parallel_for with a grain of
+ * one, so they run on the thread pool; the operations of a worker then run
+ * serially on its thread, and a single worker keeps the pool for its
+ * operations instead. Every worker owns its gradients and its arena and
+ * the worker records themselves are padded to a cache line, so no two
+ * threads write to the same line while the workers run.
+ *
+ * The parameters are cut into segments of at most TRAINER_SEGMENT_SIZE
+ * elements. Round r of the reduction adds the gradients of worker
+ * i + 2^r into those of worker i for every i multiple of 2^(r+1); the
+ * pairs and the segments of a round are the indices of one parallel_for,
+ * so even the last round, a single pair, is split across the threads.
+ * The gradient ends in worker 0 after ceil(log2(nworkers)) rounds and the
+ * update of the parameters is split by segments the same way.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#include <stdlib.h>
+#include <errno.h>
+
+#include "tensor.h"
+#include "arena.h"
+#include "ops.h"
+#include "pool.h"
+#include "parallel.h"
+#include "network.h"
+#include "trainer.h"
+
+/* Elements of the parameters added by one index of the reduction */
+#define TRAINER_SEGMENT_SIZE 16384
+
+/* Initial capacity of the arena of a worker, it grows as needed */
+#define TRAINER_ARENA_SIZE (1 << 16)
+
+struct trainer_worker {
+    network_grads_t *grads;
+    tensor_arena_t *arena;
+    double loss; // sum of the losses of the shard
+    int err; // errno of a failed step, zero if none
+} __attribute__((aligned(64)));
+
+/* Rows [row, row + nrows) of the weights of a layer, or its bias */
+struct trainer_segment {
+    size_t layer;
+    int bias;
+    size_t row;
+    size_t nrows;
+};
+
+struct trainer_task {
+    trainer_t *trainer;
+    const tensor_t *X;
+    const size_t *labels;
+    size_t stride; // distance between the workers of a pair
+    double alpha; // factor of the update
+};
+
+/* trainer_view: view of segment s of the gradients or the parameters */
+static void trainer_view(const trainer_t *trainer, const network_grads_t *g,
+                         size_t s, tensor_t *view)
+{
+    const struct trainer_segment *seg = &trainer->segments[s];
+    const tensor_t *t;
+    if(g != NULL) {
+        t = seg->bias ? g->db[seg->layer] : g->dW[seg->layer];
+    } else {
+        const struct network_layer *layer = &trainer->net->layers[seg->layer];
+        t = seg->bias ? layer->b : layer->W;
+    }
+    tensor_view_rows(t, seg->row, seg->nrows, view);
+}
+
+/* trainer_segments: cut the parameters of net into segments, it returns
+ * the number of segments and stores them in segments if not NULL */
+static size_t trainer_segments(const network_t *net,
+                               struct trainer_segment *segments)
+{
+    size_t n = 0;
+    for(size_t l = 0; l < net->nlayers; l++) {
+        const tensor_t *W = net->layers[l].W;
+        size_t step = TRAINER_SEGMENT_SIZE / W->ncols;
+        if(step == 0) step = 1;
+        for(size_t row = 0; row < W->nrows; row += step) {
+            if(segments != NULL) {
+                struct trainer_segment seg = {l, 0, row, step};
+                if(row + step > W->nrows) seg.nrows = W->nrows - row;
+                segments[n] = seg;
+            }
+            n++;
+        }
+        if(segments != NULL) {
+            struct trainer_segment seg = {l, 1, 0, 1};
+            segments[n] = seg;
+        }
+        n++;
+    }
+    return n;
+}
+
+/* allocate_trainer: Allocate new trainer on the heap for net with nworkers
+ * workers, or one worker per thread of the pool if nworkers is zero. Every
+ * step of the trainer adds -learning_rate times the mean gradient of the
+ * batch to the parameters of net. net must stay alive and keep its shapes
+ * while the trainer is used.
+ *
+ * It returns NULL and set errno to EINVAL if net is NULL.
+ * It returns NULL and set errno to ENOMEM if the allocation fails.
+ * It returns pointer to new allocated trainer_t if success. */
+trainer_t *allocate_trainer(network_t *net, size_t nworkers,
+                            double learning_rate)
+{
+    /* NULL checking */
+    if(net == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if(nworkers == 0) nworkers = parallel_get_nthreads();
+
+    trainer_t *trainer = malloc(sizeof *trainer);
+    if(trainer == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    trainer->net = net;
+    trainer->learning_rate = learning_rate;
+    trainer->nworkers = 0;
+    trainer->nsegments = trainer_segments(net, NULL);
+    trainer->segments = malloc(trainer->nsegments
+                               * sizeof *trainer->segments);
+    trainer->workers = tensor_pool_alloc(nworkers
+                                         * sizeof *trainer->workers);
+    if(trainer->segments == NULL || trainer->workers == NULL) {
+        free_trainer(trainer);
+        errno = ENOMEM;
+        return NULL;
+    }
+    trainer_segments(net, trainer->segments);
+
+    for(size_t w = 0; w < nworkers; w++) {
+        struct trainer_worker *worker = &trainer->workers[w];
+        worker->grads = allocate_network_grads(net);
+        worker->arena = allocate_tensor_arena(TRAINER_ARENA_SIZE);
+        worker->loss = 0.0;
+        worker->err = 0;
+        trainer->nworkers++;
+        if(worker->grads == NULL || worker->arena == NULL) {
+            free_trainer(trainer);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    return trainer;
+}
+
+/* free_trainer: Free the workers of trainer and trainer itself, the network
+ * is left alone. It does nothing if trainer is NULL */
+void free_trainer(trainer_t *trainer)
+{
+    if(trainer == NULL) return;
+    for(size_t w = 0; w < trainer->nworkers; w++) {
+        free_network_grads(trainer->workers[w].grads);
+        free_tensor_arena(trainer->workers[w].arena);
+    }
+    tensor_pool_free(trainer->workers);
+    free(trainer->segments);
+    free(trainer);
+}
+
+/* trainer_backward_range: forward and backward pass of the shards of the
+ * workers [begin, end) */
+static void trainer_backward_range(void *arg, size_t begin, size_t end)
+{
+    struct trainer_task *task = arg;
+    trainer_t *trainer = task->trainer;
+    size_t m = task->X->nrows;
+    for(size_t w = begin; w < end; w++) {
+        struct trainer_worker *worker = &trainer->workers[w];
+        size_t lo = m * w / trainer->nworkers;
+        size_t hi = m * (w + 1) / trainer->nworkers;
+        worker->loss = 0.0;
+        worker->err = 0;
+
+        /* a worker without rows adds zeros */
+        if(lo == hi) {
+            for(size_t l = 0; l < worker->grads->nlayers; l++) {
+                tensor_fill(worker->grads->dW[l], 0.0);
+                tensor_fill(worker->grads->db[l], 0.0);
+            }
+            continue;
+        }
+
+        tensor_t shard;
+        tensor_view_rows(task->X, lo, hi - lo, &shard);
+        tensor_arena_reset(worker->arena);
+        if(network_backward(trainer->net, &shard, task->labels + lo,
+                            worker->arena, worker->grads,
+                            &worker->loss) != 0) {
+            worker->err = errno;
+        }
+    }
+}
+
+/* trainer_reduce_range: add the segments of the pairs of workers of a round
+ * of the reduction, index i is segment i % nsegments of pair
+ * i / nsegments */
+static void trainer_reduce_range(void *arg, size_t begin, size_t end)
+{
+    struct trainer_task *task = arg;
+    const trainer_t *trainer = task->trainer;
+    for(size_t i = begin; i < end; i++) {
+        size_t s = i % trainer->nsegments;
+        size_t dst = i / trainer->nsegments * 2 * task->stride;
+        tensor_t x, y;
+        trainer_view(trainer, trainer->workers[dst + task->stride].grads, s,
+                     &x);
+        trainer_view(trainer, trainer->workers[dst].grads, s, &y);
+        tensor_axpy(1.0, &x, &y);
+    }
+}
+
+/* trainer_update_range: update the segments [begin, end) of the
+ * parameters with the gradient of worker 0 */
+static void trainer_update_range(void *arg, size_t begin, size_t end)
+{
+    struct trainer_task *task = arg;
+    const trainer_t *trainer = task->trainer;
+    for(size_t s = begin; s < end; s++) {
+        tensor_t x, y;
+        trainer_view(trainer, trainer->workers[0].grads, s, &x);
+        trainer_view(trainer, NULL, s, &y);
+        tensor_axpy(task->alpha, &x, &y);
+    }
+}
+
+/* trainer_step: Train the network of trainer on the minibatch of the rows
+ * of X with the class labels: the rows are split between the workers, the
+ * gradients of the workers are reduced and the parameters take one step
+ * against the mean gradient. The mean loss of the batch before the update
+ * is stored in loss, which can be NULL. The parameters are left untouched
+ * if the step fails.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if trainer, X or labels
+ * is NULL, X has no rows, the columns of X do not match the inputs of the
+ * network or a label is out of range
+ * It returns non-zero value and set errno to ENOMEM if the intermediate
+ * tensors cannot be allocated */
+int trainer_step(trainer_t *trainer, const tensor_t *X, const size_t *labels,
+                 double *loss)
+{
+    /* NULL checking */
+    if(trainer == NULL || X == NULL || labels == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(X->nrows == 0 || X->ncols != trainer->net->layers[0].W->nrows) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct trainer_task task = {trainer, X, labels, 0, 0.0};
+    parallel_for(0, trainer->nworkers, 1, trainer_backward_range, &task);
+    double sum = 0.0;
+    for(size_t w = 0; w < trainer->nworkers; w++) {
+        if(trainer->workers[w].err != 0) {
+            errno = trainer->workers[w].err;
+            return -1;
+        }
+        sum += trainer->workers[w].loss;
+    }
+
+    for(task.stride = 1; task.stride < trainer->nworkers; task.stride *= 2) {
+        size_t npairs = (trainer->nworkers - task.stride - 1)
+                        / (2 * task.stride) + 1;
+        parallel_for(0, npairs * trainer->nsegments, 1,
+                     trainer_reduce_range, &task);
+    }
+
+    task.alpha = -trainer->learning_rate / (double)X->nrows;
+    parallel_for(0, trainer->nsegments, 1, trainer_update_range, &task);
+    if(loss != NULL) *loss = sum / (double)X->nrows;
+    return 0;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_TRAINER_C_TEST
+#include <assert.h>
+#include <math.h>
+
+static const size_t test_sizes[3] = {6, 9, 4};
+static const tensor_activation_t test_acts[2] = {TENSOR_TANH,
+                                                 TENSOR_IDENTITY};
+
+/* test_copy: copy the parameters of src to dst */
+static void test_copy(const network_t *src, network_t *dst)
+{
+    for(size_t l = 0; l < src->nlayers; l++) {
+        const struct network_layer *layer = &src->layers[l];
+        tensor_copy_rows(layer->W, 0, layer->W->nrows, dst->layers[l].W, 0);
+        tensor_copy_rows(layer->b, 0, 1, dst->layers[l].b, 0);
+    }
+}
+
+/* test_network: a copy of the network init, or a new network if init is
+ * NULL */
+static network_t *test_network(const network_t *init)
+{
+    rng_t *rng = allocate_rng(RNG_UNIFORM);
+    assert(rng != NULL);
+    network_t *net = allocate_network(2, test_sizes, test_acts, *rng);
+    assert(net != NULL);
+    if(init != NULL) test_copy(init, net);
+    free_rng(rng);
+    return net;
+}
+
+/* test_fill: pseudo random inputs in [-1, 1) and labels */
+static void test_fill(tensor_t *X, size_t *labels, unsigned seed)
+{
+    for(size_t i = 0; i < X->nrows; i++) {
+        for(size_t j = 0; j < X->ncols; j++) {
+            seed = seed * 1103515245u + 12345u;
+            TENSOR_AT(X, i, j) = (double)(seed >> 8) / (1 << 23) - 1.0;
+        }
+        seed = seed * 1103515245u + 12345u;
+        labels[i] = (seed >> 8) % test_sizes[2];
+    }
+}
+
+/* test_compare: maximum difference between the parameters of a and b */
+static double test_compare(const network_t *a, const network_t *b)
+{
+    double diff = 0.0;
+    for(size_t l = 0; l < a->nlayers; l++) {
+        const tensor_t *Wa = a->layers[l].W, *Wb = b->layers[l].W;
+        for(size_t i = 0; i < Wa->nrows; i++) {
+            for(size_t j = 0; j < Wa->ncols; j++) {
+                double d = fabs(TENSOR_AT(Wa, i, j) - TENSOR_AT(Wb, i, j));
+                if(d > diff) diff = d;
+            }
+        }
+        for(size_t j = 0; j < a->layers[l].b->ncols; j++) {
+            double d = fabs(TENSOR_AT(a->layers[l].b, 0, j)
+                            - TENSOR_AT(b->layers[l].b, 0, j));
+            if(d > diff) diff = d;
+        }
+    }
+    return diff;
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    double loss, expected;
+    const double lr = 0.5;
+    const size_t m = 37;
+
+    tensor_t *X = allocate_tensor(m, test_sizes[0]);
+    size_t labels[37];
+    assert(X != NULL);
+    test_fill(X, labels, 3);
+
+    /* reference: one serial step on the whole batch */
+    network_t *init = test_network(NULL);
+    network_t *ref = test_network(init);
+    network_grads_t *grads = allocate_network_grads(ref);
+    tensor_arena_t *arena = allocate_tensor_arena(1 << 12);
+    assert(grads != NULL && arena != NULL);
+    err = network_backward(ref, X, labels, arena, grads, &expected);
+    assert(err == 0);
+    expected /= (double)m;
+    err = network_update(ref, grads, -lr / (double)m);
+    assert(err == 0);
+
+    /* any number of workers and threads gives the same step, workers
+     * beyond the rows of the batch add zeros */
+    size_t nthreads = parallel_get_nthreads();
+    size_t threads[3] = {1, 3, 4};
+    size_t nworkers[8] = {1, 2, 3, 4, 5, 8, 37, 50};
+    for(size_t t = 0; t < 3; t++) {
+        parallel_set_nthreads(threads[t]);
+        for(size_t k = 0; k < 8; k++) {
+            network_t *net = test_network(init);
+            trainer_t *trainer = allocate_trainer(net, nworkers[k], lr);
+            assert(trainer != NULL);
+            assert(trainer->nworkers == nworkers[k]);
+            err = trainer_step(trainer, X, labels, &loss);
+            assert(err == 0);
+            assert(fabs(loss - expected) <= 1e-12 * expected);
+            assert(test_compare(net, ref) <= 1e-12);
+            free_trainer(trainer);
+            free_network(net);
+        }
+    }
+    parallel_set_nthreads(nthreads);
+
+    /* the segments cover large layers in several parts */
+    size_t big_sizes[3] = {3000, 12, 4};
+    rng_t *rng = allocate_rng(RNG_UNIFORM);
+    assert(rng != NULL);
+    network_t *big = allocate_network(2, big_sizes, test_acts, *rng);
+    network_t *big_ref = allocate_network(2, big_sizes, test_acts, *rng);
+    tensor_t *B = allocate_tensor(11, 3000);
+    assert(big != NULL && big_ref != NULL && B != NULL);
+    test_copy(big, big_ref);
+    for(size_t i = 0; i < 11; i++) {
+        for(size_t j = 0; j < 3000; j++) {
+            TENSOR_AT(B, i, j) = TENSOR_AT(X, i, j % 6) * (double)(j % 7);
+        }
+    }
+    network_grads_t *big_grads = allocate_network_grads(big_ref);
+    assert(big_grads != NULL);
+    tensor_arena_reset(arena);
+    err = network_backward(big_ref, B, labels, arena, big_grads, NULL);
+    assert(err == 0);
+    err = network_update(big_ref, big_grads, -lr / 11.0);
+    assert(err == 0);
+    trainer_t *trainer = allocate_trainer(big, 3, lr);
+    assert(trainer != NULL && trainer->nsegments > 4);
+    err = trainer_step(trainer, B, labels, NULL);
+    assert(err == 0);
+    assert(test_compare(big, big_ref) <= 1e-12);
+    free_trainer(trainer);
+    free_network_grads(big_grads);
+    free_tensor(B);
+    free_network(big);
+    free_network(big_ref);
+    free_rng(rng);
+
+    /* training with a worker per thread reduces the loss */
+    network_t *net = test_network(init);
+    trainer = allocate_trainer(net, 0, lr);
+    assert(trainer != NULL);
+    assert(trainer->nworkers == parallel_get_nthreads());
+    double first;
+    err = trainer_step(trainer, X, labels, &first);
+    assert(err == 0);
+    for(int step = 0; step < 200; step++) {
+        err = trainer_step(trainer, X, labels, &loss);
+        assert(err == 0);
+    }
+    assert(loss < 0.75 * first);
+
+    /* invalid arguments leave the parameters alone */
+    network_t *copy = test_network(net);
+    tensor_t *Y = allocate_tensor(m, 5);
+    assert(Y != NULL);
+    assert(allocate_trainer(NULL, 2, lr) == NULL && errno == EINVAL);
+    assert(trainer_step(NULL, X, labels, &loss) != 0 && errno == EINVAL);
+    assert(trainer_step(trainer, NULL, labels, &loss) != 0);
+    assert(errno == EINVAL);
+    assert(trainer_step(trainer, X, NULL, &loss) != 0 && errno == EINVAL);
+    assert(trainer_step(trainer, Y, labels, &loss) != 0 && errno == EINVAL);
+    labels[20] = 4;
+    assert(trainer_step(trainer, X, labels, &loss) != 0 && errno == EINVAL);
+    assert(test_compare(net, copy) == 0.0);
+
+    free_trainer(NULL);
+    free_tensor(Y);
+    free_network(copy);
+    free_trainer(trainer);
+    free_network(net);
+    free_network_grads(grads);
+    free_tensor_arena(arena);
+    free_network(ref);
+    free_network(init);
+    free_tensor(X);
+    return 0;
+}
+
+#endif
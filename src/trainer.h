@@ -0,0 +1,39 @@
+/* trainer - Data-parallel minibatch training of networks
+ * A step of the trainer cuts the minibatch into one contiguous shard of
+ * rows per worker. The workers run the forward and the backward pass of
+ * their shard at the same time, each into its own gradients, and the
+ * gradients of the workers are then added pairwise in a tree before one
+ * step of gradient descent on the mean gradient of the batch. The result
+ * is the gradient of the whole batch up to the order of the additions, so
+ * the number of workers changes the speed of training, not the model.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_TRAINER_H
+#define SIMPLE_NN_TRAINER_H
+
+#include "tensor.h"
+#include "network.h"
+
+struct trainer_worker;
+struct trainer_segment;
+
+struct trainer {
+    network_t *net; // trained network, not owned
+    double learning_rate;
+    size_t nworkers;
+    struct trainer_worker *workers; // gradients and arena of every worker
+    size_t nsegments;
+    struct trainer_segment *segments; // parts of the parameters
+};
+typedef struct trainer trainer_t;
+
+trainer_t *allocate_trainer(network_t *net, size_t nworkers,
+                            double learning_rate);
+void free_trainer(trainer_t *trainer);
+
+int trainer_step(trainer_t *trainer, const tensor_t *X, const size_t *labels,
+                 double *loss);
+
+#endif
@@ -0,0 +1,744 @@
+/* transpose - Transpose of tensors into row-major memory
+ * The blocks of doubles are handled by the kernels of the CPU level: copy
+ * transposes a block into another matrix, swap exchanges a block with the
+ * transpose of its mirror block and diag transposes a square block on the
+ * diagonal in place. They work on tiles of TILE x TILE doubles loaded into
+ * registers and transposed with unpack and shuffle instructions; the
+ * elements on the edges are moved one by one.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "tensor.h"
+#include "transpose.h"
+#include "cpu.h"
+#include "parallel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRANSPOSE_X86 1
+#include <immintrin.h>
+#endif
+
+/* The recursion stops at blocks of at most BLOCK x BLOCK elements, 8 KB
+ * of doubles, so the block and its transpose stay in L1. The halves are
+ * cut on multiples of ALIGN to keep whole tiles and cache lines. */
+#define TRANSPOSE_BLOCK 32
+#define TRANSPOSE_ALIGN 8
+
+/* Outputs of at least this many doubles, 4 MB, are written with
+ * non-temporal stores: they would evict the input from the cache, and
+ * the stores don't have to read the lines of the output first. */
+#define TRANSPOSE_STREAM_SIZE (1 << 19)
+
+/* Elements below which a piece of work is not worth a thread */
+#define TRANSPOSE_GRAIN 65536
+
+/* y[j * ldy + i] = x[i * ldx + j] for the nr x nc block x */
+typedef void (*transpose_copy_t)(size_t nr, size_t nc, const double *x,
+                                 size_t ldx, double *y, size_t ldy);
+
+struct transpose_kernels {
+    transpose_copy_t copy;
+    /* exchange a[i * ld + j] and b[j * ld + i] for the nr x nc block a */
+    void (*swap)(size_t nr, size_t nc, double *a, double *b, size_t ld);
+    /* transpose the n x n block a in place */
+    void (*diag)(size_t n, double *a, size_t ld);
+    /* copy with non-temporal stores, y and ldy aligned to a cache line */
+    transpose_copy_t stream;
+};
+
+/* The block kernels are written once over the tile functions of a level:
+ * transpose_tile_<level> copies the transpose of the tile x to y, which
+ * can be x, and transpose_tiles_<level> exchanges the tile a with the
+ * transpose of the tile b. */
+#define TRANSPOSE_DEFINE_BLOCKS(level, TILE)                            \
+    TRANSPOSE_TARGET                                                    \
+    static void transpose_copy_##level(size_t nr, size_t nc,            \
+                                       const double *x, size_t ldx,     \
+                                       double *y, size_t ldy)           \
+    {                                                                   \
+        size_t i = 0, j;                                                \
+        for(; i + TILE <= nr; i += TILE) {                              \
+            for(j = 0; j + TILE <= nc; j += TILE) {                     \
+                transpose_tile_##level(x + i * ldx + j, ldx,            \
+                                       y + j * ldy + i, ldy);           \
+            }                                                           \
+            for(; j < nc; j++) {                                        \
+                for(size_t r = i; r < i + TILE; r++) {                  \
+                    y[j * ldy + r] = x[r * ldx + j];                    \
+                }                                                       \
+            }                                                           \
+        }                                                               \
+        for(; i < nr; i++) {                                            \
+            for(j = 0; j < nc; j++) y[j * ldy + i] = x[i * ldx + j];    \
+        }                                                               \
+    }                                                                   \
+                                                                        \
+    TRANSPOSE_TARGET                                                    \
+    static void transpose_swap_##level(size_t nr, size_t nc, double *a, \
+                                       double *b, size_t ld)            \
+    {                                                                   \
+        size_t i = 0, j;                                                \
+        double t;                                                       \
+        for(; i + TILE <= nr; i += TILE) {                              \
+            for(j = 0; j + TILE <= nc; j += TILE) {                     \
+                transpose_tiles_##level(a + i * ld + j,                 \
+                                        b + j * ld + i, ld);            \
+            }                                                           \
+            for(; j < nc; j++) {                                        \
+                for(size_t r = i; r < i + TILE; r++) {                  \
+                    t = a[r * ld + j];                                  \
+                    a[r * ld + j] = b[j * ld + r];                      \
+                    b[j * ld + r] = t;                                  \
+                }                                                       \
+            }                                                           \
+        }                                                               \
+        for(; i < nr; i++) {                                            \
+            for(j = 0; j < nc; j++) {                                   \
+                t = a[i * ld + j];                                      \
+                a[i * ld + j] = b[j * ld + i];                          \
+                b[j * ld + i] = t;                                      \
+            }                                                           \
+        }                                                               \
+    }                                                                   \
+                                                                        \
+    TRANSPOSE_TARGET                                                    \
+    static void transpose_diag_##level(size_t n, double *a, size_t ld)  \
+    {                                                                   \
+        size_t i = 0;                                                   \
+        for(; i + TILE <= n; i += TILE) {                               \
+            double *d = a + i * ld + i;                                 \
+            transpose_tile_##level(d, ld, d, ld);                       \
+            transpose_swap_##level(TILE, n - i - TILE, d + TILE,        \
+                                   d + TILE * ld, ld);                  \
+        }                                                               \
+        for(; i < n; i++) {                                             \
+            transpose_swap_##level(1, n - i - 1, a + i * ld + i + 1,    \
+                                   a + (i + 1) * ld + i, ld);           \
+        }                                                               \
+    }
+
+/* The streaming copy goes through transpose_stream_tile_<level>, which
+ * transposes 8 rows of x and writes whole cache lines of y around the
+ * cache. The edges are left to the copy kernel. */
+#define TRANSPOSE_DEFINE_STREAM(level, TILE)                            \
+    TRANSPOSE_TARGET                                                    \
+    static void transpose_stream_##level(size_t nr, size_t nc,          \
+                                         const double *x, size_t ldx,   \
+                                         double *y, size_t ldy)         \
+    {                                                                   \
+        size_t i = 0, j;                                                \
+        for(; i + 8 <= nr; i += 8) {                                    \
+            for(j = 0; j + TILE <= nc; j += TILE) {                     \
+                transpose_stream_tile_##level(x + i * ldx + j, ldx,     \
+                                              y + j * ldy + i, ldy);    \
+            }                                                           \
+            transpose_copy_##level(8, nc - j, x + i * ldx + j, ldx,     \
+                                   y + j * ldy + i, ldy);               \
+        }                                                               \
+        transpose_copy_##level(nr - i, nc, x + i * ldx, ldx, y + i, ldy); \
+    }
+
+/* Generic level: tiles of one element */
+static void transpose_tile_generic(const double *x, size_t ldx, double *y,
+                                   size_t ldy)
+{
+    y[0] = x[0];
+}
+
+static void transpose_tiles_generic(double *a, double *b, size_t ld)
+{
+    double t = a[0];
+    a[0] = b[0];
+    b[0] = t;
+}
+
+#define TRANSPOSE_TARGET
+TRANSPOSE_DEFINE_BLOCKS(generic, 1)
+#undef TRANSPOSE_TARGET
+
+#ifdef TRANSPOSE_X86
+/* SSE2: 2x2 tiles */
+#define TRANSPOSE_TARGET __attribute__((target("sse2")))
+#define TRANSPOSE_SSE2(r0, r1)                                          \
+    do {                                                                \
+        __m128d t0 = _mm_unpacklo_pd(r0, r1);                           \
+        r1 = _mm_unpackhi_pd(r0, r1);                                   \
+        r0 = t0;                                                        \
+    } while(0)
+
+TRANSPOSE_TARGET
+static inline void transpose_tile_sse2(const double *x, size_t ldx,
+                                       double *y, size_t ldy)
+{
+    __m128d r0 = _mm_loadu_pd(x), r1 = _mm_loadu_pd(x + ldx);
+    TRANSPOSE_SSE2(r0, r1);
+    _mm_storeu_pd(y, r0);
+    _mm_storeu_pd(y + ldy, r1);
+}
+
+TRANSPOSE_TARGET
+static inline void transpose_tiles_sse2(double *a, double *b, size_t ld)
+{
+    __m128d a0 = _mm_loadu_pd(a), a1 = _mm_loadu_pd(a + ld);
+    __m128d b0 = _mm_loadu_pd(b), b1 = _mm_loadu_pd(b + ld);
+    TRANSPOSE_SSE2(a0, a1);
+    TRANSPOSE_SSE2(b0, b1);
+    _mm_storeu_pd(a, b0);
+    _mm_storeu_pd(a + ld, b1);
+    _mm_storeu_pd(b, a0);
+    _mm_storeu_pd(b + ld, a1);
+}
+
+TRANSPOSE_DEFINE_BLOCKS(sse2, 2)
+#undef TRANSPOSE_TARGET
+
+/* AVX2: 4x4 tiles, pairs of rows are interleaved then the 128-bit halves
+ * are exchanged */
+#define TRANSPOSE_TARGET __attribute__((target("avx2")))
+#define TRANSPOSE_AVX2(r0, r1, r2, r3)                                  \
+    do {                                                                \
+        __m256d t0 = _mm256_unpacklo_pd(r0, r1);                        \
+        __m256d t1 = _mm256_unpackhi_pd(r0, r1);                        \
+        __m256d t2 = _mm256_unpacklo_pd(r2, r3);                        \
+        __m256d t3 = _mm256_unpackhi_pd(r2, r3);                        \
+        r0 = _mm256_permute2f128_pd(t0, t2, 0x20);                      \
+        r1 = _mm256_permute2f128_pd(t1, t3, 0x20);                      \
+        r2 = _mm256_permute2f128_pd(t0, t2, 0x31);                      \
+        r3 = _mm256_permute2f128_pd(t1, t3, 0x31);                      \
+    } while(0)
+
+TRANSPOSE_TARGET
+static inline void transpose_tile_avx2(const double *x, size_t ldx,
+                                       double *y, size_t ldy)
+{
+    __m256d r0 = _mm256_loadu_pd(x);
+    __m256d r1 = _mm256_loadu_pd(x + ldx);
+    __m256d r2 = _mm256_loadu_pd(x + 2 * ldx);
+    __m256d r3 = _mm256_loadu_pd(x + 3 * ldx);
+    TRANSPOSE_AVX2(r0, r1, r2, r3);
+    _mm256_storeu_pd(y, r0);
+    _mm256_storeu_pd(y + ldy, r1);
+    _mm256_storeu_pd(y + 2 * ldy, r2);
+    _mm256_storeu_pd(y + 3 * ldy, r3);
+}
+
+TRANSPOSE_TARGET
+static inline void transpose_tiles_avx2(double *a, double *b, size_t ld)
+{
+    __m256d a0 = _mm256_loadu_pd(a), a1 = _mm256_loadu_pd(a + ld);
+    __m256d a2 = _mm256_loadu_pd(a + 2 * ld);
+    __m256d a3 = _mm256_loadu_pd(a + 3 * ld);
+    __m256d b0 = _mm256_loadu_pd(b), b1 = _mm256_loadu_pd(b + ld);
+    __m256d b2 = _mm256_loadu_pd(b + 2 * ld);
+    __m256d b3 = _mm256_loadu_pd(b + 3 * ld);
+    TRANSPOSE_AVX2(a0, a1, a2, a3);
+    TRANSPOSE_AVX2(b0, b1, b2, b3);
+    _mm256_storeu_pd(a, b0);
+    _mm256_storeu_pd(a + ld, b1);
+    _mm256_storeu_pd(a + 2 * ld, b2);
+    _mm256_storeu_pd(a + 3 * ld, b3);
+    _mm256_storeu_pd(b, a0);
+    _mm256_storeu_pd(b + ld, a1);
+    _mm256_storeu_pd(b + 2 * ld, a2);
+    _mm256_storeu_pd(b + 3 * ld, a3);
+}
+
+TRANSPOSE_TARGET
+static inline void transpose_stream_tile_avx2(const double *x, size_t ldx,
+                                              double *y, size_t ldy)
+{
+    __m256d r0 = _mm256_loadu_pd(x);
+    __m256d r1 = _mm256_loadu_pd(x + ldx);
+    __m256d r2 = _mm256_loadu_pd(x + 2 * ldx);
+    __m256d r3 = _mm256_loadu_pd(x + 3 * ldx);
+    __m256d r4 = _mm256_loadu_pd(x + 4 * ldx);
+    __m256d r5 = _mm256_loadu_pd(x + 5 * ldx);
+    __m256d r6 = _mm256_loadu_pd(x + 6 * ldx);
+    __m256d r7 = _mm256_loadu_pd(x + 7 * ldx);
+    TRANSPOSE_AVX2(r0, r1, r2, r3);
+    TRANSPOSE_AVX2(r4, r5, r6, r7);
+    _mm256_stream_pd(y, r0);
+    _mm256_stream_pd(y + 4, r4);
+    _mm256_stream_pd(y + ldy, r1);
+    _mm256_stream_pd(y + ldy + 4, r5);
+    _mm256_stream_pd(y + 2 * ldy, r2);
+    _mm256_stream_pd(y + 2 * ldy + 4, r6);
+    _mm256_stream_pd(y + 3 * ldy, r3);
+    _mm256_stream_pd(y + 3 * ldy + 4, r7);
+}
+
+TRANSPOSE_DEFINE_BLOCKS(avx2, 4)
+TRANSPOSE_DEFINE_STREAM(avx2, 4)
+#undef TRANSPOSE_TARGET
+
+/* AVX-512: 8x8 tiles, pairs of rows are interleaved, then the 128-bit
+ * lanes are shuffled twice */
+#define TRANSPOSE_TARGET __attribute__((target("avx512f")))
+
+TRANSPOSE_TARGET
+static inline void transpose_avx512(__m512d *r)
+{
+    __m512d t[8], u[8];
+    for(int i = 0; i < 8; i += 2) {
+        t[i] = _mm512_unpacklo_pd(r[i], r[i + 1]);
+        t[i + 1] = _mm512_unpackhi_pd(r[i], r[i + 1]);
+    }
+    for(int i = 0; i < 8; i += 4) {
+        u[i] = _mm512_shuffle_f64x2(t[i], t[i + 2], 0x88);
+        u[i + 1] = _mm512_shuffle_f64x2(t[i + 1], t[i + 3], 0x88);
+        u[i + 2] = _mm512_shuffle_f64x2(t[i], t[i + 2], 0xdd);
+        u[i + 3] = _mm512_shuffle_f64x2(t[i + 1], t[i + 3], 0xdd);
+    }
+    for(int i = 0; i < 4; i++) {
+        r[i] = _mm512_shuffle_f64x2(u[i], u[i + 4], 0x88);
+        r[i + 4] = _mm512_shuffle_f64x2(u[i], u[i + 4], 0xdd);
+    }
+}
+
+TRANSPOSE_TARGET
+static inline void transpose_tile_avx512(const double *x, size_t ldx,
+                                         double *y, size_t ldy)
+{
+    __m512d r[8];
+    for(int i = 0; i < 8; i++) r[i] = _mm512_loadu_pd(x + i * ldx);
+    transpose_avx512(r);
+    for(int i = 0; i < 8; i++) _mm512_storeu_pd(y + i * ldy, r[i]);
+}
+
+TRANSPOSE_TARGET
+static inline void transpose_tiles_avx512(double *a, double *b, size_t ld)
+{
+    __m512d ra[8], rb[8];
+    for(int i = 0; i < 8; i++) {
+        ra[i] = _mm512_loadu_pd(a + i * ld);
+        rb[i] = _mm512_loadu_pd(b + i * ld);
+    }
+    transpose_avx512(ra);
+    transpose_avx512(rb);
+    for(int i = 0; i < 8; i++) {
+        _mm512_storeu_pd(a + i * ld, rb[i]);
+        _mm512_storeu_pd(b + i * ld, ra[i]);
+    }
+}
+
+TRANSPOSE_TARGET
+static inline void transpose_stream_tile_avx512(const double *x,
+                                                size_t ldx, double *y,
+                                                size_t ldy)
+{
+    __m512d r[8];
+    for(int i = 0; i < 8; i++) r[i] = _mm512_loadu_pd(x + i * ldx);
+    transpose_avx512(r);
+    for(int i = 0; i < 8; i++) _mm512_stream_pd(y + i * ldy, r[i]);
+}
+
+TRANSPOSE_DEFINE_BLOCKS(avx512, 8)
+TRANSPOSE_DEFINE_STREAM(avx512, 8)
+#undef TRANSPOSE_TARGET
+
+/* Kernels of every cpu_level_t */
+static const struct transpose_kernels transpose_kernels[CPU_NLEVELS] = {
+    {transpose_copy_generic, transpose_swap_generic, transpose_diag_generic,
+     transpose_copy_generic},
+    {transpose_copy_sse2, transpose_swap_sse2, transpose_diag_sse2,
+     transpose_copy_sse2},
+    {transpose_copy_avx2, transpose_swap_avx2, transpose_diag_avx2,
+     transpose_stream_avx2},
+    {transpose_copy_avx512, transpose_swap_avx512, transpose_diag_avx512,
+     transpose_stream_avx512}
+};
+#else
+static const struct transpose_kernels transpose_kernels[CPU_NLEVELS] = {
+#define TRANSPOSE_GENERIC                                               \
+    {transpose_copy_generic, transpose_swap_generic, transpose_diag_generic, \
+     transpose_copy_generic}
+    TRANSPOSE_GENERIC, TRANSPOSE_GENERIC, TRANSPOSE_GENERIC, TRANSPOSE_GENERIC
+};
+#endif
+
+/* transpose_half: where to cut n elements in two, on a multiple of
+ * TRANSPOSE_ALIGN when n is larger than TRANSPOSE_BLOCK */
+static size_t transpose_half(size_t n)
+{
+    return (n / 2 + TRANSPOSE_ALIGN - 1) / TRANSPOSE_ALIGN * TRANSPOSE_ALIGN;
+}
+
+/* transpose_copy: y = x^T for the nr x nc matrix x, cutting the longer
+ * side in halves until the blocks fit in L1 */
+static void transpose_copy(transpose_copy_t copy, size_t nr, size_t nc,
+                           const double *x, size_t ldx, double *y,
+                           size_t ldy)
+{
+    while(nr > TRANSPOSE_BLOCK || nc > TRANSPOSE_BLOCK) {
+        if(nr >= nc) {
+            size_t h = transpose_half(nr);
+            transpose_copy(copy, h, nc, x, ldx, y, ldy);
+            x += h * ldx;
+            y += h;
+            nr -= h;
+        } else {
+            size_t h = transpose_half(nc);
+            transpose_copy(copy, nr, h, x, ldx, y, ldy);
+            x += h;
+            y += h * ldy;
+            nc -= h;
+        }
+    }
+    copy(nr, nc, x, ldx, y, ldy);
+}
+
+/* transpose_swap: exchange the nr x nc block a with the transpose of its
+ * mirror block b, see transpose_copy */
+static void transpose_swap(const struct transpose_kernels *k, size_t nr,
+                           size_t nc, double *a, double *b, size_t ld)
+{
+    while(nr > TRANSPOSE_BLOCK || nc > TRANSPOSE_BLOCK) {
+        if(nr >= nc) {
+            size_t h = transpose_half(nr);
+            transpose_swap(k, h, nc, a, b, ld);
+            a += h * ld;
+            b += h;
+            nr -= h;
+        } else {
+            size_t h = transpose_half(nc);
+            transpose_swap(k, nr, h, a, b, ld);
+            a += h;
+            b += h * ld;
+            nc -= h;
+        }
+    }
+    k->swap(nr, nc, a, b, ld);
+}
+
+/* transpose_square: transpose the n x n matrix a in place: the two
+ * diagonal halves are transposed in place and the off-diagonal halves
+ * are exchanged */
+static void transpose_square(const struct transpose_kernels *k, size_t n,
+                             double *a, size_t ld)
+{
+    if(n <= TRANSPOSE_BLOCK) {
+        k->diag(n, a, ld);
+        return;
+    }
+    size_t h = transpose_half(n);
+    transpose_square(k, h, a, ld);
+    transpose_square(k, n - h, a + h * ld + h, ld);
+    transpose_swap(k, h, n - h, a + h, a + h * ld, ld);
+}
+
+/* One transpose of doubles split across threads over the rows of x */
+struct transpose_task {
+    transpose_copy_t copy;
+    int stream; // the copy kernel bypasses the cache
+    size_t ncols;
+    const double *x;
+    size_t ldx;
+    double *y;
+    size_t ldy;
+};
+
+/* transpose_range: parallel_for body over the rows of x */
+static void transpose_range(void *ctx, size_t begin, size_t end)
+{
+    const struct transpose_task *task = ctx;
+    transpose_copy(task->copy, end - begin, task->ncols,
+                   task->x + begin * task->ldx, task->ldx, task->y + begin,
+                   task->ldy);
+#ifdef TRANSPOSE_X86
+    /* order the non-temporal stores before the join of the threads */
+    if(task->stream) _mm_sfence();
+#endif
+}
+
+/* transpose_element: address of the element (i, j) of t */
+static char *transpose_element(const tensor_t *t, size_t i, size_t j)
+{
+    return (char *)t->data + (t->offset + i * t->ld + j * t->col_stride)
+                             * tensor_dtype_size(t->dtype);
+}
+
+/* transpose_any: Y = X^T element by element, in blocks so both X and Y
+ * are walked a few cache lines at a time. Used for the tensors the
+ * kernels can't take: other element types and strided views. */
+static void transpose_any(const tensor_t *X, tensor_t *Y)
+{
+    for(size_t i0 = 0; i0 < X->nrows; i0 += TRANSPOSE_BLOCK) {
+        for(size_t j0 = 0; j0 < X->ncols; j0 += TRANSPOSE_BLOCK) {
+            size_t i1 = i0 + TRANSPOSE_BLOCK, j1 = j0 + TRANSPOSE_BLOCK;
+            if(i1 > X->nrows) i1 = X->nrows;
+            if(j1 > X->ncols) j1 = X->ncols;
+            for(size_t i = i0; i < i1; i++) {
+                for(size_t j = j0; j < j1; j++) {
+                    tensor_convert_array(transpose_element(X, i, j),
+                                         X->dtype,
+                                         transpose_element(Y, j, i),
+                                         Y->dtype, 1);
+                }
+            }
+        }
+    }
+}
+
+/* transpose_overlaps: check whether the elements of tensors x and y can
+ * share memory */
+static int transpose_overlaps(const tensor_t *x, const tensor_t *y)
+{
+    uintptr_t x0 = (uintptr_t)transpose_element(x, 0, 0);
+    uintptr_t x1 = (uintptr_t)transpose_element(x, x->nrows - 1,
+                                                x->ncols - 1)
+                   + tensor_dtype_size(x->dtype) - 1;
+    uintptr_t y0 = (uintptr_t)transpose_element(y, 0, 0);
+    uintptr_t y1 = (uintptr_t)transpose_element(y, y->nrows - 1,
+                                                y->ncols - 1)
+                   + tensor_dtype_size(y->dtype) - 1;
+    return x0 <= y1 && y0 <= x1;
+}
+
+/* transpose_is_rows: check whether the rows of t are contiguous doubles */
+static int transpose_is_rows(const tensor_t *t)
+{
+    return t->dtype == TENSOR_FLOAT64 && (t->col_stride == 1 || t->ncols == 1);
+}
+
+/* tensor_transpose: Store the transpose of X in Y, Y(j, i) = X(i, j).
+ * X is m x n and Y must be an allocated n x m tensor. X and Y can be any
+ * views of any element type, the elements are converted to the type of Y.
+ * Tensors of doubles with unit column stride use the SIMD kernels and
+ * large ones are split across threads.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X or Y is NULL, the
+ * shapes do not match or Y overlaps X */
+int tensor_transpose(const tensor_t *X, tensor_t *Y)
+{
+    /* NULL checking */
+    if(X == NULL || Y == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(X->nrows != Y->ncols || X->ncols != Y->nrows) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* alias checking */
+    if(transpose_overlaps(X, Y)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!transpose_is_rows(X) || !transpose_is_rows(Y)) {
+        transpose_any(X, Y);
+        return 0;
+    }
+
+    const struct transpose_kernels *k = &transpose_kernels[cpu_get_level()];
+    double *y = (double *)Y->data + Y->offset;
+    int stream = Y->nrows * Y->ld >= TRANSPOSE_STREAM_SIZE
+                 && (uintptr_t)y % TENSOR_ALIGNMENT == 0
+                 && Y->ld * sizeof(double) % TENSOR_ALIGNMENT == 0;
+    struct transpose_task task = {
+        stream ? k->stream : k->copy, stream, X->ncols,
+        (const double *)X->data + X->offset, X->ld, y, Y->ld
+    };
+    size_t grain = TRANSPOSE_GRAIN / X->ncols;
+    grain = (grain + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK * TRANSPOSE_BLOCK;
+    return parallel_for(0, X->nrows, grain, transpose_range, &task);
+}
+
+/* tensor_transpose_square: Transpose the square tensor X in place. X can be
+ * any view of any element type.
+ *
+ * It returns zero if operation succeed
+ * It returns non-zero value and set errno to EINVAL if X is NULL or not
+ * square */
+int tensor_transpose_square(tensor_t *X)
+{
+    /* NULL checking */
+    if(X == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shape checking */
+    if(X->nrows != X->ncols) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(transpose_is_rows(X)) {
+        transpose_square(&transpose_kernels[cpu_get_level()], X->nrows,
+                         (double *)X->data + X->offset, X->ld);
+        return 0;
+    }
+
+    /* other element types are exchanged byte by byte */
+    size_t elsize = tensor_dtype_size(X->dtype);
+    for(size_t i = 0; i < X->nrows; i++) {
+        for(size_t j = i + 1; j < X->ncols; j++) {
+            char *a = transpose_element(X, i, j);
+            char *b = transpose_element(X, j, i);
+            for(size_t s = 0; s < elsize; s++) {
+                char t = a[s];
+                a[s] = b[s];
+                b[s] = t;
+            }
+        }
+    }
+    return 0;
+}
+
+/* UNIT TEST */
+#ifdef SIMPLE_NN_TRANSPOSE_C_TEST
+#include <assert.h>
+
+/* test_fill: distinct values X(i, j) = i * 1000 + j */
+static void test_fill(tensor_t *t)
+{
+    for(size_t i = 0; i < t->nrows; i++) {
+        for(size_t j = 0; j < t->ncols; j++) {
+            tensor_set_value(t, i, j, (double)(i * 1000 + j));
+        }
+    }
+}
+
+/* test_check: Y(j, i) = X(i, j) for the values of test_fill */
+static void test_check(const tensor_t *Y)
+{
+    for(size_t j = 0; j < Y->nrows; j++) {
+        for(size_t i = 0; i < Y->ncols; i++) {
+            double v;
+            tensor_get_value(*Y, j, i, &v);
+            assert(v == (double)(i * 1000 + j));
+        }
+    }
+}
+
+/* test_shape: out-of-place transposes of an m x n tensor */
+static void test_shape(size_t m, size_t n)
+{
+    tensor_t *X = allocate_tensor(m, n);
+    tensor_t *Y = allocate_tensor(n, m);
+    test_fill(X);
+    assert(tensor_transpose(X, Y) == 0);
+    test_check(Y);
+
+    /* a view of X with an offset */
+    if(m > 2 && n > 2) {
+        tensor_t rows, block;
+        tensor_t *Z = allocate_tensor(n - 1, m - 2);
+        tensor_view_rows(X, 1, m - 2, &rows);
+        tensor_view_cols(&rows, 1, n - 1, &block);
+        assert(tensor_transpose(&block, Z) == 0);
+        for(size_t j = 0; j < n - 1; j++) {
+            for(size_t i = 0; i < m - 2; i++) {
+                assert(TENSOR_AT(Z, j, i) == (double)((i + 1) * 1000 + j + 1));
+            }
+        }
+        free_tensor(Z);
+    }
+    free_tensor(Y);
+    free_tensor(X);
+}
+
+/* test_square: in-place transpose of an n x n tensor */
+static void test_square(size_t n)
+{
+    tensor_t *X = allocate_tensor(n, n);
+    test_fill(X);
+    assert(tensor_transpose_square(X) == 0);
+    test_check(X);
+    free_tensor(X);
+}
+
+int main(int argc, char **argv)
+{
+    int err = 0;
+    size_t shapes[][2] = {
+        {1, 1}, {1, 9}, {9, 1}, {3, 5}, {8, 8}, {33, 65}, {100, 37},
+        {513, 257}, {64, 2000}, {1000, 700}, {703, 999},
+    };
+    size_t nshapes = sizeof shapes / sizeof shapes[0];
+    size_t squares[] = {1, 2, 7, 8, 9, 33, 64, 100, 257};
+    size_t nthreads = parallel_get_nthreads();
+
+    /* every level, on one and on several threads */
+    for(int level = CPU_GENERIC; level <= (int)cpu_get_max_level(); level++) {
+        cpu_set_level((cpu_level_t)level);
+        for(size_t threads = 1; threads <= 4; threads += 3) {
+            parallel_set_nthreads(threads);
+            for(size_t s = 0; s < nshapes; s++) {
+                test_shape(shapes[s][0], shapes[s][1]);
+            }
+            for(size_t s = 0; s < sizeof squares / sizeof squares[0]; s++) {
+                test_square(squares[s]);
+            }
+        }
+    }
+    cpu_set_level(cpu_get_max_level());
+    parallel_set_nthreads(nthreads);
+
+    /* other element types and strided views */
+    tensor_t *F = allocate_typed_tensor(37, 70, TENSOR_FLOAT32);
+    tensor_t *D = allocate_tensor(37, 70);
+    tensor_t *G = allocate_typed_tensor(70, 37, TENSOR_FLOAT32);
+    tensor_t Dt;
+    test_fill(F);
+    err = tensor_transpose(F, G);
+    assert(err == 0);
+    test_check(G);
+    tensor_transpose_view(D, &Dt);
+    err = tensor_transpose(F, &Dt);
+    assert(err == 0);
+    for(size_t i = 0; i < 37; i++) {
+        for(size_t j = 0; j < 70; j++) {
+            assert(TENSOR_AT(D, i, j) == (double)(i * 1000 + j));
+        }
+    }
+    tensor_t *H = allocate_typed_tensor(45, 45, TENSOR_FLOAT16);
+    for(size_t i = 0; i < 45; i++) {
+        for(size_t j = 0; j < 45; j++) tensor_set_value(H, i, j, i * 32.0 + j);
+    }
+    err = tensor_transpose_square(H);
+    assert(err == 0);
+    for(size_t i = 0; i < 45; i++) {
+        for(size_t j = 0; j < 45; j++) {
+            double v;
+            tensor_get_value(*H, j, i, &v);
+            assert(v == i * 32.0 + j);
+        }
+    }
+
+    /* it returns non-zero value if the shapes do not match */
+    err = tensor_transpose(F, D);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_transpose_square(F);
+    assert(err != 0 && errno == EINVAL);
+
+    /* it returns non-zero value if Y overlaps X */
+    tensor_t *S = allocate_tensor(4, 4);
+    err = tensor_transpose(S, S);
+    assert(err != 0 && errno == EINVAL);
+
+    /* it returns non-zero value if one of the arguments is NULL */
+    err = tensor_transpose(NULL, G);
+    assert(err != 0 && errno == EINVAL);
+    err = tensor_transpose_square(NULL);
+    assert(err != 0 && errno == EINVAL);
+
+    free_tensor(S);
+    free_tensor(H);
+    free_tensor(G);
+    free_tensor(D);
+    free_tensor(F);
+    return 0;
+}
+#endif
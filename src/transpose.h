@@ -0,0 +1,21 @@
+/* transpose - Transpose of tensors into row-major memory
+ * tensor_transpose_view only swaps the strides; the functions here move the
+ * elements, so the transpose can be read row by row. The matrix is cut
+ * recursively in halves until a block fits in L1, whatever the cache size
+ * is, and the blocks of doubles are transposed in SIMD registers 2x2, 4x4
+ * or 8x8 at once depending on the CPU level. Large outputs are written
+ * a cache line at a time with non-temporal stores, which leaves the cache
+ * to the input.
+ *
+ * Copyright (c) 2016, Bayu Aldi Yansyah. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that
+ * can be found in the LICENSE file. */
+#ifndef SIMPLE_NN_TRANSPOSE_H
+#define SIMPLE_NN_TRANSPOSE_H
+
+#include "tensor.h"
+
+int tensor_transpose(const tensor_t *X, tensor_t *Y);
+int tensor_transpose_square(tensor_t *X);
+
+#endif